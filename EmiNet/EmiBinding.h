@@ -16,6 +16,7 @@
 #import <Foundation/Foundation.h>
 #include <utility>
 #include <ifaddrs.h>
+#include <sys/uio.h>
 
 class EmiSockDelegate;
 @class GCDAsyncUdpSocket;
@@ -88,6 +89,13 @@ public:
                          uint8_t *buf, size_t bufLen);
     static void randomBytes(uint8_t *buf, size_t bufSize);
     
+    // Must use the same clock as the now parameter of timer callbacks
+    inline static EmiTimeInterval now() {
+        return [NSDate timeIntervalSinceReferenceDate];
+    }
+    // Each EmiConnection has its own dispatch queue, so connections
+    // can't share an EmiTimerWheel; each connection gets its own.
+    static const bool SHARED_TIMER_WHEEL = false;
     inline static Timer *makeTimer(dispatch_queue_t timerCookie) {
         return new Timer(timerCookie);
     }
@@ -114,7 +122,7 @@ public:
                                          const sockaddr_storage& address,
                                          __strong NSError*& err);
     static void extractLocalAddress(GCDAsyncUdpSocket *socket, sockaddr_storage& address);
-    static void sendData(GCDAsyncUdpSocket *socket, const sockaddr_storage& address, const uint8_t *data, size_t size);
+    static void sendData(GCDAsyncUdpSocket *socket, const sockaddr_storage& address, const struct iovec *iov, size_t iovcnt, bool packetPair);
 };
 
 #endif
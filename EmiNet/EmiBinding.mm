@@ -117,10 +117,19 @@ void EmiBinding::extractLocalAddress(GCDAsyncUdpSocket *socket, sockaddr_storage
     }
 }
 
-void EmiBinding::sendData(GCDAsyncUdpSocket *socket, const sockaddr_storage& address, const uint8_t *data, size_t size) {
-    // TODO This copies the packet data. We might want to redesign
-    // this part of the code so that this is not required.
-    [socket sendData:[NSData dataWithBytes:data     length:size]
+void EmiBinding::sendData(GCDAsyncUdpSocket *socket, const sockaddr_storage& address, const struct iovec *iov, size_t iovcnt, bool packetPair) {
+    // GCDAsyncUdpSocket sends the data asynchronously, so it has to be
+    // copied. The buffers in iov are gathered straight into the NSData.
+    size_t size = 0;
+    for (size_t i=0; i<iovcnt; i++) {
+        size += iov[i].iov_len;
+    }
+    NSMutableData *data = [NSMutableData dataWithCapacity:size];
+    for (size_t i=0; i<iovcnt; i++) {
+        [data appendBytes:iov[i].iov_base length:iov[i].iov_len];
+    }
+    
+    [socket sendData:data
            toAddress:[NSData dataWithBytes:&address length:EmiNetUtil::addrSize(address)]
          withTimeout:-1 tag:0];
 }
@@ -64,6 +64,10 @@ typedef void (^EmiConnectionSendFinishedBlock)(NSError *err);
 // Synchronous send
 - (BOOL)send:(NSData *)data channelQualifier:(EmiChannelQualifier)channelQualifier
     priority:(EmiPriority)priority error:(NSError **)errPtr;
+// Synchronous send of a message that should be sent within deadline
+// seconds. Unreliable messages that miss their deadline are dropped.
+- (BOOL)send:(NSData *)data channelQualifier:(EmiChannelQualifier)channelQualifier
+    priority:(EmiPriority)priority deadline:(EmiTimeInterval)deadline error:(NSError **)errPtr;
 
 // Convenience alias for sendWithData:channelQualifier:priority:finished:
 - (void)send:(NSData *)data finished:(EmiConnectionSendFinishedBlock)block;
@@ -78,6 +82,11 @@ typedef void (^EmiConnectionSendFinishedBlock)(NSError *err);
 // queue as the method was invoked on.
 - (void)send:(NSData *)data channelQualifier:(EmiChannelQualifier)channelQualifier
     priority:(EmiPriority)priority finished:(EmiConnectionSendFinishedBlock)block;
+// Asynchronous send of a message that should be sent within deadline
+// seconds
+- (void)send:(NSData *)data channelQualifier:(EmiChannelQualifier)channelQualifier
+    priority:(EmiPriority)priority deadline:(EmiTimeInterval)deadline
+    finished:(EmiConnectionSendFinishedBlock)block;
 
 // Synchronously sets both the delegate and the delegate queue
 - (void)setDelegate:(id<EmiConnectionDelegate>)delegate
@@ -89,6 +98,9 @@ typedef void (^EmiConnectionSendFinishedBlock)(NSError *err);
 @property (nonatomic, readonly, strong) dispatch_queue_t connectionQueue;
 
 @property (nonatomic, readonly, assign) BOOL issuedConnectionWarning;
+// The number of unreliable messages that were dropped because they
+// missed their deadline
+@property (nonatomic, readonly, assign) NSUInteger expiredMessages;
 @property (nonatomic, readonly, weak) EmiSocket *emiSocket;
 @property (nonatomic, readonly, weak) NSData *localAddress;
 @property (nonatomic, readonly, weak) NSData *remoteAddress;
@@ -78,6 +78,10 @@
     SYNC_RETURN(BOOL, ((EC *)_ec)->issuedConnectionWarning());
 }
 
+- (NSUInteger)expiredMessages {
+    SYNC_RETURN(NSUInteger, ((EC *)_ec)->getExpiredMessages());
+}
+
 - (EmiSocket *)emiSocket {
     return _emiSocket;
 }
@@ -134,11 +138,15 @@
 }
 
 - (BOOL)send:(NSData *)data channelQualifier:(EmiChannelQualifier)channelQualifier priority:(EmiPriority)priority error:(NSError **)errPtr {
+    return [self send:data channelQualifier:channelQualifier priority:priority deadline:EMI_NO_DEADLINE error:errPtr];
+}
+
+- (BOOL)send:(NSData *)data channelQualifier:(EmiChannelQualifier)channelQualifier priority:(EmiPriority)priority deadline:(EmiTimeInterval)deadline error:(NSError **)errPtr {
     __block NSError *err;
     __block BOOL retVal;
     
     DISPATCH_SYNC(_connectionQueue, ^{
-        retVal = ((EC *)_ec)->send([self _now], data, channelQualifier, priority, err);
+        retVal = ((EC *)_ec)->send([self _now], data, channelQualifier, priority, deadline, err);
         *errPtr = err;
     });
     
@@ -161,12 +169,18 @@
 
 - (void)send:(NSData *)data channelQualifier:(EmiChannelQualifier)channelQualifier
     priority:(EmiPriority)priority finished:(EmiConnectionSendFinishedBlock)block {
+    [self send:data channelQualifier:channelQualifier priority:priority deadline:EMI_NO_DEADLINE finished:block];
+}
+
+- (void)send:(NSData *)data channelQualifier:(EmiChannelQualifier)channelQualifier
+    priority:(EmiPriority)priority deadline:(EmiTimeInterval)deadline
+    finished:(EmiConnectionSendFinishedBlock)block {
     
     dispatch_queue_t blockQueue = (block ? dispatch_get_current_queue() : NULL);
     
     dispatch_async(_connectionQueue, ^{
         NSError *err;
-        BOOL retVal = ((EC *)_ec)->send([self _now], data, channelQualifier, priority, err);
+        BOOL retVal = ((EC *)_ec)->send([self _now], data, channelQualifier, priority, deadline, err);
         
         if (block) {
             dispatch_async(blockQueue, ^{
@@ -65,6 +65,7 @@ public:
     
     // This method will always be called from the socketqueue
     dispatch_queue_t getSocketCookie();
+    dispatch_queue_t getTimerCookie();
 };
 
 #endif
@@ -117,3 +117,7 @@ dispatch_queue_t EmiSockDelegate::getSocketCookie() {
     // This method will always be called from the socketqueue
     return _socket.socketQueue;
 }
+
+dispatch_queue_t EmiSockDelegate::getTimerCookie() {
+    return _socket.socketQueue;
+}
@@ -18,9 +18,18 @@
 @property (nonatomic, assign) float heartbeatsBeforeConnectionWarning;
 @property (nonatomic, assign) NSUInteger receiverBufferSize;
 @property (nonatomic, assign) NSUInteger senderBufferSize;
+@property (nonatomic, assign) EmiCongestionControlAlgorithm congestionControl;
+@property (nonatomic, assign) uint32_t FECChannels;
+@property (nonatomic, assign) NSUInteger FECGroupSize;
+@property (nonatomic, assign) uint32_t conflatedChannels;
 @property (nonatomic, assign) BOOL acceptConnections;
 @property (nonatomic, assign) uint16_t serverPort;
 @property (nonatomic, assign) NSUInteger MTU;
 @property (nonatomic, assign) float heartbeatFrequency;
 
+// The weight of a channel decides its share of the bandwidth when
+// several channels have messages waiting to be sent. The default is 1.
+- (uint8_t)weightForChannelQualifier:(EmiChannelQualifier)channelQualifier;
+- (void)setWeight:(uint8_t)weight forChannelQualifier:(EmiChannelQualifier)channelQualifier;
+
 @end
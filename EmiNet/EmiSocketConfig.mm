@@ -80,6 +80,46 @@ typedef EmiSocketConfigSC SC;
     ((SC *)_sc)->senderBufferSize = senderBufferSize;
 }
 
+- (EmiCongestionControlAlgorithm)congestionControl {
+    return ((SC *)_sc)->congestionControl;
+}
+
+- (void)setCongestionControl:(EmiCongestionControlAlgorithm)congestionControl {
+    ((SC *)_sc)->congestionControl = congestionControl;
+}
+
+- (uint32_t)FECChannels {
+    return ((SC *)_sc)->fecChannels;
+}
+
+- (void)setFECChannels:(uint32_t)FECChannels {
+    ((SC *)_sc)->fecChannels = FECChannels;
+}
+
+- (NSUInteger)FECGroupSize {
+    return ((SC *)_sc)->fecGroupSize;
+}
+
+- (void)setFECGroupSize:(NSUInteger)FECGroupSize {
+    ((SC *)_sc)->fecGroupSize = FECGroupSize;
+}
+
+- (uint32_t)conflatedChannels {
+    return ((SC *)_sc)->conflatedChannels;
+}
+
+- (void)setConflatedChannels:(uint32_t)conflatedChannels {
+    ((SC *)_sc)->conflatedChannels = conflatedChannels;
+}
+
+- (uint8_t)weightForChannelQualifier:(EmiChannelQualifier)channelQualifier {
+    return ((SC *)_sc)->channelWeights[channelQualifier];
+}
+
+- (void)setWeight:(uint8_t)weight forChannelQualifier:(EmiChannelQualifier)channelQualifier {
+    ((SC *)_sc)->channelWeights[channelQualifier] = weight;
+}
+
 - (BOOL)acceptConnections {
     return ((SC *)_sc)->acceptConnections;
 }
@@ -41,7 +41,12 @@ public:
             else {
                 
                 if (AF_INET == b.ss_family) {
-                    return ntohl(aIn->sin_addr.s_addr) - ntohl(bIn->sin_addr.s_addr);
+                    // Don't return the difference; it might overflow
+                    uint32_t aAddr = ntohl(aIn->sin_addr.s_addr);
+                    uint32_t bAddr = ntohl(bIn->sin_addr.s_addr);
+                    if (aAddr < bAddr) return -1;
+                    else if (aAddr > bAddr) return 1;
+                    else return 0;
                 }
                 else { // Assume AF_INET6
                     return memcmp(aIn6->sin6_addr.s6_addr, bIn6->sin6_addr.s6_addr, sizeof(aIn6->sin6_addr.s6_addr));
@@ -0,0 +1,59 @@
+//
+//  EmiAddressKey.h
+//  eminet
+//
+
+#ifndef eminet_EmiAddressKey_h
+#define eminet_EmiAddressKey_h
+
+#include "EmiHashMap.h"
+
+#include <netinet/in.h>
+#include <cstring>
+#include <stdint.h>
+
+// A compact representation of an IPv4 or IPv6 address and port,
+// suitable as a key in an EmiHashMap. A sockaddr_storage is 128 bytes;
+// this is 20, and comparing two of them is one memcmp.
+//
+// IPv4 addresses are stored in the first 4 bytes of _ip, and the
+// rest is zero.
+class EmiAddressKey {
+    uint8_t  _ip[16];
+    uint16_t _port;
+    uint16_t _family;
+    
+public:
+    EmiAddressKey() :
+    _port(0),
+    _family(0) {
+        memset(_ip, 0, sizeof(_ip));
+    }
+    
+    explicit EmiAddressKey(const sockaddr_storage& address) :
+    _port(0),
+    _family(address.ss_family) {
+        memset(_ip, 0, sizeof(_ip));
+        
+        if (AF_INET == address.ss_family) {
+            const sockaddr_in& addr((const sockaddr_in&)address);
+            memcpy(_ip, &addr.sin_addr, sizeof(addr.sin_addr));
+            _port = addr.sin_port;
+        }
+        else if (AF_INET6 == address.ss_family) {
+            const sockaddr_in6& addr((const sockaddr_in6&)address);
+            memcpy(_ip, &addr.sin6_addr, sizeof(addr.sin6_addr));
+            _port = addr.sin6_port;
+        }
+    }
+    
+    inline bool operator==(const EmiAddressKey& other) const {
+        return 0 == memcmp(this, &other, sizeof(EmiAddressKey));
+    }
+    
+    inline uint32_t hash(const EmiHashSeed& seed) const {
+        return EmiHashMapUtil::hashBytes(seed, this, sizeof(EmiAddressKey));
+    }
+};
+
+#endif
@@ -0,0 +1,140 @@
+//
+//  EmiBufferPool.h
+//  eminet
+//
+
+#ifndef eminet_EmiBufferPool_h
+#define eminet_EmiBufferPool_h
+
+#include "EmiNetUtil.h"
+
+#include <cstdlib>
+#include <stdint.h>
+
+// A pool of memory chunks for message payloads, for Bindings to use in
+// makePersistentData and makeTemporaryData.
+//
+// Chunks are grouped in size classes that are powers of two, from
+// MIN_CHUNK_SIZE up to MAX_CHUNK_SIZE bytes. Each size class has a
+// free list of at most MAX_CACHED_CHUNKS chunks. Requests that are
+// larger than MAX_CHUNK_SIZE go straight to the system allocator.
+//
+// Every chunk is allocated separately and remembers its size class in
+// a small header, so a chunk can be freed to any EmiBufferPool, not
+// only to the one that allocated it. This makes it possible to have
+// one pool per thread even when buffers are released on other threads
+// than the ones that allocated them.
+//
+// An EmiBufferPool is not thread safe.
+class EmiBufferPool {
+private:
+    // Private copy constructor and assignment operator
+    inline EmiBufferPool(const EmiBufferPool& other);
+    inline EmiBufferPool& operator=(const EmiBufferPool& other);
+    
+    static const size_t MIN_CHUNK_SIZE_LOG2 = 6;
+    static const size_t NUM_SIZE_CLASSES = 7;
+    static const size_t MAX_CACHED_CHUNKS = 128;
+    // The header is 16 bytes to keep the returned memory as aligned
+    // as the memory that malloc returns.
+    static const size_t HEADER_SIZE = 16;
+    
+    struct FreeChunk {
+        FreeChunk *next;
+    };
+    
+    FreeChunk *_freeLists[NUM_SIZE_CLASSES];
+    size_t     _cached[NUM_SIZE_CLASSES];
+    
+    size_t _allocations;
+    size_t _systemAllocations;
+    
+    inline static size_t chunkSize(size_t sizeClass) {
+        return ((size_t)1) << (MIN_CHUNK_SIZE_LOG2+sizeClass);
+    }
+    
+    // Returns NUM_SIZE_CLASSES if the size is too large for the pool
+    inline static size_t sizeClassForSize(size_t size) {
+        size_t sizeClass = 0;
+        while (sizeClass < NUM_SIZE_CLASSES && chunkSize(sizeClass) < size) {
+            sizeClass++;
+        }
+        return sizeClass;
+    }
+    
+public:
+    static const size_t MIN_CHUNK_SIZE = ((size_t)1) << MIN_CHUNK_SIZE_LOG2;
+    static const size_t MAX_CHUNK_SIZE = ((size_t)1) << (MIN_CHUNK_SIZE_LOG2+NUM_SIZE_CLASSES-1);
+    
+    EmiBufferPool() :
+    _allocations(0),
+    _systemAllocations(0) {
+        for (size_t i=0; i<NUM_SIZE_CLASSES; i++) {
+            _freeLists[i] = NULL;
+            _cached[i] = 0;
+        }
+    }
+    
+    virtual ~EmiBufferPool() {
+        for (size_t i=0; i<NUM_SIZE_CLASSES; i++) {
+            FreeChunk *chunk = _freeLists[i];
+            while (chunk) {
+                FreeChunk *next = chunk->next;
+                ::free(((uint8_t *)chunk)-HEADER_SIZE);
+                chunk = next;
+            }
+        }
+    }
+    
+    // Returns a pointer to at least size bytes of memory. The memory
+    // must be freed with the free method of an EmiBufferPool.
+    void *alloc(size_t size) {
+        _allocations++;
+        
+        size_t sizeClass = sizeClassForSize(size+HEADER_SIZE);
+        
+        if (sizeClass < NUM_SIZE_CLASSES && _freeLists[sizeClass]) {
+            FreeChunk *chunk = _freeLists[sizeClass];
+            _freeLists[sizeClass] = chunk->next;
+            _cached[sizeClass]--;
+            return chunk;
+        }
+        
+        _systemAllocations++;
+        
+        uint8_t *mem = (uint8_t *)malloc(sizeClass < NUM_SIZE_CLASSES ?
+                                         chunkSize(sizeClass) :
+                                         size+HEADER_SIZE);
+        ASSERT(mem);
+        *((size_t *)mem) = sizeClass;
+        return mem+HEADER_SIZE;
+    }
+    
+    void free(void *ptr) {
+        uint8_t *mem = ((uint8_t *)ptr)-HEADER_SIZE;
+        size_t sizeClass = *((size_t *)mem);
+        
+        if (sizeClass >= NUM_SIZE_CLASSES ||
+            _cached[sizeClass] >= MAX_CACHED_CHUNKS) {
+            ::free(mem);
+            return;
+        }
+        
+        FreeChunk *chunk = (FreeChunk *)ptr;
+        chunk->next = _freeLists[sizeClass];
+        _freeLists[sizeClass] = chunk;
+        _cached[sizeClass]++;
+    }
+    
+    // The number of times alloc has been called
+    inline size_t getAllocations() const {
+        return _allocations;
+    }
+    
+    // The number of times alloc had to call malloc
+    inline size_t getSystemAllocations() const {
+        return _systemAllocations;
+    }
+};
+
+#endif
@@ -0,0 +1,57 @@
+//
+//  EmiCongestionController.h
+//  eminet
+//
+
+#ifndef eminet_EmiCongestionController_h
+#define eminet_EmiCongestionController_h
+
+#include "EmiTypes.h"
+
+#include <cstddef>
+
+// EmiCongestionController is the interface of the sender side
+// congestion control algorithms. EmiCongestionControl owns one
+// controller per connection, of the kind that is selected with
+// EmiSockConfig::congestionControl, and forwards the events that are
+// relevant for the algorithm to it.
+class EmiCongestionController {
+private:
+    // Private copy constructor and assignment operator
+    inline EmiCongestionController(const EmiCongestionController& other);
+    inline EmiCongestionController& operator=(const EmiCongestionController& other);
+    
+public:
+    EmiCongestionController() {}
+    virtual ~EmiCongestionController() {}
+    
+    // Invoked for every packet that this host sends
+    virtual void onDataSent(EmiTimeInterval now, EmiPacketSequenceNumber sequenceNumber, size_t size) = 0;
+    
+    // Invoked when the other host reports its link capacity and data
+    // arrival rate, in bytes per second
+    virtual void gotRemoteLinkCapacity(float linkCapacity) = 0;
+    virtual void gotRemoteDataArrivalRate(float dataArrivalRate) = 0;
+    
+    // Invoked for every packet that contains a packet ack. ack is the
+    // newest packet sequence number that the other host has seen.
+    // rtt is -1 if it is not yet known.
+    virtual void onAck(EmiTimeInterval now, EmiTimeInterval rtt, EmiPacketSequenceNumber ack) = 0;
+    
+    // Invoked for every packet that contains a packet nak that reports
+    // losses that have not been reported before, with all of the
+    // ranges of lost packets that it reports. numRanges is at least 1.
+    // largestSNSoFar is the sequence number of the next packet that
+    // this host will send.
+    virtual void onNak(EmiTimeInterval now,
+                       const EmiNakRange *ranges,
+                       size_t numRanges,
+                       EmiPacketSequenceNumber largestSNSoFar) = 0;
+    
+    virtual void onRto() = 0;
+    
+    // Returns the number of bytes we are allowed to send per tick.
+    virtual size_t tickAllowance() const = 0;
+};
+
+#endif
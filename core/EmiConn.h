@@ -18,7 +18,10 @@
 #include "EmiCongestionControl.h"
 #include "EmiP2PData.h"
 #include "EmiConnTimers.h"
+#include "EmiTimerWheel.h"
 #include "EmiConnTime.h"
+#include "EmiPathMtu.h"
+#include "EmiFec.h"
 #include "EmiConnParams.h"
 #include "EmiUdpSocket.h"
 #include "EmiMessageHandler.h"
@@ -42,7 +45,8 @@ class EmiConn {
     typedef EmiMessage<Binding>                          EM;
     typedef EmiReceiverBuffer<SockDelegate, EmiConn>     ERB;
     typedef EmiSendQueue<SockDelegate, ConnDelegate>     ESQ;
-    typedef EmiConnTimers<Binding, EmiConn>              ECT;
+    typedef EmiTimerWheel<Binding>                       ETW;
+    typedef EmiConnTimers<ETW, EmiConn>                  ECT;
     typedef EmiMessageHandler<EmiConn, EmiConn, Binding> EMH;
     typedef EmiLogicalConnection<SockDelegate, ConnDelegate, ERB> ELC;
     
@@ -66,14 +70,27 @@ class EmiConn {
     EmiConnectionType _type;
     
     ELC *_conn;
+    // _messagePool must be declared before all members that hold
+    // messages, because it must outlive them.
+    typename EM::Pool _messagePool;
     EmiSenderBuffer<Binding> _senderBuffer;
     ERB _receiverBuffer;
+    // _pathMtu must be declared before _sendQueue, because it is used
+    // to initialize it.
+    EmiPathMtu _pathMtu;
     ESQ _sendQueue;
+    // Scratch space for retransmitLostMessages
+    std::vector<EmiSentMessage> _lostMessages;
+    // Scratch space for enqueueParityMessages
+    std::vector<uint8_t> _parity;
     
     EmiCongestionControl<Binding> _congestionControl;
     
+    // _timerWheel must be declared before all members that have timers,
+    // because it must outlive them.
+    typename ETW::Ref _timerWheel;
     ECT _timers;
-    typename Binding::Timer *_forceCloseTimer;
+    typename ETW::Timer *_forceCloseTimer;
         
 private:
     // Private copy constructor and assignment operator
@@ -105,13 +122,24 @@ private:
         return _conn->enqueueCloseMessage(now, err);
     }
     
-    static void forceCloseTimeoutCallback(EmiTimeInterval now, typename Binding::Timer *timer, void *data) {
+    static void forceCloseTimeoutCallback(EmiTimeInterval now, typename ETW::Timer *timer, void *data) {
         EmiConn *conn = (EmiConn *)data;
-        Binding::freeTimer(timer);
+        ETW::freeTimer(timer);
         conn->_forceCloseTimer = NULL;
         conn->forceClose(EMI_REASON_THIS_HOST_CLOSED);
     }
     
+    // Returns a new reference to the timer wheel that this connection
+    // should use
+    static ETW *timerWheelForParams(const EmiConnParams<Binding>& params, ConnDelegate& delegate) {
+        if (params.timerWheel) {
+            params.timerWheel->retain();
+            return params.timerWheel;
+        }
+        
+        return new ETW(delegate.getTimerCookie());
+    }
+    
     inline bool shouldArtificiallyDropPacket() const {
         if (0 == config.fabricatedPacketDropRate) return false;
         
@@ -147,11 +175,12 @@ private:
     }
     
     void enqueueUnreliableMessage(EmiTimeInterval now,
-                                  EmiMessage<Binding> *msg) {
+                                  EmiMessage<Binding> *msg,
+                                  bool retransmission = false) {
         _timers.ensureTickTimeout();
         
         Error enqueueError;
-        if (!_sendQueue.enqueueMessage(msg, _congestionControl, _timers.getTime(), now, enqueueError)) {
+        if (!_sendQueue.enqueueMessage(msg, _congestionControl, _timers.getTime(), now, enqueueError, retransmission)) {
             // This failing is not a catastrophic failure; if the message is not reliable
             // the system should allow for it to be lost anyway, and if the message is
             // reliable, it will be re-inserted into the send queue on the applicable RTO
@@ -162,6 +191,128 @@ private:
         }
     }
     
+    // Retransmits the reliable messages that were sent in the packets
+    // that the other host reports as lost, without waiting for the RTO.
+    void retransmitLostMessages(EmiTimeInterval now, const EmiPacketHeader& packetHeader) {
+        _lostMessages.clear();
+        for (size_t i=0; i<packetHeader.numNakRanges; i++) {
+            _sendQueue.sentMessagesInPackets(packetHeader.nakRanges[i], _lostMessages);
+        }
+        
+        // A message that was sent less than one RTT ago can't have been
+        // reported as lost yet, so it has been retransmitted since the
+        // reported packet was sent.
+        EmiTimeInterval minInterval = _timers.getTime().getRtt();
+        
+        std::vector<EmiSentMessage>::iterator iter = _lostMessages.begin();
+        std::vector<EmiSentMessage>::iterator end  = _lostMessages.end();
+        while (iter != end) {
+            EM *msg = _senderBuffer.retransmitMessage((*iter).channelQualifier,
+                                                      (*iter).sequenceNumber,
+                                                      now, minInterval);
+            if (msg) {
+                // Like in eachCurrentMessageIteration, the message is
+                // already in the sender buffer
+                enqueueUnreliableMessage(now, msg, /*retransmission:*/true);
+            }
+            ++iter;
+        }
+    }
+    
+    inline bool isFecChannel(int32_t channelQualifier) const {
+        EmiChannelType channelType = EMI_CHANNEL_QUALIFIER_TYPE(channelQualifier);
+        return ((EMI_CHANNEL_TYPE_UNRELIABLE == channelType ||
+                 EMI_CHANNEL_TYPE_UNRELIABLE_SEQUENCED == channelType) &&
+                (config.fecChannels & (((uint32_t)1) << (channelQualifier & 0x1f))));
+    }
+    
+    // The space for messages in a packet of the given MTU
+    inline static size_t packetPayloadSize(size_t mtu) {
+        return (mtu -
+                EMI_UDP_HEADER_SIZE -
+                EMI_PACKET_HEADER_MAX_LENGTH);
+    }
+    
+    // The largest part of an unreliable message that fits in a packet
+    // of the current MTU. On channels with forward error correction,
+    // the parts are made smaller so that parity messages fit in the
+    // packets too.
+    inline size_t maxUnreliableMessageLength(bool fec) const {
+        return (packetPayloadSize(_pathMtu.getMtu()) -
+                EmiMessage<Binding>::maximalHeaderSize() -
+                (fec ? EMI_FEC_HEADER_LENGTH : 0));
+    }
+    
+    // The largest part of a reliable message. Reliable messages are
+    // retransmitted until they arrive, also after the path MTU has
+    // fallen back to EMI_MINIMAL_MTU because the path stopped carrying
+    // larger packets, and a part can't be split again once it has been
+    // enqueued. The parts are therefore made to fit in packets of the
+    // minimal MTU, and as large as possible such that a few of them
+    // fill a packet of the current MTU.
+    inline size_t maxReliableMessageLength() const {
+        size_t payloadSize = packetPayloadSize(_pathMtu.getMtu());
+        size_t minPayloadSize = packetPayloadSize(EMI_MINIMAL_MTU);
+        
+        // The -1 and +1 is to round up
+        size_t partsPerPacket = ((payloadSize-1) / minPayloadSize)+1;
+        return payloadSize/partsPerPacket - EmiMessage<Binding>::maximalHeaderSize();
+    }
+    
+    // Enqueues the parity messages of a message that has been split
+    // into numMessages parts of maxMessageLength bytes. See EmiFec.
+    void enqueueParityMessages(EmiTimeInterval now,
+                               EmiPriority priority,
+                               EmiTimeInterval deadline,
+                               int32_t channelQualifier,
+                               EmiNonWrappingSequenceNumber nonWrappingSequenceNumber,
+                               EmiMessageFlags flags,
+                               const PersistentData& data,
+                               size_t numMessages,
+                               size_t maxMessageLength,
+                               size_t groupSize) {
+        const uint8_t *buf = Binding::extractData(data);
+        size_t dataLength = Binding::extractLength(data);
+        
+        // Spread the parts evenly over the groups. No group is smaller
+        // than groupSize, unless the whole message is.
+        size_t numGroups = std::max((size_t)1, numMessages/groupSize);
+        
+        for (size_t group=0; group<numGroups; group++) {
+            size_t first = group*numMessages/numGroups;
+            size_t end = (group+1)*numMessages/numGroups;
+            
+            // Only the last part can be shorter than maxMessageLength
+            size_t parityLength = EMI_FEC_HEADER_LENGTH + std::min(maxMessageLength,
+                                                                   dataLength-first*maxMessageLength);
+            _parity.resize(parityLength);
+            EmiFec::initParity(&_parity[0], parityLength, end-first);
+            
+            for (size_t i=first; i<end; i++) {
+                size_t offset = i*maxMessageLength;
+                EmiFec::addPart(&_parity[0], parityLength,
+                                ((0 == i ? 0 : EMI_SPLIT_NOT_FIRST_FLAG) |
+                                 (numMessages-1 == i ? 0 : EMI_SPLIT_NOT_LAST_FLAG)),
+                                buf+offset,
+                                (numMessages-1 == i ? dataLength-offset : maxMessageLength));
+            }
+            
+            EmiMessage<Binding> *msg = EM::make(_messagePool, Binding::makePersistentData(&_parity[0], parityLength));
+            msg->priority = priority;
+            msg->deadline = deadline;
+            msg->channelQualifier = channelQualifier;
+            // A parity message has the sequence number of the first
+            // part in its group. It doesn't use up a sequence number
+            // of its own.
+            msg->nonWrappingSequenceNumber = nonWrappingSequenceNumber+first;
+            msg->flags = (flags | EMI_FEC_FLAG);
+            
+            enqueueUnreliableMessage(now, msg);
+            
+            msg->release();
+        }
+    }
+    
 public:
     const EmiSockConfig config;
     
@@ -177,11 +328,16 @@ public:
     _socket(params.socket),
     _type(params.type),
     _p2p(params.p2p),
+    _messagePool(),
     _senderBuffer(config_.senderBufferSize),
     _receiverBuffer(config_.receiverBufferSize, *this),
-    _sendQueue(*this, config_.mtu),
-    _congestionControl(),
-    _timers(config_, _delegate.getTimerCookie(), *this),
+    _pathMtu(EMI_MINIMAL_MTU, config_.mtu),
+    _sendQueue(*this, _pathMtu.getMtu(), config_.mtu),
+    _lostMessages(),
+    _parity(),
+    _congestionControl(config_.congestionControl),
+    _timerWheel(timerWheelForParams(params, _delegate)),
+    _timers(config_, _timerWheel.get(), *this),
     _forceCloseTimer(NULL),
     config(config_) {
         EmiNetUtil::anyAddr(0, AF_INET, &_localAddress);
@@ -189,7 +345,7 @@ public:
     
     virtual ~EmiConn() {
         if (_forceCloseTimer) {
-            Binding::freeTimer(_forceCloseTimer);
+            ETW::freeTimer(_forceCloseTimer);
         }
         
         deleteELC(_conn);
@@ -270,15 +426,51 @@ public:
         }
         
         _timers.gotPacket(packetHeader, now);
+        
+        // Path MTU probes that are too large for the path are expected
+        // to be lost, so NAKs for them alone are not a sign of congestion.
+        const EmiPacketHeader *congestionControlHeader = &packetHeader;
+        EmiPacketHeader headerWithoutProbes;
+        if (packetHeader.flags & EMI_NAK_PACKET_FLAG) {
+            headerWithoutProbes = packetHeader;
+            headerWithoutProbes.numNakRanges = 0;
+            
+            for (size_t i=0; i<packetHeader.numNakRanges; i++) {
+                const EmiNakRange& range(packetHeader.nakRanges[i]);
+                if (1 != range.length || !_pathMtu.isProbe(range.sequenceNumber)) {
+                    headerWithoutProbes.nakRanges[headerWithoutProbes.numNakRanges++] = range;
+                }
+            }
+            
+            if (headerWithoutProbes.numNakRanges != packetHeader.numNakRanges) {
+                if (0 == headerWithoutProbes.numNakRanges) {
+                    headerWithoutProbes.flags &= ~EMI_NAK_PACKET_FLAG;
+                }
+                else {
+                    headerWithoutProbes.nak = headerWithoutProbes.nakRanges[0].sequenceNumber;
+                }
+                congestionControlHeader = &headerWithoutProbes;
+            }
+        }
+        
         _congestionControl.gotPacket(now, _timers.getTime().getRtt(),
                                      _sendQueue.lastSentSequenceNumber(),
-                                     packetHeader, packetLength);
+                                     *congestionControlHeader, packetLength);
+        
+        if (congestionControlHeader->flags & EMI_NAK_PACKET_FLAG) {
+            retransmitLostMessages(now, *congestionControlHeader);
+        }
         
         if (packetHeader.flags & EMI_RTT_REQUEST_PACKET_FLAG) {
             _sendQueue.enqueueRttResponse(packetHeader.sequenceNumber, now);
             _timers.ensureTickTimeout();
         }
         
+        if (packetHeader.flags & EMI_RTT_RESPONSE_PACKET_FLAG &&
+            _pathMtu.gotRttResponse(packetHeader.rttResponse)) {
+            _sendQueue.setMtu(_pathMtu.getMtu());
+        }
+        
         return true;
     }
     
@@ -289,6 +481,47 @@ public:
         }
     }
     
+    // Delegates to EmiSendQueue
+    void enqueueSack(EmiChannelQualifier channelQualifier, EmiSequenceNumber sequenceNumber) {
+        if (_sendQueue.enqueueSack(channelQualifier, sequenceNumber)) {
+            _timers.ensureTickTimeout();
+        }
+    }
+    
+    // Delegates to EmiReceiverBuffer. Invoked by EmiSendQueue.
+    inline size_t sackBlocks(EmiChannelQualifier channelQualifier, EmiSackBlock *blocks, size_t maxBlocks) {
+        return _receiverBuffer.sackBlocks(channelQualifier, blocks, maxBlocks);
+    }
+    
+    // Delegates to EmiSenderBuffer. Invoked by EmiSendQueue when msg
+    // is put in a packet.
+    inline void messageWasSent(EmiTimeInterval now, EM *msg) {
+        _senderBuffer.messageWasSent(msg, now);
+    }
+    
+    // Delegates to EmiSenderBuffer
+    inline void sackReliableMessages(int32_t channelQualifier,
+                                     EmiNonWrappingSequenceNumber first,
+                                     EmiNonWrappingSequenceNumber last) {
+        _senderBuffer.sackReliableMessages(channelQualifier, first, last);
+    }
+    
+    // Retires the messages on a reliable sequenced channel whose sequence
+    // numbers are not greater than nonWrappingSequenceNumber, because a
+    // newer message makes them obsolete. They are taken out of both the
+    // sender buffer and the send queue, so they are neither sent nor
+    // retransmitted, even if they haven't been acknowledged.
+    //
+    // Unlike deregisterReliableMessages, this doesn't count as an ack.
+    void supersedeReliableMessages(EmiChannelQualifier channelQualifier,
+                                   EmiNonWrappingSequenceNumber nonWrappingSequenceNumber) {
+        _sendQueue.dropUnsentMessages(channelQualifier, nonWrappingSequenceNumber);
+        _senderBuffer.deregisterReliableMessages(channelQualifier, nonWrappingSequenceNumber);
+        
+        // This will clear the rto timeout if the sender buffer is empty
+        _timers.updateRtoTimeout();
+    }
+    
     // Delegates to EmiSenderBuffer
     //
     // channelQualifier is int32_t to be able to contain -1, which
@@ -296,7 +529,12 @@ public:
     void deregisterReliableMessages(EmiTimeInterval now,
                                     int32_t channelQualifier,
                                     EmiNonWrappingSequenceNumber nonWrappingSequenceNumber) {
-        _senderBuffer.deregisterReliableMessages(channelQualifier, nonWrappingSequenceNumber);
+        // Only an ack that acknowledges something new shows that the
+        // path carries the packets; acks that repeat themselves are
+        // sent also when packets that are too big for the path are lost
+        if (_senderBuffer.deregisterReliableMessages(channelQualifier, nonWrappingSequenceNumber)) {
+            _pathMtu.gotAck();
+        }
         
         // This will clear the rto timeout if the sender buffer is empty
         _timers.updateRtoTimeout();
@@ -327,6 +565,7 @@ public:
             PersistentData dataObj(Binding::makePersistentData(data, dataLen));
             return enqueueMessage(now,
                                   EMI_PRIORITY_CONTROL,
+                                  EMI_NO_DEADLINE,
                                   EMI_CONTROL_CHANNEL,
                                   nonWrappingSequenceNumber,
                                   flags,
@@ -338,6 +577,7 @@ public:
         else {
             return enqueueMessage(now,
                                   EMI_PRIORITY_CONTROL,
+                                  EMI_NO_DEADLINE,
                                   EMI_CONTROL_CHANNEL,
                                   nonWrappingSequenceNumber,
                                   flags,
@@ -360,8 +600,14 @@ public:
     // channelQualifier is int32_t and not EmiChannelQualifier because it
     // has to be capable of holding -1, the special SYN/RST message channel
     // as used by EmiSenderBuffer
+    //
+    // deadline is an absolute time, or EMI_NO_DEADLINE
+    //
+    // On reliable sequenced channels, the message supersedes the older
+    // messages on the channel; see supersedeReliableMessages.
     size_t enqueueMessage(EmiTimeInterval now,
                           EmiPriority priority,
+                          EmiTimeInterval deadline,
                           int32_t channelQualifier,
                           EmiNonWrappingSequenceNumber nonWrappingSequenceNumber,
                           EmiMessageFlags flags,
@@ -374,15 +620,13 @@ public:
 #if 0
         static const size_t MAX_MESSAGE_LENGTH = 1;
 #else
-        static const size_t MAX_MESSAGE_LENGTH = (EMI_MINIMAL_MTU -
-                                                  EMI_UDP_HEADER_SIZE -
-                                                  EMI_PACKET_HEADER_MAX_LENGTH -
-                                                  EmiMessage<Binding>::maximalHeaderSize());
+        const size_t MAX_MESSAGE_LENGTH = (reliable ?
+                                           maxReliableMessageLength() :
+                                           maxUnreliableMessageLength(allowSplit && isFecChannel(channelQualifier)));
 #endif
         
         bool hasOwnershipOfDataObject = true;
         
-        const uint8_t *rawData = (data ? Binding::extractData(*data) : NULL);
         size_t dataLength = (data ? Binding::extractLength(*data) : 0);
         
         // Make sure that we won't split a message when instructed not to allow that
@@ -396,34 +640,55 @@ public:
                               1 :
                               ((dataLength-1) / MAX_MESSAGE_LENGTH)+1);
         
+        bool supersedes = (reliable &&
+                           EMI_CONTROL_CHANNEL != channelQualifier &&
+                           EMI_CHANNEL_TYPE_RELIABLE_SEQUENCED == EMI_CHANNEL_QUALIFIER_TYPE(channelQualifier));
+        
         // Make sure that the message(s) we will send fit into the sender buffer
-        // if applicable.
-        if (reliable && !_senderBuffer.fitsIntoBuffer(dataLength, numMessages)) {
+        // if applicable. The older messages are only superseded if the new
+        // message fits; otherwise they would be lost without a replacement.
+        if (reliable && !_senderBuffer.fitsIntoBuffer(dataLength, numMessages,
+                                                      (supersedes ?
+                                                       _senderBuffer.reliableMessagesSize(channelQualifier, nonWrappingSequenceNumber-1) :
+                                                       0))) {
             err = Binding::makeError("com.emilir.eminet.sendbufferoverflow", 0);
             return 0;
         }
         
-        for (int i=0; i<numMessages; i++) {
+        if (supersedes) {
+            supersedeReliableMessages(channelQualifier, nonWrappingSequenceNumber-1);
+        }
+        
+        // When splitting a message, the fragments are slices of
+        // dataOwner, which is a message that is never sent itself; it
+        // only holds the data object on behalf of the fragments.
+        EmiMessage<Binding> *dataOwner = NULL;
+        if (data && 1 != numMessages) {
+            hasOwnershipOfDataObject = false;
+            dataOwner = EM::make(_messagePool, *data);
+        }
+        
+        for (size_t i=0; i<numMessages; i++) {
             EmiMessage<Binding> *msg;
             
             if (data && 1 == numMessages) {
                 // Avoid copying data if we're not splitting the message
                 hasOwnershipOfDataObject = false;
-                msg = new EmiMessage<Binding>(*data);
+                msg = EM::make(_messagePool, *data);
             }
             else if (data) {
                 // We're splitting the message
                 size_t offset = i*MAX_MESSAGE_LENGTH;
-                PersistentData dataObj(Binding::makePersistentData(rawData + offset,
-                                                                   (i == numMessages-1 ? dataLength-offset : MAX_MESSAGE_LENGTH)));
-                msg = new EmiMessage<Binding>(dataObj);
+                msg = EM::makeSlice(_messagePool, dataOwner, offset,
+                                    (i == numMessages-1 ? dataLength-offset : MAX_MESSAGE_LENGTH));
             }
             else {
                 // There are no message contents to split
-                msg = new EmiMessage<Binding>;
+                msg = EM::make(_messagePool);
             }
             
             msg->priority = priority;
+            msg->deadline = deadline;
             msg->channelQualifier = channelQualifier;
             msg->nonWrappingSequenceNumber = nonWrappingSequenceNumber+i;
             msg->flags = (flags |
@@ -443,6 +708,19 @@ public:
             msg->release();
         }
         
+        if (data && 1 != numMessages && !reliable && isFecChannel(channelQualifier)) {
+            size_t groupSize = EmiFec::groupSize(config.fecGroupSize, _congestionControl.lossRate());
+            if (0 != groupSize) {
+                enqueueParityMessages(now, priority, deadline, channelQualifier,
+                                      nonWrappingSequenceNumber, flags, *data,
+                                      numMessages, MAX_MESSAGE_LENGTH, groupSize);
+            }
+        }
+        
+        if (dataOwner) {
+            dataOwner->release();
+        }
+        
         if (hasOwnershipOfDataObject && data) {
             Binding::releasePersistentData(*data);
         }
@@ -512,6 +790,9 @@ public:
     // This instructs the RTO timer that the connection is now opened.
     inline void connectionOpened() {
         _timers.connectionOpened();
+        
+        // Start path MTU discovery
+        _timers.ensureTickTimeout();
     }
     
     inline void resetHeartbeatTimeout() {
@@ -533,18 +814,28 @@ public:
     void eachCurrentMessageIteration(EmiTimeInterval now, EmiMessage<Binding> *msg) {
         // We send this message as unreliable, because if the message is reliable,
         // it is already in the sender buffer and shouldn't be reinserted anyway
-        enqueueUnreliableMessage(now, msg);
+        enqueueUnreliableMessage(now, msg, /*retransmission:*/true);
     }
     void rtoTimeout(EmiTimeInterval now, EmiTimeInterval rtoWhenRtoTimerWasScheduled) {
+        // The RTO timer fires once per RTO for as long as the sender
+        // buffer is not empty. Only tell congestion control and path
+        // MTU discovery about it if a message actually timed out.
+        if (!_senderBuffer.eachCurrentMessage(now, rtoWhenRtoTimerWasScheduled, *this)) {
+            return;
+        }
+        
         _congestionControl.onRto();
         
-        _senderBuffer.eachCurrentMessage(now, rtoWhenRtoTimerWasScheduled, *this);
+        if (_pathMtu.onRtoTimeout()) {
+            _sendQueue.setMtu(_pathMtu.getMtu());
+            _timers.ensureTickTimeout();
+        }
     }
     inline void enqueueHeartbeat() {
         _sendQueue.enqueueHeartbeat();
     }
-    inline void enqueueNak(EmiPacketSequenceNumber nak) {
-        _sendQueue.enqueueNak(nak);
+    inline void enqueueNak(const EmiNakRange *naks, size_t numNaks) {
+        _sendQueue.enqueueNak(naks, numNaks);
     }
     inline bool senderBufferIsEmpty() const {
         return _senderBuffer.empty();
@@ -675,8 +966,8 @@ public:
         // on. This guarantees that we don't deallocate this object while
         // there are references to it left on the stack.
         if (!_forceCloseTimer) {
-            _forceCloseTimer = Binding::makeTimer(_delegate.getTimerCookie());
-            Binding::scheduleTimer(_forceCloseTimer, forceCloseTimeoutCallback,
+            _forceCloseTimer = ETW::makeTimer(_timerWheel.get());
+            ETW::scheduleTimer(_forceCloseTimer, forceCloseTimeoutCallback,
                                    this, /*time:*/0,
                                    /*repeating:*/false, /*reschedule:*/true);
         }
@@ -685,7 +976,28 @@ public:
     // Delegates to EmiSendQueue
     // Returns true if something has been sent since the last tick
     bool tick(EmiTimeInterval now) {
-        return _sendQueue.tick(_congestionControl, _timers.getTime(), now);
+        bool somethingWasSent = _sendQueue.tick(_congestionControl, _timers.getTime(), now);
+        
+        if (isOpen()) {
+            size_t probeSize = _pathMtu.probeSize(now, _timers.getTime().getRto());
+            if (0 != probeSize) {
+                EmiPacketSequenceNumber sn = _sendQueue.sendMtuProbe(_congestionControl, now, probeSize);
+                _pathMtu.sentProbe(now, sn, probeSize);
+                somethingWasSent = true;
+            }
+            
+            if (_pathMtu.isProbing()) {
+                // Keep ticking until the probe has been answered or
+                // has timed out
+                _timers.ensureTickTimeout();
+            }
+        }
+        
+        if (_sendQueue.needsTick()) {
+            _timers.ensureTickTimeout();
+        }
+        
+        return somethingWasSent;
     }
     
     // Delegates to EmiLogicalConnection
@@ -695,16 +1007,50 @@ public:
     // be modified or released until after Binding::releasePersistentData has
     // been called on it.
     bool send(EmiTimeInterval now, const PersistentData& data, EmiChannelQualifier channelQualifier, EmiPriority priority, Error& err) {
+        return send(now, data, channelQualifier, priority, EMI_NO_DEADLINE, err);
+    }
+    
+    // deadline is the number of seconds from now that the message should
+    // be sent within, or EMI_NO_DEADLINE. Messages with deadlines are
+    // sent before messages without; unreliable messages that miss their
+    // deadline are dropped. See EmiSendScheduler.
+    bool send(EmiTimeInterval now, const PersistentData& data, EmiChannelQualifier channelQualifier, EmiPriority priority, EmiTimeInterval deadline, Error& err) {
         if (!_conn || _conn->isClosing()) {
             err = Binding::makeError("com.emilir.eminet.closed", 0);
             Binding::releasePersistentData(data);
             return false;
         }
+        else if (EMI_NO_DEADLINE != deadline && deadline < 0) {
+            err = Binding::makeError("com.emilir.eminet.invaliddeadline", 0);
+            Binding::releasePersistentData(data);
+            return false;
+        }
         else {
-            return _conn->send(data, now, channelQualifier, priority, err);
+            return _conn->send(data, now, channelQualifier, priority,
+                               (EMI_NO_DEADLINE == deadline ? EMI_NO_DEADLINE : now+deadline),
+                               err);
         }
     }
     
+    // Returns true if new messages on the channel replace the messages
+    // that are waiting to be sent on it. See EmiSockConfig::conflatedChannels.
+    inline bool isConflatedChannel(int32_t channelQualifier) const {
+        return (EMI_CONTROL_CHANNEL != channelQualifier &&
+                EMI_CHANNEL_TYPE_UNRELIABLE_SEQUENCED == EMI_CHANNEL_QUALIFIER_TYPE(channelQualifier) &&
+                (config.conflatedChannels & (((uint32_t)1) << (channelQualifier & 0x1f))));
+    }
+    
+    // Delegates to EmiSendQueue
+    inline bool dropUnsentMessage(EmiChannelQualifier channelQualifier, EmiNonWrappingSequenceNumber& sequenceNumber) {
+        return _sendQueue.dropUnsentMessage(channelQualifier, sequenceNumber);
+    }
+    
+    // The number of unreliable messages that have been dropped because
+    // they missed their deadline
+    inline size_t getExpiredMessages() const {
+        return _sendQueue.expiredMessages();
+    }
+    
     inline ConnDelegate& getDelegate() {
         return _delegate;
     }
@@ -757,15 +1103,32 @@ public:
         return _conn ? _conn->getOtherHostInitialSequenceNumber() : 0;
     }
     
-    /// Invoked by EmiSendQueue
-    void sendDatagram(const uint8_t *data, size_t size) {
-        sendDatagram(getRemoteAddress(), data, size);
+    /// Invoked by EmiSendQueue. packetPair is true for the packets
+    /// of a packet pair; see EmiUdpSocket::sendData.
+    void sendDatagram(const uint8_t *data, size_t size, bool packetPair) {
+        struct iovec iov;
+        iov.iov_base = (void *)data;
+        iov.iov_len = size;
+        sendDatagram(getRemoteAddress(), &iov, 1, packetPair);
+    }
+    
+    // Sends a datagram that consists of the concatenation of the
+    // buffers in iov.
+    void sendDatagram(const struct iovec *iov, size_t iovcnt, bool packetPair) {
+        sendDatagram(getRemoteAddress(), iov, iovcnt, packetPair);
     }
     
     /// Invoked by EmiNatPunchthrough (via EmiLogicalConnection);
     /// EmiNatPunchthrough needs the ability to send packets to
     /// other addresses than the current _remoteAddress
     void sendDatagram(const sockaddr_storage& address, const uint8_t *data, size_t size) {
+        struct iovec iov;
+        iov.iov_base = (void *)data;
+        iov.iov_len = size;
+        sendDatagram(address, &iov, 1);
+    }
+    
+    void sendDatagram(const sockaddr_storage& address, const struct iovec *iov, size_t iovcnt, bool packetPair = false) {
         _timers.sentPacket();
         
         if (shouldArtificiallyDropPacket()) {
@@ -773,7 +1136,7 @@ public:
         }
         
         if (_socket) {
-            _socket->sendData(_localAddress, address, data, size);
+            _socket->sendData(_localAddress, address, iov, iovcnt, packetPair);
         }
     }
     
@@ -31,6 +31,7 @@ class EmiConnTimers {
     EmiLossList _lossList;
     
     Timer *_nakTimer;
+    Timer *_reorderTimer;
     Timer *_tickTimer;
     Timer *_heartbeatTimer;
     ERT    _rtoTimer;
@@ -44,16 +45,33 @@ private:
         return 1/sc.heartbeatFrequency * sc.heartbeatsBeforeConnectionWarning;
     }
     
+    void sendNak(EmiTimeInterval now) {
+        EmiNakRange naks[EMI_MAX_NAK_RANGES];
+        size_t numNaks = _lossList.calculateNak(now, _time.getRto(), naks, EMI_MAX_NAK_RANGES);
+        
+        if (0 != numNaks) {
+            _delegate.enqueueNak(naks, numNaks);
+            ensureTickTimeout();
+        }
+    }
+    
     static void nakTimeoutCallback(EmiTimeInterval now, Timer *timer, void *data) {
         EmiConnTimers *timers = (EmiConnTimers *)data;
         
-        EmiPacketSequenceNumber nak = timers->_lossList.calculateNak(now, timers->_time.getRto());
+        timers->sendNak(now);
+        timers->ensureNakTimeout();
+    }
+    
+    static void reorderTimeoutCallback(EmiTimeInterval now, Timer *timer, void *data) {
+        EmiConnTimers *timers = (EmiConnTimers *)data;
         
-        if (-1 != nak) {
-            timers->_delegate.enqueueNak(nak);
-            timers->ensureTickTimeout();
+        timers->sendNak(now);
+        
+        // Losses that were detected after this timer was scheduled are
+        // not due yet
+        if (timers->_lossList.hasUnreportedLosses()) {
+            timers->ensureReorderTimeout();
         }
-        timers->ensureNakTimeout();
     }
     
     static void tickTimeoutCallback(EmiTimeInterval now, Timer *timer, void *data) {
@@ -109,6 +127,7 @@ public:
     _lossList(),
     _sentDataSinceLastHeartbeat(false),
     _nakTimer(Binding::makeTimer(timerCookie)),
+    _reorderTimer(Binding::makeTimer(timerCookie)),
     _tickTimer(Binding::makeTimer(timerCookie)),
     _heartbeatTimer(Binding::makeTimer(timerCookie)),
     _rtoTimer(timeBeforeConnectionWarning(config),
@@ -120,6 +139,7 @@ public:
     
     virtual ~EmiConnTimers() {
         Binding::freeTimer(_nakTimer);
+        Binding::freeTimer(_reorderTimer);
         Binding::freeTimer(_tickTimer);
         Binding::freeTimer(_heartbeatTimer);
     }
@@ -127,6 +147,7 @@ public:
     void deschedule() {
         _rtoTimer.deschedule();
         Binding::descheduleTimer(_nakTimer);
+        Binding::descheduleTimer(_reorderTimer);
         Binding::descheduleTimer(_tickTimer);
         Binding::descheduleTimer(_heartbeatTimer);
     }
@@ -137,8 +158,15 @@ public:
     
     void gotPacket(const EmiPacketHeader& header, EmiTimeInterval now) {
         _time.gotPacket(header, now);
-        _lossList.gotPacket(now, header.sequenceNumber);
-        _rtoTimer.gotPacket();
+        if (_lossList.gotPacket(now, header.sequenceNumber) &&
+            !_delegate.isOpening()) {
+            // Report the loss as soon as the packets can't be expected
+            // to arrive out of order anymore instead of on the next NAK
+            // timeout, so that the other host can retransmit the lost
+            // messages without waiting for the RTO.
+            ensureReorderTimeout();
+        }
+        _rtoTimer.gotPacket(now);
     }
     
     void resetHeartbeatTimeout() {
@@ -161,6 +189,12 @@ public:
         }
     }
     
+    void ensureReorderTimeout() {
+        Binding::scheduleTimer(_reorderTimer, reorderTimeoutCallback,
+                               this, EmiLossList::reorderWindow(_time.getRto()),
+                               /*repeating:*/false, /*reschedule:*/false);
+    }
+    
     void ensureTickTimeout() {
         Binding::scheduleTimer(_tickTimer, tickTimeoutCallback, this,
                                EMI_TICK_TIME,
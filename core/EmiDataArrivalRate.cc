@@ -10,6 +10,7 @@
 
 EmiDataArrivalRate::EmiDataArrivalRate() :
 _lastPacketTime(-1),
+_pendingBytes(0),
 _medianFilter(1) {}
 
 EmiDataArrivalRate::~EmiDataArrivalRate() {}
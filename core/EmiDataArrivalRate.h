@@ -18,6 +18,8 @@
 class EmiDataArrivalRate {
     
     EmiTimeInterval        _lastPacketTime;
+    // The bytes that have arrived after _lastPacketTime
+    size_t                 _pendingBytes;
     // The values this filter handles are in the unit of
     // bytes per second
     EmiMedianFilter<float> _medianFilter;
@@ -29,17 +31,29 @@ public:
     
     // Call this when a packet has been received. This
     // method is fast.
+    //
+    // Packets that are received at the same time, for
+    // instance in one pass of the event loop, are counted
+    // as one sample when time has passed, since their
+    // interval would otherwise be 0.
     inline void gotPacket(EmiTimeInterval now, size_t packetLength) {
-        if (-1 != _lastPacketTime) {
-            _medianFilter.pushValue(packetLength/(now-_lastPacketTime));
+        if (-1 == _lastPacketTime) {
+            _lastPacketTime = now;
+            return;
+        }
+        
+        _pendingBytes += packetLength;
+        if (now != _lastPacketTime) {
+            _medianFilter.pushValue(_pendingBytes/(now-_lastPacketTime));
+            _pendingBytes = 0;
+            _lastPacketTime = now;
         }
-        _lastPacketTime = now;
     }
     
     // Calculates the current data arrival rate, in
-    // bytes per second. Note that this method is
-    // a bit slow, and is not intended to be called
-    // as often as once per packet.
+    // bytes per second. The result is cached until
+    // the next packet arrives, so this is cheap to
+    // call often.
     inline float calculate() const {
         return _medianFilter.calculate();
     }
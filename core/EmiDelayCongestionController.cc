@@ -0,0 +1,198 @@
+//
+//  EmiDelayCongestionController.cc
+//  eminet
+//
+
+#include "EmiDelayCongestionController.h"
+
+#include "EmiNetUtil.h"
+
+#include <algorithm>
+#include <cmath>
+
+// The packet size that the congestion window is adjusted in terms of
+static const size_t MSS = EMI_MINIMAL_MTU;
+static const size_t INITIAL_WINDOW = 4*MSS;
+static const size_t MIN_WINDOW = 2*MSS;
+// The congestion window may not grow to more than this many bytes
+// more than what is actually in flight. This prevents the window from
+// growing without bounds when the application sends less than it
+// allows.
+static const size_t ALLOWED_INCREASE = 2*MSS;
+static const EmiTimeInterval GAIN = 1;
+
+EmiDelayCongestionController::EmiDelayCongestionController() :
+_totalSent(0),
+_totalAcked(0),
+_newestSeenAckSN(-1),
+_congestionWindow(INITIAL_WINDOW),
+_slowStart(true),
+_lastDecreaseTime(-1),
+_baseDelayMinute(-1),
+_currentDelaysIdx(0),
+_srtt(-1) {
+    for (size_t i=0; i<SENT_PACKETS_SIZE; i++) {
+        _sentPackets[i].sequenceNumber = -1;
+        _sentPackets[i].time = 0;
+        _sentPackets[i].totalSent = 0;
+    }
+    
+    for (size_t i=0; i<EMI_DELAY_BASE_HISTORY; i++) {
+        _baseDelays[i] = -1;
+    }
+    
+    for (size_t i=0; i<CURRENT_DELAY_SAMPLES; i++) {
+        _currentDelays[i] = -1;
+    }
+}
+
+EmiDelayCongestionController::~EmiDelayCongestionController() {}
+
+void EmiDelayCongestionController::gotDelaySample(EmiTimeInterval now, EmiTimeInterval delay) {
+    int64_t minute = (int64_t) std::floor(now/60);
+    if (minute != _baseDelayMinute) {
+        // Start a new minute in the base delay history. Minutes in
+        // which no samples were taken keep their old values, which
+        // makes the history a bit longer when the connection is idle.
+        _baseDelayMinute = minute;
+        _baseDelays[minute % EMI_DELAY_BASE_HISTORY] = delay;
+    }
+    else {
+        EmiTimeInterval& baseDelay(_baseDelays[minute % EMI_DELAY_BASE_HISTORY]);
+        baseDelay = std::min(baseDelay, delay);
+    }
+    
+    _currentDelays[_currentDelaysIdx] = delay;
+    _currentDelaysIdx = (_currentDelaysIdx+1) % CURRENT_DELAY_SAMPLES;
+    
+    if (-1 == _srtt) {
+        _srtt = delay;
+    }
+    else {
+        static const EmiTimeInterval SMOOTH = 0.125;
+        _srtt = (1-SMOOTH)*_srtt + SMOOTH*delay;
+    }
+}
+
+EmiTimeInterval EmiDelayCongestionController::baseDelay() const {
+    EmiTimeInterval result = -1;
+    for (size_t i=0; i<EMI_DELAY_BASE_HISTORY; i++) {
+        if (-1 != _baseDelays[i] && (-1 == result || _baseDelays[i] < result)) {
+            result = _baseDelays[i];
+        }
+    }
+    return result;
+}
+
+EmiTimeInterval EmiDelayCongestionController::currentDelay() const {
+    EmiTimeInterval result = -1;
+    for (size_t i=0; i<CURRENT_DELAY_SAMPLES; i++) {
+        if (-1 != _currentDelays[i] && (-1 == result || _currentDelays[i] < result)) {
+            result = _currentDelays[i];
+        }
+    }
+    return result;
+}
+
+void EmiDelayCongestionController::onDataSent(EmiTimeInterval now, EmiPacketSequenceNumber sequenceNumber, size_t size) {
+    if (-1 == _newestSeenAckSN) {
+        _newestSeenAckSN = ((sequenceNumber-1) & EMI_PACKET_SEQUENCE_NUMBER_MASK);
+    }
+    
+    _totalSent += size;
+    
+    SentPacket& packet(_sentPackets[sequenceNumber % SENT_PACKETS_SIZE]);
+    packet.sequenceNumber = sequenceNumber;
+    packet.time = now;
+    packet.totalSent = _totalSent;
+}
+
+void EmiDelayCongestionController::onAck(EmiTimeInterval now, EmiTimeInterval rtt, EmiPacketSequenceNumber ack) {
+    if (-1 == _newestSeenAckSN ||
+        EmiNetUtil::cyclicDifferenceSigned<EMI_PACKET_SEQUENCE_NUMBER_LENGTH>(ack, _newestSeenAckSN) <= 0) {
+        // We have already seen this ack, or we have not sent anything
+        return;
+    }
+    _newestSeenAckSN = ack;
+    
+    const SentPacket& packet(_sentPackets[ack % SENT_PACKETS_SIZE]);
+    if (packet.sequenceNumber != ack) {
+        return;
+    }
+    
+    size_t bytesInFlight = _totalSent-_totalAcked;
+    size_t bytesAcked = 0;
+    if (packet.totalSent > _totalAcked) {
+        bytesAcked = packet.totalSent-_totalAcked;
+        _totalAcked = packet.totalSent;
+    }
+    
+    gotDelaySample(now, now-packet.time);
+    
+    if (0 == bytesAcked) {
+        return;
+    }
+    
+    EmiTimeInterval queuingDelay = currentDelay()-baseDelay();
+    
+    if (_slowStart && queuingDelay > EMI_DELAY_TARGET/2) {
+        // Leave slow start before the queues start to build up
+        _slowStart = false;
+    }
+    
+    double congestionWindow = _congestionWindow;
+    if (_slowStart) {
+        congestionWindow += bytesAcked;
+    }
+    else {
+        EmiTimeInterval offTarget = (EMI_DELAY_TARGET-queuingDelay)/EMI_DELAY_TARGET;
+        offTarget = std::max(-1.0, std::min(1.0, offTarget));
+        congestionWindow += GAIN*offTarget*bytesAcked*MSS/congestionWindow;
+    }
+    
+    congestionWindow = std::min(congestionWindow, (double)(bytesInFlight+ALLOWED_INCREASE));
+    congestionWindow = std::max(congestionWindow, (double)MIN_WINDOW);
+    congestionWindow = std::min(congestionWindow, (double)EMI_MAX_CONGESTION_WINDOW);
+    _congestionWindow = (size_t) congestionWindow;
+}
+
+void EmiDelayCongestionController::onNak(EmiTimeInterval now,
+                                         const EmiNakRange *ranges,
+                                         size_t numRanges,
+                                         EmiPacketSequenceNumber largestSNSoFar) {
+    _slowStart = false;
+    
+    if (-1 != _lastDecreaseTime &&
+        now-_lastDecreaseTime < std::max(_srtt, (EmiTimeInterval) EMI_TICK_TIME)) {
+        // Only react to one loss per round trip
+        return;
+    }
+    
+    _lastDecreaseTime = now;
+    _congestionWindow = std::max(_congestionWindow/2, MIN_WINDOW);
+}
+
+void EmiDelayCongestionController::onRto() {
+    _slowStart = false;
+    _congestionWindow = MIN_WINDOW;
+    
+    // Consider everything that is in flight as lost
+    _totalAcked = _totalSent;
+}
+
+size_t EmiDelayCongestionController::tickAllowance() const {
+    size_t bytesInFlight = _totalSent-_totalAcked;
+    if (bytesInFlight >= _congestionWindow) {
+        return 0;
+    }
+    
+    if (-1 == _srtt || _srtt <= EMI_TICK_TIME) {
+        return _congestionWindow-bytesInFlight;
+    }
+    
+    // EmiSendQueue uses the tick allowance as a rate, so pace the
+    // window over the round trip instead of allowing it to be sent
+    // in bursts that fill the queues. The 2 leaves room for the
+    // window to grow.
+    return (size_t) (2*_congestionWindow*EMI_TICK_TIME/_srtt);
+}
@@ -0,0 +1,79 @@
+//
+//  EmiDelayCongestionController.h
+//  eminet
+//
+
+#ifndef eminet_EmiDelayCongestionController_h
+#define eminet_EmiDelayCongestionController_h
+
+#include "EmiCongestionController.h"
+
+// This class implements a delay based congestion control algorithm,
+// in the style of LEDBAT (RFC 6817). Instead of increasing the
+// sending rate until packets are lost, which fills the queues along
+// the path, it aims for a queuing delay of EMI_DELAY_TARGET.
+//
+// The queuing delay is estimated as the difference between the
+// current round trip time and the smallest round trip time seen over
+// the last EMI_DELAY_BASE_HISTORY minutes. Round trip times are
+// measured from the send time of a packet to the arrival of an ack
+// for it. Since acks are sent once per tick, these measurements are
+// up to EMI_TICK_TIME too high, which is why the current round trip
+// time is the minimum of a few recent measurements.
+//
+// Losses halve the congestion window, at most once per round trip.
+class EmiDelayCongestionController : public EmiCongestionController {
+    struct SentPacket {
+        EmiPacketSequenceNumber sequenceNumber;
+        EmiTimeInterval         time;
+        // The total number of bytes sent, up to and including this packet
+        size_t                  totalSent;
+    };
+    
+    static const size_t SENT_PACKETS_SIZE = 1024;
+    static const size_t CURRENT_DELAY_SAMPLES = 4;
+    
+    // The packets that have been sent recently, indexed by sequence
+    // number. Acks for packets that are not in this buffer any more
+    // are ignored.
+    SentPacket _sentPackets[SENT_PACKETS_SIZE];
+    size_t _totalSent;
+    size_t _totalAcked;
+    EmiPacketSequenceNumber _newestSeenAckSN;
+    
+    size_t _congestionWindow;
+    bool   _slowStart;
+    EmiTimeInterval _lastDecreaseTime;
+    
+    // The minimum round trip time of each of the last
+    // EMI_DELAY_BASE_HISTORY minutes, or -1
+    EmiTimeInterval _baseDelays[EMI_DELAY_BASE_HISTORY];
+    int64_t         _baseDelayMinute;
+    EmiTimeInterval _currentDelays[CURRENT_DELAY_SAMPLES];
+    size_t          _currentDelaysIdx;
+    EmiTimeInterval _srtt; // -1 if not set
+    
+    void gotDelaySample(EmiTimeInterval now, EmiTimeInterval delay);
+    EmiTimeInterval baseDelay() const;
+    EmiTimeInterval currentDelay() const;
+    
+public:
+    EmiDelayCongestionController();
+    virtual ~EmiDelayCongestionController();
+    
+    virtual void onDataSent(EmiTimeInterval now, EmiPacketSequenceNumber sequenceNumber, size_t size);
+    
+    virtual void gotRemoteLinkCapacity(float linkCapacity) {}
+    virtual void gotRemoteDataArrivalRate(float dataArrivalRate) {}
+    
+    virtual void onAck(EmiTimeInterval now, EmiTimeInterval rtt, EmiPacketSequenceNumber ack);
+    virtual void onNak(EmiTimeInterval now,
+                       const EmiNakRange *ranges,
+                       size_t numRanges,
+                       EmiPacketSequenceNumber largestSNSoFar);
+    virtual void onRto();
+    
+    virtual size_t tickAllowance() const;
+};
+
+#endif
@@ -0,0 +1,69 @@
+//
+//  EmiFec.cc
+//  eminet
+//
+
+#include "EmiFec.h"
+
+#include "EmiNetUtil.h"
+
+#include <algorithm>
+#include <cstring>
+
+static const EmiMessageFlags SPLIT_FLAGS = (EMI_SPLIT_NOT_FIRST_FLAG | EMI_SPLIT_NOT_LAST_FLAG);
+
+size_t EmiFec::groupSize(size_t configuredGroupSize, float lossRate) {
+    size_t groupSize = configuredGroupSize;
+    if (0 == groupSize) {
+        if (lossRate < EMI_FEC_MIN_LOSS_RATE) {
+            return 0;
+        }
+        
+        groupSize = (size_t) (EMI_FEC_LOSS_FACTOR/lossRate);
+    }
+    
+    groupSize = std::max(groupSize, (size_t) EMI_FEC_MIN_GROUP_SIZE);
+    groupSize = std::min(groupSize, (size_t) EMI_FEC_MAX_GROUP_SIZE);
+    return groupSize;
+}
+
+void EmiFec::initParity(uint8_t *buf, size_t bufSize, size_t numParts) {
+    ASSERT(bufSize >= EMI_FEC_HEADER_LENGTH);
+    ASSERT(numParts <= 0xff);
+    
+    memset(buf, 0, bufSize);
+    buf[0] = (uint8_t) numParts;
+}
+
+void EmiFec::addPart(uint8_t *buf, size_t bufSize,
+                     EmiMessageFlags flags,
+                     const uint8_t *data, size_t length) {
+    ASSERT(length <= 0xffff);
+    
+    buf[1] ^= (flags & SPLIT_FLAGS);
+    buf[2] ^= (uint8_t) (length >> 8);
+    buf[3] ^= (uint8_t) length;
+    
+    size_t end = std::min(length, bufSize-EMI_FEC_HEADER_LENGTH);
+    uint8_t *parity = buf+EMI_FEC_HEADER_LENGTH;
+    for (size_t i=0; i<end; i++) {
+        parity[i] ^= data[i];
+    }
+}
+
+bool EmiFec::parse(const uint8_t *buf, size_t bufSize, size_t *numParts) {
+    if (bufSize < EMI_FEC_HEADER_LENGTH) {
+        return false;
+    }
+    
+    *numParts = buf[0];
+    return true;
+}
+
+EmiMessageFlags EmiFec::partFlags(const uint8_t *buf) {
+    return buf[1] & SPLIT_FLAGS;
+}
+
+size_t EmiFec::partLength(const uint8_t *buf) {
+    return (((size_t) buf[2]) << 8) | buf[3];
+}
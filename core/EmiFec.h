@@ -0,0 +1,61 @@
+//
+//  EmiFec.h
+//  eminet
+//
+
+#ifndef eminet_EmiFec_h
+#define eminet_EmiFec_h
+
+#include "EmiTypes.h"
+
+#include <cstddef>
+
+// This class implements forward error correction for split messages
+// on unreliable channels, which never retransmit lost parts.
+//
+// The parts of a split message are divided into groups, and after
+// each group the sender sends a parity message. The parity message
+// has the EMI_FEC_FLAG flag, the channel qualifier of the split
+// message and the sequence number of the first part in the group.
+// Its data is an EMI_FEC_HEADER_LENGTH byte header followed by the
+// XOR of the data of the parts, each padded with zeros to the length
+// of the longest one.
+//
+// A receiver that has got all parts of a group but one rebuilds the
+// missing part by adding the parts it has to a copy of the parity
+// message: What remains is the flags, length and data of the
+// missing part.
+class EmiFec {
+private:
+    // Private constructor, copy constructor and assignment operator
+    inline EmiFec();
+    inline EmiFec(const EmiFec& other);
+    inline EmiFec& operator=(const EmiFec& other);
+    
+public:
+    // Returns the number of parts per parity message, or 0 if no
+    // parity messages should be sent. configuredGroupSize is
+    // EmiSockConfig::fecGroupSize.
+    static size_t groupSize(size_t configuredGroupSize, float lossRate);
+    
+    // buf must have room for EMI_FEC_HEADER_LENGTH bytes plus the
+    // length of the longest part in the group. The data is zeroed.
+    static void initParity(uint8_t *buf, size_t bufSize, size_t numParts);
+    // Adds a part to a parity message, or removes it from one, since
+    // adding the same part twice cancels it out.
+    static void addPart(uint8_t *buf, size_t bufSize,
+                        EmiMessageFlags flags,
+                        const uint8_t *data, size_t length);
+    
+    // Returns false if buf is too small to be a parity message
+    static bool parse(const uint8_t *buf, size_t bufSize, size_t *numParts);
+    
+    // These read the part that is left in a parity message that the
+    // other parts of the group have been added to. partLength might
+    // be larger than bufSize-EMI_FEC_HEADER_LENGTH if the message is
+    // corrupt.
+    static EmiMessageFlags partFlags(const uint8_t *buf);
+    static size_t partLength(const uint8_t *buf);
+};
+
+#endif
@@ -0,0 +1,275 @@
+//
+//  EmiHashMap.h
+//  eminet
+//
+
+#ifndef eminet_EmiHashMap_h
+#define eminet_EmiHashMap_h
+
+#include "EmiNetUtil.h"
+
+#include <cstring>
+#include <stdint.h>
+
+// The secret key of EmiHashMapUtil::hashBytes. Every EmiHashMap has
+// its own, which its owner picks at random.
+struct EmiHashSeed {
+    EmiHashSeed() : k0(0), k1(0) {}
+    EmiHashSeed(uint64_t k0_, uint64_t k1_) : k0(k0_), k1(k1_) {}
+    
+    uint64_t k0;
+    uint64_t k1;
+};
+
+class EmiHashMapUtil {
+private:
+    inline EmiHashMapUtil();
+    
+    static inline uint64_t rotl(uint64_t x, int b) {
+        return (x << b) | (x >> (64-b));
+    }
+        
+    static inline void sipRound(uint64_t& v0, uint64_t& v1, uint64_t& v2, uint64_t& v3) {
+        v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32);
+        v2 += v3; v3 = rotl(v3, 16); v3 ^= v2;
+        v0 += v3; v3 = rotl(v3, 21); v3 ^= v0;
+        v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32);
+    }
+    
+public:
+    // A keyed hash (SipHash-1-3) of a small blob of memory. The keys
+    // that EmiNet hashes are addresses and cookies, which remote hosts
+    // choose, and anyone can spoof source addresses. With an unkeyed
+    // hash, an attacker could pick addresses that land in the same part
+    // of a map and turn every lookup into a linear scan of it. Without
+    // the seed, the attacker can't tell which addresses collide.
+    static uint32_t hashBytes(const EmiHashSeed& seed, const void *data, size_t len) {
+        const uint8_t *bytes = (const uint8_t *)data;
+        uint64_t v0 = seed.k0 ^ 0x736f6d6570736575ULL;
+        uint64_t v1 = seed.k1 ^ 0x646f72616e646f6dULL;
+        uint64_t v2 = seed.k0 ^ 0x6c7967656e657261ULL;
+        uint64_t v3 = seed.k1 ^ 0x7465646279746573ULL;
+        uint64_t last = ((uint64_t)len) << 56;
+        
+        while (len >= 8) {
+            uint64_t m;
+            memcpy(&m, bytes, sizeof(m));
+            v3 ^= m;
+            sipRound(v0, v1, v2, v3);
+            v0 ^= m;
+            bytes += 8;
+            len -= 8;
+        }
+        for (size_t i=0; i<len; i++) {
+            last |= ((uint64_t)bytes[i]) << (8*i);
+        }
+        v3 ^= last;
+        sipRound(v0, v1, v2, v3);
+        v0 ^= last;
+        
+        v2 ^= 0xff;
+        sipRound(v0, v1, v2, v3);
+        sipRound(v0, v1, v2, v3);
+        sipRound(v0, v1, v2, v3);
+        
+        uint64_t h = v0 ^ v1 ^ v2 ^ v3;
+        return (uint32_t)(h ^ (h >> 32));
+    }
+};
+
+// A hash map with open addressing and linear probing, designed for
+// looking up connections by address or cookie on every received
+// datagram. All entries are stored in one array, so a lookup usually
+// touches only one or two cache lines, as opposed to the O(log n)
+// nodes that a std::map lookup touches.
+//
+// Key must be default constructible and assignable, and have an
+// operator== and a uint32_t hash(const EmiHashSeed&) const method. Value must be a
+// pointer type; NULL values can't be stored, because NULL marks an
+// empty slot. Because of that, find returns NULL when a key is not
+// in the map.
+//
+// Erasing an entry moves entries of the same probe sequence back
+// instead of leaving a tombstone, so the map does not degrade when
+// connections come and go. This also means that erasing invalidates
+// iterators.
+template<class Key, class Value>
+class EmiHashMap {
+public:
+    struct Entry {
+        Entry() : first(), second(NULL) {}
+        
+        Key   first;
+        Value second;
+    };
+    
+    class iterator {
+        friend class EmiHashMap;
+        
+        Entry *_entry;
+        Entry *_end;
+        
+        iterator(Entry *entry, Entry *end) :
+        _entry(entry),
+        _end(end) {
+            skipEmpty();
+        }
+        
+        inline void skipEmpty() {
+            while (_entry != _end && !_entry->second) {
+                ++_entry;
+            }
+        }
+        
+    public:
+        inline Entry& operator*() const {
+            return *_entry;
+        }
+        
+        inline iterator& operator++() {
+            ++_entry;
+            skipEmpty();
+            return *this;
+        }
+        
+        inline bool operator==(const iterator& other) const {
+            return _entry == other._entry;
+        }
+        
+        inline bool operator!=(const iterator& other) const {
+            return _entry != other._entry;
+        }
+    };
+    
+private:
+    // Private copy constructor and assignment operator
+    inline EmiHashMap(const EmiHashMap& other);
+    inline EmiHashMap& operator=(const EmiHashMap& other);
+    
+    static const size_t MIN_CAPACITY = 16;
+    
+    EmiHashSeed _seed;
+    Entry  *_entries;
+    // The capacity is always a power of two; _mask is capacity-1
+    size_t  _mask;
+    size_t  _size;
+    
+    inline size_t idealIndex(const Key& key) const {
+        return key.hash(_seed) & _mask;
+    }
+    
+    // Returns the index of key, or the index of the empty slot where
+    // it would be inserted.
+    size_t findIndex(const Key& key) const {
+        size_t i = idealIndex(key);
+        while (_entries[i].second && !(_entries[i].first == key)) {
+            i = (i+1) & _mask;
+        }
+        return i;
+    }
+    
+    void grow() {
+        Entry *oldEntries = _entries;
+        size_t oldCapacity = _mask+1;
+        
+        _entries = new Entry[oldCapacity*2];
+        _mask = oldCapacity*2-1;
+        
+        for (size_t i=0; i<oldCapacity; i++) {
+            if (oldEntries[i].second) {
+                Entry& entry(_entries[findIndex(oldEntries[i].first)]);
+                entry.first = oldEntries[i].first;
+                entry.second = oldEntries[i].second;
+            }
+        }
+        
+        delete[] oldEntries;
+    }
+    
+public:
+    // The seed should be random; see EmiHashMapUtil::hashBytes
+    explicit EmiHashMap(const EmiHashSeed& seed) :
+    _seed(seed),
+    _entries(new Entry[MIN_CAPACITY]),
+    _mask(MIN_CAPACITY-1),
+    _size(0) {}
+    
+    virtual ~EmiHashMap() {
+        delete[] _entries;
+    }
+    
+    inline size_t size() const {
+        return _size;
+    }
+    
+    inline bool empty() const {
+        return 0 == _size;
+    }
+    
+    inline Value find(const Key& key) const {
+        return _entries[findIndex(key)].second;
+    }
+    
+    // Returns false and does nothing if key is already in the map
+    bool insert(const Key& key, Value value) {
+        ASSERT(value);
+        
+        size_t i = findIndex(key);
+        if (_entries[i].second) {
+            return false;
+        }
+        
+        _entries[i].first = key;
+        _entries[i].second = value;
+        _size++;
+        
+        // Linear probing degrades quickly when the table fills up,
+        // so keep the load factor at or below 1/2.
+        if (_size*2 > _mask+1) {
+            grow();
+        }
+        
+        return true;
+    }
+    
+    // Returns false if key was not in the map
+    bool erase(const Key& key) {
+        size_t i = findIndex(key);
+        if (!_entries[i].second) {
+            return false;
+        }
+        
+        // Move back the entries after i that would be reachable from
+        // their ideal index only through i.
+        size_t j = i;
+        for (;;) {
+            j = (j+1) & _mask;
+            if (!_entries[j].second) {
+                break;
+            }
+            
+            size_t k = idealIndex(_entries[j].first);
+            if ((j > i && (k <= i || k > j)) ||
+                (j < i && (k <= i && k > j))) {
+                _entries[i] = _entries[j];
+                i = j;
+            }
+        }
+        
+        _entries[i].first = Key();
+        _entries[i].second = NULL;
+        _size--;
+        
+        return true;
+    }
+    
+    inline iterator begin() {
+        return iterator(_entries, _entries+_mask+1);
+    }
+    
+    inline iterator end() {
+        return iterator(_entries+_mask+1, _entries+_mask+1);
+    }
+};
+
+#endif
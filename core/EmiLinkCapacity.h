@@ -31,9 +31,9 @@ public:
     void gotPacket(EmiTimeInterval now, EmiPacketSequenceNumber sequenceNumber, size_t packetLength);
     
     // Calculates the current estimated link capaticy, in
-    // bytes per second. Note that this method is a bit
-    // slow, and is not intended to be called as often as
-    // once per packet.
+    // bytes per second. The result is cached until the
+    // next sample is taken, so this is cheap to call
+    // often.
     inline float calculate() const {
         return _medianFilter.calculate();
     }
@@ -510,14 +510,17 @@ public:
     // Returns false if the sender buffer was full and the message couldn't be sent
     //
     // send assumes ownership of the data PersistentData object
-    bool send(const PersistentData& data, EmiTimeInterval now, EmiChannelQualifier channelQualifier, EmiPriority priority, Error& err) {
+    //
+    // deadline is an absolute time, or EMI_NO_DEADLINE
+    bool send(const PersistentData& data, EmiTimeInterval now, EmiChannelQualifier channelQualifier, EmiPriority priority, EmiTimeInterval deadline, Error& err) {
         // This has to be called before we increment _sequenceMemo[cq]
         EmiNonWrappingSequenceNumber prevSeqMemo = sequenceMemoForChannelQualifier(channelQualifier);
         
         EmiChannelType channelType = EMI_CHANNEL_QUALIFIER_TYPE(channelQualifier);
         
         bool reliable = (EMI_CHANNEL_TYPE_RELIABLE_SEQUENCED == channelType ||
-                         EMI_CHANNEL_TYPE_RELIABLE_ORDERED == channelType);
+                         EMI_CHANNEL_TYPE_RELIABLE_ORDERED == channelType ||
+                         EMI_CHANNEL_TYPE_RELIABLE_UNORDERED == channelType);
         
         if (isClosed()) {
             err = Binding::makeError("com.emilir.eminet.closed", 0);
@@ -529,8 +532,18 @@ public:
             return false;
         }
         
+        if (_conn->isConflatedChannel(channelQualifier)) {
+            // Replace the previous message on the channel if it hasn't
+            // been sent yet. The new message gets its sequence numbers.
+            EmiNonWrappingSequenceNumber unsentSeqMemo;
+            if (_conn->dropUnsentMessage(channelQualifier, unsentSeqMemo)) {
+                prevSeqMemo = unsentSeqMemo;
+            }
+        }
+        
         size_t enqueuedMessages = _conn->enqueueMessage(now,
                                                         priority,
+                                                        deadline,
                                                         channelQualifier,
                                                         /*nonWrappingSequenceNumber:*/prevSeqMemo,
                                                         /*flags:*/0,
@@ -549,11 +562,8 @@ public:
         }
         
         if (EMI_CHANNEL_TYPE_RELIABLE_SEQUENCED == channelType) {
-            // We have now successfully enqueued a new message on a RELIABLE_SEQUENCED
-            // channel. We can safely deregister previous reliable messages on the
-            // channel.
-            
-            _conn->deregisterReliableMessages(now, channelQualifier, prevSeqMemo-1);
+            // enqueueMessage has retired the previous reliable messages on
+            // the channel; see EmiConn::supersedeReliableMessages.
             _reliableSequencedBuffer[channelQualifier] = prevSeqMemo+enqueuedMessages;
         }
         
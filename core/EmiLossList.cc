@@ -10,14 +10,98 @@
 
 #include "EmiNetUtil.h"
 
+#include <algorithm>
+
+// Returns the index of the least significant set bit. word must not be 0.
+inline static size_t firstSetBit(uint64_t word) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(word);
+#else
+    size_t result = 0;
+    while (0 == (word & 1)) {
+        word >>= 1;
+        result++;
+    }
+    return result;
+#endif
+}
+
+// Returns a word with the bits [first, first+count) set
+inline static uint64_t bitMask(size_t first, size_t count) {
+    uint64_t bits = (64 == count ? ~((uint64_t)0) : (((uint64_t)1) << count)-1);
+    return bits << first;
+}
+
 EmiLossList::EmiLossList() :
 _newestSequenceNumber(-1),
 _newestSequenceNumberTime(0),
-_lossSet() {}
+_rangesBegin(0),
+_rangesCount(0) {
+    std::fill(_lostBits, _lostBits+NUM_WORDS, 0);
+}
 
 EmiLossList::~EmiLossList() {}
 
-void EmiLossList::gotPacket(EmiTimeInterval now, EmiPacketSequenceNumber wrappedSequenceNumber) {
+void EmiLossList::setLost(EmiNonWrappingPacketSequenceNumber oldest, EmiNonWrappingPacketSequenceNumber newest, bool lost) {
+    EmiNonWrappingPacketSequenceNumber sn = oldest;
+    while (sn <= newest) {
+        size_t bitIdx = sn % EMI_LOSS_LIST_WINDOW;
+        size_t bitInWord = bitIdx % BITS_PER_WORD;
+        size_t count = std::min((EmiNonWrappingPacketSequenceNumber) (BITS_PER_WORD-bitInWord), newest-sn+1);
+        
+        if (lost) {
+            _lostBits[bitIdx/BITS_PER_WORD] |= bitMask(bitInWord, count);
+        }
+        else {
+            _lostBits[bitIdx/BITS_PER_WORD] &= ~bitMask(bitInWord, count);
+        }
+        sn += count;
+    }
+}
+
+EmiNonWrappingPacketSequenceNumber EmiLossList::findOldest(EmiNonWrappingPacketSequenceNumber oldest,
+                                                           EmiNonWrappingPacketSequenceNumber newest,
+                                                           bool lost) const {
+    EmiNonWrappingPacketSequenceNumber sn = oldest;
+    while (sn <= newest) {
+        size_t bitIdx = sn % EMI_LOSS_LIST_WINDOW;
+        size_t bitInWord = bitIdx % BITS_PER_WORD;
+        size_t count = std::min((EmiNonWrappingPacketSequenceNumber) (BITS_PER_WORD-bitInWord), newest-sn+1);
+        
+        uint64_t word = _lostBits[bitIdx/BITS_PER_WORD];
+        if (!lost) {
+            word = ~word;
+        }
+        word &= bitMask(bitInWord, count);
+        
+        if (0 != word) {
+            return sn + (firstSetBit(word)-bitInWord);
+        }
+        sn += count;
+    }
+    
+    return -1;
+}
+
+void EmiLossList::addRange(EmiTimeInterval now,
+                           EmiNonWrappingPacketSequenceNumber oldest,
+                           EmiNonWrappingPacketSequenceNumber newest) {
+    if (EMI_LOSS_LIST_MAX_RANGES == _rangesCount) {
+        // Forget the oldest loss event. It is the one that we are
+        // least likely to want to send a NAK for.
+        _rangesBegin = (_rangesBegin+1) % EMI_LOSS_LIST_MAX_RANGES;
+        _rangesCount--;
+    }
+    
+    LostPacketRange& lpr(rangeAt(_rangesCount));
+    lpr.oldestSequenceNumber = oldest;
+    lpr.newestSequenceNumber = newest;
+    lpr.lastFeedbackTime = now;
+    lpr.numFeedbacks = 0;
+    _rangesCount++;
+}
+
+bool EmiLossList::gotPacket(EmiTimeInterval now, EmiPacketSequenceNumber wrappedSequenceNumber) {
     
     EmiNonWrappingPacketSequenceNumber expectedSn = _newestSequenceNumber+1;
     
@@ -38,95 +122,148 @@ void EmiLossList::gotPacket(EmiTimeInterval now, EmiPacketSequenceNumber wrapped
         }
     }
     
-    if (-1 == _newestSequenceNumber ||
-        expectedSn == guessedNonWrappedSequenceNumber) {
-        // We received the expected sequence number.
-        // No need to do anything with the loss set.
+    bool foundLoss = false;
+    
+    if (-1 == _newestSequenceNumber) {
+        // This is the first packet. The bitmap is empty.
     }
-    else if (_newestSequenceNumber > guessedNonWrappedSequenceNumber) {
+    else if (_newestSequenceNumber >= guessedNonWrappedSequenceNumber) {
         // We received an old sequence number, which presumably
-        // arrived out of order. Remove it from the loss set if
-        // it's present.
-        
-        LossSetIter iter = _lossSet.lower_bound(LostPacketRange(0, 0, guessedNonWrappedSequenceNumber));
-        
-        if (_lossSet.end() == iter) {
-            // We did not find any matching LostPacketRange
-            return;
+        // arrived out of order. Remove it from the loss bitmap if
+        // it's still within the window.
+        if (guessedNonWrappedSequenceNumber >= oldestSequenceNumberInWindow()) {
+            setLost(guessedNonWrappedSequenceNumber, guessedNonWrappedSequenceNumber, false);
         }
         
-        const LostPacketRange& lpr(*iter);
+        // Don't move _newestSequenceNumber backwards
+        return false;
+    }
+    else {
+        // The bits that the sequence numbers between the previous
+        // newest and this packet map to hold the state of packets
+        // that just fell out of the window, so all of them must be
+        // overwritten.
+        if (guessedNonWrappedSequenceNumber - _newestSequenceNumber > 1) {
+            // We received a newer sequence number than what we
+            // expected. Add the lost range.
+            EmiNonWrappingPacketSequenceNumber oldest = std::max(_newestSequenceNumber+1,
+                                                                 guessedNonWrappedSequenceNumber-EMI_LOSS_LIST_WINDOW+1);
+            EmiNonWrappingPacketSequenceNumber newest = guessedNonWrappedSequenceNumber-1;
         
-        if (lpr.oldestSequenceNumber > guessedNonWrappedSequenceNumber) {
-            // The LostPacketRange we found doesn't contain this sequence number
-            return;
+            setLost(oldest, newest, true);
+            addRange(now, oldest, newest);
+            foundLoss = true;
         }
         
-        // We only have a reference to lp, so we must use it before
-        // we erase it from _lossSet.
-        LostPacketRange lowerBound(lpr);
-        lowerBound.newestSequenceNumber = guessedNonWrappedSequenceNumber-1;
-        LostPacketRange upperBound(lpr);
-        upperBound.oldestSequenceNumber = guessedNonWrappedSequenceNumber+1;
-        upperBound.numFeedbacks = 0;
-        
-        // To make sure that we don't get problems with duplicates in the set,
-        // we must erase lp before we insert the split versions of it.
-        _lossSet.erase(iter);
-        
-        if (lowerBound.oldestSequenceNumber <= lowerBound.newestSequenceNumber) {
-            _lossSet.insert(lowerBound);
-        }
-        if (upperBound.oldestSequenceNumber <= upperBound.newestSequenceNumber) {
-            _lossSet.insert(upperBound);
-        }
-    }
-    else if (guessedNonWrappedSequenceNumber - _newestSequenceNumber > 1) {
-        // We received a newer sequence number than what we
-        // expected. Add the lost range to the loss set.
-        
-        LostPacketRange lpr(now, 
-                            _newestSequenceNumber+1,
-                            guessedNonWrappedSequenceNumber-1);
-        _lossSet.insert(lpr);
+        setLost(guessedNonWrappedSequenceNumber, guessedNonWrappedSequenceNumber, false);
     }
     
     _newestSequenceNumber = guessedNonWrappedSequenceNumber;
     _newestSequenceNumberTime = now;
+    
+    return foundLoss;
 }
 
-EmiPacketSequenceNumber EmiLossList::calculateNak(EmiTimeInterval now, EmiTimeInterval rtt) {
-    LossSetRIter iter = _lossSet.rbegin();
-    LossSetRIter end  = _lossSet.rend();
+bool EmiLossList::hasUnreportedLosses() const {
+    EmiNonWrappingPacketSequenceNumber oldestInWindow = oldestSequenceNumberInWindow();
     
-    while (iter != end) {
-        const LostPacketRange& lpr(*iter);
-        
-        if (lpr.lastFeedbackTime + rtt*(2+lpr.numFeedbacks) > now) {
-            // Bingo! We found the LostPacket we wanted.
-            LostPacketRange newLpr(lpr);
-            newLpr.numFeedbacks++;
-            newLpr.oldestSequenceNumber = newLpr.oldestSequenceNumber+1;
-            newLpr.lastFeedbackTime = now;
-            EmiNonWrappingPacketSequenceNumber nak = lpr.oldestSequenceNumber;
-            
-            // Remove all LostPackets that are older or as old as lpr in _lossSet
-            _lossSet.erase(_lossSet.begin(), ++_lossSet.find(*iter));
+    for (size_t i=0; i<_rangesCount; i++) {
+        const LostPacketRange& lpr(_ranges[(_rangesBegin+i) % EMI_LOSS_LIST_MAX_RANGES]);
+        
+        if (0 == lpr.numFeedbacks &&
+            lpr.newestSequenceNumber >= oldestInWindow &&
+            -1 != findOldest(std::max(lpr.oldestSequenceNumber, oldestInWindow), lpr.newestSequenceNumber, true)) {
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+size_t EmiLossList::calculateNak(EmiTimeInterval now, EmiTimeInterval rtt, EmiNakRange *ranges, size_t maxRanges) {
+    EmiNonWrappingPacketSequenceNumber oldestInWindow = oldestSequenceNumberInWindow();
+    
+    // The runs of lost packets to report. This is a ring, so that it
+    // keeps the newest maxRanges runs.
+    struct Run {
+        EmiNonWrappingPacketSequenceNumber oldest;
+        EmiNonWrappingPacketSequenceNumber newest;
+        size_t                             rangeIdx;
+    };
+    Run runs[EMI_MAX_NAK_RANGES];
+    size_t runsBegin = 0;
+    size_t numRuns = 0;
+    maxRanges = std::min(maxRanges, (size_t) EMI_MAX_NAK_RANGES);
+        
+    if (0 == maxRanges) {
+        return 0;
+    }
+    
+    for (size_t i=0; i<_rangesCount; i++) {
+        const LostPacketRange& lpr(rangeAt(i));
+        
+        if (isStale(lpr) || !isDue(lpr, now, rtt)) {
+            continue;
+        }
             
-            // Replace lp with a new object with incremented
-            // numFeedbacks and oldestSequenceNumber, and updated
-            // lastFeedbackTime
-            if (newLpr.oldestSequenceNumber <= newLpr.newestSequenceNumber) {
-                _lossSet.insert(newLpr);
+        EmiNonWrappingPacketSequenceNumber sn = std::max(lpr.oldestSequenceNumber, oldestInWindow);
+        while (sn <= lpr.newestSequenceNumber) {
+            EmiNonWrappingPacketSequenceNumber runOldest = findOldest(sn, lpr.newestSequenceNumber, true);
+            if (-1 == runOldest) {
+                break;
+            }
+        
+            EmiNonWrappingPacketSequenceNumber received = findOldest(runOldest, lpr.newestSequenceNumber, false);
+            EmiNonWrappingPacketSequenceNumber runNewest = (-1 == received ? lpr.newestSequenceNumber : received-1);
+        
+            Run& run(runs[(runsBegin+numRuns) % maxRanges]);
+            run.oldest = runOldest;
+            run.newest = runNewest;
+            run.rangeIdx = i;
+            if (maxRanges == numRuns) {
+                // Forget the oldest run
+                runsBegin = (runsBegin+1) % maxRanges;
             }
+            else {
+                numRuns++;
+            }
+    
+            sn = runNewest+2;
+        }
+    }
+
+    // Write the runs. Their bits stay set, so that they are reported
+    // again if this NAK is lost.
+    size_t lastRangeIdx = _rangesCount;
+    for (size_t i=0; i<numRuns; i++) {
+        const Run& run(runs[(runsBegin+i) % maxRanges]);
+        
+        ranges[i].sequenceNumber = run.oldest & EMI_PACKET_SEQUENCE_NUMBER_MASK;
+        ranges[i].length = (uint32_t) (run.newest-run.oldest+1);
+        
+        if (lastRangeIdx != run.rangeIdx) {
+            lastRangeIdx = run.rangeIdx;
             
-            // Exit the loop early and return the sequence number we found
-            return nak & EMI_PACKET_SEQUENCE_NUMBER_MASK;
+            LostPacketRange& lpr(rangeAt(run.rangeIdx));
+            lpr.numFeedbacks++;
+            lpr.lastFeedbackTime = now;
+        }
+    }
+    
+    // Prune the oldest ranges that are stale or that have no lost
+    // packets left
+    while (0 != _rangesCount) {
+        const LostPacketRange& lpr(rangeAt(0));
+        
+        if (!isStale(lpr) &&
+            lpr.newestSequenceNumber >= oldestInWindow &&
+            -1 != findOldest(std::max(lpr.oldestSequenceNumber, oldestInWindow), lpr.newestSequenceNumber, true)) {
+            break;
         }
         
-        ++iter;
+        _rangesBegin = (_rangesBegin+1) % EMI_LOSS_LIST_MAX_RANGES;
+        _rangesCount--;
     }
     
-    // We did not find any applicable packet.
-    return -1;
+    return numRuns;
 }
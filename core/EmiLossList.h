@@ -12,73 +12,121 @@
 #include "EmiTypes.h"
 #include "EmiNetUtil.h"
 
-#include <set>
+#include <stddef.h>
 
 // This class implements the logic required to know which NAKs to
 // send out, if any.
 //
-// The NAK to send out is the oldest packet's sequence number that
-// is in the newest packet range recorded to have been lost (we
-// have received a newer packet) whose last feedback time is at
-// least RTT*k ago, where k is initialized as 2 and increased by 1
-// each time the number is fed back.
+// A NAK reports the packets that have been recorded to have been
+// lost (we have received a newer packet) as ranges of consecutive
+// sequence numbers. Data is never retransmitted with the same packet
+// sequence number, so a lost packet stays lost.
 //
-// Also, once a NAK has been sent, we will never send an older
-// sequence number as a NAK. This allows EmiLossList to prune old
-// lost packets.
+// A loss event is first reported when it has been known for
+// RTT*EMI_LOSS_LIST_REORDER_WINDOW, since a packet that arrives out of
+// order looks like a loss until it arrives, and the other host treats
+// losses as a sign of congestion. Since the NAK might be lost too, it
+// is reported again when its last feedback time is at least RTT*k
+// ago, where k is 2 plus the number of times the event has been fed
+// back. After EMI_LOSS_LIST_MAX_FEEDBACKS reports,
+// the event is stale and is not reported anymore. This allows
+// EmiLossList to prune old lost packets.
+//
+// Which packets are missing is kept in a circular bitmap over the
+// newest EMI_LOSS_LIST_WINDOW sequence numbers, and the ranges only
+// remember where each loss event started and ended. This means that
+// a packet that arrives out of order only clears a bit; ranges are
+// never split. Nothing is allocated on the heap.
 class EmiLossList {
     
     struct LostPacketRange {
-        LostPacketRange(EmiTimeInterval lastFeedbackTime_,
-                        EmiNonWrappingPacketSequenceNumber oldestSequenceNumber_,
-                        EmiNonWrappingPacketSequenceNumber newestSequenceNumber_) :
-        oldestSequenceNumber(oldestSequenceNumber_),
-        newestSequenceNumber(newestSequenceNumber_),
-        lastFeedbackTime(lastFeedbackTime_),
-        numFeedbacks(0) {}
-        
         EmiNonWrappingPacketSequenceNumber oldestSequenceNumber;
         EmiNonWrappingPacketSequenceNumber newestSequenceNumber;
         EmiTimeInterval                    lastFeedbackTime;
         uint32_t                           numFeedbacks;
-        
-        inline bool operator<(const LostPacketRange& other) const {
-            // TODO What happens here when the sequence number has wrapped?
-            return newestSequenceNumber < other.newestSequenceNumber;
-        }
     };
     
-    typedef std::set<LostPacketRange> LossSet;
-    typedef LossSet::iterator         LossSetIter;
-    typedef LossSet::reverse_iterator LossSetRIter;
+    static const size_t BITS_PER_WORD = 64;
+    static const size_t NUM_WORDS = EMI_LOSS_LIST_WINDOW/BITS_PER_WORD;
     
     EmiNonWrappingPacketSequenceNumber _newestSequenceNumber;
     EmiTimeInterval _newestSequenceNumberTime;
-    // EmiLossList maintains the invariant that any oldestSequenceNumber
-    // of a LostPacketRange in the set is greater than the previous
-    // LostPacketRange's newestSequenceNumber.
-    LossSet _lossSet;
+    
+    // A set bit means that the packet with the sequence number that
+    // maps to it has been lost. The sequence numbers are non-wrapping,
+    // so the bits are only meaningful for the newest
+    // EMI_LOSS_LIST_WINDOW sequence numbers.
+    uint64_t _lostBits[NUM_WORDS];
+    
+    // A ring of the loss events, oldest first. EmiLossList maintains
+    // the invariant that the oldestSequenceNumber of a range is greater
+    // than the previous range's newestSequenceNumber.
+    LostPacketRange _ranges[EMI_LOSS_LIST_MAX_RANGES];
+    size_t          _rangesBegin;
+    size_t          _rangesCount;
+    
+    inline LostPacketRange& rangeAt(size_t idx) {
+        return _ranges[(_rangesBegin+idx) % EMI_LOSS_LIST_MAX_RANGES];
+    }
+    
+    inline EmiNonWrappingPacketSequenceNumber oldestSequenceNumberInWindow() const {
+        return _newestSequenceNumber-EMI_LOSS_LIST_WINDOW+1;
+    }
+    
+    void setLost(EmiNonWrappingPacketSequenceNumber oldest, EmiNonWrappingPacketSequenceNumber newest, bool lost);
+    // Returns the oldest sequence number in the range whose lost bit
+    // is lost, or -1 if there is none
+    EmiNonWrappingPacketSequenceNumber findOldest(EmiNonWrappingPacketSequenceNumber oldest,
+                                                  EmiNonWrappingPacketSequenceNumber newest,
+                                                  bool lost) const;
+    inline bool isStale(const LostPacketRange& lpr) const {
+        return lpr.numFeedbacks >= EMI_LOSS_LIST_MAX_FEEDBACKS;
+    }
+    // The lastFeedbackTime of a loss event that has not been reported
+    // yet is the time it was detected
+    inline bool isDue(const LostPacketRange& lpr, EmiTimeInterval now, EmiTimeInterval rtt) const {
+        return lpr.lastFeedbackTime + (0 == lpr.numFeedbacks ?
+                                       reorderWindow(rtt) :
+                                       rtt*(2+lpr.numFeedbacks)) <= now;
+    }
+    void addRange(EmiTimeInterval now,
+                  EmiNonWrappingPacketSequenceNumber oldest,
+                  EmiNonWrappingPacketSequenceNumber newest);
     
 public:
     EmiLossList();
     virtual ~EmiLossList();
     
-    // Amortized complexity of this method is at worst O(log n) where
-    // n is the size of _lossSet. When all packets arrive exactly once
-    // and in order, complexity is O(1).
-    void gotPacket(EmiTimeInterval now, EmiPacketSequenceNumber sequenceNumber);
+    // Complexity of this method is O(1), except when it detects
+    // lost packets, which are marked a word of the bitmap at a time.
+    //
+    // Returns true if the packet revealed that packets were lost.
+    bool gotPacket(EmiTimeInterval now, EmiPacketSequenceNumber sequenceNumber);
+    
+    // The time that a loss event has to be known before it is reported
+    inline static EmiTimeInterval reorderWindow(EmiTimeInterval rtt) {
+        return rtt*EMI_LOSS_LIST_REORDER_WINDOW;
+    }
+    
+    // Returns true if there are packets that have been found lost but
+    // not yet reported, because they might still arrive out of order
+    bool hasUnreportedLosses() const;
     
-    // Should be called on NAK timeouts. Calculates the current value
-    // to send as NAK. Returns -1 if no NAK should be sent.
+    // Should be called on NAK timeouts. Calculates the ranges of lost
+    // packets to send as NAK, and writes at most maxRanges of them to
+    // ranges, oldest first. If there are more, the newest ones are
+    // written, and the others are left for the next NAK timeout.
+    // Returns the number of ranges that were written; 0 means that no
+    // NAK should be sent.
     //
-    // This method is potentially rather slow. It's intended to be
-    // invoked exactly once per NAK timeout.
+    // It's intended to be invoked exactly once per NAK timeout. The
+    // bitmap is scanned a word at a time.
     //
-    // Note that this method is not free of side effects; it increases
-    // the numFeedbacks field of the LostPacketRange object in question.
-    // It also prunes LostPacketRanges that are older than the one
-    // returned.
-    EmiPacketSequenceNumber calculateNak(EmiTimeInterval now, EmiTimeInterval rtt);
+    // Note that this method is not free of side effects; the numFeedbacks
+    // and lastFeedbackTime fields of the LostPacketRange objects in
+    // question are updated, which postpones their next report. It also
+    // prunes old LostPacketRanges.
+    size_t calculateNak(EmiTimeInterval now, EmiTimeInterval rtt, EmiNakRange *ranges, size_t maxRanges);
 };
 
 #endif
@@ -15,47 +15,129 @@
 // This class implements a simple algorithm for a non-linear
 // median filter, as used for calculating packet arrival rate
 // and link capacity in the UDT congestion control algorithm.
+//
+// Values are pushed once per packet, so in addition to the ring of
+// the newest values, the filter keeps the same values in sorted order,
+// which pushValue updates by moving the elements between the old and
+// the new value one step. The result of calculate is cached until the
+// next value is pushed.
+//
+// Until the buffer is full, only the values that have been pushed
+// count, and the filter returns the default value until the first one
+// is pushed. Filling the buffer with the default instead would keep it
+// the median until half of the buffer has been filled, which for link
+// capacity samples takes many packets.
 template<typename Element, int BUFFER_SIZE = 64, int TOLERANCE = 8>
 class EmiMedianFilter {
     
     Element _elms[BUFFER_SIZE];
     size_t  _frontIdx; // This is the index to the value just ahead of the newest element
+    // The elements of _elms, sorted in ascending order. Until the
+    // buffer is full, only the first _count elements are valid.
+    Element _sortedElms[BUFFER_SIZE];
+    size_t  _count;
+    Element _defaultValue;
+    
+    mutable Element _filteredMean;
+    mutable bool    _filteredMeanIsValid;
+    
+    inline static bool isWithinTolerance(Element elm, Element median) {
+        return !(TOLERANCE < ((elm > median) ? elm/median : median/elm));
+    }
     
 public:
     explicit EmiMedianFilter(Element defaultValue) :
-    _frontIdx(0) {
-        std::fill(_elms, _elms+BUFFER_SIZE, defaultValue);
-    }
+    _frontIdx(0),
+    _count(0),
+    _defaultValue(defaultValue),
+    _filteredMean(0),
+    _filteredMeanIsValid(false) {}
     
     virtual ~EmiMedianFilter() {}
     
     inline void pushValue(Element value) {
+        if ((size_t)BUFFER_SIZE != _count) {
+            // The buffer is not full yet, so no value is replaced
+            _elms[_frontIdx] = value;
+            _frontIdx = (_frontIdx+1) % BUFFER_SIZE;
+            _filteredMeanIsValid = false;
+            
+            Element *end = _sortedElms+_count;
+            Element *newPos = std::upper_bound(_sortedElms, end, value);
+            std::copy_backward(newPos, end, end+1);
+            *newPos = value;
+            _count++;
+            return;
+        }
+        
+        Element oldValue = _elms[_frontIdx];
         _elms[_frontIdx] = value;
         _frontIdx = (_frontIdx+1) % BUFFER_SIZE;
+        _filteredMeanIsValid = false;
+        
+        // Replace one occurrence of oldValue in _sortedElms with value
+        Element *begin = _sortedElms;
+        Element *end = _sortedElms+BUFFER_SIZE;
+        Element *oldPos = std::lower_bound(begin, end, oldValue);
+        
+        if (value < oldValue) {
+            Element *newPos = std::upper_bound(begin, oldPos, value);
+            std::copy_backward(newPos, oldPos, oldPos+1);
+            *newPos = value;
+        }
+        else {
+            Element *newPos = std::lower_bound(oldPos+1, end, value);
+            std::copy(oldPos+1, newPos, oldPos);
+            *(newPos-1) = value;
+        }
     }
     
     Element calculate() const {
-        Element sortedElms[BUFFER_SIZE];
-        std::copy(_elms, _elms+BUFFER_SIZE, sortedElms);
-        std::sort(sortedElms, sortedElms+BUFFER_SIZE);
+        if (_filteredMeanIsValid) {
+            return _filteredMean;
+        }
         
-        Element median = sortedElms[BUFFER_SIZE/2];
+        if (0 == _count) {
+            return _defaultValue;
+        }
         
-        Element sum = 0;
-        int count = 0;
+        int count = (int)_count;
+        Element median = _sortedElms[count/2];
         
-        for (int i=0; i<BUFFER_SIZE; i++) {
-            Element elm = sortedElms[i];
-            
-            if (TOLERANCE < ((elm > median) ? elm/median : median/elm)) {
-                continue;
+        // The elements that are within the tolerance form a contiguous
+        // range around the median. Find its ends with binary searches.
+        int first = 0;
+        int high = count/2;
+        while (first < high) {
+            int mid = (first+high)/2;
+            if (isWithinTolerance(_sortedElms[mid], median)) {
+                high = mid;
+            }
+            else {
+                first = mid+1;
             }
-            
-            sum += elm;
-            count++;
         }
         
-        return sum/count;
+        int low = count/2;
+        int last = count;
+        while (low < last) {
+            int mid = (low+last)/2;
+            if (isWithinTolerance(_sortedElms[mid], median)) {
+                low = mid+1;
+            }
+            else {
+                last = mid;
+            }
+        }
+        
+        Element sum = 0;
+        for (int i=first; i<last; i++) {
+            sum += _sortedElms[i];
+        }
+            
+        _filteredMean = sum/(last-first);
+        _filteredMeanIsValid = true;
+        return _filteredMean;
     }
 };
 
@@ -13,13 +13,18 @@
 #include "EmiConnTime.h"
 #include "EmiNetUtil.h"
 #include "EmiPacketHeader.h"
+#include "EmiObjectPool.h"
 
+#include <new>
 #include <cmath>
 #include <algorithm>
 
 // A message, as it is represented in the sender side of the pipeline
 template<class Binding>
 class EmiMessage {
+public:
+    typedef EmiObjectPool<EmiMessage> Pool;
+    
 private:
     typedef typename Binding::PersistentData PersistentData;
     
@@ -28,14 +33,33 @@ private:
     inline EmiMessage& operator=(const EmiMessage& other);
     
     size_t _refCount;
+    // The pool that this message was allocated from, or NULL if it
+    // was allocated with new
+    Pool *_pool;
+    // When this message is a slice of another message's data, _dataOwner
+    // is that message, and this message holds a reference to it. The
+    // data of this message is then _dataLength bytes at _dataOffset in
+    // the data of _dataOwner. Otherwise, _dataOwner is NULL and the slice
+    // covers all of data.
+    EmiMessage *_dataOwner;
+    size_t _dataOffset;
+    size_t _dataLength;
     
     inline void commonInit() {
         _refCount = 1;
+        _pool = NULL;
+        _dataOwner = NULL;
+        _dataOffset = 0;
+        _dataLength = 0;
         registrationTime = 0;
+        retransmissionPrev = NULL;
+        retransmissionNext = NULL;
+        sacked = false;
         channelQualifier = EMI_CHANNEL_QUALIFIER_DEFAULT;
         nonWrappingSequenceNumber = 0;
         flags = 0;
         priority = EMI_PRIORITY_DEFAULT;
+        deadline = EMI_NO_DEADLINE;
     }
     
 public:
@@ -61,6 +85,7 @@ public:
     // EmiMessage assumes ownership of the PersistentData object
     explicit EmiMessage(PersistentData data_) : data(data_) {
         commonInit();
+        _dataLength = Binding::extractLength(data);
     }
     
     EmiMessage() : data() {
@@ -68,16 +93,62 @@ public:
     }
     
     ~EmiMessage() {
+        if (_dataOwner) {
+            _dataOwner->release();
+        }
         Binding::releasePersistentData(data);
     }
     
+    // Returns a message with a reference count of 1 that is allocated
+    // from pool. The pool must outlive the message.
+    //
+    // EmiMessage assumes ownership of the PersistentData object
+    static EmiMessage *make(Pool& pool, PersistentData data_) {
+        EmiMessage *msg = new (pool.alloc()) EmiMessage(data_);
+        msg->_pool = &pool;
+        return msg;
+    }
+    
+    // Returns a message with a reference count of 1 that is allocated
+    // from pool. The pool must outlive the message.
+    static EmiMessage *make(Pool& pool) {
+        EmiMessage *msg = new (pool.alloc()) EmiMessage;
+        msg->_pool = &pool;
+        return msg;
+    }
+    
+    // Returns a message with a reference count of 1, allocated from
+    // pool, whose data is length bytes at offset in the data of owner.
+    // The data is not copied; the returned message retains owner
+    // instead. This is used to split large messages.
+    static EmiMessage *makeSlice(Pool& pool, EmiMessage *owner, size_t offset, size_t length) {
+        ASSERT(!owner->_dataOwner);
+        ASSERT(offset+length <= owner->_dataLength);
+        
+        EmiMessage *msg = make(pool);
+        owner->retain();
+        msg->_dataOwner = owner;
+        msg->_dataOffset = offset;
+        msg->_dataLength = length;
+        return msg;
+    }
+    
     inline void retain() {
         _refCount++;
     }
     
     inline void release() {
         _refCount--;
-        if (0 == _refCount) delete this;
+        if (0 == _refCount) {
+            if (_pool) {
+                Pool *pool = _pool;
+                this->~EmiMessage();
+                pool->free(this);
+            }
+            else {
+                delete this;
+            }
+        }
     }
     
     static inline const size_t maximalHeaderSize() {
@@ -90,38 +161,68 @@ public:
     // on the wire. Note that EmiSendQueue relies on this method to
     // always return the same value given the same message.
     size_t approximateSize() const {
-        return maximalHeaderSize() + Binding::extractLength(data);
+        return maximalHeaderSize() + _dataLength;
+    }
+    
+    inline const uint8_t *getData() const {
+        if (0 == _dataLength) {
+            return NULL;
+        }
+        
+        const PersistentData& ownerData(_dataOwner ? _dataOwner->data : data);
+        return Binding::extractData(ownerData)+_dataOffset;
     }
     
-    // THIS FIELD IS INTENDED TO BE USED ONLY BY EmiSenderBuffer!
-    // Modifying this field outside of that class will break invariants
+    inline size_t getDataLength() const {
+        return _dataLength;
+    }
+    
+    // THESE FIELDS ARE INTENDED TO BE USED ONLY BY EmiSenderBuffer!
+    // Modifying these fields outside of that class will break invariants
     // and can result in behaviour ranging from mild inefficiencies and
     // stalled message streams to hard crashes.
     EmiTimeInterval registrationTime;
+    EmiMessage *retransmissionPrev;
+    EmiMessage *retransmissionNext;
+    // True when the other host has reported that it has the message
+    // (see EmiSenderBuffer::sackReliableMessages)
+    bool sacked;
     // This is int32_t and not EmiChannelQualifier because it has to be capable of
     // holding -1, the special SYN/RST message channel as used by EmiSenderBuffer
     int32_t channelQualifier;
     EmiNonWrappingSequenceNumber nonWrappingSequenceNumber;
     EmiMessageFlags flags;
     EmiPriority priority;
+    // The time that the message should be sent before, or
+    // EMI_NO_DEADLINE. See EmiSendScheduler.
+    EmiTimeInterval deadline;
     const PersistentData data;
     
-    // Returns 0 if buffer was not big enough to accomodate the message
-    static size_t writeMsg(uint8_t *buf,
-                           size_t bufSize,
-                           size_t offset,
-                           bool hasAck,
-                           EmiSequenceNumber ack,
-                           int32_t channelQualifier,
-                           EmiSequenceNumber sequenceNumber,
-                           const uint8_t *data,
-                           size_t dataLength,
-                           EmiMessageFlags flags) {
-        // TODO The way this code is written makes the method rather fragile.
-        // It's easy to make small mistakes that lead to potential buffer
-        // overflow bugs. It should probably be rewritten in a clearer way.
+    // Returns the size of the header of a message as encoded on the
+    // wire. The size of the whole message is this plus dataLength.
+    static size_t msgHeaderSize(bool hasAck,
+                                size_t dataLength,
+                                EmiMessageFlags flags) {
+        size_t sequenceNumberFieldSize =
+            (((0 != dataLength && !(flags & EMI_SACK_FLAG)) ||
+              ((flags & EMI_SYN_FLAG) && !(flags & EMI_PRX_FLAG))) ? EMI_HEADER_SEQUENCE_NUMBER_LENGTH : 0);
+        size_t ackSize = (hasAck ? EMI_HEADER_SEQUENCE_NUMBER_LENGTH : 0);
         
-        size_t pos = offset;
+        return EMI_MESSAGE_HEADER_MIN_LENGTH + sequenceNumberFieldSize + ackSize;
+    }
+    
+    // Writes the header of a message to buf. buf must have space for
+    // at least msgHeaderSize(hasAck, dataLength, flags) bytes.
+    //
+    // Returns the number of bytes that were written
+    static size_t writeMsgHeader(uint8_t *buf,
+                                 bool hasAck,
+                                 EmiSequenceNumber ack,
+                                 int32_t channelQualifier,
+                                 EmiSequenceNumber sequenceNumber,
+                                 size_t dataLength,
+                                 EmiMessageFlags flags) {
+        size_t pos = 0;
         
         flags |= (hasAck ? EMI_ACK_FLAG : 0); // SYN/RST/ACK flags
         
@@ -129,17 +230,8 @@ public:
         ASSERT(0 != flags || 0 != dataLength);
         
         size_t sequenceNumberFieldSize =
-            ((0 != dataLength ||
+            (((0 != dataLength && !(flags & EMI_SACK_FLAG)) ||
               ((flags & EMI_SYN_FLAG) && !(flags & EMI_PRX_FLAG))) ? EMI_HEADER_SEQUENCE_NUMBER_LENGTH : 0);
-        size_t ackSize = (hasAck ? EMI_HEADER_SEQUENCE_NUMBER_LENGTH : 0);
-        
-        if (bufSize-pos <= (EMI_MESSAGE_HEADER_MIN_LENGTH +
-                            sequenceNumberFieldSize +
-                            ackSize +
-                            dataLength)) {
-            // Buffer not big enough
-            return 0;
-        }
         
         *((uint8_t*)  (buf+pos)) = flags; pos += 1;
         *((uint8_t*)  (buf+pos)) = std::max(0, channelQualifier); pos += 1; // channelQualifier == -1 means SYN/RST message
@@ -147,9 +239,63 @@ public:
         if (sequenceNumberFieldSize) {
             EmiNetUtil::write24(buf+pos, sequenceNumber); pos += sequenceNumberFieldSize;
         }
-        if (ackSize) {
-            EmiNetUtil::write24(buf+pos, ack); pos += ackSize;
+        if (hasAck) {
+            EmiNetUtil::write24(buf+pos, ack); pos += EMI_HEADER_SEQUENCE_NUMBER_LENGTH;
         }
+        
+        ASSERT(pos == msgHeaderSize(hasAck, dataLength, flags));
+        
+        return pos;
+    }
+    
+    // Writes the data of a SACK message, which is the SACK blocks
+    // expressed relative to ack, to buf. buf must have space for at
+    // least numBlocks*EMI_SACK_BLOCK_LENGTH bytes. Blocks that don't
+    // begin after ack, or too far after it, are left out.
+    //
+    // Returns the number of bytes that were written
+    static size_t writeSackBlocks(uint8_t *buf,
+                                  EmiSequenceNumber ack,
+                                  const EmiSackBlock *blocks,
+                                  size_t numBlocks) {
+        size_t pos = 0;
+        
+        for (size_t i=0; i<numBlocks; i++) {
+            const EmiSackBlock& block(blocks[i]);
+            uint32_t offset = (block.sequenceNumber-ack) & EMI_HEADER_SEQUENCE_NUMBER_MASK;
+            if (0 == offset || offset > 0xffff ||
+                0 == block.length || block.length > 0x10000) {
+                continue;
+            }
+            
+            *((uint16_t*) (buf+pos)) = htons(offset); pos += 2;
+            *((uint16_t*) (buf+pos)) = htons(block.length-1); pos += 2;
+        }
+        
+        return pos;
+    }
+    
+    // Returns 0 if buffer was not big enough to accomodate the message
+    static size_t writeMsg(uint8_t *buf,
+                           size_t bufSize,
+                           size_t offset,
+                           bool hasAck,
+                           EmiSequenceNumber ack,
+                           int32_t channelQualifier,
+                           EmiSequenceNumber sequenceNumber,
+                           const uint8_t *data,
+                           size_t dataLength,
+                           EmiMessageFlags flags) {
+        size_t headerSize = msgHeaderSize(hasAck, dataLength, flags);
+        
+        if (bufSize-offset <= headerSize+dataLength) {
+            // Buffer not big enough
+            return 0;
+        }
+        
+        size_t pos = offset;
+        pos += writeMsgHeader(buf+pos, hasAck, ack, channelQualifier,
+                              sequenceNumber, dataLength, flags);
         if (dataLength) {
             memcpy(buf+pos, data, dataLength); pos += dataLength;
         }
@@ -20,14 +20,19 @@ bool EmiMessageHeader::parse(const uint8_t *buf, size_t bufSize, EmiMessageHeade
     bool rstFlag = connByte & EMI_RST_FLAG;
     bool ackFlag = connByte & EMI_ACK_FLAG;
     bool synFlag = connByte & EMI_SYN_FLAG;
+    bool sackFlag = connByte & EMI_SACK_FLAG;
     
     // If the message has RST, SYN and ACK flags, it's a close
     // connection ack message, not a normal message with ack
     bool messageHasAckData = ackFlag && !(rstFlag && synFlag) && !prxFlag;
     
-    bool messageHasSequenceNumber = (length || (synFlag && !prxFlag));
+    // The data of a SACK message is its SACK blocks. It has no
+    // sequence number of its own.
+    bool hasData = (length && !sackFlag);
     
-    size_t lengthOffset = (length || synFlag) ? EMI_HEADER_SEQUENCE_NUMBER_LENGTH : 0;
+    bool messageHasSequenceNumber = (hasData || (synFlag && !prxFlag));
+    
+    size_t lengthOffset = (hasData || synFlag) ? EMI_HEADER_SEQUENCE_NUMBER_LENGTH : 0;
     size_t headerLength = EMI_MESSAGE_HEADER_MIN_LENGTH + lengthOffset + (messageHasAckData ? EMI_HEADER_SEQUENCE_NUMBER_LENGTH : 0);
     
     if (headerLength > bufSize) return false;
@@ -69,7 +74,6 @@ bool EmiMessageHeader::parseNextMessage(const uint8_t *buf, size_t bufSize,
         }
         
         *offset += header->headerLength+header->length;
-        if (header->flags & EMI_SACK_FLAG) return false;
         
         return true;
     }
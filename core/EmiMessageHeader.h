@@ -25,7 +25,8 @@ struct EmiMessageHeader {
     // holding -1, which means that the header had no sequence number
     int32_t sequenceNumber;
     size_t headerLength;
-    // length is 0 if the message has no content
+    // length is 0 if the message has no content. For messages with
+    // the SACK flag, the content is the SACK blocks.
     size_t length;
     // This is int32_t and not EmiSequenceNumber because it has to be capable of
     // holding -1, which means that the header had no ack
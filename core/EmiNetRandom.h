@@ -57,6 +57,10 @@ public:
         return(r);
     }
     
+    static uint64_t random64() {
+        return (((uint64_t)random()) << 32) | random();
+    }
+    
     static void randomStir() {
         unsigned char randBuf[EmiRC4::ENTROPY_SIZE];
         int i;
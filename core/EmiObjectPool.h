@@ -0,0 +1,99 @@
+//
+//  EmiObjectPool.h
+//  eminet
+//
+
+#ifndef eminet_EmiObjectPool_h
+#define eminet_EmiObjectPool_h
+
+#include "EmiNetUtil.h"
+
+#include <new>
+
+// A free list of memory chunks that are large enough for one T. It
+// hands out raw memory; the caller constructs and destructs the objects
+// with placement new and explicit destructor calls.
+//
+// An EmiObjectPool is not thread safe. EmiConn has one pool for its
+// EmiMessage objects, which means that it is only used from the thread
+// of that connection.
+//
+// At most MAX_CACHED_OBJECTS chunks are kept in the free list; chunks
+// that are freed when the free list is full are returned to the system
+// allocator.
+template<class T, size_t MAX_CACHED_OBJECTS = 64>
+class EmiObjectPool {
+private:
+    // Private copy constructor and assignment operator
+    inline EmiObjectPool(const EmiObjectPool& other);
+    inline EmiObjectPool& operator=(const EmiObjectPool& other);
+    
+    union Chunk {
+        Chunk *next;
+        char   object[sizeof(T)];
+    };
+    
+    Chunk *_freeList;
+    size_t _cached;
+    
+    size_t _allocations;
+    size_t _systemAllocations;
+    
+public:
+    EmiObjectPool() :
+    _freeList(NULL),
+    _cached(0),
+    _allocations(0),
+    _systemAllocations(0) {}
+    
+    virtual ~EmiObjectPool() {
+        while (_freeList) {
+            Chunk *next = _freeList->next;
+            ::operator delete(_freeList);
+            _freeList = next;
+        }
+    }
+    
+    void *alloc() {
+        _allocations++;
+        
+        if (_freeList) {
+            Chunk *chunk = _freeList;
+            _freeList = chunk->next;
+            _cached--;
+            return chunk;
+        }
+        
+        _systemAllocations++;
+        // ::operator new rather than malloc, so that the compiler can
+        // see that the chunks are released with the matching
+        // ::operator delete after the objects in them were made with
+        // placement new
+        return ::operator new(sizeof(Chunk));
+    }
+    
+    void free(void *mem) {
+        if (_cached >= MAX_CACHED_OBJECTS) {
+            ::operator delete(mem);
+            return;
+        }
+        
+        Chunk *chunk = (Chunk *)mem;
+        chunk->next = _freeList;
+        _freeList = chunk;
+        _cached++;
+    }
+    
+    // The number of times alloc has been called
+    inline size_t getAllocations() const {
+        return _allocations;
+    }
+    
+    // The number of times alloc had to allocate memory, because the free
+    // list was empty
+    inline size_t getSystemAllocations() const {
+        return _systemAllocations;
+    }
+};
+
+#endif
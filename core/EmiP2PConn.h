@@ -14,6 +14,7 @@
 #include "EmiConnTime.h"
 #include "EmiMessage.h"
 #include "EmiRtoTimer.h"
+#include "EmiHashMap.h"
 #include "EmiAddressCmp.h"
 #include "EmiUdpSocket.h"
 
@@ -25,6 +26,11 @@ public:
     public:
         uint8_t randNum[EMI_P2P_RAND_NUM_SIZE];
         
+        // For EmiHashMap
+        ConnCookieRandNum() {
+            memset(randNum, 0, sizeof(randNum));
+        }
+        
         ConnCookieRandNum(const uint8_t *cookie_, size_t cookieLength) {
             ASSERT(cookieLength >= EMI_P2P_RAND_NUM_SIZE);
             memcpy(randNum, cookie_, sizeof(randNum));
@@ -35,11 +41,20 @@ public:
         }
         inline ConnCookieRandNum& operator=(const ConnCookieRandNum& other) {
             memcpy(randNum, other.randNum, sizeof(randNum));
+            return *this;
         }
         
         inline bool operator<(const ConnCookieRandNum& rhs) const {
             return 0 > memcmp(randNum, rhs.randNum, sizeof(randNum));
         }
+        
+        inline bool operator==(const ConnCookieRandNum& rhs) const {
+            return 0 == memcmp(randNum, rhs.randNum, sizeof(randNum));
+        }
+        
+        inline uint32_t hash(const EmiHashSeed& seed) const {
+            return EmiHashMapUtil::hashBytes(seed, randNum, sizeof(randNum));
+        }
     };
     
 private:
@@ -195,8 +210,8 @@ public:
         int idx(addressIndex(address));
         ASSERT(-1 != idx);
         
-        if (0 == idx) _rtoTimer0.gotPacket();
-        else          _rtoTimer1.gotPacket();
+        if (0 == idx) _rtoTimer0.gotPacket(now);
+        else          _rtoTimer1.gotPacket(now);
         
         _times[idx].gotPacket(packetHeader, now);
     }
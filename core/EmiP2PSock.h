@@ -16,13 +16,14 @@
 #include "EmiMessageHeader.h"
 #include "EmiMessage.h"
 #include "EmiAddressCmp.h"
+#include "EmiAddressKey.h"
+#include "EmiHashMap.h"
 #include "EmiUdpSocket.h"
 #include "EmiPacketHeader.h"
 #include "EmiNetRandom.h"
 
 #include <algorithm>
 #include <cmath>
-#include <map>
 #include <utility>
 
 static const EmiTimeInterval EMI_P2P_COOKIE_RESOLUTION  = 5*60; // In seconds
@@ -47,10 +48,9 @@ protected:
     
     typedef EmiP2PSockConfig                                 SockConfig;
     typedef typename Conn::ConnCookieRandNum                 ConnCookieRandNum;
-    typedef std::map<sockaddr_storage, Conn*, EmiAddressCmp> ConnMap;
+    typedef EmiHashMap<EmiAddressKey, Conn*>                 ConnMap;
     typedef typename ConnMap::iterator                       ConnMapIter;
-    typedef std::map<ConnCookieRandNum, Conn*>               ConnCookieMap;
-    typedef typename ConnCookieMap::iterator                 ConnCookieMapIter;
+    typedef EmiHashMap<ConnCookieRandNum, Conn*>             ConnCookieMap;
     
 private:
     // Private copy constructor and assignment operator
@@ -142,8 +142,7 @@ private:
     }
     
     Conn *findConn(const sockaddr_storage& address) {
-        ConnMapIter cur = _conns.find(address);
-        return _conns.end() == cur ? NULL : (*cur).second;
+        return _conns.find(EmiAddressKey(address));
     }
     
     void gotConnectionOpen(EmiTimeInterval now,
@@ -177,12 +176,11 @@ private:
             // Check to see if we have a connection with this cookie
             ConnCookieRandNum cc(cookie, cookieLength);
             
-            ConnCookieMapIter cur = _connCookies.find(cc);
+            conn = _connCookies.find(cc);
             
-            if (_connCookies.end() != cur) {
+            if (conn) {
                 // There was a connection open with this cookie
                 
-                conn = (*cur).second;
                 
                 if (conn->firstPeerHadComplementaryCookie() == cookieIsComplementary) {
                     // This happens if we get a SYN message with the same cookie data
@@ -197,7 +195,7 @@ private:
                 }
                 
                 // We don't need to save the cookie anymore
-                _connCookies.erase(cur);
+                _connCookies.erase(cc);
                 
                 conn->gotOtherAddress(inboundAddress, remoteAddress, initialSequenceNumber);
             }
@@ -211,10 +209,10 @@ private:
                                 config.connectionTimeout,
                                 config.initialConnectionTimeout,
                                 config.rateLimit);
-                _connCookies.insert(std::make_pair(cc, conn));
+                _connCookies.insert(cc, conn);
             }
             
-            _conns.insert(std::make_pair(remoteAddress, conn));
+            _conns.insert(EmiAddressKey(remoteAddress), conn);
         }
         
         // Regardless of whether we had an EmiP2PConn object set up
@@ -271,8 +269,8 @@ public:
     // conn might be NULL. In that case, this is a no-op
     void removeConnection(Conn *conn) {
         if (conn) {
-            _conns.erase(conn->getFirstAddress());
-            _conns.erase(conn->getOtherAddress());
+            _conns.erase(EmiAddressKey(conn->getFirstAddress()));
+            _conns.erase(EmiAddressKey(conn->getOtherAddress()));
             _connCookies.erase(conn->cookie);
             
             delete conn;
@@ -282,7 +280,10 @@ public:
     const SockConfig config;
     
     EmiP2PSock(const SockConfig& config_, const TimerCookie& timerCookie) :
-    _timerCookie(timerCookie), _socket(NULL), config(config_) {
+    _timerCookie(timerCookie), _socket(NULL),
+    _conns(EmiHashSeed(EmiNetRandom<Binding>::random64(), EmiNetRandom<Binding>::random64())),
+    _connCookies(EmiHashSeed(EmiNetRandom<Binding>::random64(), EmiNetRandom<Binding>::random64())),
+    config(config_) {
         Binding::randomBytes(_serverSecret, sizeof(_serverSecret));
     }
     virtual ~EmiP2PSock() {
@@ -294,7 +295,12 @@ public:
         ConnMapIter iter = _conns.begin();
         ConnMapIter end  = _conns.end();
         while (iter != end) {
-            delete (*iter).second;
+            // Connections that have both peers are in _conns twice;
+            // make sure to delete them only once.
+            Conn *conn = (*iter).second;
+            if ((*iter).first == EmiAddressKey(conn->getFirstAddress())) {
+                delete conn;
+            }
             ++iter;
         }
     }
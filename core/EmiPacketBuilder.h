@@ -0,0 +1,162 @@
+//
+//  EmiPacketBuilder.h
+//  eminet
+//
+
+#ifndef eminet_EmiPacketBuilder_h
+#define eminet_EmiPacketBuilder_h
+
+#include "EmiNetUtil.h"
+#include "EmiPacketHeader.h"
+
+#include <sys/uio.h>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+// EmiPacketBuilder assembles a packet as a list of iovecs, so that the
+// packet can be sent with scatter-gather IO instead of being copied
+// into one contiguous buffer first.
+//
+// Headers are written to a scratch area that is owned by the builder.
+// Message payloads are not copied; the packet refers to them where they
+// are, which means that they must stay alive until the packet has been
+// sent. Consecutive header parts that are written to the scratch area
+// share one iovec.
+//
+// The scratch area is as large as the MTU, plus two bytes for
+// addFillerBytes. Headers are part of the packet, so they can never
+// need more than that.
+class EmiPacketBuilder {
+private:
+    // Private copy constructor and assignment operator
+    inline EmiPacketBuilder(const EmiPacketBuilder& other);
+    inline EmiPacketBuilder& operator=(const EmiPacketBuilder& other);
+    
+    uint8_t *_scratch;
+    size_t   _scratchSize;
+    size_t   _scratchUsed;
+    // True if the last iovec ends where the unused part of the scratch
+    // area begins, which means that it can be extended instead of
+    // adding another iovec.
+    bool     _lastIsScratch;
+    
+    std::vector<struct iovec> _iovs;
+    size_t _size;
+    
+    inline void pushIov(void *base, size_t len) {
+        struct iovec iov;
+        iov.iov_base = base;
+        iov.iov_len = len;
+        _iovs.push_back(iov);
+    }
+    
+public:
+    EmiPacketBuilder(size_t mtu) :
+    _scratch((uint8_t *)malloc(mtu+2)),
+    _scratchSize(mtu+2),
+    _scratchUsed(0),
+    _lastIsScratch(false),
+    _iovs(),
+    _size(0) {
+        ASSERT(_scratch);
+    }
+    
+    virtual ~EmiPacketBuilder() {
+        free(_scratch);
+    }
+    
+    void clear() {
+        _scratchUsed = 0;
+        _lastIsScratch = false;
+        _iovs.clear();
+        _size = 0;
+    }
+    
+    // The total size of the packet
+    inline size_t size() const {
+        return _size;
+    }
+    
+    inline const struct iovec *iov() const {
+        return _iovs.empty() ? NULL : &_iovs[0];
+    }
+    
+    inline size_t iovCount() const {
+        return _iovs.size();
+    }
+    
+    // Appends len bytes of scratch memory to the packet and returns a
+    // pointer to it. The caller is expected to write the bytes.
+    uint8_t *appendScratch(size_t len) {
+        ASSERT(_scratchUsed+len <= _scratchSize);
+        
+        uint8_t *result = _scratch+_scratchUsed;
+        
+        if (_lastIsScratch) {
+            _iovs.back().iov_len += len;
+        }
+        else {
+            pushIov(result, len);
+            _lastIsScratch = true;
+        }
+        
+        _scratchUsed += len;
+        _size += len;
+        
+        return result;
+    }
+    
+    // Appends len bytes at data to the packet without copying them.
+    void appendData(const uint8_t *data, size_t len) {
+        if (0 == len) {
+            return;
+        }
+        
+        pushIov((void *)data, len);
+        _lastIsScratch = false;
+        _size += len;
+    }
+    
+    // The equivalent of EmiPacketHeader::addFillerBytes. The packet
+    // must begin with a packet header that was written with
+    // appendScratch.
+    void addFillerBytes(uint16_t fillerSize) {
+        if (0 == fillerSize) {
+            return;
+        }
+        
+        // The filler bytes go right after the flags byte of the packet
+        // header, or after the extra flags byte if it has one.
+        size_t prefixSize = ((_scratch[0] & EMI_EXTRA_FLAGS_PACKET_FLAG) ? 2 : 1);
+        
+        ASSERT(!_iovs.empty() && _scratch == _iovs[0].iov_base);
+        ASSERT(_iovs[0].iov_len >= prefixSize);
+        ASSERT(_scratchUsed+fillerSize+prefixSize <= _scratchSize);
+        
+        // Instead of moving the rest of the packet, make a copy of the
+        // flags bytes followed by the filler in the scratch area, and
+        // let the first iovec skip the original flags bytes.
+        uint8_t *filler = _scratch+_scratchUsed;
+        memcpy(filler, _scratch, prefixSize);
+        EmiPacketHeader::addFillerBytes(filler, /*packetSize:*/prefixSize, fillerSize);
+        _scratchUsed += fillerSize+prefixSize;
+        _lastIsScratch = false;
+        
+        struct iovec& first(_iovs[0]);
+        first.iov_base = _scratch+prefixSize;
+        first.iov_len -= prefixSize;
+        if (0 == first.iov_len) {
+            _iovs.erase(_iovs.begin());
+        }
+        
+        struct iovec iov;
+        iov.iov_base = filler;
+        iov.iov_len = fillerSize+prefixSize;
+        _iovs.insert(_iovs.begin(), iov);
+        
+        _size += fillerSize;
+    }
+};
+
+#endif
@@ -18,6 +18,7 @@ inline static void extractFlagsAndSize(EmiPacketFlags flags,
                                        bool *hasSequenceNumber,
                                        bool *hasAck,
                                        bool *hasNak,
+                                       bool *hasNakRanges,
                                        bool *hasLinkCapacity,
                                        bool *hasArrivalRate, 
                                        bool *hasRttRequest,
@@ -34,6 +35,7 @@ inline static void extractFlagsAndSize(EmiPacketFlags flags,
     *hasRttRequest     = !!(flags & EMI_RTT_REQUEST_PACKET_FLAG);
     *hasRttResponse    = !!(flags & EMI_RTT_RESPONSE_PACKET_FLAG);
     bool hasExtraFlags = !!(flags & EMI_EXTRA_FLAGS_PACKET_FLAG);
+    *hasNakRanges      = (*hasNak && hasExtraFlags && !!(extraFlags & EMI_NAK_RANGES_EXTRA_PACKET_FLAG));
     
     // 1 for the flags byte
     *expectedSize = sizeof(EmiPacketFlags);
@@ -41,10 +43,10 @@ inline static void extractFlagsAndSize(EmiPacketFlags flags,
     if (hasExtraFlags) {
         *expectedSize += 1; // The packet extra flags byte
         
-        if (flags & EMI_1_BYTE_FILLER_EXTRA_PACKET_FLAG) {
+        if (extraFlags & EMI_1_BYTE_FILLER_EXTRA_PACKET_FLAG) {
             fillerSize = 1;
         }
-        else if (flags & EMI_2_BYTE_FILLER_EXTRA_PACKET_FLAG) {
+        else if (extraFlags & EMI_2_BYTE_FILLER_EXTRA_PACKET_FLAG) {
             fillerSize = 2;
         }
         else {
@@ -64,6 +66,19 @@ inline static void extractFlagsAndSize(EmiPacketFlags flags,
     *expectedSize += (*hasLinkCapacity   ? sizeof(float) : 0);
     *expectedSize += (*hasArrivalRate    ? sizeof(float) : 0);
     *expectedSize += (*hasRttResponse    ? EMI_PACKET_SEQUENCE_NUMBER_LENGTH+sizeof(uint8_t) : 0);
+    
+    // The size of the NAK ranges is not included, since it is
+    // variable; see nakRangesSize
+}
+
+// The NAK ranges are at the end of the header. They consist of a byte
+// with the number of ranges, followed by the ranges. The first range
+// starts at the nak sequence number, so only its length is stored. The
+// other ranges store the difference between their first sequence
+// number and that of the previous range. Both are 16 bit numbers, and
+// the lengths are stored minus 1.
+inline static size_t nakRangesSize(size_t numNakRanges) {
+    return 1 + sizeof(uint16_t) + (numNakRanges-1)*2*sizeof(uint16_t);
 }
 
 EmiPacketHeader::EmiPacketHeader() :
@@ -71,6 +86,7 @@ flags(0),
 sequenceNumber(0),
 ack(0),
 nak(0),
+numNakRanges(0),
 linkCapacity(0),
 arrivalRate(0),
 rttResponse(0),
@@ -86,11 +102,11 @@ bool EmiPacketHeader::parse(const uint8_t *buf, size_t bufSize, EmiPacketHeader
     EmiPacketFlags flags = buf[0];
     
     EmiPacketExtraFlags extraFlags = (EmiPacketExtraFlags) 0;
-    if (bufSize >= 1) {
+    if (bufSize > 1) {
         extraFlags = (EmiPacketExtraFlags) buf[1];
     }
     
-    bool hasSequenceNumber, hasAck, hasNak, hasLinkCapacity;
+    bool hasSequenceNumber, hasAck, hasNak, hasNakRanges, hasLinkCapacity;
     bool hasArrivalRate, hasRttRequest, hasRttResponse;
     size_t expectedSize, fillerSize;
     extractFlagsAndSize(flags,
@@ -98,6 +114,7 @@ bool EmiPacketHeader::parse(const uint8_t *buf, size_t bufSize, EmiPacketHeader
                         &hasSequenceNumber,
                         &hasAck,
                         &hasNak,
+                        &hasNakRanges,
                         &hasLinkCapacity,
                         &hasArrivalRate, 
                         &hasRttRequest,
@@ -116,6 +133,13 @@ bool EmiPacketHeader::parse(const uint8_t *buf, size_t bufSize, EmiPacketHeader
         expectedSize += twoByteFillerSize;
     }
     
+    if (hasNakRanges) {
+        if (bufSize < expectedSize+1 || 0 == buf[expectedSize]) {
+            return false;
+        }
+        expectedSize += nakRangesSize(buf[expectedSize]);
+    }
+    
     if (bufSize < expectedSize) {
         return false;
     }
@@ -124,6 +148,7 @@ bool EmiPacketHeader::parse(const uint8_t *buf, size_t bufSize, EmiPacketHeader
     header->sequenceNumber = 0;
     header->ack = 0;
     header->nak = 0;
+    header->numNakRanges = 0;
     header->linkCapacity = 0.0f;
     header->arrivalRate = 0.0f;
     header->rttResponse = 0;
@@ -149,6 +174,10 @@ bool EmiPacketHeader::parse(const uint8_t *buf, size_t bufSize, EmiPacketHeader
     if (hasNak) {
         header->nak = EmiNetUtil::read24(bufCur);
         bufCur += EMI_PACKET_SEQUENCE_NUMBER_LENGTH;
+        
+        header->numNakRanges = 1;
+        header->nakRanges[0].sequenceNumber = header->nak;
+        header->nakRanges[0].length = 1;
     }
     
     if (hasLinkCapacity) {
@@ -171,6 +200,30 @@ bool EmiPacketHeader::parse(const uint8_t *buf, size_t bufSize, EmiPacketHeader
         bufCur += sizeof(header->rttResponseDelay);
     }
     
+    if (hasNakRanges) {
+        size_t numNakRanges = *bufCur;
+        bufCur += 1;
+        
+        EmiPacketSequenceNumber sequenceNumber = header->nak;
+        for (size_t i=0; i<numNakRanges; i++) {
+            if (0 != i) {
+                int16_t offset = (int16_t) ntohs(*((uint16_t *)bufCur));
+                sequenceNumber = (sequenceNumber+offset) & EMI_PACKET_SEQUENCE_NUMBER_MASK;
+                bufCur += sizeof(uint16_t);
+            }
+            
+            uint32_t length = ((uint32_t) ntohs(*((uint16_t *)bufCur)))+1;
+            bufCur += sizeof(uint16_t);
+            
+            // Ranges that don't fit are ignored
+            if (i < EMI_MAX_NAK_RANGES) {
+                header->nakRanges[i].sequenceNumber = sequenceNumber;
+                header->nakRanges[i].length = length;
+                header->numNakRanges = i+1;
+            }
+        }
+    }
+    
     if (headerLength) {
         *headerLength = expectedSize;
     }
@@ -183,14 +236,28 @@ bool EmiPacketHeader::write(uint8_t *buf, size_t bufSize, const EmiPacketHeader&
         return false;
     }
     
-    bool hasSequenceNumber, hasAck, hasNak, hasLinkCapacity;
+    ASSERT(header.numNakRanges <= EMI_MAX_NAK_RANGES);
+    
+    // The extra flags byte is only written when there are NAK ranges;
+    // filler is added with addFillerBytes.
+    EmiPacketFlags flags = header.flags & ~EMI_EXTRA_FLAGS_PACKET_FLAG;
+    EmiPacketExtraFlags extraFlags = (EmiPacketExtraFlags) 0;
+    if (flags & EMI_NAK_PACKET_FLAG &&
+        (header.numNakRanges > 1 ||
+         (1 == header.numNakRanges && 1 != header.nakRanges[0].length))) {
+        flags |= EMI_EXTRA_FLAGS_PACKET_FLAG;
+        extraFlags = EMI_NAK_RANGES_EXTRA_PACKET_FLAG;
+    }
+    
+    bool hasSequenceNumber, hasAck, hasNak, hasNakRanges, hasLinkCapacity;
     bool hasArrivalRate, hasRttRequest, hasRttResponse;
     size_t expectedSize;
-    extractFlagsAndSize(header.flags,
-                        (EmiPacketExtraFlags)0,
+    extractFlagsAndSize(flags,
+                        extraFlags,
                         &hasSequenceNumber,
                         &hasAck,
                         &hasNak,
+                        &hasNakRanges,
                         &hasLinkCapacity,
                         &hasArrivalRate, 
                         &hasRttRequest,
@@ -198,15 +265,24 @@ bool EmiPacketHeader::write(uint8_t *buf, size_t bufSize, const EmiPacketHeader&
                         /*fillerSize:*/NULL,
                         &expectedSize);
     
+    if (hasNakRanges) {
+        expectedSize += nakRangesSize(header.numNakRanges);
+    }
+    
     if (bufSize < expectedSize) {
         return false;
     }
     
     memset(buf, 0, expectedSize);
-    buf[0] = header.flags;
+    buf[0] = flags;
     
     uint8_t *bufCur = buf+sizeof(EmiPacketFlags);
     
+    if (flags & EMI_EXTRA_FLAGS_PACKET_FLAG) {
+        *bufCur = extraFlags;
+        bufCur += 1;
+    }
+    
     if (hasSequenceNumber) {
         EmiNetUtil::write24(bufCur, header.sequenceNumber);
         bufCur += EMI_PACKET_SEQUENCE_NUMBER_LENGTH;
@@ -218,7 +294,9 @@ bool EmiPacketHeader::write(uint8_t *buf, size_t bufSize, const EmiPacketHeader&
     }
     
     if (hasNak) {
-        EmiNetUtil::write24(bufCur, header.nak);
+        EmiNetUtil::write24(bufCur, (0 == header.numNakRanges ?
+                                     header.nak :
+                                     header.nakRanges[0].sequenceNumber));
         bufCur += EMI_PACKET_SEQUENCE_NUMBER_LENGTH;
     }
     
@@ -240,6 +318,30 @@ bool EmiPacketHeader::write(uint8_t *buf, size_t bufSize, const EmiPacketHeader&
         bufCur += sizeof(header.rttResponseDelay);
     }
     
+    if (hasNakRanges) {
+        *bufCur = (uint8_t) header.numNakRanges;
+        bufCur += 1;
+        
+        for (size_t i=0; i<header.numNakRanges; i++) {
+            const EmiNakRange& range(header.nakRanges[i]);
+            
+            if (0 != i) {
+                int32_t offset = ((range.sequenceNumber-header.nakRanges[i-1].sequenceNumber) &
+                                  EMI_PACKET_SEQUENCE_NUMBER_MASK);
+                if (offset > EMI_PACKET_SEQUENCE_NUMBER_MASK/2) {
+                    offset -= EMI_PACKET_SEQUENCE_NUMBER_MASK+1;
+                }
+                ASSERT(offset >= -32768 && offset <= 32767);
+                *((uint16_t *)bufCur) = htons((uint16_t) offset);
+                bufCur += sizeof(uint16_t);
+            }
+            
+            ASSERT(range.length >= 1 && range.length <= 65536);
+            *((uint16_t *)bufCur) = htons((uint16_t) (range.length-1));
+            bufCur += sizeof(uint16_t);
+        }
+    }
+    
     if (headerLength) {
         *headerLength = expectedSize;
     }
@@ -266,11 +368,11 @@ void EmiPacketHeader::addFillerBytes(uint8_t *buf, size_t packetSize, uint16_t f
         return;
     }
     
-    // Move the packet data
-    std::copy_backward(buf+1, buf+packetSize, buf+packetSize+fillerSize);
-    
-    // Make sure we have the extra flags byte
+    // Make sure we have the extra flags byte, and move the packet data
+    // to make room for the filler, which goes right after it
     if (!(buf[0] & EMI_EXTRA_FLAGS_PACKET_FLAG)) {
+        std::copy_backward(buf+1, buf+packetSize, buf+packetSize+fillerSize);
+    
         buf[0] |= EMI_EXTRA_FLAGS_PACKET_FLAG;
         buf[1] = 0;
         
@@ -279,6 +381,9 @@ void EmiPacketHeader::addFillerBytes(uint8_t *buf, size_t packetSize, uint16_t f
         // the size of the packet by one.
         fillerSize -= 1;
     }
+    else {
+        std::copy_backward(buf+2, buf+packetSize, buf+packetSize+fillerSize);
+    }
     
     if (0 == fillerSize) {
         // We're done. This happens when fillerSize was 1 and
@@ -28,6 +28,13 @@ public:
     EmiPacketSequenceNumber sequenceNumber; // Set if (flags & EMI_SEQUENCE_NUMBER_PACKET_FLAG)
     EmiPacketSequenceNumber ack; // Set if (flags & EMI_ACK_PACKET_FLAG)
     EmiPacketSequenceNumber nak; // Set if (flags & EMI_NAK_PACKET_FLAG)
+    // Set if (flags & EMI_NAK_PACKET_FLAG). These are the packets that
+    // the NAK reports as lost; the first range starts at nak. When
+    // writing a header, a numNakRanges of 0 means that only nak is
+    // reported. When parsing, numNakRanges is always at least 1 for
+    // headers with a NAK.
+    EmiNakRange nakRanges[EMI_MAX_NAK_RANGES];
+    size_t numNakRanges;
     float linkCapacity; // Set if (flags & EMI_LINK_CAPACITY_PACKET_FLAG)
     float arrivalRate; // Set if (flags & EMI_ARRIVAL_RATE_PACKET_FLAG)
     EmiPacketSequenceNumber rttResponse; // Set if (flags & EMI_RTT_RESPONSE_PACKET_FLAG)
@@ -0,0 +1,164 @@
+//
+//  EmiPathMtu.cc
+//  eminet
+//
+
+#include "EmiPathMtu.h"
+
+#include <algorithm>
+
+static const size_t NUM_RECENT_PROBES = EMI_PATH_MTU_MAX_PROBES*2;
+
+EmiPathMtu::EmiPathMtu(size_t minMtu, size_t maxMtu) :
+_minMtu(std::min(minMtu, maxMtu)),
+_maxMtu(maxMtu),
+_mtu(std::min(minMtu, maxMtu)),
+_searchLow(0),
+_searchHigh(0),
+_searchDoneTime(-1),
+_probeSize(0),
+_probeTime(0),
+_probeCount(0),
+_recentProbesIdx(0),
+_rtoCount(0) {
+    for (size_t i=0; i<NUM_RECENT_PROBES; i++) {
+        _recentProbes[i].sequenceNumber = -1;
+        _recentProbes[i].size = 0;
+    }
+    
+    startSearch();
+}
+
+EmiPathMtu::~EmiPathMtu() {}
+
+void EmiPathMtu::startSearch() {
+    _searchLow = _mtu;
+    _searchHigh = _maxMtu+1;
+    _searchDoneTime = -1;
+    _probeSize = 0;
+    _probeCount = 0;
+}
+
+size_t EmiPathMtu::probeSize(EmiTimeInterval now, EmiTimeInterval rto) {
+    if (0 != _probeSize) {
+        if (now-_probeTime < rto) {
+            // Wait for the response
+            return 0;
+        }
+        
+        _probeCount++;
+        if (_probeCount < EMI_PATH_MTU_MAX_PROBES) {
+            // Try again; the probe might have been lost for other
+            // reasons than its size
+            return _probeSize;
+        }
+        
+        // The path doesn't seem to carry packets of this size
+        _searchHigh = _probeSize;
+        _probeSize = 0;
+        _probeCount = 0;
+    }
+    
+    if (-1 != _searchDoneTime &&
+        _mtu < _maxMtu &&
+        now-_searchDoneTime >= EMI_PATH_MTU_RAISE_INTERVAL) {
+        // The path might have changed since the last search
+        startSearch();
+    }
+    
+    if (-1 == _searchDoneTime) {
+        if (_searchHigh-_searchLow > EMI_PATH_MTU_SEARCH_PRECISION) {
+            // Most paths carry the maximal MTU, so try that first
+            _probeSize = (_maxMtu+1 == _searchHigh ?
+                          _maxMtu :
+                          (_searchLow+_searchHigh)/2);
+            _probeCount = 0;
+            return _probeSize;
+        }
+        
+        _searchDoneTime = now;
+    }
+    
+    return 0;
+}
+
+void EmiPathMtu::sentProbe(EmiTimeInterval now, EmiPacketSequenceNumber sequenceNumber, size_t size) {
+    _probeTime = now;
+    
+    Probe& probe(_recentProbes[_recentProbesIdx]);
+    probe.sequenceNumber = sequenceNumber;
+    probe.size = size;
+    _recentProbesIdx = (_recentProbesIdx+1) % NUM_RECENT_PROBES;
+}
+
+bool EmiPathMtu::isProbe(EmiPacketSequenceNumber sequenceNumber) const {
+    for (size_t i=0; i<NUM_RECENT_PROBES; i++) {
+        if (_recentProbes[i].sequenceNumber == sequenceNumber) {
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+bool EmiPathMtu::gotRttResponse(EmiPacketSequenceNumber sequenceNumber) {
+    Probe *probe = NULL;
+    for (size_t i=0; i<NUM_RECENT_PROBES; i++) {
+        if (_recentProbes[i].sequenceNumber == sequenceNumber) {
+            probe = &_recentProbes[i];
+            break;
+        }
+    }
+    
+    if (!probe) {
+        return false;
+    }
+    
+    size_t size = probe->size;
+    probe->sequenceNumber = -1;
+    
+    if (size == _probeSize) {
+        _probeSize = 0;
+        _probeCount = 0;
+    }
+    
+    if (size <= _searchLow) {
+        return false;
+    }
+    
+    _searchLow = size;
+    if (_searchHigh <= _searchLow) {
+        // This is a late response to a probe that we had given up on
+        _searchHigh = _searchLow+1;
+    }
+    
+    bool changed = (_mtu != _searchLow);
+    _mtu = _searchLow;
+    return changed;
+}
+
+bool EmiPathMtu::onRtoTimeout() {
+    _rtoCount++;
+    
+    if (_rtoCount < EMI_PATH_MTU_BLACK_HOLE_RTOS || _minMtu == _mtu) {
+        return false;
+    }
+    
+    // Packets of the current MTU might be dropped somewhere along
+    // the path. Fall back to the minimal MTU and search again.
+    _mtu = _minMtu;
+    _rtoCount = 0;
+    
+    // Responses to old probes must not raise the MTU again
+    for (size_t i=0; i<NUM_RECENT_PROBES; i++) {
+        _recentProbes[i].sequenceNumber = -1;
+    }
+    
+    startSearch();
+    
+    return true;
+}
+
+void EmiPathMtu::gotAck() {
+    _rtoCount = 0;
+}
@@ -0,0 +1,91 @@
+//
+//  EmiPathMtu.h
+//  eminet
+//
+
+#ifndef eminet_EmiPathMtu_h
+#define eminet_EmiPathMtu_h
+
+#include "EmiTypes.h"
+
+#include <cstddef>
+
+// This class implements the sender side logic of packetization
+// layer path MTU discovery (in the spirit of RFC 4821).
+//
+// The connection starts out with the minimal MTU. Probe packets,
+// which are padded with filler bytes and carry an RTT request, are
+// sent to find out if the path can carry larger packets. A probe is
+// considered successful when the other host responds to its RTT
+// request. The MTU is first probed at the maximal MTU, and if that
+// fails, it is found with a binary search.
+//
+// Lost probes are not taken as a sign of congestion. The search is
+// restarted every EMI_PATH_MTU_RAISE_INTERVAL seconds if the MTU is
+// below the maximum, and when consecutive RTO timeouts suggest that
+// the path no longer carries packets of the current MTU.
+class EmiPathMtu {
+    struct Probe {
+        EmiPacketSequenceNumber sequenceNumber;
+        size_t                  size;
+    };
+    
+    size_t _minMtu;
+    size_t _maxMtu;
+    size_t _mtu;
+    
+    // The search is done when _searchHigh-_searchLow is at most
+    // EMI_PATH_MTU_SEARCH_PRECISION. _searchLow is the largest size
+    // that is known to work, _searchHigh is one more than the
+    // largest size that might work.
+    size_t _searchLow;
+    size_t _searchHigh;
+    EmiTimeInterval _searchDoneTime;
+    
+    // 0 if no probe is outstanding
+    size_t          _probeSize;
+    EmiTimeInterval _probeTime;
+    int             _probeCount;
+    
+    // The probes that have been sent recently. Responses and NAKs for
+    // them can arrive after the probe has timed out.
+    Probe  _recentProbes[EMI_PATH_MTU_MAX_PROBES*2];
+    size_t _recentProbesIdx;
+    
+    int _rtoCount; // Number of rto timeouts since last ack
+    
+    void startSearch();
+    
+public:
+    EmiPathMtu(size_t minMtu, size_t maxMtu);
+    virtual ~EmiPathMtu();
+    
+    inline size_t getMtu() const {
+        return _mtu;
+    }
+    
+    inline size_t getMaxMtu() const {
+        return _maxMtu;
+    }
+    
+    // Returns true while a probe is outstanding or a search is in
+    // progress, which means that the connection needs to keep ticking.
+    inline bool isProbing() const {
+        return 0 != _probeSize || -1 == _searchDoneTime;
+    }
+    
+    // Returns the size of the probe packet that should be sent now,
+    // or 0 if no probe should be sent.
+    size_t probeSize(EmiTimeInterval now, EmiTimeInterval rto);
+    void sentProbe(EmiTimeInterval now, EmiPacketSequenceNumber sequenceNumber, size_t size);
+    
+    bool isProbe(EmiPacketSequenceNumber sequenceNumber) const;
+    
+    // Returns true if the MTU changed
+    bool gotRttResponse(EmiPacketSequenceNumber sequenceNumber);
+    // Returns true if the MTU changed
+    bool onRtoTimeout();
+    void gotAck();
+};
+
+#endif
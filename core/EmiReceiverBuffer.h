@@ -11,10 +11,16 @@
 
 #include "EmiNetUtil.h"
 #include "EmiMessageHeader.h"
+#include "EmiFec.h"
 
-#include <set>
 #include <map>
-#include <vector>
+#include <algorithm>
+
+// The largest number of sequence numbers that the receiver buffer of
+// one channel can span. Messages that would make the window larger
+// than this are dropped, just like messages that don't fit in the
+// receiver buffer.
+#define EMI_RECEIVER_BUFFER_MAX_WINDOW (1 << 14)
 
 template<class SockDelegate, class Receiver>
 class EmiReceiverBuffer {
@@ -24,273 +30,289 @@ class EmiReceiverBuffer {
     
     typedef std::map<EmiChannelQualifier, EmiNonWrappingSequenceNumber> EmiNonWrappingSequenceNumberMemo;
     
-    // The purpose of this class is to encapsulate an efficient
-    // algorithm for handling split messages.
+    enum {
+        SPLIT_GROUP_HAS_FIRST_MESSAGE = 0x1,
+        SPLIT_GROUP_HAS_LAST_MESSAGE  = 0x2
+    };
+    
+    // The receiver buffer has one Slot per sequence number in the
+    // window of each channel. A Slot contains three independent things:
     //
-    // The class provides a fast way to know whether a split message
-    // that arrives is the last one in the split, so we can reconstruct
-    // the message and emit it.
+    // 1) The buffered message with that sequence number, if any.
     //
-    // See http://avdongre.wordpress.com/2011/12/06/disjoint-set-data-structure-c/
-    // and http://en.wikipedia.org/wiki/Disjoint-set_data_structure
+    // 2) The split group data of that sequence number, if any. Split
+    //    groups are kept track of with a disjoint set data structure,
+    //    which provides a fast way to know whether a split message that
+    //    arrives is the last one in the split, so we can reconstruct the
+    //    message and emit it.
     //
-    // In addition to the conventional disjoint set data structure,
-    // this class keeps track of whether the first and last messages
-    // are present in the set.
+    //    See http://avdongre.wordpress.com/2011/12/06/disjoint-set-data-structure-c/
+    //    and http://en.wikipedia.org/wiki/Disjoint-set_data_structure
     //
-    // This extra data is required to quickly be able to determine
-    // whether a disjoint set contains all messages in a split.
-    class DisjointMessageSets {
-        
-        enum {
-            DISJOINT_SET_HAS_FIRST_MESSAGE = 0x1,
-            DISJOINT_SET_HAS_LAST_MESSAGE  = 0x2
-        } DisjointSetFlags;
-        
-        struct DisjointSet {
-            EmiNonWrappingSequenceNumber parent;
-            unsigned rank;
-            int flags;
-            EmiNonWrappingSequenceNumber firstMessage; // The smallest sequence number in this set
-            EmiNonWrappingSequenceNumber lastMessage;  // The largest  sequence number in this set
-            size_t size; // The total size, in bytes, of the messages in this set
-            
-            DisjointSet(EmiNonWrappingSequenceNumber i) :
-            parent(i),
-            rank(0),
-            flags(0),
-            firstMessage(EMI_NON_WRAPPING_SEQUENCE_NUMBER_MAX),
-            lastMessage(0),
-            size(0) { }
-        };
-        
-        typedef std::pair<EmiChannelQualifier, EmiNonWrappingSequenceNumber> ForestKey;
-        
-        struct ForestCmp {
-            inline bool operator()(const ForestKey& a, const ForestKey& b) const {
-                return (a.first  != b.first ?
-                        a.first  <  b.first :
-                        a.second <  b.second);
-            }
-        };
-        
-        typedef std::map<ForestKey, DisjointSet, ForestCmp> ForestMap;
-        typedef typename ForestMap::iterator ForestIter;
-        
-        ForestMap _forest;
-        
-        typedef std::pair<ForestKey, DisjointSet*> FindResult;
-        
-        FindResult find(EmiChannelQualifier cq,
-                        EmiNonWrappingSequenceNumber sn,
-                        bool createIfMissing = true) {
-            ForestKey key(cq, sn);
-            
-            ForestIter iter = _forest.find(key);
-            ForestIter end  = _forest.end();
-            if (iter == end) {
-                if (!createIfMissing) {
-                    return std::make_pair(key, (DisjointSet *)NULL);
-                }
-                
-                // If there is no entry for this sequence number and
-                // channel qualifier, create one.
-                iter = _forest.insert(make_pair(key, DisjointSet(sn))).first;
-            }
-            
-            DisjointSet& ds = (*iter).second;
+    //    In addition to the conventional disjoint set data structure,
+    //    the root of each set keeps track of whether the first and last
+    //    messages are present in the set. This extra data is required
+    //    to quickly be able to determine whether a disjoint set contains
+    //    all messages in a split.
+    //
+    //    A message that is not the last in its split is merged with the
+    //    following sequence number, even if that message has not arrived
+    //    yet. This means that a split group always spans a contiguous
+    //    range of sequence numbers.
+    //
+    // 3) On RELIABLE_UNORDERED channels, whether the message with that
+    //    sequence number has been emitted. Together with the expected
+    //    sequence number of the channel, below which every message has
+    //    been emitted, this is the set of received messages that
+    //    duplicates are checked against.
+    struct Slot {
+        bool hasMessage;
+        bool inSet;
+        bool delivered;
+        
+        EmiMessageHeader header;
+        PersistentData data;
+        
+        int flags;
+        unsigned rank;
+        EmiNonWrappingSequenceNumber parent;
+        EmiNonWrappingSequenceNumber firstMessage; // The smallest sequence number in this set
+        EmiNonWrappingSequenceNumber lastMessage;  // The largest  sequence number in this set
+        size_t size; // The total size, in bytes, of the messages in this set
             
-            if (ds.parent == sn) {
-                return std::make_pair(key, &ds);
-            }
-            else {
-                FindResult result = find(cq, ds.parent);
-                ds.parent = result.first.second;
-                return result;
-            }
+        inline bool isEmpty() const {
+            return !hasMessage && !inSet && !delivered;
         }
         
-        // Returns the new root
-        FindResult merge(EmiChannelQualifier cq,
-                         EmiNonWrappingSequenceNumber i,
-                         EmiNonWrappingSequenceNumber j) {
-            FindResult findIResult = find(cq, i);
-            FindResult findJResult = find(cq, j);
-            
-            EmiNonWrappingSequenceNumber rootISn = findIResult.first.second;
-            EmiNonWrappingSequenceNumber rootJSn = findJResult.first.second;
-            
-            DisjointSet& rootI = *(findIResult.second);
-            DisjointSet& rootJ = *(findJResult.second);
-            
-            if (rootISn != rootJSn) {
-                bool iIsTheNewRoot = rootI.rank > rootJ.rank;
-                
-                EmiNonWrappingSequenceNumber newRootSn = (iIsTheNewRoot ? rootISn : rootJSn);
-                
-                DisjointSet& newRoot = (iIsTheNewRoot ? rootI : rootJ);
-                DisjointSet& nonRoot = (iIsTheNewRoot ? rootJ : rootI);
-                
-                if (rootI.rank == rootJ.rank) {
-                    newRoot.rank += 1;
-                }
-                
-                nonRoot.parent = newRootSn;
-                newRoot.flags |= nonRoot.flags;
-                newRoot.firstMessage = std::min(newRoot.firstMessage,
-                                                nonRoot.firstMessage);
-                newRoot.lastMessage  = std::max(newRoot.lastMessage,
-                                                nonRoot.lastMessage);
-                newRoot.size += nonRoot.size;
+        inline bool isReceived() const {
+            return hasMessage || delivered;
+        }
+        
+        inline void clearSet() {
+            inSet = false;
+            flags = 0;
+            rank = 0;
+            parent = 0;
+            firstMessage = EMI_NON_WRAPPING_SEQUENCE_NUMBER_MAX;
+            lastMessage = 0;
+            size = 0;
+        }
+    };
+        
+    // The sliding window of Slots of one channel, indexed by sequence
+    // number. The Slots are stored in a ring buffer whose size is a power
+    // of two, which means that looking up a sequence number is O(1), and
+    // so is removing the oldest sequence numbers.
+    //
+    // The window begins at the oldest sequence number that has either a
+    // buffered message or split group data. It grows when needed, but the
+    // ring buffer is never shrunk.
+    class Channel {
+    private:
+        // Private copy constructor and assignment operator
+        inline Channel(const Channel& other);
+        inline Channel& operator=(const Channel& other);
+        
+        Slot *_slots;
+        size_t _mask;
+        EmiNonWrappingSequenceNumber _base;
+        size_t _span;
+        
+        void clearSlot(Slot& slot) {
+            if (slot.hasMessage) {
+                Binding::releasePersistentData(slot.data);
+                slot.hasMessage = false;
+            }
+            slot.data = PersistentData();
+            slot.delivered = false;
+            slot.clearSet();
+        }
                 
-                return (iIsTheNewRoot ? findIResult : findJResult);
+        void grow(size_t minCapacity) {
+            size_t capacity = _mask+1;
+            while (capacity < minCapacity) {
+                capacity *= 2;
             }
-            else {
-                return findIResult;
+            
+            Slot *slots = new Slot[capacity];
+            for (size_t i=0; i<capacity; i++) {
+                slots[i].hasMessage = false;
+                slots[i].delivered = false;
+                slots[i].data = PersistentData();
+                slots[i].clearSet();
+            }
+            for (size_t i=0; i<_span; i++) {
+                slots[(_base+i) & (capacity-1)] = _slots[(_base+i) & _mask];
             }
+            
+            delete[] _slots;
+            _slots = slots;
+            _mask = capacity-1;
         }
         
     public:
-        typedef std::pair<bool, std::pair<EmiNonWrappingSequenceNumber, size_t> > MessageData;
-        
-        // This method must be called exactly once per message,
-        // otherwise the message size data will get messed up.
-        void gotMessage(EmiChannelQualifier cq,
-                        EmiNonWrappingSequenceNumber i,
-                        EmiMessageFlags messageFlags,
-                        size_t messageSize) {
-            
-            bool first = !(messageFlags & EMI_SPLIT_NOT_FIRST_FLAG);
-            bool last  = !(messageFlags & EMI_SPLIT_NOT_LAST_FLAG);
-            
-            if (first && last) {
-                // This is a non-split message; there's no need to store
-                // it in the forest since we already know that it is
-                // complete.
-                return;
+        Channel() :
+        _slots(NULL),
+        _mask(15),
+        _base(0),
+        _span(0) {
+            _slots = new Slot[_mask+1];
+            for (size_t i=0; i<=_mask; i++) {
+                _slots[i].hasMessage = false;
+                _slots[i].delivered = false;
+                _slots[i].data = PersistentData();
+                _slots[i].clearSet();
             }
-            
-            // Merge the message with sequence number i with the following
-            // message, but only for messages that are not last in a split.
-            DisjointSet& root = *(last ?
-                                  find(cq, i).second :
-                                  merge(cq, i, i+1).second);
-            
-            if (first) root.flags |= DISJOINT_SET_HAS_FIRST_MESSAGE;
-            if (last)  root.flags |= DISJOINT_SET_HAS_LAST_MESSAGE;
-            
-            root.firstMessage = std::min(i, root.firstMessage);
-            root.lastMessage  = std::max(i, root.lastMessage);
-            root.size += messageSize;
         }
         
-        // This method returns a pair of (whether a full set of split messages
-        // have been received, [a pair of (the largest sequence number in this
-        // set, the total size of the messages in this set in bytes)])
-        MessageData getMessageData(EmiChannelQualifier cq,
-                                   EmiNonWrappingSequenceNumber i,
-                                   EmiMessageFlags messageFlags,
-                                   size_t messageSize) {
-            
-            if (!(messageFlags & EMI_SPLIT_NOT_FIRST_FLAG) &&
-                !(messageFlags & EMI_SPLIT_NOT_LAST_FLAG)) {
-                // This is a non-split message; there's no need to store
-                // it in the forest since we already know that it is
-                // complete.
-                return std::make_pair(true, std::make_pair(i, messageSize));
+        ~Channel() {
+            for (size_t i=0; i<_span; i++) {
+                clearSlot(_slots[(_base+i) & _mask]);
             }
-            else {
-                DisjointSet& root = *(find(cq, i).second);
+            delete[] _slots;
+        }
                 
-                return std::make_pair(((root.flags & DISJOINT_SET_HAS_FIRST_MESSAGE) &&
-                                       (root.flags & DISJOINT_SET_HAS_LAST_MESSAGE)),
-                                      std::make_pair(root.lastMessage,
-                                                     root.size));
+        inline bool empty() const {
+            return 0 == _span;
+        }
+                
+        inline EmiNonWrappingSequenceNumber begin() const {
+            return _base;
+        }
+        
+        inline EmiNonWrappingSequenceNumber end() const {
+            return _base+_span;
+        }
+        
+        // Returns NULL if sn is outside of the window
+        inline Slot *get(EmiNonWrappingSequenceNumber sn) {
+            if (sn < _base || sn >= _base+_span) {
+                return NULL;
             }
+            return &_slots[sn & _mask];
         }
         
-        // Removes a message from the disjoint sets data structure.
-        // Also removes all older messages than the specified message.
-        // The sequence number parameter can be the sequence number
-        // of any message that is in the split group to be removed.
+        // Extends the window so that it includes first and last. Returns
+        // false if that would make the window too large.
         //
-        // Note: This method must only be used for messages that are
-        // complete, that is, all parts of the split group have been
-        // registered.
-        void removeMessageAndOlderMessages(EmiChannelQualifier cq, EmiNonWrappingSequenceNumber i) {
-            DisjointSet *root = find(cq, i, /*createIfMissing:*/false).second;
+        // This might invalidate all Slot pointers.
+        bool reserve(EmiNonWrappingSequenceNumber first, EmiNonWrappingSequenceNumber last) {
+            EmiNonWrappingSequenceNumber newBase = (0 == _span ? first : std::min(_base, first));
+            EmiNonWrappingSequenceNumber newEnd = (0 == _span ? last+1 : std::max(_base+_span, last+1));
+            
+            if (newEnd-newBase > EMI_RECEIVER_BUFFER_MAX_WINDOW) {
+                return false;
+            }
             
-            ASSERT(!root ||
-                   ((root->flags & DISJOINT_SET_HAS_FIRST_MESSAGE) &&
-                    (root->flags & DISJOINT_SET_HAS_LAST_MESSAGE)));
+            if (newEnd-newBase > _mask+1) {
+                grow(newEnd-newBase);
+            }
             
-            _forest.erase(_forest.lower_bound(ForestKey(cq, 0)),
-                          _forest.upper_bound(ForestKey(cq, root ? root->lastMessage : i)));
+            _base = newBase;
+            _span = newEnd-newBase;
+            return true;
         }
         
-        EmiNonWrappingSequenceNumber getLastSequenceNumberInSet(EmiChannelQualifier cq,
-                                                                EmiNonWrappingSequenceNumber i) {
-            FindResult findResult(find(cq, i, /*createIfMissing:*/false));
-            return (findResult.second ?
-                    findResult.second->lastMessage :
-                    i);
+        // Removes the buffered messages with sequence numbers lower than sn.
+        // Returns the total size of the removed messages, in bytes.
+        size_t removeMessagesBefore(EmiNonWrappingSequenceNumber sn, size_t (*entrySize)(const EmiMessageHeader&)) {
+            size_t removedSize = 0;
+            EmiNonWrappingSequenceNumber end = std::min(sn, _base+_span);
+            for (EmiNonWrappingSequenceNumber i=_base; i<end; i++) {
+                Slot& slot(_slots[i & _mask]);
+                if (slot.hasMessage) {
+                    removedSize += entrySize(slot.header);
+                    Binding::releasePersistentData(slot.data);
+                    slot.data = PersistentData();
+                    slot.hasMessage = false;
+                }
+            }
+            trim();
+            return removedSize;
         }
-        
-        EmiNonWrappingSequenceNumber getFirstSequenceNumberInSet(EmiChannelQualifier cq,
-                                                                 EmiNonWrappingSequenceNumber i) {
-            FindResult findResult(find(cq, i, /*createIfMissing:*/false));
-            return (findResult.second ?
-                    findResult.second->firstMessage :
-                    i);
+            
+        // Removes the buffered message with sequence number sn, if any,
+        // but not its split group data. Returns the size of the removed
+        // message, in bytes.
+        size_t removeMessage(EmiNonWrappingSequenceNumber sn, size_t (*entrySize)(const EmiMessageHeader&)) {
+            Slot *slot = get(sn);
+            if (!slot || !slot->hasMessage) {
+                return 0;
+            }
+            
+            size_t removedSize = entrySize(slot->header);
+            Binding::releasePersistentData(slot->data);
+            slot->data = PersistentData();
+            slot->hasMessage = false;
+            return removedSize;
         }
-    };
-    
-    class Entry {
-    private:
-        // Private copy constructor and assignment operator
-        inline Entry(const Entry& other);
-        inline Entry& operator=(const Entry& other);
         
-    public:
-        Entry(EmiNonWrappingSequenceNumber guessedNonWrappedSequenceNumber_,
-              const EmiMessageHeader& header_,
-              const TemporaryData &data_,
-              size_t offset,
-              size_t length) :
-        guessedNonWrappedSequenceNumber(guessedNonWrappedSequenceNumber_),
-        header(header_),
-        data(Binding::makePersistentData(Binding::extractData(data_)+offset, length)) {}
+        // Removes the split group data of sequence numbers from sn to
+        // the end of the window.
+        void removeSetsFrom(EmiNonWrappingSequenceNumber sn) {
+            for (EmiNonWrappingSequenceNumber i=std::max(sn, _base); i<_base+_span; i++) {
+                _slots[i & _mask].clearSet();
+            }
+        }
+            
+        // Removes the split group data of sequence numbers up to and
+        // including sn.
+        void removeSetsUpTo(EmiNonWrappingSequenceNumber sn) {
+            EmiNonWrappingSequenceNumber end = std::min(sn+1, _base+_span);
+            for (EmiNonWrappingSequenceNumber i=_base; i<end; i++) {
+                _slots[i & _mask].clearSet();
+            }
+            trim();
+        }
         
-        Entry() :
-        guessedNonWrappedSequenceNumber(0) {}
+        // Marks the slots from first to last, inclusive, as delivered,
+        // and removes their buffered messages and split group data.
+        // first and last must be in the window, and if they are in a
+        // split group, it must be exactly that group. Returns the total
+        // size of the removed messages, in bytes.
+        size_t markDelivered(EmiNonWrappingSequenceNumber first,
+                             EmiNonWrappingSequenceNumber last,
+                             size_t (*entrySize)(const EmiMessageHeader&)) {
+            size_t removedSize = 0;
+            for (EmiNonWrappingSequenceNumber i=first; i<=last; i++) {
+                Slot& slot(_slots[i & _mask]);
+                if (slot.hasMessage) {
+                    removedSize += entrySize(slot.header);
+                }
+                clearSlot(slot);
+                slot.delivered = true;
+            }
+            return removedSize;
+        }
         
-        ~Entry() {
-            Binding::releasePersistentData(data);
+        // Clears the delivered marks of the slots from sn up to the
+        // first slot that is not delivered, and returns the sequence
+        // number of that slot.
+        EmiNonWrappingSequenceNumber removeDeliveredFrom(EmiNonWrappingSequenceNumber sn) {
+            Slot *slot;
+            while ((slot = get(sn)) && slot->delivered) {
+                slot->delivered = false;
+                sn++;
+            }
+            trim();
+            return sn;
         }
         
-        EmiNonWrappingSequenceNumber guessedNonWrappedSequenceNumber;
-        EmiMessageHeader header;
-        PersistentData data;
-    };
-    
-    struct BufferTreeCmp {
-        inline bool operator()(Entry *a, Entry *b) const {
-            EmiChannelQualifier acq = a->header.channelQualifier;
-            EmiChannelQualifier bcq = b->header.channelQualifier;
-            
-            return (acq != bcq ?
-                    acq < bcq :
-                    a->guessedNonWrappedSequenceNumber < b->guessedNonWrappedSequenceNumber);
+        // Moves the beginning of the window past all empty slots
+        void trim() {
+            while (_span && _slots[_base & _mask].isEmpty()) {
+                _base++;
+                _span--;
+            }
         }
     };
     
-    typedef std::set<Entry *, BufferTreeCmp> BufferTree;
-    typedef typename BufferTree::iterator    BufferTreeIter;
+    typedef std::pair<bool, std::pair<EmiNonWrappingSequenceNumber, size_t> > MessageData;
+        
     // Buffer max size
     size_t _size;
     
-    DisjointMessageSets _messageSets;
-    BufferTree _tree;
+    Channel *_channels[256];
     size_t _bufferSize;
     
     // This is a map that contains the next message's expected
@@ -325,111 +347,401 @@ private:
     inline EmiReceiverBuffer(const EmiReceiverBuffer& other);
     inline EmiReceiverBuffer& operator=(const EmiReceiverBuffer& other);
     
-    static size_t bufferEntrySize(size_t headerLength, size_t length) {
-        return headerLength + length;
+    static size_t bufferEntrySize(const EmiMessageHeader& header) {
+        return header.headerLength + header.length;
     }
     
-    EmiNonWrappingSequenceNumber expectedSequenceNumber(const EmiMessageHeader& header) {
-        EmiNonWrappingSequenceNumberMemo::iterator cur = _expectedSnMemo.find(header.channelQualifier);
+    inline Channel *getChannel(EmiChannelQualifier channelQualifier) {
+        return _channels[channelQualifier];
+    }
+    
+    Channel& getOrCreateChannel(EmiChannelQualifier channelQualifier) {
+        Channel *channel = _channels[channelQualifier];
+        if (!channel) {
+            channel = _channels[channelQualifier] = new Channel;
+        }
+        return *channel;
+    }
+    
+    EmiNonWrappingSequenceNumber expectedSequenceNumber(EmiChannelQualifier channelQualifier) {
+        EmiNonWrappingSequenceNumberMemo::iterator cur = _expectedSnMemo.find(channelQualifier);
         EmiNonWrappingSequenceNumberMemo::iterator end = _expectedSnMemo.end();
         
         return (end == cur ? _receiver.getOtherHostInitialSequenceNumber() : (*cur).second);
     }
     
+    inline EmiNonWrappingSequenceNumber expectedSequenceNumber(const EmiMessageHeader& header) {
+        return expectedSequenceNumber(header.channelQualifier);
+    }
+    
+    /// Split group operations
+    
+    inline static void makeSet(Slot& slot, EmiNonWrappingSequenceNumber sn) {
+        slot.clearSet();
+        slot.inSet = true;
+        slot.parent = sn;
+    }
+    
+    // Returns the root of the set that sn is in, or NULL if sn is not in
+    // a set and createIfMissing is false.
+    //
+    // This might extend the channel's window, which invalidates all
+    // Slot pointers except the returned one. If createIfMissing is true,
+    // the caller must have reserved sn in the channel's window.
+    Slot *findSet(Channel& channel, EmiNonWrappingSequenceNumber sn, bool createIfMissing, EmiNonWrappingSequenceNumber *rootSn) {
+        Slot *slot = channel.get(sn);
+        if (!slot || !slot->inSet) {
+            if (!createIfMissing || !slot) {
+                return NULL;
+            }
+            makeSet(*slot, sn);
+        }
+        
+        EmiNonWrappingSequenceNumber root = sn;
+        Slot *rootSlot = slot;
+        while (rootSlot->parent != root) {
+            EmiNonWrappingSequenceNumber parent = rootSlot->parent;
+            Slot *parentSlot = channel.get(parent);
+            
+            if (!parentSlot) {
+                // The parent has been removed and is no longer in the
+                // window. Re-create it as an empty set, like below.
+                if (channel.reserve(parent, parent)) {
+                    return findSet(channel, sn, createIfMissing, rootSn);
+                }
+                
+                // The window can't fit the parent; detach this node instead
+                makeSet(*rootSlot, root);
+                break;
+            }
+            
+            if (!parentSlot->inSet) {
+                // The parent has been removed, so the set that this node
+                // was in is gone. Re-create the parent as an empty set.
+                makeSet(*parentSlot, parent);
+            }
+            
+            root = parent;
+            rootSlot = parentSlot;
+        }
+        
+        // Path compression
+        while (slot->parent != root) {
+            Slot *next = channel.get(slot->parent);
+            slot->parent = root;
+            slot = next;
+        }
+        
+        if (rootSn) {
+            *rootSn = root;
+        }
+        return rootSlot;
+    }
+    
+    // Returns the new root. The caller must have reserved i and j in the
+    // channel's window.
+    Slot *mergeSets(Channel& channel,
+                    EmiNonWrappingSequenceNumber i,
+                    EmiNonWrappingSequenceNumber j) {
+        EmiNonWrappingSequenceNumber rootISn;
+        EmiNonWrappingSequenceNumber rootJSn;
+        findSet(channel, i, /*createIfMissing:*/true, &rootISn);
+        findSet(channel, j, /*createIfMissing:*/true, &rootJSn);
+        
+        // The second findSet might have invalidated the pointer that the
+        // first one returned, so look up both roots again.
+        Slot *rootI = channel.get(rootISn);
+        Slot *rootJ = channel.get(rootJSn);
+        
+        if (rootISn == rootJSn) {
+            return rootI;
+        }
+        
+        bool iIsTheNewRoot = rootI->rank > rootJ->rank;
+        
+        EmiNonWrappingSequenceNumber newRootSn = (iIsTheNewRoot ? rootISn : rootJSn);
+        
+        Slot& newRoot = (iIsTheNewRoot ? *rootI : *rootJ);
+        Slot& nonRoot = (iIsTheNewRoot ? *rootJ : *rootI);
+        
+        if (rootI->rank == rootJ->rank) {
+            newRoot.rank += 1;
+        }
+        
+        nonRoot.parent = newRootSn;
+        newRoot.flags |= nonRoot.flags;
+        newRoot.firstMessage = std::min(newRoot.firstMessage,
+                                        nonRoot.firstMessage);
+        newRoot.lastMessage  = std::max(newRoot.lastMessage,
+                                        nonRoot.lastMessage);
+        newRoot.size += nonRoot.size;
+        
+        return &newRoot;
+    }
+    
+    // This method must be called exactly once per message,
+    // otherwise the message size data will get messed up.
+    //
+    // The caller must have reserved i and i+1 in the channel's window.
+    void addMessageToSet(Channel& channel,
+                         EmiNonWrappingSequenceNumber i,
+                         EmiMessageFlags messageFlags,
+                         size_t messageSize) {
+        bool first = !(messageFlags & EMI_SPLIT_NOT_FIRST_FLAG);
+        bool last  = !(messageFlags & EMI_SPLIT_NOT_LAST_FLAG);
+        
+        if (first && last) {
+            // This is a non-split message; there's no need to store
+            // it in a set since we already know that it is complete.
+            return;
+        }
+        
+        // Merge the message with sequence number i with the following
+        // message, but only for messages that are not last in a split.
+        Slot& root = *(last ?
+                       findSet(channel, i, /*createIfMissing:*/true, NULL) :
+                       mergeSets(channel, i, i+1));
+        
+        if (first) root.flags |= SPLIT_GROUP_HAS_FIRST_MESSAGE;
+        if (last)  root.flags |= SPLIT_GROUP_HAS_LAST_MESSAGE;
+        
+        root.firstMessage = std::min(i, root.firstMessage);
+        root.lastMessage  = std::max(i, root.lastMessage);
+        root.size += messageSize;
+    }
+    
+    // This method returns a pair of (whether a full set of split messages
+    // have been received, [a pair of (the largest sequence number in this
+    // set, the total size of the messages in this set in bytes)])
+    MessageData getMessageData(Channel& channel,
+                               EmiNonWrappingSequenceNumber i,
+                               EmiMessageFlags messageFlags,
+                               size_t messageSize) {
+        if (!(messageFlags & EMI_SPLIT_NOT_FIRST_FLAG) &&
+            !(messageFlags & EMI_SPLIT_NOT_LAST_FLAG)) {
+            // This is a non-split message; it is not in a set since
+            // we already know that it is complete.
+            return std::make_pair(true, std::make_pair(i, messageSize));
+        }
+        
+        Slot *root = findSet(channel, i, /*createIfMissing:*/false, NULL);
+        if (!root) {
+            return std::make_pair(false, std::make_pair(i, messageSize));
+        }
+        
+        return std::make_pair(((root->flags & SPLIT_GROUP_HAS_FIRST_MESSAGE) &&
+                               (root->flags & SPLIT_GROUP_HAS_LAST_MESSAGE)),
+                              std::make_pair(root->lastMessage,
+                                             root->size));
+    }
+    
+    // Removes a message from the split group data. Also removes all
+    // older messages than the specified message. The sequence number
+    // parameter can be the sequence number of any message that is in
+    // the split group to be removed.
+    //
+    // Note: This method must only be used for messages that are
+    // complete, that is, all parts of the split group have been
+    // registered.
+    void removeSetAndOlderSets(Channel& channel, EmiNonWrappingSequenceNumber i) {
+        Slot *root = findSet(channel, i, /*createIfMissing:*/false, NULL);
+        
+        ASSERT(!root ||
+               ((root->flags & SPLIT_GROUP_HAS_FIRST_MESSAGE) &&
+                (root->flags & SPLIT_GROUP_HAS_LAST_MESSAGE)));
+        
+        channel.removeSetsUpTo(root ? root->lastMessage : i);
+    }
+    
+    EmiNonWrappingSequenceNumber getLastSequenceNumberInSet(Channel *channel,
+                                                            EmiNonWrappingSequenceNumber i) {
+        Slot *root = (channel ? findSet(*channel, i, /*createIfMissing:*/false, NULL) : NULL);
+        return root ? root->lastMessage : i;
+    }
+    
+    EmiNonWrappingSequenceNumber getFirstSequenceNumberInSet(Channel *channel,
+                                                             EmiNonWrappingSequenceNumber i) {
+        Slot *root = (channel ? findSet(*channel, i, /*createIfMissing:*/false, NULL) : NULL);
+        return root ? root->firstMessage : i;
+    }
+    
+    /// Message buffer operations
+    
+    // Removes buffered messages of the channel that have higher
+    // sequence numbers than sn, newest first, until there is room for
+    // size more bytes in the buffer. Returns false if there is not room
+    // even after removing all of them.
+    //
+    // Removed messages that were parts of a split leave their split
+    // group incomplete, so the split group data from the group that the
+    // oldest removed message was in and onwards is removed, and then
+    // rebuilt from the messages that are left.
+    bool removeNewerMessages(Channel& channel, EmiNonWrappingSequenceNumber sn, size_t size) {
+        EmiNonWrappingSequenceNumber cut = channel.end();
+        while (_bufferSize + size > _size && cut > sn+1) {
+            cut--;
+            _bufferSize -= channel.removeMessage(cut, EmiReceiverBuffer::bufferEntrySize);
+        }
+        
+        if (cut == channel.end()) {
+            // Nothing was removed
+            return _bufferSize + size <= _size;
+        }
+        
+        EmiNonWrappingSequenceNumber rebuildFrom = getFirstSequenceNumberInSet(&channel, cut);
+        channel.removeSetsFrom(rebuildFrom);
+        for (EmiNonWrappingSequenceNumber i=rebuildFrom; i<cut; i++) {
+            Slot *slot = channel.get(i);
+            if (slot && slot->hasMessage) {
+                addMessageToSet(channel, i, slot->header.flags, /*messageSize:*/slot->header.length);
+            }
+        }
+        
+        return _bufferSize + size <= _size;
+    }
+    
+    // Returns true if all sequence numbers from the expected one up to
+    // but not including sn are buffered, which means that the message
+    // with sequence number sn is the next one that the channel needs
+    // to make progress. If a split message is being received, that is
+    // the next missing part of it.
+    bool isNextNeededMessage(Channel& channel,
+                             EmiNonWrappingSequenceNumber expectedSn,
+                             EmiNonWrappingSequenceNumber sn) {
+        for (EmiNonWrappingSequenceNumber i=expectedSn; i<sn; i++) {
+            Slot *slot = channel.get(i);
+            if (!slot || !slot->isReceived()) {
+                return false;
+            }
+        }
+        return true;
+    }
+    
     void bufferMessage(EmiNonWrappingSequenceNumber guessedNonWrappedSequenceNumber,
                        const EmiMessageHeader& header,
                        const TemporaryData& buf,
                        size_t offset,
                        size_t length) {
-        size_t msgSize = EmiReceiverBuffer::bufferEntrySize(header.headerLength, header.length);
+        size_t msgSize = EmiReceiverBuffer::bufferEntrySize(header);
+        EmiChannelType channelType = EMI_CHANNEL_QUALIFIER_TYPE(header.channelQualifier);
         
-        // Discard the message if it doesn't fit in the buffer
-        if (_bufferSize + msgSize <= _size) {
-            Entry *entry = new Entry(guessedNonWrappedSequenceNumber, header, buf, offset, length);
-            
-            bool wasInserted = _tree.insert(entry).second;
+        Channel& channel(getOrCreateChannel(header.channelQualifier));
+        
+        if (_bufferSize + msgSize > _size) {
+            // The message doesn't fit in the buffer. On reliable ordered
+            // and unordered channels, the next message that the channel
+            // needs is the one that it can't make progress without, and
+            // the messages after it are only waiting for it. Make room
+            // for it by removing the newest of those; they will be
+            // retransmitted. Other messages are discarded.
+            if ((EMI_CHANNEL_TYPE_RELIABLE_ORDERED != channelType &&
+                 EMI_CHANNEL_TYPE_RELIABLE_UNORDERED != channelType) ||
+                !isNextNeededMessage(channel, expectedSequenceNumber(header), guessedNonWrappedSequenceNumber) ||
+                !removeNewerMessages(channel, guessedNonWrappedSequenceNumber, msgSize)) {
+                return;
+            }
+        }
             
-            // Only increment this._bufferSize if the message wasn't already in the buffer
-            if (wasInserted) {
-                _bufferSize += msgSize;
-                
-                _messageSets.gotMessage(entry->header.channelQualifier,
-                                        entry->guessedNonWrappedSequenceNumber,
-                                        entry->header.flags,
-                                        /*messageSize:*/entry->header.length);
+        // addMessageToSet might need the slot after this message
+        if (!channel.reserve(guessedNonWrappedSequenceNumber,
+                             guessedNonWrappedSequenceNumber+1)) {
+            // On channels that are allowed to skip messages, the
+            // messages that are too old to fit in the window along with
+            // this one are not worth waiting for anymore. Drop them.
+            // On reliable ordered and unordered channels, drop this
+            // message instead; it will be retransmitted.
+            if (EMI_CHANNEL_TYPE_RELIABLE_ORDERED == channelType ||
+                EMI_CHANNEL_TYPE_RELIABLE_UNORDERED == channelType ||
+                guessedNonWrappedSequenceNumber < channel.begin()) {
+                return;
             }
-            else {
-                delete entry;
+                
+            EmiNonWrappingSequenceNumber newBegin = guessedNonWrappedSequenceNumber+2-EMI_RECEIVER_BUFFER_MAX_WINDOW;
+            channel.removeSetsUpTo(newBegin-1);
+            removeMessagesBefore(channel, newBegin);
+            
+            if (!channel.reserve(guessedNonWrappedSequenceNumber,
+                                 guessedNonWrappedSequenceNumber+1)) {
+                return;
             }
         }
-    }
     
-    void remove(BufferTreeIter begin, BufferTreeIter end) {
-        BufferTreeIter iter = begin;
-        while (iter != end) {
-            Entry *entry = *iter;
-            
-            _bufferSize -= EmiReceiverBuffer::bufferEntrySize(entry->header.headerLength,
-                                                              entry->header.length);
+        Slot& slot(*channel.get(guessedNonWrappedSequenceNumber));
             
-            delete entry;
-            
-            ++iter;
+        // Only store the message if it isn't already in the buffer, or
+        // already emitted
+        if (slot.isReceived()) {
+            channel.trim();
+            return;
         }
         
-        _tree.erase(begin, end);
+        slot.hasMessage = true;
+        slot.header = header;
+        slot.data = Binding::makePersistentData(Binding::extractData(buf)+offset, length);
+        _bufferSize += msgSize;
+        
+        addMessageToSet(channel,
+                        guessedNonWrappedSequenceNumber,
+                        header.flags,
+                        /*messageSize:*/header.length);
+        
+        channel.trim();
+    }
+    
+    void removeMessagesBefore(Channel& channel, EmiNonWrappingSequenceNumber sn) {
+        _bufferSize -= channel.removeMessagesBefore(sn, EmiReceiverBuffer::bufferEntrySize);
+    }
+    
+    // Returns the sequence number of the oldest buffered message of the
+    // channel, or false if there is none.
+    bool firstMessage(Channel& channel, EmiNonWrappingSequenceNumber *sn) {
+        for (EmiNonWrappingSequenceNumber i=channel.begin(); i<channel.end(); i++) {
+            if (channel.get(i)->hasMessage) {
+                *sn = i;
+                return true;
+            }
+        }
+        return false;
     }
     
     // Processes a set of messages in a split that is known to be complete.
     // This method iterates through the messages and fills buf so that it
     // is a continuous buffer of the data of the messages.
     //
-    // iter must point to the first Entry of the message set.
-    //
-    // The return value is an iterator pointing to the first entry that is
-    // in the buffer that is not part of the message set. Note that the
-    // return value can be _tree.end() or an iterator to a message with a
-    // different channelQualifier.
-    BufferTreeIter processMessageSetData(EmiChannelQualifier channelQualifier,
-                                         EmiNonWrappingSequenceNumber largestSequenceNumberInSet,
-                                         BufferTreeIter iter,
-                                         uint8_t *buf, size_t bufSize) {
-        BufferTreeIter end = _tree.end();
-        Entry *entry = *iter;
+    // sn must be the sequence number of the first message of the set.
+    void processMessageSetData(Channel& channel,
+                               EmiNonWrappingSequenceNumber sn,
+                               EmiNonWrappingSequenceNumber largestSequenceNumberInSet,
+                               uint8_t *buf, size_t bufSize) {
         size_t bufPos = 0;
         
-        // This loop increments iter until we are past the message set
-        // we just processed, and marks all messages we pass for removal.
-        do {
-            size_t edlen = Binding::extractLength(entry->data);
+        for (; sn <= largestSequenceNumberInSet; sn++) {
+            Slot *slot = channel.get(sn);
+            ASSERT(slot && slot->hasMessage);
+            
+            size_t edlen = Binding::extractLength(slot->data);
             ASSERT(bufPos + edlen <= bufSize);
-            memcpy(buf+bufPos, Binding::extractData(entry->data), edlen);
+            memcpy(buf+bufPos, Binding::extractData(slot->data), edlen);
             bufPos += edlen;
-            
-            ++iter;
-        } while (iter != end &&
-                 (entry = *iter) &&
-                 entry->guessedNonWrappedSequenceNumber <= largestSequenceNumberInSet);
+        }
         
         ASSERT(bufPos == bufSize);
-        
-        return iter;
     }
     
-    // This method iterates through the buffer and emits as many
+    // This method goes through the buffer and emits as many
     // complete messages as it can find, while still enforcing
     // strict message ordering (no skipped messages).
     //
-    // The search begins in iter.
+    // The search begins at sn, which must be the sequence number
+    // of a buffered message.
     //
-    // The return value is an iterator that points to the message
-    // after the last one that was processed by processBuffer. Note
-    // that the return value can be _tree.end() or an iterator to a
-    // message with a different channelQualifier.
-    BufferTreeIter processBuffer(EmiChannelQualifier channelQualifier,
-                                 BufferTreeIter iter,
-                                 int64_t *largestProcessedMessageSet,
-                                 EmiNonWrappingSequenceNumber *largestProcessedSn) {
+    // The return value is the sequence number of the first message
+    // that was not processed by processBuffer.
+    EmiNonWrappingSequenceNumber processBuffer(EmiChannelQualifier channelQualifier,
+                                               Channel& channel,
+                                               EmiNonWrappingSequenceNumber sn,
+                                               int64_t *largestProcessedMessageSet,
+                                               EmiNonWrappingSequenceNumber *largestProcessedSn) {
         
         if (largestProcessedMessageSet) {
             *largestProcessedMessageSet = -1;
@@ -438,15 +750,10 @@ private:
             *largestProcessedSn = -1;
         }
         
-        BufferTreeIter end = _tree.end();
+        Slot *slot = channel.get(sn);
+        ASSERT(slot && slot->hasMessage);
         
-        if (iter == end) {
-            return iter;
-        }
-        
-        Entry *entry = *iter;
-        
-        if (entry->header.flags & EMI_SPLIT_NOT_FIRST_FLAG) {
+        if (slot->header.flags & EMI_SPLIT_NOT_FIRST_FLAG) {
             // The first message is in the middle of a split.
             // That means that there is no complete message that
             // we can process.
@@ -454,30 +761,23 @@ private:
             // This check is needed in order to ensure that we
             // don't invoke processMessageSetData with an
             // incomplete message set.
-            return iter;
+            return sn;
         }
         
-        EmiNonWrappingSequenceNumber expectedSequenceNumber = entry->guessedNonWrappedSequenceNumber;
+        while ((slot = channel.get(sn)) && slot->hasMessage) {
         
-        while (iter != end &&
-               (entry = *iter) &&
-               entry->header.channelQualifier == channelQualifier &&
-               entry->guessedNonWrappedSequenceNumber <= expectedSequenceNumber) {
-            
-            // Search for a message set that contains entry->guessedNonWrappedSequenceNumber
-            typename DisjointMessageSets::MessageData messageData;
-            messageData = _messageSets.getMessageData(channelQualifier,
-                                                      entry->guessedNonWrappedSequenceNumber,
-                                                      entry->header.flags,
-                                                      /*messageSize:*/entry->header.length);
+            // Search for a message set that contains sn
+            MessageData messageData(getMessageData(channel,
+                                                   sn,
+                                                   slot->header.flags,
+                                                   /*messageSize:*/slot->header.length));
             bool setIsComplete = messageData.first;
             EmiNonWrappingSequenceNumber largestSequenceNumberInSet = messageData.second.first;
             size_t totalSizeOfSet = messageData.second.second;
             
-            // Update the expected sequence number to the largest sequence
-            // number in the set, and enqueue an acknowledgment to the other
-            // host that we have received all data up to that point.
-            expectedSequenceNumber = largestSequenceNumberInSet+1;
+            // Enqueue an acknowledgment to the other host that we have
+            // received all data up to the largest sequence number in
+            // the set.
             if (largestProcessedSn) {
                 *largestProcessedSn = largestSequenceNumberInSet;
             }
@@ -488,19 +788,20 @@ private:
                 break;
             }
             
-            if (largestSequenceNumberInSet == entry->guessedNonWrappedSequenceNumber) {
+            // getMessageData might have extended the window
+            slot = channel.get(sn);
+            
+            if (largestSequenceNumberInSet == sn) {
                 // The message set consists of just one message
                 //
                 // This special case is purely an optimization, to avoid
                 // the overhead of allocating a new TemporaryData buffer
-                // when it's possible to just use entry->data right away.
+                // when it's possible to just use the slot's data right away.
                 
                 _receiver.emitMessage(channelQualifier,
-                                      Binding::castToTemporary(entry->data),
+                                      Binding::castToTemporary(slot->data),
                                       /*offset:*/0,
-                                      entry->header.length);
-                
-                ++iter;
+                                      slot->header.length);
             }
             else {
                 // The message set contains more than one message
@@ -508,11 +809,11 @@ private:
                 uint8_t *mergedDataBuf;
                 TemporaryData mergedData = Binding::makeTemporaryData(totalSizeOfSet, &mergedDataBuf);
                 
-                iter = processMessageSetData(channelQualifier,
-                                             largestSequenceNumberInSet,
-                                             iter,
-                                             /*buf:*/mergedDataBuf,
-                                             /*bufSize:*/Binding::extractLength(mergedData));
+                processMessageSetData(channel,
+                                      sn,
+                                      largestSequenceNumberInSet,
+                                      /*buf:*/mergedDataBuf,
+                                      /*bufSize:*/Binding::extractLength(mergedData));
                 
                 _receiver.emitMessage(channelQualifier,
                                       mergedData,
@@ -520,12 +821,14 @@ private:
                                       Binding::extractLength(mergedData));
             }
             
+            sn = largestSequenceNumberInSet+1;
+            
             if (largestProcessedMessageSet) {
                 *largestProcessedMessageSet = largestSequenceNumberInSet;
             }
         }
         
-        return iter;
+        return sn;
     }
     
     // This is works with RELIABLE_ORDERED channels.
@@ -535,33 +838,28 @@ private:
     // buffer.
     void flushBuffer(EmiChannelQualifier channelQualifier,
                      EmiNonWrappingSequenceNumber expectedSequenceNumber) {
-        if (_tree.empty()) return;
-        
-        Entry mockEntry;
-        mockEntry.guessedNonWrappedSequenceNumber = 0;
-        mockEntry.header.channelQualifier = channelQualifier;
+        Channel *channel = getChannel(channelQualifier);
+        if (!channel) return;
         
-        BufferTreeIter iter = _tree.lower_bound(&mockEntry);
-        
-        if (_tree.end() == iter) {
+        EmiNonWrappingSequenceNumber firstSn;
+        if (!firstMessage(*channel, &firstSn)) {
             // We found nothing.
             return;
         }
         
-        Entry *foundEntry = *iter;
-        if (foundEntry->header.channelQualifier != channelQualifier ||
-            foundEntry->guessedNonWrappedSequenceNumber > expectedSequenceNumber) {
-            // The entry we found was either not in the expected channel qualifier,
-            // or it was newer than the newest permissible message to process.
+        if (firstSn > expectedSequenceNumber) {
+            // The message we found was newer than the newest permissible
+            // message to process.
             return;
         }
         
         int64_t largestProcessedMessageSet;
         EmiNonWrappingSequenceNumber largestProcessedSn;
-        BufferTreeIter end = processBuffer(channelQualifier,
-                                           iter,
-                                           &largestProcessedMessageSet,
-                                           &largestProcessedSn);
+        EmiNonWrappingSequenceNumber end = processBuffer(channelQualifier,
+                                                         *channel,
+                                                         firstSn,
+                                                         &largestProcessedMessageSet,
+                                                         &largestProcessedSn);
         
         if (-1 != largestProcessedSn) {
             _receiver.enqueueAck(channelQualifier, largestProcessedSn & EMI_HEADER_SEQUENCE_NUMBER_MASK);
@@ -569,16 +867,13 @@ private:
         }
         
         // We have now processed and emitted messages. The next
-        // step is to remove those from the buffer data structure.
-        //
-        // To do this correctly, we need to remove data from both
-        // _messageSets and _tree.
+        // step is to remove those from the buffer, both the
+        // messages and their split group data.
         
         if (-1 != largestProcessedMessageSet) {
-            _messageSets.removeMessageAndOlderMessages(channelQualifier,
-                                                       largestProcessedMessageSet);
+            removeSetAndOlderSets(*channel, largestProcessedMessageSet);
         }
-        remove(iter, end);
+        removeMessagesBefore(*channel, end);
     }
     
     void processUnorderedMessage(EmiNonWrappingSequenceNumber guessedNonWrappedSequenceNumber,
@@ -592,20 +887,12 @@ private:
             
             _receiver.emitMessage(header.channelQualifier, data, offset, header.length);
             
-            // Remove older messages from _tree and _messageSets
-            _messageSets.removeMessageAndOlderMessages(header.channelQualifier,
-                                                       guessedNonWrappedSequenceNumber);
-            
-            Entry mockEntry1;
-            mockEntry1.guessedNonWrappedSequenceNumber = 0;
-            mockEntry1.header.channelQualifier = header.channelQualifier;
-            
-            Entry mockEntry2;
-            mockEntry2.guessedNonWrappedSequenceNumber = guessedNonWrappedSequenceNumber;
-            mockEntry2.header.channelQualifier = header.channelQualifier;
-            
-            remove(_tree.lower_bound(&mockEntry1),
-                   _tree.upper_bound(&mockEntry2));
+            // Remove older messages from the buffer
+            Channel *channel = getChannel(header.channelQualifier);
+            if (channel) {
+                removeSetAndOlderSets(*channel, guessedNonWrappedSequenceNumber);
+                removeMessagesBefore(*channel, guessedNonWrappedSequenceNumber+1);
+            }
             
             // Enqueue ack if this is a reliable sequenced channel
             if (EMI_CHANNEL_TYPE_RELIABLE_SEQUENCED == channelType) {
@@ -617,16 +904,14 @@ private:
             bufferMessage(guessedNonWrappedSequenceNumber,
                           header, data, offset, header.length);
             
-            EmiNonWrappingSequenceNumber firstSequenceNumberInSet = _messageSets.getFirstSequenceNumberInSet(header.channelQualifier,
-                                                                                                             guessedNonWrappedSequenceNumber);
+            Channel *channel = getChannel(header.channelQualifier);
             
-            Entry mockEntry1;
-            mockEntry1.guessedNonWrappedSequenceNumber = firstSequenceNumberInSet;
-            mockEntry1.header.channelQualifier = header.channelQualifier;
-            BufferTreeIter iter = _tree.find(&mockEntry1);
+            EmiNonWrappingSequenceNumber firstSequenceNumberInSet = getFirstSequenceNumberInSet(channel,
+                                                                                                guessedNonWrappedSequenceNumber);
             
             // Enqueue ack if this is a reliable sequenced channel.
-            // Note that this needs to be done before we flush _messageSets.
+            // Note that this needs to be done before we remove split
+            // group data.
             //
             // Also, we want to enqueue the ack before we do the sanity
             // checks that might return from the function, because the other
@@ -634,18 +919,19 @@ private:
             // full or if this happens to be a message that doesn't complete
             // a message group.
             if (EMI_CHANNEL_TYPE_RELIABLE_SEQUENCED == channelType) {
-                EmiNonWrappingSequenceNumber sn = _messageSets.getLastSequenceNumberInSet(header.channelQualifier,
-                                                                                          _expectedSnMemo[header.channelQualifier]);
+                EmiNonWrappingSequenceNumber sn = getLastSequenceNumberInSet(channel,
+                                                                             expectedSequenceNumber(header));
                 _expectedSnMemo[header.channelQualifier] = sn;
                 _receiver.enqueueAck(header.channelQualifier, sn & EMI_HEADER_SEQUENCE_NUMBER_MASK);
             }
             
-            if (_tree.end() == iter) {
+            Slot *slot = (channel ? channel->get(firstSequenceNumberInSet) : NULL);
+            if (!slot || !slot->hasMessage) {
                 // This happens when the receiver buffer is full. Fail.
                 return;
             }
             
-            if ((*iter)->header.flags & EMI_SPLIT_NOT_FIRST_FLAG) {
+            if (slot->header.flags & EMI_SPLIT_NOT_FIRST_FLAG) {
                 // The message we found is not the first in the set.
                 // This means that the set is not complete. Fail.
                 //
@@ -657,38 +943,234 @@ private:
             
             int64_t largestProcessedMessageSet;
             
-            BufferTreeIter processEnd = processBuffer(header.channelQualifier,
-                                                      iter,
-                                                      &largestProcessedMessageSet,
-                                                      /*largestProcessedSn:*/NULL);
+            EmiNonWrappingSequenceNumber processEnd = processBuffer(header.channelQualifier,
+                                                                    *channel,
+                                                                    firstSequenceNumberInSet,
+                                                                    &largestProcessedMessageSet,
+                                                                    /*largestProcessedSn:*/NULL);
             
-            // Remove processed and older messages from _tree and _messageSets
+            // Remove processed and older messages from the buffer
             if (-1 != largestProcessedMessageSet) {
-                _messageSets.removeMessageAndOlderMessages(header.channelQualifier,
-                                                           largestProcessedMessageSet);
+                removeSetAndOlderSets(*channel, largestProcessedMessageSet);
+            }
+            removeMessagesBefore(*channel, processEnd);
+        }
+    }
+    
+    // This works with RELIABLE_UNORDERED channels. The message must
+    // not be older than expectedSn.
+    //
+    // Messages are emitted as soon as they are complete, and are then
+    // marked as delivered so that retransmitted copies of them are
+    // recognized as duplicates. When the message with the expected
+    // sequence number has been emitted, the expected sequence number
+    // moves past it and the messages after it that have been delivered
+    // too, and their marks are removed. The other host is acked up to
+    // there, and told about the messages after it with SACK blocks.
+    void processReliableUnorderedMessage(EmiNonWrappingSequenceNumber expectedSn,
+                                         EmiNonWrappingSequenceNumber guessedNonWrappedSequenceNumber,
+                                         const EmiMessageHeader& header,
+                                         const TemporaryData& data, size_t offset) {
+        EmiChannelQualifier channelQualifier = header.channelQualifier;
+        bool inOrder = false;
+        
+        if (0 == (header.flags & (EMI_SPLIT_NOT_FIRST_FLAG | EMI_SPLIT_NOT_LAST_FLAG))) {
+            if (guessedNonWrappedSequenceNumber == expectedSn) {
+                // This is purely an optimization: There is no need to
+                // mark the message as delivered, since the expected
+                // sequence number moves past it right away.
+                inOrder = true;
+            }
+            else {
+                Channel& channel(getOrCreateChannel(channelQualifier));
+                if (!channel.reserve(guessedNonWrappedSequenceNumber,
+                                     guessedNonWrappedSequenceNumber)) {
+                    // There is no room to remember that the message has
+                    // been emitted. Drop it; it will be retransmitted.
+                    return;
+                }
+                
+                Slot& slot(*channel.get(guessedNonWrappedSequenceNumber));
+                if (slot.isReceived()) {
+                    // This is a duplicate
+                    channel.trim();
+                    _receiver.enqueueSack(channelQualifier, (expectedSn-1) & EMI_HEADER_SEQUENCE_NUMBER_MASK);
+                    return;
+                }
+                
+                channel.markDelivered(guessedNonWrappedSequenceNumber,
+                                      guessedNonWrappedSequenceNumber,
+                                      EmiReceiverBuffer::bufferEntrySize);
             }
             
-            Entry mockEntry2;
-            mockEntry2.guessedNonWrappedSequenceNumber = 0;
-            mockEntry2.header.channelQualifier = header.channelQualifier;
-            BufferTreeIter removeFrom = _tree.lower_bound(&mockEntry2);
+            _receiver.emitMessage(channelQualifier, data, offset, header.length);
+        }
+        else {
+            bufferMessage(guessedNonWrappedSequenceNumber,
+                          header, data, offset, header.length);
+            
+            Channel *channel = getChannel(channelQualifier);
+            Slot *root = (channel ? findSet(*channel, guessedNonWrappedSequenceNumber, /*createIfMissing:*/false, NULL) : NULL);
             
-            remove(removeFrom, processEnd);
+            if (root &&
+                (root->flags & SPLIT_GROUP_HAS_FIRST_MESSAGE) &&
+                (root->flags & SPLIT_GROUP_HAS_LAST_MESSAGE)) {
+                // The message that this part belongs to is complete
+                EmiNonWrappingSequenceNumber first = root->firstMessage;
+                EmiNonWrappingSequenceNumber last  = root->lastMessage;
+                
+                uint8_t *mergedDataBuf;
+                TemporaryData mergedData = Binding::makeTemporaryData(root->size, &mergedDataBuf);
+                
+                processMessageSetData(*channel,
+                                      first,
+                                      last,
+                                      /*buf:*/mergedDataBuf,
+                                      /*bufSize:*/Binding::extractLength(mergedData));
+                
+                _bufferSize -= channel->markDelivered(first, last, EmiReceiverBuffer::bufferEntrySize);
+                
+                _receiver.emitMessage(channelQualifier,
+                                      mergedData,
+                                      /*offset:*/0,
+                                      Binding::extractLength(mergedData));
+            }
+        }
+        
+        // The connection might have been closed when invoking emitMessage
+        if (_receiver.isClosed()) {
+            return;
+        }
+        
+        Channel *channel = getChannel(channelQualifier);
+        EmiNonWrappingSequenceNumber newExpectedSn = (inOrder ? expectedSn+1 : expectedSn);
+        if (channel) {
+            newExpectedSn = channel->removeDeliveredFrom(newExpectedSn);
+        }
+        _expectedSnMemo[channelQualifier] = newExpectedSn;
+        
+        EmiSequenceNumber ack = (newExpectedSn-1) & EMI_HEADER_SEQUENCE_NUMBER_MASK;
+        if (channel && !channel->empty()) {
+            // There are messages after a hole
+            _receiver.enqueueSack(channelQualifier, ack);
+        }
+        else {
+            _receiver.enqueueAck(channelQualifier, ack);
         }
     }
     
+    // Rebuilds the part of a split message that is missing from the
+    // FEC group of a parity message, if exactly one is missing. When
+    // none is missing, the parts have either been emitted already or
+    // are still buffered, and when more than one is missing, there is
+    // nothing that can be done. See EmiFec.
+    void processParityMessage(EmiNonWrappingSequenceNumber guessedNonWrappedSequenceNumber,
+                              const EmiMessageHeader& header,
+                              const TemporaryData& data, size_t offset) {
+        Channel *channel = getChannel(header.channelQualifier);
+        size_t numParts;
+        if (!channel ||
+            !EmiFec::parse(Binding::extractData(data)+offset, header.length, &numParts)) {
+            return;
+        }
+        
+        EmiNonWrappingSequenceNumber missingSn = 0;
+        size_t numMissing = 0;
+        for (size_t i=0; i<numParts; i++) {
+            Slot *slot = channel->get(guessedNonWrappedSequenceNumber+i);
+            if (!slot || !slot->hasMessage) {
+                missingSn = guessedNonWrappedSequenceNumber+i;
+                numMissing++;
+            }
+        }
+        
+        if (1 != numMissing || numParts == numMissing) {
+            return;
+        }
+        
+        uint8_t *buf;
+        TemporaryData partData = Binding::makeTemporaryData(header.length, &buf);
+        memcpy(buf, Binding::extractData(data)+offset, header.length);
+        
+        for (size_t i=0; i<numParts; i++) {
+            Slot *slot = channel->get(guessedNonWrappedSequenceNumber+i);
+            if (slot && slot->hasMessage) {
+                EmiFec::addPart(buf, header.length,
+                                slot->header.flags,
+                                Binding::extractData(slot->data),
+                                slot->header.length);
+            }
+        }
+        
+        EmiMessageHeader partHeader(header);
+        partHeader.flags = EmiFec::partFlags(buf);
+        partHeader.sequenceNumber = missingSn & EMI_HEADER_SEQUENCE_NUMBER_MASK;
+        partHeader.length = EmiFec::partLength(buf);
+        
+        if (0 == partHeader.length ||
+            partHeader.length > header.length-EMI_FEC_HEADER_LENGTH ||
+            0 == partHeader.flags) {
+            // The parity message is corrupt
+            return;
+        }
+        
+        processUnorderedMessage(missingSn, partHeader, partData, EMI_FEC_HEADER_LENGTH);
+    }
+    
 public:
     
     EmiReceiverBuffer(size_t size, Receiver &receiver) :
-    _size(size), _bufferSize(0), _receiver(receiver) {}
+    _size(size), _bufferSize(0), _receiver(receiver) {
+        for (size_t i=0; i<sizeof(_channels)/sizeof(*_channels); i++) {
+            _channels[i] = NULL;
+        }
+    }
     
     virtual ~EmiReceiverBuffer() {
-        remove(_tree.begin(), _tree.end());
+        for (size_t i=0; i<sizeof(_channels)/sizeof(*_channels); i++) {
+            delete _channels[i];
+        }
         
         _size = 0;
         _bufferSize = 0;
     }
     
+    // Fills blocks with the ranges of messages that have been received
+    // on the reliable ordered or unordered channel channelQualifier,
+    // starting at the first message that has not been acknowledged. Returns the number of
+    // blocks; if there are more than maxBlocks, the oldest are returned.
+    size_t sackBlocks(EmiChannelQualifier channelQualifier, EmiSackBlock *blocks, size_t maxBlocks) {
+        Channel *channel = getChannel(channelQualifier);
+        if (!channel || 0 == maxBlocks) return 0;
+        
+        EmiNonWrappingSequenceNumber sn = std::max(expectedSequenceNumber(channelQualifier),
+                                                   channel->begin());
+        
+        size_t numBlocks = 0;
+        EmiNonWrappingSequenceNumber end = channel->end();
+        while (sn < end) {
+            if (!channel->get(sn)->isReceived()) {
+                sn++;
+                continue;
+            }
+            
+            EmiNonWrappingSequenceNumber first = sn;
+            while (sn < end && channel->get(sn)->isReceived()) {
+                sn++;
+            }
+            
+            EmiSackBlock& block(blocks[numBlocks++]);
+            block.sequenceNumber = first & EMI_HEADER_SEQUENCE_NUMBER_MASK;
+            block.length = (uint32_t) (sn-first);
+            
+            if (numBlocks == maxBlocks) {
+                break;
+            }
+        }
+        
+        return numBlocks;
+    }
+    
 #define EMI_GOT_INVALID_MESSAGE(err) do { /* NSLog(err); */ return false; } while (1)
     bool gotMessage(EmiTimeInterval now,
                     const EmiMessageHeader& header,
@@ -714,6 +1196,19 @@ public:
             }
         }
         
+        if (header.flags & EMI_FEC_FLAG) {
+            if (EMI_CHANNEL_TYPE_UNRELIABLE           != channelType &&
+                EMI_CHANNEL_TYPE_UNRELIABLE_SEQUENCED != channelType) EMI_GOT_INVALID_MESSAGE("Got parity message on reliable channel");
+            if (header.flags & ~EMI_FEC_FLAG) EMI_GOT_INVALID_MESSAGE("Got parity message with other flags");
+            
+            // A parity message has the sequence number of the first
+            // part in its group, which is usually older than expected
+            // on unreliable sequenced channels, so it must bypass the
+            // sequencing below.
+            processParityMessage(guessedNonWrappedSequenceNumber, header, data, offset);
+            return true;
+        }
+        
         if ((EMI_CHANNEL_TYPE_UNRELIABLE_SEQUENCED == channelType ||
              EMI_CHANNEL_TYPE_RELIABLE_SEQUENCED   == channelType) &&
             -1 != header.sequenceNumber) {
@@ -772,15 +1267,47 @@ public:
                                         data, offset);
             }
         }
-        else if (EMI_CHANNEL_TYPE_RELIABLE_ORDERED == channelType) {
-            if (header.flags & EMI_SACK_FLAG) EMI_GOT_INVALID_MESSAGE("SACK is not implemented");
+        else if (EMI_CHANNEL_TYPE_RELIABLE_ORDERED == channelType ||
+                 EMI_CHANNEL_TYPE_RELIABLE_UNORDERED == channelType) {
+            // Acks work the same way on reliable ordered and unordered
+            // channels
+            if (header.flags & EMI_SACK_FLAG) {
+                if (!(header.flags & EMI_ACK_FLAG)) EMI_GOT_INVALID_MESSAGE("Got SACK message without ACK flag");
+                if (0 != header.length % EMI_SACK_BLOCK_LENGTH) EMI_GOT_INVALID_MESSAGE("Got SACK message with invalid length");
+            }
             
             if (header.flags & EMI_ACK_FLAG) {
                 EmiNonWrappingSequenceNumber nonWrappedAck = _receiver.guessSequenceNumberWrapping(channelQualifier, header.ack);
+                
+                if (header.flags & EMI_SACK_FLAG) {
+                    // The blocks are relative to the ack
+                    const uint8_t *buf = Binding::extractData(data)+offset;
+                    for (size_t pos=0; pos<header.length; pos+=EMI_SACK_BLOCK_LENGTH) {
+                        EmiNonWrappingSequenceNumber first = nonWrappedAck+ntohs(*((uint16_t *)(buf+pos)));
+                        EmiNonWrappingSequenceNumber last  = first+ntohs(*((uint16_t *)(buf+pos+2)));
+                        _receiver.sackReliableMessages(channelQualifier, first, last);
+                    }
+                }
+                
                 _receiver.deregisterReliableMessages(now, channelQualifier, nonWrappedAck);
             }
             
-            if (-1 != header.sequenceNumber) {
+            if (-1 != header.sequenceNumber &&
+                EMI_CHANNEL_TYPE_RELIABLE_UNORDERED == channelType) {
+                ASSERT(0 != header.length);
+                
+                if (guessedNonWrappedSequenceNumber < expectedSn) {
+                    // This message has already been emitted. Ack it
+                    // again; the previous ack was probably lost.
+                    _receiver.enqueueAck(channelQualifier, (expectedSn-1) & EMI_HEADER_SEQUENCE_NUMBER_MASK);
+                }
+                else {
+                    processReliableUnorderedMessage(expectedSn,
+                                                    guessedNonWrappedSequenceNumber,
+                                                    header, data, offset);
+                }
+            }
+            else if (-1 != header.sequenceNumber) {
                 ASSERT(0 != header.length);
                 
                 int64_t seqDiff = (int64_t)expectedSn - (int64_t)guessedNonWrappedSequenceNumber;
@@ -817,6 +1344,14 @@ public:
                     bufferMessage(guessedNonWrappedSequenceNumber,
                                   header, data, offset, header.length);
                     flushBuffer(channelQualifier, expectedSn);
+                    
+                    if (seqDiff < 0) {
+                        // The message arrived after a hole. Tell the
+                        // other host which messages we have, so that it
+                        // only retransmits the ones that are missing.
+                        _receiver.enqueueSack(channelQualifier,
+                                              (expectedSequenceNumber(header)-1) & EMI_HEADER_SEQUENCE_NUMBER_MASK);
+                    }
                 }
             }
         }
@@ -18,6 +18,7 @@ class EmiRtoTimer {
     
     typedef typename Binding::Timer       Timer;
     typedef typename Binding::TimerCookie TimerCookie;
+    typedef void (TimerCb)(EmiTimeInterval now, Timer *timer, void *data);
     
     EmiConnTime&           _time;
     Timer                 *_rtoTimer;
@@ -28,6 +29,8 @@ class EmiRtoTimer {
     const EmiTimeInterval  _initialConnectionTimeout;
     bool                   _connectionOpen;
     bool                   _issuedConnectionWarning;
+    bool                   _gotPacket;
+    EmiTimeInterval        _lastPacketTime;
     
     Delegate& _delegate;
     
@@ -46,9 +49,39 @@ private:
         ert->updateRtoTimeout();
     }
     
+    // Receiving a packet does not reschedule _connectionTimer; that
+    // would mean one timer reschedule per received packet, which is
+    // expensive when packets arrive in large batches. Instead, gotPacket
+    // just records the time, and when _connectionTimer fires, this method
+    // checks if a packet has arrived since it was scheduled. If so, the
+    // timer is pushed forward to where it would have been, had it been
+    // rescheduled when the last packet arrived.
+    //
+    // Returns true if the timer was rescheduled, in which case the
+    // timeout should be ignored.
+    bool postponeConnectionTimer(EmiTimeInterval now, TimerCb *timerCb, EmiTimeInterval interval) {
+        if (!_gotPacket) {
+            return false;
+        }
+        
+        EmiTimeInterval remaining = _lastPacketTime + interval - now;
+        if (remaining <= 0) {
+            return false;
+        }
+        
+        Binding::scheduleTimer(_connectionTimer, timerCb, this, remaining,
+                               /*repeating:*/false, /*reschedule:*/true);
+        return true;
+    }
+    
     static void connectionTimeoutCallback(EmiTimeInterval now, Timer *timer, void *data) {
         EmiRtoTimer *ert = (EmiRtoTimer *)data;
         
+        if (!ert->_issuedConnectionWarning &&
+            ert->postponeConnectionTimer(now, connectionTimeoutCallback, ert->getConnectionTimeout())) {
+            return;
+        }
+        
         ert->_delegate.connectionTimeout();
     }
     
@@ -59,6 +92,10 @@ private:
     static void connectionWarningCallback(EmiTimeInterval now, Timer *timer, void *data) {
         EmiRtoTimer *ert = (EmiRtoTimer *)data;
         
+        if (ert->postponeConnectionTimer(now, connectionWarningCallback, ert->_timeBeforeConnectionWarning)) {
+            return;
+        }
+        
         ert->_issuedConnectionWarning = true;
         Binding::scheduleTimer(ert->_connectionTimer, connectionTimeoutCallback, ert,
                                ert->getConnectionTimeout() - ert->_timeBeforeConnectionWarning,
@@ -106,6 +143,8 @@ public:
     _initialConnectionTimeout(initialConnectionTimeout),
     _connectionOpen(false),
     _issuedConnectionWarning(false),
+    _gotPacket(false),
+    _lastPacketTime(0),
     _delegate(delegate) {
         resetConnectionTimeout();
     }
@@ -142,8 +181,17 @@ public:
         }
     }
     
-    inline void gotPacket() {
-        resetConnectionTimeout();
+    inline void gotPacket(EmiTimeInterval now) {
+        _gotPacket = true;
+        _lastPacketTime = now;
+        
+        // The connection timer is normally postponed lazily (see
+        // postponeConnectionTimer), but if a connection warning has
+        // been issued, the delegate must be told immediately that the
+        // connection is regained.
+        if (_issuedConnectionWarning) {
+            resetConnectionTimeout();
+        }
     }
     
     inline void connectionOpened() {
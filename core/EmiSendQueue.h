@@ -13,7 +13,9 @@
 #include "EmiNetUtil.h"
 #include "EmiNetRandom.h"
 #include "EmiPacketHeader.h"
+#include "EmiPacketBuilder.h"
 #include "EmiCongestionControl.h"
+#include "EmiSendScheduler.h"
 
 #include <arpa/inet.h>
 #include <deque>
@@ -25,6 +27,13 @@
 
 class EmiConnTime;
 
+// A reliable message that has been sent, as remembered by EmiSendQueue
+struct EmiSentMessage {
+    EmiPacketSequenceNumber      packetSequenceNumber;
+    int32_t                      channelQualifier;
+    EmiNonWrappingSequenceNumber sequenceNumber;
+};
+
 template<class SockDelegate, class ConnDelegate>
 class EmiConn;
 
@@ -40,6 +49,8 @@ class EmiSendQueue {
     typedef std::map<EmiChannelQualifier, EmiSequenceNumber> SendQueueAcksMap;
     typedef typename SendQueueAcksMap::iterator SendQueueAcksMapIter;
     typedef std::set<EmiChannelQualifier> SendQueueAcksSet;
+    typedef std::map<EmiChannelQualifier, std::vector<EM *> > SendQueueLastMessagesMap;
+    typedef typename SendQueueLastMessagesMap::iterator SendQueueLastMessagesMapIter;
     typedef EmiConn<SockDelegate, ConnDelegate> EC;
     
     // The purpose of BytesSentTheLastNTicks is to increase the
@@ -107,186 +118,46 @@ class EmiSendQueue {
         }
     };
     
-    // The purpose of this class is to encapsulate the memory management
-    // and priority aspects of the queue.
-    class SendQueue {
-    private:
-        // Private copy constructor and assignment operator
-        inline SendQueue(const SendQueue& other);
-        inline SendQueue& operator=(const SendQueue& other);
-        
-        typedef std::deque<EM *> SendQueueDeque;
-        typedef typename SendQueueDeque::iterator SendQueueDequeIter;
-        
-        SendQueueDeque _queues[EMI_NUMBER_OF_PRIORITIES];
-        size_t _queueSize;
-        
-    public:
-        
-        class iterator {
-            friend class SendQueue;
-            
-            SendQueue& _queue;
-            
-            uint32_t _prioIndices[EMI_NUMBER_OF_PRIORITIES];
-            
-            int currentPriority() const {
-                int possibleResult = -1;
-                
-                for (int i=0; i<EMI_NUMBER_OF_PRIORITIES; i++) {
-                    if (_prioIndices[i] >= _queue._queues[i].size()) {
-                        // There are no more messages with this priority
-                        continue;
-                    }
-                    
-                    if (i < EMI_NUMBER_OF_PRIORITIES-1 &&
-                        _prioIndices[i] > _prioIndices[i+1]*2+1) {
-                        // We have sent more than twice as many messages of
-                        // this priority compared to the next (lower) priority.
-                        //
-                        // It is time to let lower priority messages go through.
-                        
-                        // If we find no messages in lower priorities, we need
-                        // to pick this priority.
-                        possibleResult = i;
-                        
-                        continue;
-                    }
-                    
-                    return i;
-                }
-                
-                return possibleResult;
-            }
-            
-            void increment() {
-                int cp = currentPriority();
-                ASSERT(-1 != cp);
-                _prioIndices[cp] += 1;
-            }
-            
-        public:
-            
-            iterator(SendQueue& queue) : _queue(queue) {
-                std::fill(_prioIndices, _prioIndices+EMI_NUMBER_OF_PRIORITIES, 0);
-            }
-            
-            const EM* operator*() const {
-                int cp = currentPriority();
-                ASSERT(-1 != cp);
-                return _queue._queues[cp][_prioIndices[cp]];
-            }
-            
-            EM* operator*() {
-                int cp = currentPriority();
-                ASSERT(-1 != cp);
-                return _queue._queues[cp][_prioIndices[cp]];
-            }
-            
-            iterator& operator++() { // Prefix
-                increment();
-                
-                return *this;
-            }
-            
-            iterator operator++(int) { // Postfix
-                iterator copy(*this);
-                
-                increment();
-                
-                return copy;
-            }
-            
-            bool isAtEnd() const {
-                return -1 == currentPriority();
-            }
-        };
-        
-        SendQueue() : _queueSize(0) {}
-        
-        void eraseUntil(const iterator& iter) {
-            for (int i=0; i<EMI_NUMBER_OF_PRIORITIES; i++) {
-                SendQueueDeque &queue(_queues[i]);
-                
-                SendQueueDequeIter dequeIter = queue.begin();
-                for (int j=0; j<iter._prioIndices[i]; j++) {
-                    EM *msg = *dequeIter;
-                    
-                    _queueSize -= msg->approximateSize();
-                    msg->release();
-                    ++dequeIter;
-                }
-                
-                // Optimize for common special case
-                if (queue.end() == dequeIter) {
-                    queue.clear();
-                }
-                else {
-                    queue.erase(queue.begin(), dequeIter);
-                }
-            }
-        }
-        
-        iterator begin() {
-            return iterator(*this);
-        }
-        
-        void clear() {
-            for (int i=0; i<EMI_NUMBER_OF_PRIORITIES; i++) {
-                SendQueueDeque &queue(_queues[i]);
-                
-                SendQueueDequeIter iter = queue.begin();
-                SendQueueDequeIter end  = queue.end();
-                while (iter != end) {
-                    EM *msg = *iter;
-                    msg->release();
-                    ++iter;
-                }
-                
-                queue.clear();
-            }
-            
-            _queueSize = 0;
-        }
-        
-        size_t sizeInBytes() const {
-            return _queueSize;
-        }
-        
-        bool empty() const {
-            return 0 == _queueSize;
-        }
-        
-        void push(EM *msg) {
-            size_t msgSize = msg->approximateSize();
-            ASSERT(0 != msgSize); // The empty method requires this
-            ASSERT(msg->priority >= 0 && msg->priority < EMI_NUMBER_OF_PRIORITIES);
-            
-            msg->retain();
-            _queues[msg->priority].push_back(msg);
-            _queueSize += msgSize;
-        }
-    };
-    
-    typedef typename SendQueue::iterator SendQueueIter;
-    
     EC& _conn;
     
     EmiPacketSequenceNumber _packetSequenceNumber;
     EmiPacketSequenceNumber _rttResponseSequenceNumber;
     EmiTimeInterval _rttResponseRegisterTime;
-    SendQueue _queue;
+    EmiSendScheduler<Binding> _queue;
     SendQueueAcksMap _acks;
+    // The channels whose acks should carry SACK blocks
+    SendQueueAcksSet _sacks;
     // This set is intended to ensure that only one ack is sent per channel per tick
     SendQueueAcksSet _acksSentInThisTick;
+    // _bufLength is the current path MTU of the connection, and
+    // _maxBufLength is the largest MTU that it can grow to.
     size_t _bufLength;
-    uint8_t *_buf;
-    // _otherBuf is a pointer into _buf, and should not be freed. Its length is _bufLength
-    uint8_t *_otherBuf;
+    size_t _maxBufLength;
+    // _packet and _otherPacket refer to the data of the messages that
+    // they contain; they must be sent before those messages are released.
+    EmiPacketBuilder _packet;
+    // _otherPacket is used for the second packet of packet pairs
+    EmiPacketBuilder _otherPacket;
+    // The messages that have been removed from _queue and put in
+    // _packet or _otherPacket. They are released when the packets
+    // have been sent.
+    std::vector<EM *> _sentMessages;
     bool _enqueueHeartbeat;
     bool _enqueuePacketAck; // This helps to make sure that we only send one packet ACK per tick
-    EmiPacketSequenceNumber _enqueuedNak;
+    // The ranges of lost packets to report in the next packet
+    EmiNakRange _enqueuedNaks[EMI_MAX_NAK_RANGES];
+    size_t      _numEnqueuedNaks;
     BytesSentTheLastNTicks<100> _bytesSentCounter;
+    // The most recently sent reliable messages, in the order that they
+    // were sent, which is also the order of their packet sequence
+    // numbers. This is a ring buffer; the oldest messages are forgotten
+    // when it is full.
+    EmiSentMessage _sentMessageIndex[EMI_SENT_MESSAGE_INDEX_SIZE];
+    size_t         _sentMessageIndexBegin;
+    size_t         _sentMessageIndexCount;
+    // The most recently enqueued message on each conflated channel,
+    // as its parts and parity messages. See dropUnsentMessage.
+    SendQueueLastMessagesMap _lastMessages;
     
 private:
     // Private copy constructor and assignment operator
@@ -297,18 +168,63 @@ private:
         _packetSequenceNumber = (_packetSequenceNumber+1) & EMI_PACKET_SEQUENCE_NUMBER_MASK;
     }
     
+    inline const EmiSentMessage& sentMessageAt(size_t idx) const {
+        return _sentMessageIndex[(_sentMessageIndexBegin+idx) % EMI_SENT_MESSAGE_INDEX_SIZE];
+    }
+    
+    void addToSentMessageIndex(EmiPacketSequenceNumber packetSequenceNumber, const EM *msg) {
+        EmiChannelType channelType = EMI_CHANNEL_QUALIFIER_TYPE(msg->channelQualifier);
+        if (EMI_CHANNEL_TYPE_RELIABLE_ORDERED   != channelType &&
+            EMI_CHANNEL_TYPE_RELIABLE_SEQUENCED != channelType &&
+            EMI_CHANNEL_TYPE_RELIABLE_UNORDERED != channelType) {
+            return;
+        }
+        
+        if (EMI_SENT_MESSAGE_INDEX_SIZE == _sentMessageIndexCount) {
+            _sentMessageIndexBegin = (_sentMessageIndexBegin+1) % EMI_SENT_MESSAGE_INDEX_SIZE;
+            _sentMessageIndexCount--;
+        }
+        
+        EmiSentMessage& entry(_sentMessageIndex[(_sentMessageIndexBegin+_sentMessageIndexCount) % EMI_SENT_MESSAGE_INDEX_SIZE]);
+        entry.packetSequenceNumber = packetSequenceNumber;
+        entry.channelQualifier = msg->channelQualifier;
+        entry.sequenceNumber = msg->nonWrappingSequenceNumber;
+        _sentMessageIndexCount++;
+    }
+    
+    // The other host takes every packet with a sequence number that is
+    // a multiple of EMI_PACKET_PAIR_INTERVAL, and the packet after it,
+    // as a packet pair if they have the same size, no matter how they
+    // were sent. (See EmiLinkCapacity)
+    static bool isPacketPairPacket(EmiPacketSequenceNumber sequenceNumber) {
+        return (sequenceNumber % EMI_PACKET_PAIR_INTERVAL) <= 1;
+    }
+    
     void sendDatagram(ECC& congestionControl,
+                      EmiTimeInterval now,
+                      EmiPacketSequenceNumber sequenceNumber,
                       const uint8_t *buf, size_t bufSize) {
-        congestionControl.onDataSent(_packetSequenceNumber, bufSize);
+        congestionControl.onDataSent(now, sequenceNumber, bufSize);
         
-        _conn.sendDatagram(buf, bufSize);
+        _conn.sendDatagram(buf, bufSize, isPacketPairPacket(sequenceNumber));
         
         _bytesSentCounter.sendData(bufSize);
     }
     
-    void sendMessageInSeparatePacket(ECC& congestionControl, const EM *msg) {
-        const uint8_t *data = Binding::extractData(msg->data);
-        size_t dataLen = Binding::extractLength(msg->data);
+    void sendDatagram(ECC& congestionControl,
+                      EmiTimeInterval now,
+                      EmiPacketSequenceNumber sequenceNumber,
+                      const EmiPacketBuilder& packet) {
+        congestionControl.onDataSent(now, sequenceNumber, packet.size());
+        
+        _conn.sendDatagram(packet.iov(), packet.iovCount(), isPacketPairPacket(sequenceNumber));
+        
+        _bytesSentCounter.sendData(packet.size());
+    }
+    
+    void sendMessageInSeparatePacket(ECC& congestionControl, EmiTimeInterval now, const EM *msg) {
+        const uint8_t *data = msg->getData();
+        size_t dataLen = msg->getDataLength();
         
         uint8_t packetBuf[128];
         size_t size = EM::writeControlPacketWithData(msg->flags,
@@ -320,7 +236,40 @@ private:
         ASSERT(0 != size); // size == 0 when the buffer was too small
         
         // Actually send the packet
-        sendDatagram(congestionControl, packetBuf, size);
+        sendDatagram(congestionControl, now, _packetSequenceNumber, packetBuf, size);
+    }
+    
+    static void releaseMessages(std::vector<EM *>& messages) {
+        typename std::vector<EM *>::iterator iter = messages.begin();
+        typename std::vector<EM *>::iterator end  = messages.end();
+        while (iter != end) {
+            (*iter)->release();
+            ++iter;
+        }
+        
+        messages.clear();
+    }
+    
+    void rememberLastMessage(EM *msg) {
+        std::vector<EM *>& parts(_lastMessages[msg->channelQualifier]);
+        if (!(msg->flags & (EMI_SPLIT_NOT_FIRST_FLAG | EMI_FEC_FLAG))) {
+            // This is the first part of a new message
+            releaseMessages(parts);
+        }
+        
+        msg->retain();
+        parts.push_back(msg);
+    }
+    
+    void releaseSentMessages() {
+        typename std::vector<EM *>::iterator iter = _sentMessages.begin();
+        typename std::vector<EM *>::iterator end  = _sentMessages.end();
+        while (iter != end) {
+            (*iter)->release();
+            ++iter;
+        }
+        
+        _sentMessages.clear();
     }
     
     void fillPacketHeaderData(EmiTimeInterval now,
@@ -340,9 +289,13 @@ private:
             }
         }
         
-        if (-1 != _enqueuedNak) {
+        // The NAK is only removed once a packet that carries it has
+        // been written, since the header might be thrown away.
+        if (0 != _numEnqueuedNaks) {
             packetHeader.flags |= EMI_NAK_PACKET_FLAG;
-            packetHeader.nak = _enqueuedNak;
+            packetHeader.nak = _enqueuedNaks[0].sequenceNumber;
+            std::copy(_enqueuedNaks, _enqueuedNaks+_numEnqueuedNaks, packetHeader.nakRanges);
+            packetHeader.numNakRanges = _numEnqueuedNaks;
         }
         
         // Note that we only send RTT requests if a packet would be sent anyways.
@@ -381,15 +334,21 @@ private:
         }
     }
     
-    // Returns the size of the packet that was written to buf.
+    // Assembles a packet in packet. Returns the size of the packet.
+    //
+    // The size of each message is computed before it is written, so
+    // nothing is written for messages that don't fit in the packet.
+    // Message payloads are not copied; packet refers to them.
     //
     // If fillPacket fails, it returns 0
-    size_t fillPacket(uint8_t *buf,
+    size_t fillPacket(EmiPacketBuilder& packet,
                       size_t bufLength,
                       ECC& congestionControl,
                       EmiConnTime& connTime,
                       EmiTimeInterval now,
                       bool ignoreCongestionControl = false) {
+        packet.clear();
+        
         if (_queue.empty() && _acks.empty()) {
             return 0;
         }
@@ -400,77 +359,100 @@ private:
             allowedSize = bufLength;
         }
         else {
-            // The std::min(..., bufLength) is there to ensure that
-            // we don't attempt to send more data than what fills
-            // in a packet.
-            //
             // The std::max(bufLength, ...) is there to ensure that
             // we are allowed to send at least one full packet every
             // _bytesSentCounter.N() ticks, regardless of what the
             // congestion control algorithm says.
-            allowedSize = std::min((std::max(bufLength,
-                                             _bytesSentCounter.N()*congestionControl.tickAllowance()) -
-                                    _bytesSentCounter.bytesSent()),
-                                   bufLength);
+            //
+            // A packet may be sent as long as less than the allowance
+            // has been sent, so the allowance can be exceeded by at
+            // most one packet. Packet pairs and heartbeats are sent
+            // without asking, so more than the allowance may have been
+            // sent; then no data is sent until it has been used up.
+            size_t allowance = std::max(bufLength,
+                                        _bytesSentCounter.N()*congestionControl.tickAllowance());
+            allowedSize = (_bytesSentCounter.bytesSent() < allowance ? bufLength : 0);
+            
+            if (0 == allowedSize && _acks.empty()) {
+                // Nothing can be sent. Return before the packet header
+                // is filled, since that consumes the packet ack and
+                // the RTT response.
+                return 0;
+            }
         }
         
         EmiPacketHeader packetHeader;
         fillPacketHeaderData(now, congestionControl, connTime, packetHeader);
+        uint8_t packetHeaderBuf[EMI_PACKET_HEADER_MAX_LENGTH];
         size_t packetHeaderLength;
-        if (!EmiPacketHeader::write(buf, bufLength, packetHeader, &packetHeaderLength)) {
+        if (!EmiPacketHeader::write(packetHeaderBuf, sizeof(packetHeaderBuf), packetHeader, &packetHeaderLength) ||
+            packetHeaderLength > bufLength) {
             return 0;
         }
+        memcpy(packet.appendScratch(packetHeaderLength), packetHeaderBuf, packetHeaderLength);
         
         size_t pos = packetHeaderLength;
         
         /// Send the enqueued messages
         SendQueueAcksMapIter noAck = _acks.end();
-        SendQueueIter        iter  = _queue.begin(); // Note: iter is used below this loop
-        while (!iter.isAtEnd()) {
-            EM *msg = *iter;
-            // We need to increment iter here, because we might break
-            // out of the loop early, and there is code later on that
-            // relies on iter being after the last message that was
-            // saved to the packet to be sent.
-            ++iter;
+        EM *msg;
+        while (NULL != (msg = _queue.front(now))) {
             
             SendQueueAcksMapIter curAck;
             if (0 != _acksSentInThisTick.count(msg->channelQualifier)) {
                 // Only send an ack for a particular channel once per packet
                 curAck = noAck;
             }
+            else if (0 != _sacks.count(msg->channelQualifier)) {
+                // SACK blocks can't be piggybacked on a message with
+                // data; they are sent in an ack message of their own.
+                curAck = noAck;
+            }
             else {
                 curAck = _acks.find(msg->channelQualifier);
             }
             
             bool hasAck = curAck != noAck;
             
-            size_t msgSize = EM::writeMsg(buf, /* buf */
-                                          bufLength, /* bufSize */
-                                          pos, /* offset */
-                                          hasAck, /* hasAck */
-                                          hasAck && (*curAck).second, /* ack */
-                                          msg->channelQualifier,
-                                          msg->nonWrappingSequenceNumber & EMI_HEADER_SEQUENCE_NUMBER_MASK,
-                                          Binding::extractData(msg->data),
-                                          Binding::extractLength(msg->data),
-                                          msg->flags);
+            size_t dataLength = msg->getDataLength();
+            size_t headerSize = EM::msgHeaderSize(hasAck, dataLength, msg->flags);
+            size_t msgSize = headerSize+dataLength;
+            
+            bool fits = (pos+msgSize < bufLength && pos+msgSize <= allowedSize);
+            if (!fits &&
+                packetHeaderLength == pos &&
+                bufLength == allowedSize &&
+                pos+msgSize < _maxBufLength) {
+                // The message was split when the MTU was larger than
+                // it is now. It can't be split again, so send it in
+                // a packet of its own. This only happens to unreliable
+                // messages; reliable ones are split to fit packets of
+                // EMI_MINIMAL_MTU (see EmiConn::maxReliableMessageLength).
+                fits = true;
+            }
             
-            // msgSize is 0 if the message did not fit in the buffer
-            if (0 == msgSize || pos+msgSize > allowedSize) {
+            if (!fits) {
                 // The message got too big.
                 break;
             }
             
-            // Do the actual side effects to save the packet data.
-            //
-            // We need to do this after the potential break above.
-            //
-            // Up until now, this loop iteration did not perform
-            // any side effects: saving the message to the buffer
-            // does not count since we did not actually increment
-            // pos. Code below will assume that that data is undefined
-            // garbage unless we increment pos.
+            // Now that we know that the message fits, do the side
+            // effects. The message is removed from the queue here and
+            // not before the break above, so that it is the next one
+            // to be sent if it didn't fit.
+            _sentMessages.push_back(_queue.pop());
+            
+            EM::writeMsgHeader(packet.appendScratch(headerSize),
+                               hasAck, /* hasAck */
+                               hasAck && (*curAck).second, /* ack */
+                               msg->channelQualifier,
+                               msg->nonWrappingSequenceNumber & EMI_HEADER_SEQUENCE_NUMBER_MASK,
+                               dataLength,
+                               msg->flags);
+            packet.appendData(msg->getData(), dataLength);
+            addToSentMessageIndex(packetHeader.sequenceNumber, msg);
+            _conn.messageWasSent(now, msg);
+            
             pos += msgSize;
             _acksSentInThisTick.insert(msg->channelQualifier);
             _acks.erase(msg->channelQualifier);
@@ -487,18 +469,21 @@ private:
             if (0 == _acksSentInThisTick.count(cq)) {
                 EmiSequenceNumber sn = (*ackIter).second;
                 
-                size_t msgSize = EM::writeMsg(buf, /* buf */
-                                              bufLength, /* bufSize */
-                                              pos, /* offset */
-                                              true, /* hasAck */
-                                              sn, /* ack */
-                                              cq, /* channelQualifier */
-                                              0, /* sequenceNumber */
-                                              NULL, /* data */
-                                              0, /* dataLength */
-                                              0 /* flags */);
+                uint8_t sackBuf[EMI_MAX_SACK_BLOCKS*EMI_SACK_BLOCK_LENGTH];
+                size_t sackLength = 0;
+                if (0 != _sacks.count(cq)) {
+                    EmiSackBlock blocks[EMI_MAX_SACK_BLOCKS];
+                    size_t numBlocks = _conn.sackBlocks(cq, blocks, EMI_MAX_SACK_BLOCKS);
+                    sackLength = EM::writeSackBlocks(sackBuf, sn, blocks, numBlocks);
+                }
+                EmiMessageFlags flags = (sackLength ? EMI_SACK_FLAG : 0);
+                
+                size_t headerSize = EM::msgHeaderSize(/*hasAck:*/true, sackLength, flags);
+                size_t msgSize = headerSize+sackLength;
                 
-                if (pos+msgSize > allowedSize) {
+                // Acks are not congestion controlled, since the other
+                // host's congestion control depends on them.
+                if (pos+msgSize >= bufLength) {
                     // The message got too big.
                     break;
                 }
@@ -506,6 +491,16 @@ private:
                 // Do the actual side effects. Like the previous loop,
                 // we need to do all lasting side effects after the
                 // potential break above.
+                uint8_t *buf = packet.appendScratch(msgSize);
+                EM::writeMsgHeader(buf,
+                                   true, /* hasAck */
+                                   sn, /* ack */
+                                   cq, /* channelQualifier */
+                                   0, /* sequenceNumber */
+                                   sackLength, /* dataLength */
+                                   flags);
+                memcpy(buf+headerSize, sackBuf, sackLength);
+                
                 pos += msgSize;
                 _acksSentInThisTick.insert(cq);
                 // We can't _acks.erase(cq), because that invalidates ackIter
@@ -521,14 +516,16 @@ private:
             while (iter != end) {
                 EmiChannelQualifier cq = *iter;
                 _acks.erase(cq);
+                _sacks.erase(cq);
                 ++iter;
             }
         }
         
         if (packetHeaderLength != pos) {
-            ASSERT(pos <= bufLength);
+            ASSERT(pos <= _maxBufLength);
+            ASSERT(pos == packet.size());
             
-            _queue.eraseUntil(iter);
+            _numEnqueuedNaks = 0;
             
             // Return non-zero to signify that a packet was written
             return pos;
@@ -543,13 +540,14 @@ private:
     bool flush(ECC& congestionControl,
                EmiConnTime& connTime,
                EmiTimeInterval now) {
-        size_t packetSize = fillPacket(_buf, _bufLength, congestionControl, connTime, now);
+        size_t packetSize = fillPacket(_packet, _bufLength, congestionControl, connTime, now);
         
         if (0 == packetSize) {
             return false;
         }
         else {
-            sendDatagram(congestionControl, _buf, packetSize);
+            sendDatagram(congestionControl, now, _packetSequenceNumber, _packet);
+            releaseSentMessages();
             incrementSequenceNumber();
             
             return true;
@@ -558,37 +556,86 @@ private:
     
 public:
     
-    EmiSendQueue(EC& conn, size_t mtu) :
+    EmiSendQueue(EC& conn, size_t mtu, size_t maxMtu) :
     _conn(conn),
     _packetSequenceNumber(EmiNetRandom<Binding>::random() & EMI_PACKET_SEQUENCE_NUMBER_MASK),
     _rttResponseSequenceNumber(-1),
     _rttResponseRegisterTime(0),
+    _bufLength(mtu),
+    _maxBufLength(maxMtu),
+    _packet(maxMtu),
+    _otherPacket(maxMtu),
+    _sentMessages(),
     _enqueueHeartbeat(false),
     _enqueuePacketAck(false),
-    _enqueuedNak(-1),
-    _bytesSentCounter() {
-        _bufLength = mtu;
-        _buf = (uint8_t *)malloc(_bufLength*2);
-        _otherBuf = _buf+_bufLength;
-    }
+    _numEnqueuedNaks(0),
+    _bytesSentCounter(),
+    _sentMessageIndexBegin(0),
+    _sentMessageIndexCount(0),
+    _lastMessages() {}
     virtual ~EmiSendQueue() {
         _queue.clear();
+        releaseSentMessages();
         
-        _enqueueHeartbeat = false;
-        
-        if (NULL != _buf) {
-            _bufLength = 0;
-            free(_buf);
-            _buf = NULL;
+        SendQueueLastMessagesMapIter iter = _lastMessages.begin();
+        SendQueueLastMessagesMapIter end  = _lastMessages.end();
+        while (iter != end) {
+            releaseMessages((*iter).second);
+            ++iter;
         }
+        
+        _enqueueHeartbeat = false;
     }
     
     void enqueueHeartbeat() {
         _enqueueHeartbeat = true;
     }
     
-    void enqueueNak(EmiPacketSequenceNumber nak) {
-        _enqueuedNak = nak;
+    // Adds ranges of lost packets to the NAK of the next packet. If
+    // there are more than fit in a packet, the oldest are dropped.
+    void enqueueNak(const EmiNakRange *naks, size_t numNaks) {
+        for (size_t i=0; i<numNaks; i++) {
+            if (EMI_MAX_NAK_RANGES == _numEnqueuedNaks) {
+                std::copy(_enqueuedNaks+1, _enqueuedNaks+_numEnqueuedNaks, _enqueuedNaks);
+                _numEnqueuedNaks--;
+            }
+            _enqueuedNaks[_numEnqueuedNaks++] = naks[i];
+        }
+    }
+    
+    inline void setMtu(size_t mtu) {
+        ASSERT(mtu <= _maxBufLength);
+        _bufLength = mtu;
+    }
+    
+    // Sends a path MTU probe packet of size bytes. The packet consists
+    // of a packet header with an RTT request, padded with filler bytes.
+    //
+    // Like control messages, probes are not congestion controlled. They
+    // are sent at most once per RTO.
+    //
+    // Returns the sequence number of the probe packet.
+    EmiPacketSequenceNumber sendMtuProbe(ECC& congestionControl, EmiTimeInterval now, size_t size) {
+        ASSERT(size <= _maxBufLength);
+        
+        EmiPacketHeader ph;
+        ph.flags = EMI_SEQUENCE_NUMBER_PACKET_FLAG | EMI_RTT_REQUEST_PACKET_FLAG;
+        ph.sequenceNumber = _packetSequenceNumber;
+        
+        uint8_t buf[EMI_PACKET_HEADER_MAX_LENGTH];
+        size_t packetLength;
+        EmiPacketHeader::write(buf, sizeof(buf), ph, &packetLength);
+        ASSERT(packetLength < size);
+        
+        _packet.clear();
+        memcpy(_packet.appendScratch(packetLength), buf, packetLength);
+        _packet.addFillerBytes(size-packetLength);
+        
+        EmiPacketSequenceNumber sequenceNumber = _packetSequenceNumber;
+        sendDatagram(congestionControl, now, sequenceNumber, _packet);
+        incrementSequenceNumber();
+        
+        return sequenceNumber;
     }
     
     // Returns the number of bytes sent
@@ -598,18 +645,29 @@ public:
         EmiPacketHeader ph;
         fillPacketHeaderData(now, congestionControl, connTime, ph);
         
-        uint8_t buf[32];
+        uint8_t buf[EMI_PACKET_HEADER_MAX_LENGTH];
         size_t packetLength;
         EmiPacketHeader::write(buf, sizeof(buf), ph, &packetLength);
         
         if (_conn.isOpen()) {
-            sendDatagram(congestionControl, buf, packetLength);
+            sendDatagram(congestionControl, now, _packetSequenceNumber, buf, packetLength);
             incrementSequenceNumber();
+            _numEnqueuedNaks = 0;
         }
         
         return packetLength;
     }
     
+    // Returns true if the send queue has to be ticked again, either
+    // because it has messages that congestion control holds back or
+    // because some of the bytes sent the last N ticks still count
+    // against the allowance. The tick timer is not otherwise
+    // rescheduled when nothing happens, and without the ticks the
+    // allowance would never open up again.
+    inline bool needsTick() const {
+        return !_queue.empty() || 0 != _bytesSentCounter.bytesSent();
+    }
+    
     // Returns true if something has been sent since the last tick
     bool tick(ECC& congestionControl,
               EmiConnTime& connTime,
@@ -626,7 +684,8 @@ public:
             if (0 == (_packetSequenceNumber % EMI_PACKET_PAIR_INTERVAL)) {
                 /// Send a packet pair, for link capacity estimation
                 
-                size_t firstPacketSize = fillPacket(_buf, _bufLength,
+                EmiPacketSequenceNumber firstPacketSequenceNumber = _packetSequenceNumber;
+                size_t firstPacketSize = fillPacket(_packet, _bufLength,
                                                     congestionControl, connTime,
                                                     now);
                 
@@ -643,7 +702,7 @@ public:
                 // For the second packet in the packet pair, we ignore
                 // congestion control, because we really want to send
                 // out the other part of the pair if at all possible.
-                size_t secondPacketSize = fillPacket(_otherBuf, _bufLength,
+                size_t secondPacketSize = fillPacket(_otherPacket, _bufLength,
                                                      congestionControl, connTime,
                                                      now,
                                                      /*ignoreCongestionControl:*/true);
@@ -651,7 +710,7 @@ public:
                 if (0 == secondPacketSize) {
                     // There was no data to send for the second packet. Don't
                     // send a packet pair.
-                    sendDatagram(congestionControl, _buf, firstPacketSize);
+                    sendDatagram(congestionControl, now, firstPacketSequenceNumber, _packet);
                 }
                 else {
                     // Increment the sequence number, to account for the second packet
@@ -664,16 +723,17 @@ public:
                     // the two packets are of the same size. The link capacity
                     // estimation algorithm requires that.
                     if (firstPacketSize != secondPacketSize) {
-                        uint8_t *smallestPacket = (firstPacketSize < secondPacketSize ? _buf : _otherBuf);
+                        EmiPacketBuilder& smallestPacket(firstPacketSize < secondPacketSize ? _packet : _otherPacket);
                         
-                        EmiPacketHeader::addFillerBytes(smallestPacket, smallestPacketSize,
-                                                        biggestPacketSize-smallestPacketSize);
+                        smallestPacket.addFillerBytes(biggestPacketSize-smallestPacketSize);
                     }
                     
-                    sendDatagram(congestionControl, _buf,      biggestPacketSize);
-                    sendDatagram(congestionControl, _otherBuf, biggestPacketSize);
+                    sendDatagram(congestionControl, now, firstPacketSequenceNumber, _packet);
+                    sendDatagram(congestionControl, now, (firstPacketSequenceNumber+1) & EMI_PACKET_SEQUENCE_NUMBER_MASK, _otherPacket);
                 }
                 
+                releaseSentMessages();
+                
                 return true;
             }
             else {
@@ -682,7 +742,13 @@ public:
             }
         } while (packetWasSent);
         
-        if (0 == _bytesSentCounter.bytesSentSinceLastTick() && _enqueueHeartbeat) {
+        // RTT responses are sent right away even if there is nothing else
+        // to send, since path MTU probes rely on getting them. So are
+        // NAKs, since the other host waits for them to retransmit.
+        if (0 == _bytesSentCounter.bytesSentSinceLastTick() &&
+            (_enqueueHeartbeat ||
+             -1 != _rttResponseSequenceNumber ||
+             0 != _numEnqueuedNaks)) {
             // Send heartbeat
             size_t heartbeatSize = sendHeartbeat(congestionControl, connTime, now);
             _bytesSentCounter.sendData(heartbeatSize);
@@ -710,6 +776,67 @@ public:
         return !_acks.empty();
     }
     
+    // Like enqueueAck, but the ack is sent along with SACK blocks that
+    // describe the messages that the receiver buffer holds beyond it.
+    // The blocks are computed when the ack is written.
+    bool enqueueSack(EmiChannelQualifier channelQualifier, EmiSequenceNumber sequenceNumber) {
+        _sacks.insert(channelQualifier);
+        return enqueueAck(channelQualifier, sequenceNumber);
+    }
+    
+    // Appends the reliable messages that were sent in the packets of
+    // range to result, in the order they were sent. Messages that were
+    // sent too long ago to be remembered are left out.
+    void sentMessagesInPackets(const EmiNakRange& range, std::vector<EmiSentMessage>& result) const {
+        if (0 == _sentMessageIndexCount || 0 == range.length) {
+            return;
+        }
+        
+        // Packet sequence numbers wrap, so they are compared by how
+        // long before the newest packet in the index they were sent.
+        static const EmiPacketSequenceNumber HALF = (EMI_PACKET_SEQUENCE_NUMBER_MASK+1)/2;
+        EmiPacketSequenceNumber newest = sentMessageAt(_sentMessageIndexCount-1).packetSequenceNumber;
+        EmiPacketSequenceNumber last = (range.sequenceNumber+range.length-1) & EMI_PACKET_SEQUENCE_NUMBER_MASK;
+        EmiPacketSequenceNumber firstAge = (newest-range.sequenceNumber) & EMI_PACKET_SEQUENCE_NUMBER_MASK;
+        EmiPacketSequenceNumber lastAge = (newest-last) & EMI_PACKET_SEQUENCE_NUMBER_MASK;
+        
+        if (firstAge >= HALF) {
+            // The whole range is newer than the newest message
+            return;
+        }
+        if (lastAge >= HALF) {
+            lastAge = 0;
+        }
+        
+        // The ages decrease along the index. Find the first message
+        // that was sent in the range.
+        size_t low = 0;
+        size_t high = _sentMessageIndexCount;
+        while (low < high) {
+            size_t mid = low+(high-low)/2;
+            EmiPacketSequenceNumber age = (newest-sentMessageAt(mid).packetSequenceNumber) & EMI_PACKET_SEQUENCE_NUMBER_MASK;
+            if (age > firstAge) {
+                low = mid+1;
+            }
+            else {
+                high = mid;
+            }
+        }
+        
+        for (size_t idx=low; idx<_sentMessageIndexCount; idx++) {
+            const EmiSentMessage& entry(sentMessageAt(idx));
+            EmiPacketSequenceNumber age = (newest-entry.packetSequenceNumber) & EMI_PACKET_SEQUENCE_NUMBER_MASK;
+            if (age < lastAge) {
+                break;
+            }
+            result.push_back(entry);
+        }
+    }
+    
+    inline size_t expiredMessages() const {
+        return _queue.expiredMessages();
+    }
+    
     inline EmiPacketSequenceNumber lastSentSequenceNumber() const {
         return _packetSequenceNumber;
     }
@@ -719,17 +846,21 @@ public:
         _rttResponseRegisterTime = now;
     }
     
+    // retransmission is true if msg has been sent before; see
+    // EmiSendScheduler::push
     bool enqueueMessage(EM *msg,
                         ECC& congestionControl,
                         EmiConnTime& connTime,
                         EmiTimeInterval now,
-                        Error& err) {
+                        Error& err,
+                        bool retransmission = false) {
         if (msg->flags & (EMI_PRX_FLAG | EMI_RST_FLAG | EMI_SYN_FLAG)) {
             // This is a control message, one that cannot be bundled with
             // other messages. We might just as well send it right away.
             //
             // Control messages are not congestion controlled.
-            sendMessageInSeparatePacket(congestionControl, msg);
+            sendMessageInSeparatePacket(congestionControl, now, msg);
+            _conn.messageWasSent(now, msg);
         }
         else {
             size_t msgSize = msg->approximateSize();
@@ -746,11 +877,68 @@ public:
                 flush(congestionControl, connTime, now);
             }
             
-            _queue.push(msg);
+            int32_t cq = msg->channelQualifier;
+            _queue.push(msg, (EMI_CONTROL_CHANNEL == cq ?
+                              EMI_DEFAULT_CHANNEL_WEIGHT :
+                              _conn.config.channelWeights[cq]),
+                        retransmission);
+            
+            if (_conn.isConflatedChannel(cq)) {
+                rememberLastMessage(msg);
+            }
         }
         
         return true;
     }
+    
+    // Removes the messages on channelQualifier that are waiting to be
+    // sent and whose sequence numbers are not greater than
+    // nonWrappingSequenceNumber. This includes retransmissions.
+    inline void dropUnsentMessages(int32_t channelQualifier,
+                                   EmiNonWrappingSequenceNumber nonWrappingSequenceNumber) {
+        _queue.removeChannelMessages(channelQualifier, nonWrappingSequenceNumber);
+    }
+    
+    // If none of the parts of the most recently enqueued message on
+    // the conflated channel channelQualifier have been sent yet,
+    // removes the message from the queue, sets sequenceNumber to the
+    // sequence number of its first part and returns true. The message
+    // that replaces it should take over its sequence numbers, so that
+    // the other host doesn't see a gap.
+    //
+    // A message that has been partially sent is left alone; dropping
+    // the rest of it would waste the parts that were sent.
+    bool dropUnsentMessage(EmiChannelQualifier channelQualifier, EmiNonWrappingSequenceNumber& sequenceNumber) {
+        SendQueueLastMessagesMapIter lastMessage = _lastMessages.find(channelQualifier);
+        if (_lastMessages.end() == lastMessage) {
+            return false;
+        }
+        
+        std::vector<EM *>& parts((*lastMessage).second);
+        
+        bool unsent = !parts.empty();
+        typename std::vector<EM *>::iterator iter = parts.begin();
+        typename std::vector<EM *>::iterator end  = parts.end();
+        while (unsent && iter != end) {
+            unsent = _queue.contains(*iter);
+            ++iter;
+        }
+        
+        if (unsent) {
+            sequenceNumber = parts.front()->nonWrappingSequenceNumber;
+            
+            iter = parts.begin();
+            while (iter != end) {
+                _queue.remove(*iter);
+                ++iter;
+            }
+        }
+        
+        releaseMessages(parts);
+        _lastMessages.erase(lastMessage);
+        
+        return unsent;
+    }
 };
 
 #endif
@@ -0,0 +1,480 @@
+//
+//  EmiSendScheduler.h
+//  eminet
+//
+
+#ifndef eminet_EmiSendScheduler_h
+#define eminet_EmiSendScheduler_h
+
+#include "EmiTypes.h"
+#include "EmiNetUtil.h"
+#include "EmiMessage.h"
+
+#include <deque>
+#include <vector>
+#include <algorithm>
+
+// EmiSendScheduler decides in which order the messages that are
+// waiting in EmiSendQueue are sent.
+//
+// It keeps one FIFO queue of messages, a flow, per priority and
+// channel, and picks between the flows with deficit round robin: The
+// flows that have messages take turns, and in its turn, a flow may
+// send as many bytes as its quantum plus what it didn't use of its
+// previous turn. The quantum of a flow is EMI_SCHEDULER_QUANTUM times
+// the weight of its priority times the weight of its channel (see
+// EmiSockConfig::channelWeights). This means that when several flows
+// have messages, each gets a share of the bandwidth in proportion to
+// its weight, and a busy channel can't starve the others.
+//
+// EMI_PRIORITY_IMMEDIATE is a strict priority class: Its flows take
+// turns among themselves, but they are always served before the flows
+// of the other priorities.
+//
+// As long as the quantum is at least as large as the largest message,
+// each turn sends at least one message, so picking the next message
+// is O(1).
+//
+// Messages that have a deadline bypass the flows: They are sent
+// earliest deadline first, after the EMI_PRIORITY_IMMEDIATE messages
+// but before everything else. Unreliable messages that have missed
+// their deadline when it is their turn are dropped instead of sent,
+// since they would be stale by the time they arrive. Reliable messages
+// are sent regardless; they can't be dropped.
+//
+// Messages can be removed from the scheduler before they are sent
+// (see EmiSendQueue::dropUnsentMessage). A flow that is emptied that
+// way keeps its place in the round until it is its turn, so that the
+// messages that replace the removed ones aren't sent any later than
+// those would have been.
+template<class Binding>
+class EmiSendScheduler {
+    typedef EmiMessage<Binding> EM;
+    
+    struct Flow {
+        std::deque<EM *> messages;
+        size_t quantum;
+        size_t deficit;
+        bool inRound;
+        // The next flow in the round. Only meaningful when inRound
+        Flow *next;
+    };
+    
+    // The flows that have messages, in the order that they take their
+    // turns. The head is the flow whose turn it is. The round can also
+    // contain flows whose messages have been removed; they leave the
+    // round when it is their turn.
+    struct Round {
+        Flow *head;
+        Flow *tail;
+    };
+    
+    struct DeadlineEntry {
+        EM *msg;
+        // Messages with the same deadline are sent in the order that
+        // they were pushed
+        uint64_t seq;
+    };
+    
+    class DeadlineEntryCmp {
+    public:
+        // The heap functions put the largest element first, so this
+        // makes the entry with the earliest deadline the largest
+        inline bool operator()(const DeadlineEntry& a, const DeadlineEntry& b) const {
+            if (a.msg->deadline != b.msg->deadline) {
+                return a.msg->deadline > b.msg->deadline;
+            }
+            return a.seq > b.seq;
+        }
+    };
+    
+    // A heap ordered by DeadlineEntryCmp
+    typedef std::vector<DeadlineEntry> DeadlineQueue;
+    typedef typename DeadlineQueue::iterator DeadlineQueueIter;
+    
+    // The flows are indexed by priority and channel qualifier, except
+    // for the control channel, whose index is 256
+    Flow *_flows[EMI_NUMBER_OF_PRIORITIES][257];
+    Round _strictRound;
+    Round _round;
+    DeadlineQueue _deadlineQueue;
+    uint64_t _deadlineSeq;
+    size_t _queueSize;
+    size_t _expiredMessages;
+    
+private:
+    // Private copy constructor and assignment operator
+    inline EmiSendScheduler(const EmiSendScheduler& other);
+    inline EmiSendScheduler& operator=(const EmiSendScheduler& other);
+    
+    static size_t priorityWeight(EmiPriority priority) {
+        switch (priority) {
+            case EMI_PRIORITY_HIGH:   return EMI_PRIORITY_HIGH_WEIGHT;
+            case EMI_PRIORITY_MEDIUM: return EMI_PRIORITY_MEDIUM_WEIGHT;
+            case EMI_PRIORITY_LOW:    return EMI_PRIORITY_LOW_WEIGHT;
+            default:                  return 1;
+        }
+    }
+    
+    inline Round& roundForPriority(EmiPriority priority) {
+        return (EMI_PRIORITY_IMMEDIATE == priority ? _strictRound : _round);
+    }
+    
+    inline Round& currentRound() {
+        return (_strictRound.head ? _strictRound : _round);
+    }
+    
+    static inline bool hasDeadline(const EM *msg) {
+        // EMI_PRIORITY_IMMEDIATE messages are sent before messages with
+        // deadlines anyway, so their deadlines are ignored
+        return (EMI_NO_DEADLINE != msg->deadline &&
+                EMI_PRIORITY_IMMEDIATE != msg->priority);
+    }
+    
+    inline Flow *&flowForMessage(const EM *msg) {
+        int32_t cq = msg->channelQualifier;
+        return _flows[msg->priority][EMI_CONTROL_CHANNEL == cq ? 256 : cq];
+    }
+    
+    EM *popDeadlineQueue() {
+        EM *msg = _deadlineQueue.front().msg;
+        std::pop_heap(_deadlineQueue.begin(), _deadlineQueue.end(), DeadlineEntryCmp());
+        _deadlineQueue.pop_back();
+        return msg;
+    }
+    
+    DeadlineQueueIter findInDeadlineQueue(const EM *msg) {
+        DeadlineQueueIter iter = _deadlineQueue.begin();
+        DeadlineQueueIter end  = _deadlineQueue.end();
+        while (iter != end && (*iter).msg != msg) {
+            ++iter;
+        }
+        return iter;
+    }
+    
+    static bool isUnreliable(const EM *msg) {
+        if (EMI_CONTROL_CHANNEL == msg->channelQualifier) {
+            return false;
+        }
+        
+        EmiChannelType channelType = EMI_CHANNEL_QUALIFIER_TYPE(msg->channelQualifier);
+        return (EMI_CHANNEL_TYPE_UNRELIABLE == channelType ||
+                EMI_CHANNEL_TYPE_UNRELIABLE_SEQUENCED == channelType);
+    }
+    
+    void dropExpiredMessages(EmiTimeInterval now) {
+        while (!_deadlineQueue.empty()) {
+            EM *msg = _deadlineQueue.front().msg;
+            if (msg->deadline >= now || !isUnreliable(msg)) {
+                break;
+            }
+            
+            popDeadlineQueue();
+            _queueSize -= msg->approximateSize();
+            _expiredMessages++;
+            msg->release();
+        }
+    }
+    
+    // Adds flow to the end of round. If the round was empty, it is
+    // now the flow's turn.
+    static void pushFlow(Round& round, Flow *flow) {
+        flow->inRound = true;
+        flow->next = NULL;
+        if (round.tail) {
+            round.tail->next = flow;
+        }
+        else {
+            round.head = flow;
+            flow->deficit += flow->quantum;
+        }
+        round.tail = flow;
+    }
+    
+    // Removes the flow whose turn it is from round, and starts the
+    // turn of the next flow
+    static Flow *popFlow(Round& round) {
+        Flow *flow = round.head;
+        round.head = flow->next;
+        if (round.head) {
+            round.head->deficit += round.head->quantum;
+        }
+        else {
+            round.tail = NULL;
+        }
+        flow->inRound = false;
+        flow->next = NULL;
+        return flow;
+    }
+    
+    // Removes the flows whose messages have been removed from the
+    // head of round
+    static void pruneRound(Round& round) {
+        while (round.head && round.head->messages.empty()) {
+            Flow *flow = popFlow(round);
+            flow->deficit = 0;
+        }
+    }
+    
+    void clearRound(Round& round) {
+        while (round.head) {
+            Flow *flow = popFlow(round);
+            
+            typename std::deque<EM *>::iterator iter = flow->messages.begin();
+            typename std::deque<EM *>::iterator end  = flow->messages.end();
+            while (iter != end) {
+                (*iter)->release();
+                ++iter;
+            }
+            
+            flow->messages.clear();
+            flow->deficit = 0;
+        }
+    }
+    
+public:
+    
+    EmiSendScheduler() :
+    _deadlineQueue(),
+    _deadlineSeq(0),
+    _queueSize(0),
+    _expiredMessages(0) {
+        for (int i=0; i<EMI_NUMBER_OF_PRIORITIES; i++) {
+            for (int j=0; j<257; j++) {
+                _flows[i][j] = NULL;
+            }
+        }
+        
+        _strictRound.head = _strictRound.tail = NULL;
+        _round.head = _round.tail = NULL;
+    }
+    
+    virtual ~EmiSendScheduler() {
+        clear();
+        
+        for (int i=0; i<EMI_NUMBER_OF_PRIORITIES; i++) {
+            for (int j=0; j<257; j++) {
+                delete _flows[i][j];
+            }
+        }
+    }
+    
+    // Returns the message that is next in turn to be sent, or NULL if
+    // there is none. The message stays in the scheduler until pop is
+    // called, so front can be called again if the message didn't fit
+    // in the packet.
+    EM *front(EmiTimeInterval now) {
+        pruneRound(_strictRound);
+        
+        if (!_strictRound.head) {
+            dropExpiredMessages(now);
+            if (!_deadlineQueue.empty()) {
+                return _deadlineQueue.front().msg;
+            }
+        }
+        
+        pruneRound(_round);
+        
+        Round& round(currentRound());
+        if (!round.head) {
+            return NULL;
+        }
+        
+        while (round.head->deficit < round.head->messages.front()->approximateSize()) {
+            // The flow has used up its turn. Since every turn adds to
+            // the deficit, this terminates.
+            pushFlow(round, popFlow(round));
+            pruneRound(round);
+        }
+        
+        return round.head->messages.front();
+    }
+    
+    // Removes the message that front returned. The caller takes over
+    // the scheduler's reference to it.
+    EM *pop() {
+        if (!_strictRound.head && !_deadlineQueue.empty()) {
+            EM *msg = popDeadlineQueue();
+            _queueSize -= msg->approximateSize();
+            return msg;
+        }
+        
+        Round& round(currentRound());
+        Flow *flow = round.head;
+        ASSERT(flow);
+        
+        EM *msg = flow->messages.front();
+        size_t msgSize = msg->approximateSize();
+        ASSERT(flow->deficit >= msgSize);
+        
+        flow->messages.pop_front();
+        flow->deficit -= msgSize;
+        _queueSize -= msgSize;
+        
+        if (flow->messages.empty()) {
+            popFlow(round);
+            // Flows don't save up turns while they have nothing to send
+            flow->deficit = 0;
+        }
+        
+        return msg;
+    }
+    
+    // channelWeight is the weight of the message's channel.
+    //
+    // Retransmissions are put first in their flow instead of last,
+    // since the messages that the other host has already received
+    // can't be delivered (on ordered channels) or released from the
+    // sender buffer before they arrive.
+    void push(EM *msg, size_t channelWeight, bool retransmission = false) {
+        size_t msgSize = msg->approximateSize();
+        ASSERT(0 != msgSize); // The empty method requires this
+        ASSERT(msg->priority >= 0 && msg->priority < EMI_NUMBER_OF_PRIORITIES);
+        
+        if (hasDeadline(msg)) {
+            DeadlineEntry entry;
+            entry.msg = msg;
+            entry.seq = _deadlineSeq++;
+            
+            msg->retain();
+            _deadlineQueue.push_back(entry);
+            std::push_heap(_deadlineQueue.begin(), _deadlineQueue.end(), DeadlineEntryCmp());
+            _queueSize += msgSize;
+            return;
+        }
+        
+        Flow *&flow(flowForMessage(msg));
+        if (!flow) {
+            flow = new Flow;
+            flow->deficit = 0;
+            flow->inRound = false;
+            flow->next = NULL;
+        }
+        flow->quantum = (EMI_SCHEDULER_QUANTUM*
+                         priorityWeight(msg->priority)*
+                         std::max(channelWeight, (size_t)1));
+        
+        msg->retain();
+        if (retransmission) {
+            flow->messages.push_front(msg);
+        }
+        else {
+            flow->messages.push_back(msg);
+        }
+        _queueSize += msgSize;
+        
+        if (!flow->inRound) {
+            pushFlow(roundForPriority(msg->priority), flow);
+        }
+    }
+    
+    // Returns true if msg has been pushed and not yet popped
+    bool contains(const EM *msg) {
+        if (hasDeadline(msg)) {
+            return _deadlineQueue.end() != findInDeadlineQueue(msg);
+        }
+        
+        Flow *flow = flowForMessage(msg);
+        return (flow &&
+                flow->messages.end() != std::find(flow->messages.begin(), flow->messages.end(), msg));
+    }
+    
+    // Removes a message that has been pushed and not yet popped, and
+    // releases the scheduler's reference to it
+    void remove(EM *msg) {
+        if (hasDeadline(msg)) {
+            DeadlineQueueIter iter = findInDeadlineQueue(msg);
+            ASSERT(_deadlineQueue.end() != iter);
+            _deadlineQueue.erase(iter);
+            std::make_heap(_deadlineQueue.begin(), _deadlineQueue.end(), DeadlineEntryCmp());
+        }
+        else {
+            Flow *flow = flowForMessage(msg);
+            ASSERT(flow);
+            typename std::deque<EM *>::iterator iter = std::find(flow->messages.begin(), flow->messages.end(), msg);
+            ASSERT(flow->messages.end() != iter);
+            // If this empties the flow, it stays in its round; see the
+            // comment at the top of this file
+            flow->messages.erase(iter);
+        }
+        
+        _queueSize -= msg->approximateSize();
+        msg->release();
+    }
+    
+    // Removes the messages on channelQualifier whose sequence numbers
+    // are not greater than nonWrappingSequenceNumber, and releases the
+    // scheduler's references to them. Like with remove, emptied flows
+    // stay in their rounds.
+    void removeChannelMessages(int32_t channelQualifier,
+                               EmiNonWrappingSequenceNumber nonWrappingSequenceNumber) {
+        int32_t idx = (EMI_CONTROL_CHANNEL == channelQualifier ? 256 : channelQualifier);
+        for (int priority=0; priority<EMI_NUMBER_OF_PRIORITIES; priority++) {
+            Flow *flow = _flows[priority][idx];
+            if (!flow) continue;
+            
+            typename std::deque<EM *>::iterator iter = flow->messages.begin();
+            while (iter != flow->messages.end()) {
+                EM *msg = *iter;
+                if (msg->nonWrappingSequenceNumber <= nonWrappingSequenceNumber) {
+                    iter = flow->messages.erase(iter);
+                    _queueSize -= msg->approximateSize();
+                    msg->release();
+                }
+                else {
+                    ++iter;
+                }
+            }
+        }
+        
+        bool removedDeadlineEntries = false;
+        DeadlineQueueIter iter = _deadlineQueue.begin();
+        while (iter != _deadlineQueue.end()) {
+            EM *msg = (*iter).msg;
+            if (msg->channelQualifier == channelQualifier &&
+                msg->nonWrappingSequenceNumber <= nonWrappingSequenceNumber) {
+                iter = _deadlineQueue.erase(iter);
+                _queueSize -= msg->approximateSize();
+                msg->release();
+                removedDeadlineEntries = true;
+            }
+            else {
+                ++iter;
+            }
+        }
+        if (removedDeadlineEntries) {
+            std::make_heap(_deadlineQueue.begin(), _deadlineQueue.end(), DeadlineEntryCmp());
+        }
+    }
+    
+    void clear() {
+        clearRound(_strictRound);
+        clearRound(_round);
+        
+        DeadlineQueueIter iter = _deadlineQueue.begin();
+        DeadlineQueueIter end  = _deadlineQueue.end();
+        while (iter != end) {
+            (*iter).msg->release();
+            ++iter;
+        }
+        _deadlineQueue.clear();
+        
+        _queueSize = 0;
+    }
+    
+    size_t sizeInBytes() const {
+        return _queueSize;
+    }
+    
+    bool empty() const {
+        return 0 == _queueSize;
+    }
+    
+    // The number of unreliable messages that have been dropped because
+    // they missed their deadline
+    size_t expiredMessages() const {
+        return _expiredMessages;
+    }
+};
+
+#endif
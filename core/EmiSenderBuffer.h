@@ -12,120 +12,276 @@
 #include "EmiMessage.h"
 #include "EmiNetUtil.h"
 
-#include <set>
-#include <vector>
-
+// EmiSenderBuffer keeps the reliable messages that have been sent but
+// not yet acknowledged.
+//
+// The messages of each channel are kept in a ring buffer, sorted by
+// sequence number. Since acks always acknowledge the oldest messages
+// of a channel, deregistering messages only touches the front of the
+// ring.
+//
+// In addition to that, the messages that are in flight are in a doubly
+// linked list (the retransmission list) that is sorted by
+// registrationTime, the time they were last sent. Messages enter the
+// list when they are put in a packet (see messageWasSent) rather than
+// when they are registered or retransmitted, since they can wait in the
+// send queue for a while before congestion control lets them through.
+// Messages are always put in the list with the current time, so keeping
+// the list sorted is a matter of appending messages to its end, and
+// finding the messages to retransmit is a matter of looking at its
+// beginning.
+//
+// Messages that the other host has reported with a SACK are taken out
+// of the retransmission list, but stay in their channel until they are
+// acknowledged with an ordinary ack. A retransmission timeout puts them
+// back into the retransmission list.
 template<class Binding>
 class EmiSenderBuffer {
     typedef typename Binding::Error Error;
     typedef EmiMessage<Binding>     EM;
     
-    struct NextMsgTreeCmp {
-        inline bool operator()(const EM *a, const EM *b) const {
-            EmiTimeInterval art = a->registrationTime;
-            EmiTimeInterval brt = b->registrationTime;
+    class Channel {
+    private:
+        // Private copy constructor and assignment operator
+        inline Channel(const Channel& other);
+        inline Channel& operator=(const Channel& other);
             
-            if (art != brt) return art < brt;
-            else {
-                int32_t acq = a->channelQualifier;
-                int32_t bcq = b->channelQualifier;
+        EM   **_messages;
+        size_t _mask;
+        size_t _first;
+        size_t _count;
                 
-                if (acq != bcq) return acq < bcq;
+        inline EM *&at(size_t idx) {
+            return _messages[(_first+idx) & _mask];
+        }
+        
+        void grow() {
+            size_t capacity = (_mask+1)*2;
+            EM **messages = new EM*[capacity];
+            for (size_t i=0; i<_count; i++) {
+                messages[i] = at(i);
+            }
+            
+            delete[] _messages;
+            _messages = messages;
+            _mask = capacity-1;
+            _first = 0;
+        }
+        
+    public:
+        Channel() :
+        _messages(new EM*[8]),
+        _mask(7),
+        _first(0),
+        _count(0) {}
+        
+        ~Channel() {
+            delete[] _messages;
+        }
+        
+        inline bool empty() const {
+            return 0 == _count;
+        }
+        
+        inline size_t size() const {
+            return _count;
+        }
+        
+        inline EM *get(size_t idx) {
+            ASSERT(idx < _count);
+            return at(idx);
+        }
+        
+        inline EM *front() {
+            return _count ? at(0) : NULL;
+        }
+        
+        // Returns the index of the first message whose sequence number
+        // is not less than sn
+        size_t lowerBound(EmiNonWrappingSequenceNumber sn) {
+            size_t low = 0;
+            size_t high = _count;
+            while (low < high) {
+                size_t mid = low+(high-low)/2;
+                if (at(mid)->nonWrappingSequenceNumber < sn) {
+                    low = mid+1;
+                }
                 else {
-                    return a->nonWrappingSequenceNumber < b->nonWrappingSequenceNumber;
+                    high = mid;
                 }
             }
+            return low;
         }
-    };
-    
-    struct SendBufferCmp {
-        inline bool operator()(const EM *a, const EM *b) const {
-            int32_t acq = a->channelQualifier;
-            int32_t bcq = b->channelQualifier;
+        
+        inline void popFront() {
+            ASSERT(_count);
+            _first = (_first+1) & _mask;
+            _count--;
+        }
+        
+        // Returns false if there already is a message with the same
+        // sequence number in the channel
+        bool insert(EM *message) {
+            EmiNonWrappingSequenceNumber sn = message->nonWrappingSequenceNumber;
             
-            if (acq != bcq) return acq < bcq;
-            else {
-                return a->nonWrappingSequenceNumber < b->nonWrappingSequenceNumber;
+            // Messages are almost always registered in sequence number
+            // order, so look for the insertion point from the back.
+            size_t idx = _count;
+            while (idx > 0 && at(idx-1)->nonWrappingSequenceNumber > sn) {
+                idx--;
+            }
+            if (idx > 0 && at(idx-1)->nonWrappingSequenceNumber == sn) {
+                return false;
             }
+            
+            if (_count == _mask+1) {
+                grow();
+            }
+            
+            for (size_t i=_count; i>idx; i--) {
+                at(i) = at(i-1);
+            }
+            at(idx) = message;
+            _count++;
+            
+            return true;
         }
     };
     
-    typedef std::vector<EM *> EmiMessageVector;
-    typedef std::set<EM *, NextMsgTreeCmp>      NextMsgTree;
-    typedef std::set<EM *, SendBufferCmp>       SendBuffer;
-    typedef typename EmiMessageVector::iterator EmiMessageVectorIter;
-    typedef typename NextMsgTree::iterator      NextMsgTreeIter;
-    typedef typename SendBuffer::iterator       SendBufferIter;
-    
     // Buffer max size
     size_t _size;
-    
-    // Contains at most one message per channel. It is sorted by regTime
-    NextMsgTree _nextMsgTree;
-    // contains all messages in the reliable buffer. It is sorted by
-    // channelQualifier and sequenceNumber
-    SendBuffer _sendBuffer;
     size_t _sendBufferSize;
     
+    // One Channel per EmiChannelQualifier, plus one for
+    // EMI_CONTROL_CHANNEL. They are indexed by channelQualifier+1.
+    Channel *_channels[257];
+    
+    // The retransmission list
+    EM *_oldestMessage;
+    EM *_newestMessage;
+    
 private:
     // Private copy constructor and assignment operator
     inline EmiSenderBuffer(const EmiSenderBuffer& other);
     inline EmiSenderBuffer& operator=(const EmiSenderBuffer& other);
     
-    EM *messageSearch(EM *messageStub) {
-        SendBufferIter iter = _sendBuffer.lower_bound(messageStub);
-        SendBufferIter end  = _sendBuffer.end();
+    size_t messageSize(size_t dataSize, size_t numMessages = 1) {
+        return dataSize + numMessages*EM::maximalHeaderSize();
+    }
+    
+    inline Channel *&channelSlot(int32_t channelQualifier) {
+        ASSERT(channelQualifier >= EMI_CONTROL_CHANNEL &&
+               channelQualifier < 256);
+        return _channels[channelQualifier+1];
+    }
+    
+    void appendToRetransmissionList(EM *message) {
+        message->retransmissionPrev = _newestMessage;
+        message->retransmissionNext = NULL;
         
-        // We need to look at both *iter and *(++iter), and of course
-        // also guard for if we reach end. That's what this loop does.
-        for (int i=0; iter != end && i<2; i++) {
-            if (messageStub->channelQualifier == (*iter)->channelQualifier) return *iter;
-            ++iter;
+        if (_newestMessage) {
+            _newestMessage->retransmissionNext = message;
         }
-        
-        return NULL;
+        else {
+            _oldestMessage = message;
+        }
+        _newestMessage = message;
     }
     
-    size_t messageSize(size_t dataSize, size_t numMessages = 1) {
-        return dataSize + numMessages*EM::maximalHeaderSize();
+    inline bool isInRetransmissionList(const EM *message) const {
+        return message->retransmissionPrev || message == _oldestMessage;
+    }
+    
+    void unlinkFromRetransmissionList(EM *message) {
+        if (message->retransmissionPrev) {
+            message->retransmissionPrev->retransmissionNext = message->retransmissionNext;
+        }
+        else {
+            _oldestMessage = message->retransmissionNext;
+        }
+        
+        if (message->retransmissionNext) {
+            message->retransmissionNext->retransmissionPrev = message->retransmissionPrev;
+        }
+        else {
+            _newestMessage = message->retransmissionPrev;
+        }
+        
+        message->retransmissionPrev = NULL;
+        message->retransmissionNext = NULL;
     }
     
 public:
     
-    EmiSenderBuffer(size_t size) : _size(size), _sendBufferSize(0) {}
+    EmiSenderBuffer(size_t size) :
+    _size(size),
+    _sendBufferSize(0),
+    _oldestMessage(NULL),
+    _newestMessage(NULL) {
+        for (size_t i=0; i<sizeof(_channels)/sizeof(*_channels); i++) {
+            _channels[i] = NULL;
+        }
+    }
+    
     virtual ~EmiSenderBuffer() {
-        SendBufferIter iter = _sendBuffer.begin();
-        SendBufferIter end  = _sendBuffer.end();
-        while (iter != end) {
-            (*iter)->release();
-            ++iter;
+        // SACKed messages are not in the retransmission list, so
+        // release the messages through the channels.
+        for (size_t i=0; i<sizeof(_channels)/sizeof(*_channels); i++) {
+            Channel *channel = _channels[i];
+            if (!channel) continue;
+            
+            EM *msg;
+            while ((msg = channel->front())) {
+                channel->popFront();
+                msg->release();
+            }
+        
+            delete channel;
         }
     }
     
-    bool fitsIntoBuffer(size_t dataSize, size_t numMessages) {
-        return _size >= _sendBufferSize+messageSize(dataSize, numMessages);
+    // freedSize is the number of bytes that will be deregistered
+    // before the message is registered
+    bool fitsIntoBuffer(size_t dataSize, size_t numMessages, size_t freedSize = 0) {
+        return _size+freedSize >= _sendBufferSize+messageSize(dataSize, numMessages);
+    }
+    
+    // Returns the number of bytes of the buffer that the messages on
+    // the particular channelQualifier whose sequenceNumber <=
+    // sequenceNumber use
+    size_t reliableMessagesSize(int32_t channelQualifier,
+                                EmiNonWrappingSequenceNumber nonWrappingSequenceNumber) {
+        Channel *channel = channelSlot(channelQualifier);
+        if (!channel) return 0;
+        
+        size_t result = 0;
+        size_t end = channel->lowerBound(nonWrappingSequenceNumber+1);
+        for (size_t idx=0; idx<end; idx++) {
+            result += messageSize(channel->get(idx)->getDataLength());
+        }
+        return result;
     }
     
     // Returns false if the buffer didn't have space for the message
     bool registerReliableMessage(EM *message, Error& err, EmiTimeInterval now) {
-        size_t msgSize = messageSize(Binding::extractLength(message->data));
+        size_t msgSize = messageSize(message->getDataLength());
         
         if (_sendBufferSize+msgSize > _size) {
             err = Binding::makeError("com.emilir.eminet.sendbufferoverflow", 0);
             return false;
         }
         
-        message->registrationTime = now;
-        
-        // Check if there already is a message with this channel qualifier in the buffer
-        if (NULL == messageSearch(message)) {
-            // Only add to _nextMsgTree if there wasn't already a message for that connection id
-            // and channel id in the system.
-            _nextMsgTree.insert(message);
+        Channel *&channel(channelSlot(message->channelQualifier));
+        if (!channel) {
+            channel = new Channel;
         }
         
-        bool wasInserted = _sendBuffer.insert(message).second;
-        if (wasInserted) {
+        if (channel->insert(message)) {
+            // The message enters the retransmission list when it is sent
+            message->registrationTime = now;
+            message->retransmissionPrev = NULL;
+            message->retransmissionNext = NULL;
+            
             message->retain();
             _sendBufferSize += msgSize;
         }
@@ -134,119 +290,173 @@ public:
     }
     
     // Deregisters all messages on the particular channelQualifier
-    // whose sequenceNumber <= sequenceNumber
+    // whose sequenceNumber <= sequenceNumber. Returns true if there
+    // were any.
     //
     // channelQualifier is int32_t to be able to contain -1, which
     // is a special control message channel.
-    void deregisterReliableMessages(int32_t channelQualifier,
+    bool deregisterReliableMessages(int32_t channelQualifier,
                                     EmiNonWrappingSequenceNumber nonWrappingSequenceNumber) {
-        EM msgStub;
-        msgStub.channelQualifier          = channelQualifier;
-        msgStub.nonWrappingSequenceNumber = nonWrappingSequenceNumber;
+        Channel *channel = channelSlot(channelQualifier);
+        if (!channel) return false;
         
-        SendBufferIter begin = _sendBuffer.begin();
-        SendBufferIter iter  = _sendBuffer.lower_bound(&msgStub);
+        bool deregistered = false;
+        EM *msg;
+        while ((msg = channel->front()) &&
+               msg->nonWrappingSequenceNumber <= nonWrappingSequenceNumber) {
+            channel->popFront();
+            if (isInRetransmissionList(msg)) {
+                unlinkFromRetransmissionList(msg);
+            }
+            
+            _sendBufferSize -= messageSize(msg->getDataLength());
+            
+            msg->release();
+            deregistered = true;
+        }
         
-        if (iter == _sendBuffer.end()) return;
+        return deregistered;
+    }
+    
+    // Marks the messages on the particular channelQualifier whose
+    // sequence numbers are between first and last, inclusive, as
+    // received by the other host, so that they are not retransmitted.
+    void sackReliableMessages(int32_t channelQualifier,
+                              EmiNonWrappingSequenceNumber first,
+                              EmiNonWrappingSequenceNumber last) {
+        Channel *channel = channelSlot(channelQualifier);
+        if (!channel) return;
         
-        EmiMessageVector toBeRemoved;
-        do {
-            EM *msg = *iter;
-            
-            if (channelQualifier != msg->channelQualifier) {
+        for (size_t idx=channel->lowerBound(first); idx<channel->size(); idx++) {
+            EM *msg = channel->get(idx);
+            if (msg->nonWrappingSequenceNumber > last) {
                 break;
             }
-            if (msg->nonWrappingSequenceNumber > nonWrappingSequenceNumber) {
-                // This can happen because we used lower_bound.
-                // It should not happen more than once, though.
-                //
-                // We do not continue; here, because that would
-                // iterate the loop without decrementing iter,
-                // resulting in an infinite loop.
-            }
-            else {
-                toBeRemoved.push_back(msg);
-            }
-            
-            if (iter == begin) break;
             
-            --iter;
-        } while (1);
+            if (!msg->sacked) {
+                msg->sacked = true;
+                if (isInRetransmissionList(msg)) {
+                    unlinkFromRetransmissionList(msg);
+                }
+            }
+        }
+    }
+    
+    // Starts the retransmission timeout of a message that is put in a
+    // packet, by moving it to the end of the retransmission list. Does
+    // nothing if the message is not registered, or has been SACKed.
+    void messageWasSent(EM *message, EmiTimeInterval now) {
+        if (message->sacked) return;
         
-        bool wasInReliableTree = false;
+        Channel *channel = channelSlot(message->channelQualifier);
+        if (!channel) return;
         
-        EmiMessageVectorIter viter = toBeRemoved.begin();
-        EmiMessageVectorIter vend = toBeRemoved.end();
-        while (viter != vend) {
-            EM *msg = *viter;
-            
-            bool wasRemovedFromSendBuffer = (0 != _sendBuffer.erase(msg));
-            ASSERT(wasRemovedFromSendBuffer);
-            
-            _sendBufferSize -= messageSize(Binding::extractLength(msg->data));
-            
-            bool wasRemovedFromNextMsgTree = 0 != _nextMsgTree.erase(msg);
-            wasInReliableTree = wasRemovedFromNextMsgTree || wasInReliableTree;
-            
-            msg->release();
-            
-            ++viter;
+        size_t idx = channel->lowerBound(message->nonWrappingSequenceNumber);
+        if (idx == channel->size() || channel->get(idx) != message) {
+            // The message is unreliable, or has been acknowledged
+            return;
         }
         
-        if (wasInReliableTree) {
-            EM *newMsg = messageSearch(&msgStub);
-            if (newMsg) _nextMsgTree.insert(newMsg);
+        if (isInRetransmissionList(message)) {
+            unlinkFromRetransmissionList(message);
+        }
+        message->registrationTime = now;
+        appendToRetransmissionList(message);
+    }
+    
+    // Looks up a message that is to be retransmitted before its RTO,
+    // because the other host has reported the packet it was sent in
+    // as lost. Returns NULL if the message has been acknowledged or
+    // SACKed, or if it was sent less than minInterval ago, in which
+    // case the report is probably about an older copy of it.
+    //
+    // Otherwise, the message is taken out of the retransmission list,
+    // like eachCurrentMessage does, and returned. The caller is
+    // responsible for actually sending it.
+    EM *retransmitMessage(int32_t channelQualifier,
+                          EmiNonWrappingSequenceNumber nonWrappingSequenceNumber,
+                          EmiTimeInterval now,
+                          EmiTimeInterval minInterval) {
+        Channel *channel = channelSlot(channelQualifier);
+        if (!channel) return NULL;
+        
+        size_t idx = channel->lowerBound(nonWrappingSequenceNumber);
+        if (idx == channel->size()) return NULL;
+        
+        EM *msg = channel->get(idx);
+        if (msg->nonWrappingSequenceNumber != nonWrappingSequenceNumber ||
+            !isInRetransmissionList(msg) ||
+            now-msg->registrationTime < minInterval) {
+            return NULL;
         }
+        
+        unlinkFromRetransmissionList(msg);
+        
+        return msg;
     }
     
+    // Returns true if there are no messages that wait for an ack
     bool empty() const {
-        return _nextMsgTree.empty();
+        return 0 == _sendBufferSize;
     }
     
+    // Retransmits the messages that were sent at least rto ago.
+    // Returns false if there were none, which means that the timeout
+    // is not a sign of congestion.
     template<class Delegate>
-    void eachCurrentMessage(EmiTimeInterval now, EmiTimeInterval rto,
+    bool eachCurrentMessage(EmiTimeInterval now, EmiTimeInterval rto,
                             Delegate& delegate) {
-        NextMsgTreeIter iter = _nextMsgTree.begin();
-        NextMsgTreeIter end = _nextMsgTree.end();
-        
-        EmiMessageVector toBePushedToTheEnd;
+        if (!_oldestMessage || rto > now-_oldestMessage->registrationTime) {
+            return false;
+        }
         
-        while (iter != end) {
-            EM *msg = *iter;
+        // The SACKs can't be trusted when a retransmission timeout has
+        // happened: the ack that should have released the oldest SACKed
+        // messages might have been lost, or the other host might have
+        // dropped SACKed messages from its receiver buffer to make room
+        // for earlier ones. Like RFC 2018 recommends, forget the SACKs,
+        // and retransmit the oldest message of each channel right away
+        // to make the other host send a new ack and new SACKs. Messages
+        // that it still has are SACKed again before they are due for
+        // retransmission.
+        for (size_t i=0; i<sizeof(_channels)/sizeof(*_channels); i++) {
+            Channel *channel = _channels[i];
+            if (!channel) continue;
             
+            for (size_t idx=0; idx<channel->size(); idx++) {
+                EM *msg = channel->get(idx);
+                if (msg->sacked) {
+                    msg->sacked = false;
+                    
+                    if (0 == idx) {
+                        delegate.eachCurrentMessageIteration(now, msg);
+                    }
+                    else {
+                        msg->registrationTime = now;
+                        appendToRetransmissionList(msg);
+                    }
+                }
+            }
+        }
+        
+        // Messages that are retransmitted leave the list until
+        // messageWasSent puts them back, so that the time they spend in
+        // the send queue doesn't count towards their next timeout, and
+        // so that they aren't retransmitted again before they have been
+        // sent.
+        EM *msg;
+        while ((msg = _oldestMessage)) {
             if (rto > now-msg->registrationTime) {
                 // This message was sent less than RTO ago
                 break;
             }
             
-            // Since we're iterating _nextMsgTree, we
-            // can't modify it here. Do it later.
-            toBePushedToTheEnd.push_back(msg);
+            unlinkFromRetransmissionList(msg);
             
             delegate.eachCurrentMessageIteration(now, msg);
-            
-            ++iter;
         }
         
-        EmiMessageVectorIter viter = toBePushedToTheEnd.begin();
-        EmiMessageVectorIter vend  = toBePushedToTheEnd.end();
-        while (viter != vend) {
-            EM *msg = *viter;
-            
-            // We want to update msg->registrationTime, but because
-            // _nextMsgTree's ordering depends on it, we can't change
-            // it while the object is in _nextMsgTree
-            
-            bool wasRemovedFromNextMsgTree = 0 != _nextMsgTree.erase(msg);
-            ASSERT(wasRemovedFromNextMsgTree);
-            
-            msg->registrationTime = now;
-            
-            bool wasInserted = _nextMsgTree.insert(msg).second;
-            ASSERT(wasInserted);
-            
-            ++viter;
-        }
+        return true;
     }
 };
 
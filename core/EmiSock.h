@@ -14,13 +14,16 @@
 #include "EmiSockConfig.h"
 #include "EmiConnParams.h"
 #include "EmiAddressCmp.h"
+#include "EmiAddressKey.h"
+#include "EmiHashMap.h"
 #include "EmiUdpSocket.h"
 #include "EmiNetUtil.h"
 #include "EmiNetRandom.h"
 #include "EmiMessageHandler.h"
+#include "EmiTimerWheel.h"
 
-#include <map>
 #include <set>
+#include <vector>
 #include <cstdlib>
 #include <netinet/in.h>
 
@@ -70,25 +73,14 @@ class EmiSock {
     typedef typename Binding::SocketHandle     SocketHandle;
     typedef typename SockDelegate::ConnectionOpenedCallbackCookie  ConnectionOpenedCallbackCookie;
     
-    struct AddressKey {
-    public:
-        explicit AddressKey(const sockaddr_storage& address_) :
-        address(address_) {}
-        
-        sockaddr_storage address;
-        
-        inline bool operator<(const AddressKey& rhs) const {
-            return 0 > EmiAddressCmp::compare(address, rhs.address);
-        }
-    };
-    
     typedef EmiConnParams<Binding>                  ECP;
     typedef EmiConn<SockDelegate, ConnDelegate>     EC;
     typedef EmiMessage<Binding>                     EM;
     typedef EmiUdpSocket<Binding>                   EUS;
     typedef EmiMessageHandler<EC, EmiSock, Binding> EMH;
+    typedef EmiTimerWheel<Binding>                  ETW;
     
-    typedef std::map<AddressKey, EC*>              ServerConnectionMap;
+    typedef EmiHashMap<EmiAddressKey, EC*>         ServerConnectionMap;
     typedef typename ServerConnectionMap::iterator ServerConnectionMapIter;
     
     // For makeServerConnection
@@ -102,6 +94,14 @@ private:
     EMH                   _messageHandler;
     EUS                  *_serverSocket;
     ServerConnectionMap   _serverConns;
+    // The server connection that the last datagram was for, or NULL.
+    // Bindings that receive datagrams in batches deliver datagrams from
+    // the same remote host back to back, and this saves a map lookup
+    // for all but the first datagram of each such run.
+    EC                   *_lastServerConn;
+    // The timer wheel that all connections of this socket share, if
+    // Binding::SHARED_TIMER_WHEEL is true. It is created lazily.
+    ETW                  *_timerWheel;
     SockDelegate          _delegate;
     
     // SockDelegate::connectionOpened will be called on the cookie iff this function returns true.
@@ -112,7 +112,7 @@ private:
         sockaddr_storage bindAddress(config.address);
         EmiNetUtil::addrSetPort(bindAddress, 0); // Bind to a random free port number
         
-        EC *ec(_delegate.makeConnection(ECP(remoteAddress,
+        EC *ec(_delegate.makeConnection(ECP(getTimerWheel(), remoteAddress,
                                             p2pCookie, p2pCookieLength,
                                             sharedSecret, sharedSecretLength)));
         if (!ec->open(now, bindAddress, callbackCookie, err)) {
@@ -139,8 +139,7 @@ private:
         
         ASSERT(sock->_serverSocket == socket);
         
-        ServerConnectionMapIter cur(sock->_serverConns.find(AddressKey(remoteAddress)));
-        EC *conn = (sock->_serverConns.end() == cur ? NULL : (*cur).second);
+        EC *conn = sock->findServerConnection(remoteAddress);
         
         if (conn) {
             // The purpose of connectionGotMessage is to give the bindings
@@ -161,15 +160,36 @@ private:
         }
     }
     
+    EC *findServerConnection(const sockaddr_storage& remoteAddress) {
+        if (_lastServerConn &&
+            0 == EmiAddressCmp::compare(remoteAddress, _lastServerConn->getRemoteAddress())) {
+            return _lastServerConn;
+        }
+        
+        _lastServerConn = _serverConns.find(EmiAddressKey(remoteAddress));
+        return _lastServerConn;
+    }
+    
     EC *makeServerConnection(const sockaddr_storage& remoteAddress, uint16_t inboundPort) {
-        EC *conn = _delegate.makeConnection(ECP(_serverSocket, remoteAddress, inboundPort));
-        ASSERT(0 == _serverConns.count(AddressKey(remoteAddress)));
-        _serverConns.insert(std::make_pair(AddressKey(remoteAddress), conn));
+        EC *conn = _delegate.makeConnection(ECP(getTimerWheel(), _serverSocket, remoteAddress, inboundPort));
+        bool inserted = _serverConns.insert(EmiAddressKey(remoteAddress), conn);
+        ASSERT(inserted);
         _delegate.gotServerConnection(*conn);
         
         return conn;
     }
     
+    ETW *getTimerWheel() {
+        if (!Binding::SHARED_TIMER_WHEEL) {
+            return NULL;
+        }
+        
+        if (!_timerWheel) {
+            _timerWheel = new ETW(_delegate.getTimerCookie());
+        }
+        return _timerWheel;
+    }
+    
     inline bool shouldArtificiallyDropPacket() const {
         if (0 == config.fabricatedPacketDropRate) return false;
         
@@ -183,35 +203,44 @@ public:
     config(config_),
     _messageHandler(*this),
     _delegate(delegate),
-    _serverSocket(NULL) {}
+    _serverSocket(NULL),
+    _serverConns(EmiHashSeed(EmiNetRandom<Binding>::random64(), EmiNetRandom<Binding>::random64())),
+    _lastServerConn(NULL),
+    _timerWheel(NULL) {}
     
     virtual ~EmiSock() {
         /// EmiSock should not be deleted before all open connections are closed,
         /// but just to be sure, we close all remaining connections.
         
-        size_t numConns = _serverConns.size();
+        // Closing a connection removes it from _serverConns, which
+        // invalidates all iterators, so make a copy first.
+        std::vector<EC*> conns;
+        conns.reserve(_serverConns.size());
         ServerConnectionMapIter iter = _serverConns.begin();
         ServerConnectionMapIter end  = _serverConns.end();
         while (iter != end) {
-            // This will remove the connection from _conns
-            (*iter).second->forceClose();
-            
-            // We do this check to make sure we don't enter an infinite loop.
-            // It shouldn't be required.
-            size_t newNumConns = _serverConns.size();
-            ASSERT(newNumConns < numConns);
-            numConns = newNumConns;
-            
-            // We can't increment iter, it has been
-            // invalidated because the connection was
-            // removed from _conns
-            iter = _serverConns.begin();
+            conns.push_back((*iter).second);
+            ++iter;
         }
         
+        for (size_t i=0; i<conns.size(); i++) {
+            // This will remove the connection from _serverConns. The
+            // argument-less forceClose can't be used here, because it
+            // closes the connection asynchronously.
+            conns[i]->forceClose(EMI_REASON_THIS_HOST_CLOSED);
+        }
+        ASSERT(_serverConns.empty());
+        
         /// Close the server socket
         if (_serverSocket) {
             delete _serverSocket;
         }
+        
+        /// The connections that are still alive have their own
+        /// references to the timer wheel
+        if (_timerWheel) {
+            _timerWheel->release();
+        }
     }
     
     SockDelegate& getDelegate() {
@@ -236,7 +265,7 @@ public:
         
         return true;
     }
-        
+    
     // SockDelegate::connectionOpened will be called on the cookie iff this function returns true.
     bool connect(EmiTimeInterval now,
                  const sockaddr_storage& remoteAddress,
@@ -269,7 +298,11 @@ public:
     void deregisterServerConnection(EC *conn) {
         ASSERT(EMI_CONNECTION_TYPE_SERVER == conn->getType());
         
-        _serverConns.erase(AddressKey(conn->getRemoteAddress()));
+        if (_lastServerConn == conn) {
+            _lastServerConn = NULL;
+        }
+        
+        _serverConns.erase(EmiAddressKey(conn->getRemoteAddress()));
     }
 };
 
@@ -13,23 +13,32 @@
 #include "EmiNetUtil.h"
 
 #include <netinet/in.h>
+#include <algorithm>
 
 class EmiSockConfig {
 public:
     EmiSockConfig() :
-    mtu(EMI_MINIMAL_MTU),
+    mtu(EMI_DEFAULT_MTU),
     heartbeatFrequency(EMI_DEFAULT_HEARTBEAT_FREQUENCY),
     connectionTimeout(EMI_DEFAULT_CONNECTION_TIMEOUT),
     initialConnectionTimeout(EMI_DEFAULT_CONNECTION_TIMEOUT),
     heartbeatsBeforeConnectionWarning(EMI_DEFAULT_HEARTBEATS_BEFORE_CONNECTION_WARNING),
     receiverBufferSize(EMI_DEFAULT_RECEIVER_BUFFER_SIZE),
     senderBufferSize(EMI_DEFAULT_SENDER_BUFFER_SIZE),
+    congestionControl(EMI_CONGESTION_CONTROL_UDT),
+    fecChannels(0),
+    fecGroupSize(EMI_DEFAULT_FEC_GROUP_SIZE),
+    conflatedChannels(0),
     acceptConnections(false),
     port(0),
     fabricatedPacketDropRate(0) {
+        std::fill(channelWeights, channelWeights+256, EMI_DEFAULT_CHANNEL_WEIGHT);
         EmiNetUtil::anyAddr(0, AF_INET, &address);
     }
     
+    // The largest packet size that path MTU discovery will probe for.
+    // Packets are never larger than EMI_MINIMAL_MTU before the path has
+    // been probed.
     size_t mtu;
     float heartbeatFrequency;
     EmiTimeInterval connectionTimeout;
@@ -37,6 +46,29 @@ public:
     float heartbeatsBeforeConnectionWarning;
     size_t receiverBufferSize;
     size_t senderBufferSize;
+    EmiCongestionControlAlgorithm congestionControl;
+    // A bitmask of the channels that send parity messages along with
+    // split messages, which lets the other host rebuild a lost part
+    // without a round trip. Bit n applies to the unreliable and the
+    // unreliable sequenced channel with number n; reliable channels
+    // retransmit lost parts instead.
+    uint32_t fecChannels;
+    // The number of split message parts per parity message, or 0 to
+    // adapt it to the observed loss rate. It is kept between
+    // EMI_FEC_MIN_GROUP_SIZE and EMI_FEC_MAX_GROUP_SIZE.
+    size_t fecGroupSize;
+    // A bitmask of the unreliable sequenced channels where a new message
+    // replaces the previous message on the channel if that hasn't been
+    // sent yet. Bit n applies to the channel with number n. This is
+    // useful for state updates that the game produces faster than
+    // they can be sent.
+    uint32_t conflatedChannels;
+    // The share of the bandwidth that each channel gets when several
+    // channels with the same priority have messages waiting to be
+    // sent, indexed by channel qualifier. A channel with weight 2
+    // gets twice as much as a channel with weight 1. See
+    // EmiSendScheduler.
+    uint8_t channelWeights[256];
     bool acceptConnections;
     uint16_t port;
     sockaddr_storage address;
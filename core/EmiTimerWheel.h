@@ -0,0 +1,402 @@
+//
+//  EmiTimerWheel.h
+//  eminet
+//
+
+#ifndef eminet_EmiTimerWheel_h
+#define eminet_EmiTimerWheel_h
+
+#include "EmiTypes.h"
+#include "EmiNetUtil.h"
+
+#include <algorithm>
+#include <cmath>
+#include <stdint.h>
+
+// The time of one tick of the wheel, in seconds
+#define EMI_TIMER_WHEEL_RESOLUTION (0.001)
+// The number of slots per level of the wheel is 2^EMI_TIMER_WHEEL_BITS
+#define EMI_TIMER_WHEEL_BITS       (8)
+#define EMI_TIMER_WHEEL_LEVELS     (4)
+
+// EmiTimerWheel is a hierarchical timing wheel that drives any number
+// of timers with one Binding timer. Scheduling and descheduling a
+// timer is O(1), and the Binding timer is only rescheduled when a
+// timer is scheduled to fire before all other timers of the wheel.
+//
+// Every EmiConn has several timers that are rescheduled all the time.
+// With one Binding timer per EmiConn timer, a server with many
+// connections spends most of its time maintaining the timer heap of
+// the binding. With a wheel that is shared between all connections of
+// an EmiSock, the binding only ever sees one timer.
+//
+// The wheel has a resolution of EMI_TIMER_WHEEL_RESOLUTION. Timers
+// never fire early, but they might fire up to one tick late.
+//
+// EmiTimerWheel implements the timer part of the Binding interface,
+// with TimerCookie being the wheel itself. Classes that only use the
+// timer part of Binding, like EmiRtoTimer and EmiConnTimers, can use
+// an EmiTimerWheel as their Binding.
+//
+// EmiTimerWheel objects are reference counted, because an EmiSock and
+// its connections might be deallocated in any order. Just like all
+// other parts of EmiNet, it is not thread safe; all timers of a wheel
+// must be used from one thread. See the thread safety comment in
+// EmiSock.h.
+template<class Binding>
+class EmiTimerWheel {
+public:
+    class Timer;
+    
+    typedef EmiTimerWheel* TimerCookie;
+    typedef void (TimerCb)(EmiTimeInterval now, Timer *timer, void *data);
+    
+    class Timer {
+        friend class EmiTimerWheel;
+    private:
+        // Private copy constructor and assignment operator
+        inline Timer(const Timer& other);
+        inline Timer& operator=(const Timer& other);
+        
+        EmiTimerWheel&  _wheel;
+        // The timers of a slot form a doubly linked list. _slot points
+        // to the head pointer of that list.
+        Timer          *_prev;
+        Timer          *_next;
+        Timer         **_slot;
+        TimerCb        *_timerCb;
+        void           *_data;
+        EmiTimeInterval _interval;
+        uint64_t        _expiry;
+        bool            _repeating;
+        
+        explicit Timer(EmiTimerWheel& wheel) :
+        _wheel(wheel),
+        _prev(NULL),
+        _next(NULL),
+        _slot(NULL),
+        _timerCb(NULL),
+        _data(NULL),
+        _interval(0),
+        _expiry(0),
+        _repeating(false) {}
+        
+    public:
+        inline bool isActive() const {
+            return !!_slot;
+        }
+    };
+    
+    class Ref {
+        EmiTimerWheel *_wheel;
+        
+        // Private assignment operator
+        inline Ref& operator=(const Ref& other);
+        
+    public:
+        // Takes over the reference that the caller has to wheel
+        explicit Ref(EmiTimerWheel *wheel) : _wheel(wheel) {}
+        
+        Ref(const Ref& other) : _wheel(other._wheel) {
+            _wheel->retain();
+        }
+        
+        ~Ref() {
+            _wheel->release();
+        }
+        
+        inline EmiTimerWheel *get() const {
+            return _wheel;
+        }
+    };
+    
+private:
+    // Private copy constructor and assignment operator
+    inline EmiTimerWheel(const EmiTimerWheel& other);
+    inline EmiTimerWheel& operator=(const EmiTimerWheel& other);
+    
+    static const size_t   SLOTS = 1 << EMI_TIMER_WHEEL_BITS;
+    static const uint64_t SLOT_MASK = SLOTS-1;
+    
+    typename Binding::Timer *_driver;
+    size_t                   _refCount;
+    // The Binding::now() that tick 0 corresponds to
+    EmiTimeInterval          _epoch;
+    // All ticks up to and including _currentTick have been processed
+    uint64_t                 _currentTick;
+    // The tick that _driver is scheduled for, or 0 if it's not scheduled
+    uint64_t                 _armedTick;
+    size_t                   _numTimers;
+    bool                     _advancing;
+    Timer                   *_slots[EMI_TIMER_WHEEL_LEVELS][SLOTS];
+    
+    ~EmiTimerWheel() {
+        ASSERT(0 == _numTimers);
+        Binding::freeTimer(_driver);
+    }
+    
+    // Timers expire at the first tick that is not before their deadline,
+    // and the wheel only processes the ticks that have passed, which is
+    // why timers never fire early.
+    inline uint64_t expiryForTime(EmiTimeInterval time) const {
+        EmiTimeInterval ticks = ceil((time-_epoch)/EMI_TIMER_WHEEL_RESOLUTION);
+        return ticks <= 0 ? 0 : (uint64_t)ticks;
+    }
+    
+    inline uint64_t passedTicksForTime(EmiTimeInterval time) const {
+        EmiTimeInterval ticks = floor((time-_epoch)/EMI_TIMER_WHEEL_RESOLUTION);
+        return ticks <= 0 ? 0 : (uint64_t)ticks;
+    }
+    
+    inline EmiTimeInterval timeForTick(uint64_t tick) const {
+        return _epoch + tick*EMI_TIMER_WHEEL_RESOLUTION;
+    }
+    
+    void link(Timer *timer) {
+        uint64_t delta = timer->_expiry - _currentTick;
+        
+        int level = 0;
+        while (level < EMI_TIMER_WHEEL_LEVELS-1 &&
+               delta >= ((uint64_t)1 << ((level+1)*EMI_TIMER_WHEEL_BITS))) {
+            level++;
+        }
+        
+        // Timers that are further away than the wheel can represent are
+        // put at the furthest slot of the last level. They will be
+        // re-linked when that slot is cascaded.
+        uint64_t expiry = timer->_expiry;
+        const uint64_t maxDelta = ((uint64_t)1 << (EMI_TIMER_WHEEL_LEVELS*EMI_TIMER_WHEEL_BITS))-1;
+        if (delta > maxDelta) {
+            expiry = _currentTick+maxDelta;
+        }
+        
+        Timer **slot = &_slots[level][(expiry >> (level*EMI_TIMER_WHEEL_BITS)) & SLOT_MASK];
+        timer->_slot = slot;
+        timer->_prev = NULL;
+        timer->_next = *slot;
+        if (*slot) {
+            (*slot)->_prev = timer;
+        }
+        *slot = timer;
+    }
+    
+    void unlink(Timer *timer) {
+        if (timer->_prev) {
+            timer->_prev->_next = timer->_next;
+        }
+        else {
+            *timer->_slot = timer->_next;
+        }
+        if (timer->_next) {
+            timer->_next->_prev = timer->_prev;
+        }
+        
+        timer->_slot = NULL;
+        timer->_prev = NULL;
+        timer->_next = NULL;
+    }
+    
+    // Moves all timers of the slot of level that _currentTick has just
+    // reached down to the lower levels.
+    void cascade(int level) {
+        Timer **slot = &_slots[level][(_currentTick >> (level*EMI_TIMER_WHEEL_BITS)) & SLOT_MASK];
+        
+        while (*slot) {
+            Timer *timer = *slot;
+            unlink(timer);
+            link(timer);
+        }
+    }
+    
+    // Returns the first tick after _currentTick at which the wheel might
+    // have something to do. That is either the expiry of the first timer
+    // of level 0, or the next time a higher level slot is cascaded.
+    uint64_t nextTick() const {
+        uint64_t windowEnd = (_currentTick | SLOT_MASK) + 1;
+        for (uint64_t tick = _currentTick+1; tick < windowEnd; tick++) {
+            if (_slots[0][tick & SLOT_MASK]) {
+                return tick;
+            }
+        }
+        return windowEnd;
+    }
+    
+    void arm() {
+        if (0 == _numTimers) {
+            if (_armedTick) {
+                Binding::descheduleTimer(_driver);
+                _armedTick = 0;
+            }
+            return;
+        }
+        
+        uint64_t tick = nextTick();
+        if (tick == _armedTick) {
+            return;
+        }
+        _armedTick = tick;
+        
+        EmiTimeInterval interval = timeForTick(tick) - Binding::now();
+        Binding::scheduleTimer(_driver, driverCallback, this,
+                               interval < 0 ? 0 : interval,
+                               /*repeating:*/false, /*reschedule:*/true);
+    }
+    
+    // Processes all ticks that have passed at now, and at least the
+    // ticks up to and including minTick.
+    void advance(EmiTimeInterval now, uint64_t minTick = 0) {
+        uint64_t targetTick = std::max(passedTicksForTime(now), minTick);
+        
+        if (0 == _numTimers) {
+            // There is nothing to process, so just skip ahead
+            if (targetTick > _currentTick) {
+                _currentTick = targetTick;
+            }
+            return;
+        }
+        
+        while (_currentTick < targetTick) {
+            _currentTick++;
+            
+            for (int level=1; level<EMI_TIMER_WHEEL_LEVELS; level++) {
+                if (0 != (_currentTick & (((uint64_t)1 << (level*EMI_TIMER_WHEEL_BITS))-1))) {
+                    break;
+                }
+                cascade(level);
+            }
+            
+            // Timers that are scheduled by the callbacks that we invoke
+            // here always expire after _currentTick, so they never end
+            // up in this slot.
+            Timer **slot = &_slots[0][_currentTick & SLOT_MASK];
+            while (*slot) {
+                Timer *timer = *slot;
+                unlink(timer);
+                
+                if (timer->_repeating) {
+                    timer->_expiry = expiryForTime(now+timer->_interval);
+                    if (timer->_expiry <= _currentTick) {
+                        timer->_expiry = _currentTick+1;
+                    }
+                    link(timer);
+                }
+                else {
+                    _numTimers--;
+                }
+                
+                timer->_timerCb(now, timer, timer->_data);
+            }
+        }
+    }
+    
+    static void driverCallback(EmiTimeInterval now, typename Binding::Timer *timer, void *data) {
+        EmiTimerWheel *wheel = (EmiTimerWheel *)data;
+        
+        // The timer callbacks might release the last reference to the
+        // wheel from outside.
+        wheel->retain();
+        
+        // The driver was scheduled for the time of _armedTick, but
+        // because of rounding errors, now might be a hair before it.
+        // Don't rely on the clock to have moved on; with a simulated
+        // clock it hasn't, and the wheel would be re-armed for the same
+        // tick over and over again.
+        uint64_t armedTick = wheel->_armedTick;
+        
+        wheel->_armedTick = 0;
+        wheel->_advancing = true;
+        wheel->advance(now, armedTick);
+        wheel->_advancing = false;
+        wheel->arm();
+        
+        wheel->release();
+    }
+    
+public:
+    
+    // The returned wheel has a reference count of 1
+    explicit EmiTimerWheel(const typename Binding::TimerCookie& timerCookie) :
+    _driver(Binding::makeTimer(timerCookie)),
+    _refCount(1),
+    _epoch(Binding::now()),
+    _currentTick(0),
+    _armedTick(0),
+    _numTimers(0),
+    _advancing(false) {
+        for (int level=0; level<EMI_TIMER_WHEEL_LEVELS; level++) {
+            for (size_t i=0; i<SLOTS; i++) {
+                _slots[level][i] = NULL;
+            }
+        }
+    }
+    
+    inline void retain() {
+        ++_refCount;
+    }
+    
+    inline void release() {
+        ASSERT(0 != _refCount);
+        
+        if (0 == --_refCount) {
+            delete this;
+        }
+    }
+    
+    static Timer *makeTimer(EmiTimerWheel *wheel) {
+        return new Timer(*wheel);
+    }
+    
+    static void freeTimer(Timer *timer) {
+        descheduleTimer(timer);
+        delete timer;
+    }
+    
+    static void scheduleTimer(Timer *timer, TimerCb *timerCb, void *data, EmiTimeInterval interval,
+                              bool repeating, bool reschedule) {
+        if (timer->isActive()) {
+            if (!reschedule) {
+                // We were told not to re-schedule the timer.
+                // The timer is already active, so do nothing.
+                return;
+            }
+            
+            timer->_wheel.unlink(timer);
+            timer->_wheel._numTimers--;
+        }
+        
+        EmiTimerWheel& wheel(timer->_wheel);
+        
+        if (0 == wheel._numTimers && !wheel._advancing) {
+            // The wheel has not been advanced while it was empty, so
+            // _currentTick might be far behind.
+            wheel.advance(Binding::now());
+        }
+        
+        timer->_timerCb = timerCb;
+        timer->_data = data;
+        timer->_interval = interval;
+        timer->_repeating = repeating;
+        timer->_expiry = wheel.expiryForTime(Binding::now()+interval);
+        if (timer->_expiry <= wheel._currentTick) {
+            timer->_expiry = wheel._currentTick+1;
+        }
+        
+        wheel.link(timer);
+        wheel._numTimers++;
+        
+        // When the wheel is advancing, it is armed when it's done
+        if (!wheel._advancing &&
+            (0 == wheel._armedTick || timer->_expiry < wheel._armedTick)) {
+            wheel.arm();
+        }
+    }
+    
+    static void descheduleTimer(Timer *timer) {
+        if (timer->isActive()) {
+            timer->_wheel.unlink(timer);
+            timer->_wheel._numTimers--;
+        }
+    }
+};
+
+#endif
@@ -12,6 +12,10 @@
 #include <stdint.h>
 
 #define EMI_MINIMAL_MTU                  (576)
+// The largest UDP payload that fits in an unfragmented IPv6 packet on
+// an Ethernet link. Connections start out with EMI_MINIMAL_MTU and
+// probe for larger MTUs up to the configured MTU.
+#define EMI_DEFAULT_MTU                  (1452)
 #define EMI_DEFAULT_HEARTBEAT_FREQUENCY  (0.3)
 #define EMI_DEFAULT_HEARTBEATS_BEFORE_CONNECTION_WARNING (2.5)
 #define EMI_DEFAULT_CONNECTION_TIMEOUT   (30)
@@ -20,10 +24,26 @@
 // upper bound on how large a single message can be.
 #define EMI_DEFAULT_RECEIVER_BUFFER_SIZE (131072)
 #define EMI_DEFAULT_SENDER_BUFFER_SIZE   (8192)
+// 0 means that the FEC group size adapts to the observed loss rate
+#define EMI_DEFAULT_FEC_GROUP_SIZE       (0)
 
 #define EMI_UDP_HEADER_SIZE           (8)
 #define EMI_MESSAGE_HEADER_MIN_LENGTH (4)
-#define EMI_PACKET_HEADER_MAX_LENGTH  (21)
+// The maximal number of ranges of lost packets in one NAK
+#define EMI_MAX_NAK_RANGES            (8)
+// The extra flags byte, the range count byte, 2 bytes for the first
+// range and 4 bytes for each of the others
+#define EMI_NAK_RANGES_MAX_LENGTH     (4+4*(EMI_MAX_NAK_RANGES-1))
+#define EMI_PACKET_HEADER_MAX_LENGTH  (22+EMI_NAK_RANGES_MAX_LENGTH)
+// The maximal number of SACK blocks in one ack message, and the size
+// of each block on the wire: The offset of its first message from the
+// ack and its length minus one, both 16 bits.
+#define EMI_MAX_SACK_BLOCKS           (8)
+#define EMI_SACK_BLOCK_LENGTH         (4)
+// The size of the header in the data of a parity message: The number
+// of messages in its FEC group, the XOR of their split flags and the
+// XOR of their lengths (16 bits)
+#define EMI_FEC_HEADER_LENGTH         (4)
 
 #define EMI_MIN_CONGESTION_WINDOW         ((size_t)(1024))
 #define EMI_MAX_CONGESTION_WINDOW         ((size_t)(1024*1024*10))
@@ -37,11 +57,78 @@
 #define EMI_MAX_RTO          (20.0)
 #define EMI_INIT_RTO         (1.0)
 
-#define EMI_IS_VALID_CHANNEL_QUALIFIER(cq)  (0 == ((cq) & 0x20))
-#define EMI_CHANNEL_QUALIFIER_TYPE(cq)      ((EmiChannelType) (((cq) & 0xc0) >> 6))
-#define EMI_CHANNEL_QUALIFIER(type, number) (((number) & 0x1f) | (((type) & 0x3) << 6))
+// The number of packets, counting back from the newest received one,
+// that the receiver keeps track of losses for. Must be a multiple of
+// 64, and no more than 32768, since NAK ranges are encoded relative
+// to each other in 16 bits.
+#define EMI_LOSS_LIST_WINDOW     (4096)
+// The number of separate loss events that the receiver remembers
+#define EMI_LOSS_LIST_MAX_RANGES (64)
+// The number of times that the receiver reports a loss event
+#define EMI_LOSS_LIST_MAX_FEEDBACKS (4)
+// The fraction of the RTT that the receiver waits for a missing
+// packet to arrive out of order before it reports it as lost
+#define EMI_LOSS_LIST_REORDER_WINDOW (0.25)
+// The number of reliable messages, counting back from the most
+// recently sent one, that the sender remembers which packets they
+// were sent in. This is what makes it possible to retransmit them
+// when the other host reports the packets as lost.
+#define EMI_SENT_MESSAGE_INDEX_SIZE (1024)
+// The number of sent packets that the sender's estimate of the loss
+// rate is averaged over
+#define EMI_LOSS_RATE_WINDOW        (512)
+
+// The limits of the number of split message parts that share one
+// parity message. The adaptive FEC group size is EMI_FEC_LOSS_FACTOR
+// divided by the loss rate, which makes a group with one lost part
+// about 20 times more likely than a group with two, regardless of
+// the loss rate. Below EMI_FEC_MIN_LOSS_RATE, no parity messages are
+// sent at all.
+#define EMI_FEC_MIN_GROUP_SIZE (2)
+#define EMI_FEC_MAX_GROUP_SIZE (16)
+#define EMI_FEC_LOSS_FACTOR    (0.1)
+#define EMI_FEC_MIN_LOSS_RATE  (0.002)
+
+// The number of bytes that a channel with weight 1 and priority
+// EMI_PRIORITY_LOW may send per turn when several channels have
+// messages waiting to be sent. The other priorities get their
+// weight times as much. It should be at least as large as the
+// largest message, or picking the next message to send takes
+// more than one step.
+#define EMI_SCHEDULER_QUANTUM        (1500)
+#define EMI_PRIORITY_HIGH_WEIGHT     (4)
+#define EMI_PRIORITY_MEDIUM_WEIGHT   (2)
+#define EMI_PRIORITY_LOW_WEIGHT      (1)
+#define EMI_DEFAULT_CHANNEL_WEIGHT   (1)
+// The deadline of messages that don't have one
+#define EMI_NO_DEADLINE              (-1)
+
+#define EMI_PATH_MTU_SEARCH_PRECISION (16)
+#define EMI_PATH_MTU_MAX_PROBES       (3)
+#define EMI_PATH_MTU_RAISE_INTERVAL   (600)
+#define EMI_PATH_MTU_BLACK_HOLE_RTOS  (3)
+
+// The amount of queuing delay, in seconds, that the delay based
+// congestion control algorithm aims for
+#define EMI_DELAY_TARGET       (0.025)
+// The number of minutes of history that the delay based congestion
+// control algorithm uses to find the base delay of the path
+#define EMI_DELAY_BASE_HISTORY (10)
+
+// The two most significant bits of a channel qualifier are the channel
+// type, and the five least significant bits are the channel number.
+// There is no room for EMI_CHANNEL_TYPE_RELIABLE_UNORDERED in the type
+// bits, so those channels instead have the 0x20 bit set and the type
+// bits cleared.
+#define EMI_IS_VALID_CHANNEL_QUALIFIER(cq)  (0 == ((cq) & 0x20) || 0 == ((cq) & 0xc0))
+#define EMI_CHANNEL_QUALIFIER_TYPE(cq)      ((EmiChannelType) (0x20 == ((cq) & 0xe0) ?               \
+                                                               EMI_CHANNEL_TYPE_RELIABLE_UNORDERED : \
+                                                               ((cq) & 0xc0) >> 6))
+#define EMI_CHANNEL_QUALIFIER(type, number) (((number) & 0x1f) |                                     \
+                                             (EMI_CHANNEL_TYPE_RELIABLE_UNORDERED == (type) ?        \
+                                              0x20 :                                                 \
+                                              ((type) & 0x3) << 6))
 
-// To be changed when priorities are actually implemented
 #define EMI_PRIORITY_DEFAULT          (EMI_PRIORITY_MEDIUM)
 #define EMI_PRIORITY_CONTROL          (EMI_PRIORITY_HIGH)
 #define EMI_CHANNEL_TYPE_DEFAULT      (EMI_CHANNEL_TYPE_RELIABLE_ORDERED)
@@ -61,7 +148,8 @@ typedef enum {
     EMI_CHANNEL_TYPE_UNRELIABLE           = 0,
     EMI_CHANNEL_TYPE_UNRELIABLE_SEQUENCED = 1,
     EMI_CHANNEL_TYPE_RELIABLE_SEQUENCED   = 2,
-    EMI_CHANNEL_TYPE_RELIABLE_ORDERED     = 3
+    EMI_CHANNEL_TYPE_RELIABLE_ORDERED     = 3,
+    EMI_CHANNEL_TYPE_RELIABLE_UNORDERED   = 4
 } EmiChannelType;
 
 typedef enum {
@@ -72,6 +160,14 @@ typedef enum {
     EMI_REASON_OTHER_HOST_DID_NOT_RESPOND = 4
 } EmiDisconnectReason;
 
+typedef enum {
+    // The loss based algorithm of UDT
+    EMI_CONGESTION_CONTROL_UDT   = 0,
+    // A delay based algorithm in the style of LEDBAT that keeps the
+    // queues along the path short
+    EMI_CONGESTION_CONTROL_DELAY = 1
+} EmiCongestionControlAlgorithm;
+
 typedef enum {
     EMI_CONNECTION_TYPE_SERVER,
     EMI_CONNECTION_TYPE_CLIENT,
@@ -106,6 +202,7 @@ typedef uint8_t  EmiPacketFlags;
 typedef double   EmiTimeInterval;
 
 typedef enum {
+    EMI_FEC_FLAG             = 0x80, // This flag means that this is a parity message for a group of split message parts
     EMI_SPLIT_NOT_FIRST_FLAG = 0x40, // This flag means that this is a split message, and it's not the first part
     EMI_SPLIT_NOT_LAST_FLAG  = 0x20, // This flag means that this is a split message, and it's not the last part
     EMI_PRX_FLAG             = 0x10,
@@ -128,7 +225,25 @@ typedef enum {
 
 typedef enum {
     EMI_1_BYTE_FILLER_EXTRA_PACKET_FLAG = 0x01,
-    EMI_2_BYTE_FILLER_EXTRA_PACKET_FLAG = 0x02
+    EMI_2_BYTE_FILLER_EXTRA_PACKET_FLAG = 0x02,
+    EMI_NAK_RANGES_EXTRA_PACKET_FLAG    = 0x04
 } EmiPacketExtraFlags;
 
+// A range of consecutive lost packets, as reported in a NAK. The
+// sequence numbers wrap, so the last packet in the range is
+// (sequenceNumber+length-1) & EMI_PACKET_SEQUENCE_NUMBER_MASK.
+struct EmiNakRange {
+    EmiPacketSequenceNumber sequenceNumber;
+    uint32_t                length;
+};
+
+// A range of consecutive messages that the receiver of a reliable
+// ordered channel holds beyond the first missing message. Like the
+// sequence numbers of messages, they wrap at
+// EMI_HEADER_SEQUENCE_NUMBER_MASK.
+struct EmiSackBlock {
+    EmiSequenceNumber sequenceNumber;
+    uint32_t          length;
+};
+
 #endif
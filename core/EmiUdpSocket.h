@@ -12,6 +12,7 @@
 #include "EmiAddressCmp.h"
 
 #include <netinet/in.h>
+#include <sys/uio.h>
 #include <vector>
 #include <utility>
 
@@ -160,10 +161,36 @@ public:
     }
     
     // To send from all sockets, specify a fromAddress with a port number of 0
+    //
+    // Note that Binding::sendData is not required to send the datagram
+    // immediately; it must copy the data, but it may batch the datagrams
+    // of a socket and send them later on, as long as it does so before
+    // the binding waits for more events. The posix binding does this, to
+    // be able to send all packets that the connections of a socket
+    // produce during one tick with one system call.
     void sendData(const sockaddr_storage& fromAddress,
                   const sockaddr_storage& toAddress,
                   const uint8_t *data,
                   size_t size) {
+        struct iovec iov;
+        iov.iov_base = (void *)data;
+        iov.iov_len = size;
+        sendData(fromAddress, toAddress, &iov, 1);
+    }
+    
+    // Sends a datagram that consists of the concatenation of the
+    // buffers in iov. Like with the other sendData method,
+    // Binding::sendData must copy the data.
+    //
+    // packetPair is true for the two packets of a packet pair (see
+    // EmiLinkCapacity). The receiver measures the time between them,
+    // so a binding that coalesces datagrams must send them as packets
+    // of their own.
+    void sendData(const sockaddr_storage& fromAddress,
+                  const sockaddr_storage& toAddress,
+                  const struct iovec *iov,
+                  size_t iovcnt,
+                  bool packetPair = false) {
         uint16_t fromAddrPort(EmiNetUtil::addrPortH(fromAddress));
         
         SocketVectorIter iter(_sockets.begin());
@@ -176,7 +203,7 @@ public:
                 
                 SocketHandle* sh(asp.second);
                 if (sh) {
-                    Binding::sendData(sh, toAddress, data, size);
+                    Binding::sendData(sh, toAddress, iov, iovcnt, packetPair);
                 }
                 
             }
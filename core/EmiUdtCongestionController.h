@@ -0,0 +1,270 @@
+//
+//  EmiUdtCongestionController.h
+//  eminet
+//
+//  Created by Per Eckerdal on 2012-05-24.
+//  Copyright (c) 2012 Per Eckerdal. All rights reserved.
+//
+
+#ifndef eminet_EmiUdtCongestionController_h
+#define eminet_EmiUdtCongestionController_h
+
+#include "EmiCongestionController.h"
+#include "EmiNetUtil.h"
+#include "EmiNetRandom.h"
+
+#include <algorithm>
+#include <cmath>
+
+// Set this to non-zero to add a few asserts regarding
+// sequence numbers. Warning: Do not enable these in
+// production builds! The asserts might trigger even
+// in normal circumstances (but it's rare enough to
+// make the asserts useful for debugging).
+#define EMI_DEBUG_SEQUENCE_NUMBERS 0
+
+// This class implements the loss based congestion control
+// algorithm of UDT.
+template<class Binding>
+class EmiUdtCongestionController : public EmiCongestionController {
+    
+    size_t _congestionWindow;
+    // A sending rate of 0 means that we're in the slow start phase
+    float  _sendingRate;
+    size_t _totalDataSentInSlowStart;
+    
+    float _avgPacketSize;
+    
+    // The average number of NAKs in a congestion period.
+    float _avgNakCount;
+    // The number of NAKs in the current congestion period.
+    int _nakCount;
+    // The number of times the rate has been decreased in this
+    // congestion period
+    int _decCount;
+    int _decRandom;
+    // The biggest sequence number when last time the
+    // packet sending rate is decreased. Initially -1
+    EmiPacketSequenceNumber _lastDecSeq;
+    
+    EmiPacketSequenceNumber _newestSentSN;
+    EmiPacketSequenceNumber _newestSeenAckSN;
+    
+    float _remoteLinkCapacity;
+    float _remoteDataArrivalRate;
+    
+    EmiTimeInterval _rtt; // -1 if not known
+    
+    void endSlowStartPhase() {
+        _sendingRate = _remoteDataArrivalRate;
+        
+        // Like UDT, fall back on the rate that the congestion window
+        // allows. The data arrival rate starts out very low, and it is
+        // not a usable estimate until a few packets have arrived.
+        if (-1 != _rtt) {
+            _sendingRate = std::max(_sendingRate,
+                                    (float) (_congestionWindow/(_rtt+EMI_TICK_TIME)));
+        }
+    }
+    
+public:
+    EmiUdtCongestionController() :
+    _congestionWindow(EMI_MIN_CONGESTION_WINDOW),
+    _sendingRate(0),
+    _totalDataSentInSlowStart(0),
+    
+    _avgPacketSize(-1),
+    
+    _avgNakCount(1),
+    _nakCount(1),
+    _decRandom(2),
+    _decCount(1),
+    _lastDecSeq(-1),
+    
+    _newestSentSN(-1),
+    _newestSeenAckSN(-1),
+    
+    _remoteLinkCapacity(-1),
+    _remoteDataArrivalRate(-1),
+    
+    _rtt(-1) {}
+    
+    virtual ~EmiUdtCongestionController() {}
+    
+    virtual void onDataSent(EmiTimeInterval now, EmiPacketSequenceNumber sequenceNumber, size_t size) {
+        if (-1 == _newestSentSN) {
+            _newestSeenAckSN = ((sequenceNumber-1) & EMI_PACKET_SEQUENCE_NUMBER_MASK);
+        }
+        _newestSentSN = sequenceNumber;
+        
+        if (0 == _sendingRate) {
+            // We're in slow start mode
+            _totalDataSentInSlowStart += size;
+        }
+        
+        if (-1 == _avgPacketSize) {
+            _avgPacketSize = size;
+        }
+        else {
+            static const float SMOOTH = 0.125;
+            _avgPacketSize = (1-SMOOTH)*_avgPacketSize + SMOOTH*size;
+        }
+    }
+    
+    virtual void gotRemoteLinkCapacity(float linkCapacity) {
+        static const float SMOOTH = 0.125;
+        
+        if (-1 == _remoteLinkCapacity) {
+            _remoteLinkCapacity = linkCapacity;
+        }
+        else {
+            _remoteLinkCapacity = (1-SMOOTH)*_remoteLinkCapacity + SMOOTH*linkCapacity;
+        }
+    }
+    
+    virtual void gotRemoteDataArrivalRate(float dataArrivalRate) {
+        static const float SMOOTH = 0.125;
+        
+        if (-1 == _remoteDataArrivalRate) {
+            _remoteDataArrivalRate = dataArrivalRate;
+        }
+        else {
+            _remoteDataArrivalRate = (1-SMOOTH)*_remoteDataArrivalRate + SMOOTH*dataArrivalRate;
+        }
+    }
+    
+    virtual void onAck(EmiTimeInterval now, EmiTimeInterval rtt, EmiPacketSequenceNumber ack) {
+        if (-1 == _newestSeenAckSN ||
+            EmiNetUtil::cyclicDifferenceSigned<EMI_PACKET_SEQUENCE_NUMBER_LENGTH>(ack,
+                                                                                  _newestSeenAckSN) > 0) {
+#if EMI_DEBUG_SEQUENCE_NUMBERS
+            ASSERT(-1 == _newestSeenAckSN ||
+                   EmiNetUtil::cyclicDifference24Signed(ack,
+                                                        _newestSeenAckSN) < 100);
+#endif
+            _newestSeenAckSN = ack;
+        }
+        
+        if (-1 != rtt) {
+            _rtt = rtt;
+        }
+        
+        if (0 == _sendingRate) {
+            // We're in the slow start phase
+            _congestionWindow = std::max(EMI_MIN_CONGESTION_WINDOW, _totalDataSentInSlowStart);
+            
+            if (_congestionWindow >= EMI_MAX_CONGESTION_WINDOW) {
+                _congestionWindow = EMI_MAX_CONGESTION_WINDOW;
+                
+                endSlowStartPhase();
+            }
+        }
+        else {
+            // We're not in the slow start phase
+            
+            float inc = 1;
+            
+            if (_remoteLinkCapacity > _sendingRate) {
+                // These are constants as specified by UDT. I have no
+                // idea of why they have this particular value.
+                static const double ALPHA = 8;
+                static const double BETA  = 0.0000015;
+                inc = std::max(std::pow(10, std::ceil(std::log10((_remoteLinkCapacity-_sendingRate)*ALPHA))) * BETA,
+                               1.0);
+            }
+            
+            _sendingRate += inc/EMI_TICK_TIME;
+            
+            _congestionWindow = (size_t) (_remoteDataArrivalRate * (rtt + EMI_TICK_TIME) + 10*1024);
+            _congestionWindow = std::min(EMI_MAX_CONGESTION_WINDOW, _congestionWindow);
+        }
+    }
+    
+    virtual void onNak(EmiTimeInterval now,
+                       const EmiNakRange *ranges,
+                       size_t numRanges,
+                       EmiPacketSequenceNumber largestSNSoFar) {
+        // Like in UDT, the whole NAK counts as one loss event, which is
+        // identified by the first packet that it reports.
+        EmiPacketSequenceNumber nak = ranges[0].sequenceNumber;
+        
+        if (0 == _sendingRate) {
+            // We're in the slow start phase.
+            
+            if (-1 == _remoteLinkCapacity ||
+                -1 == _remoteDataArrivalRate) {
+                // We got a NAK, but we have not yet received
+                // data about the link capacity and the arrival
+                // rate. Ignore this packet.
+                return;
+            }
+            
+            endSlowStartPhase();
+        }
+        else {
+            // We're not in the slow start phase
+            
+            static const float SENDING_RATE_DECREASE = 1.125;
+            
+            if (nak > _lastDecSeq) {
+                // This NAK starts a new congestion period
+                
+                _sendingRate /= SENDING_RATE_DECREASE;
+                
+                static const float SMOOTH = 0.125;
+                _avgNakCount = (1-SMOOTH)*_avgNakCount + SMOOTH*_nakCount;
+                _nakCount = 1;
+                _decRandom = EmiNetRandom<Binding>::randomUniform(((int)std::floor(_avgNakCount))+1) + 1;
+                _decCount = 1;
+                _lastDecSeq = largestSNSoFar;
+            }
+            else {
+                // This NAK does not start a new congestion period
+                if (_decCount <= 5 && _nakCount == _decCount*_decRandom) {
+                    // The _decCount <= 5 ensures that the sending rate is not
+                    // decreased by more than 50% per congestion period (1.125^6≈2)
+                    
+                    _sendingRate /= SENDING_RATE_DECREASE;
+                    _decCount++;
+                    _lastDecSeq = largestSNSoFar;
+                }
+                
+                _nakCount++;
+            }
+        }
+    }
+    
+    virtual void onRto() {
+        _sendingRate /= 2;
+    }
+    
+    virtual size_t tickAllowance() const {
+        int packetsInTransit;
+        
+        if (-1 == _newestSentSN) {
+            packetsInTransit = 0;
+        }
+        else {
+            // /2 because presumably half of the packets are
+            // in transit, the other half's ACKs are in transit
+            packetsInTransit = EmiNetUtil::cyclicDifference<EMI_PACKET_SEQUENCE_NUMBER_LENGTH>(_newestSentSN,
+                                                                                               _newestSeenAckSN)/2;
+        }
+        
+        // The packets in transit can take up more than the congestion
+        // window, for instance right after it has shrunk
+        float bytesInTransit = packetsInTransit*_avgPacketSize;
+        size_t cwndAllowance = (bytesInTransit < _congestionWindow ?
+                                static_cast<size_t>(_congestionWindow - bytesInTransit) : 0);
+        size_t rateAllowance = static_cast<size_t>(_sendingRate * EMI_TICK_TIME);
+        
+        if (0 == rateAllowance) {
+            return cwndAllowance;
+        }
+        else {
+            return std::min(cwndAllowance, rateAllowance);
+        }
+    }
+};
+
+#endif
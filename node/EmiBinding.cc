@@ -3,6 +3,7 @@
 #include "EmiBinding.h"
 
 #include "../core/EmiNetUtil.h"
+#include "../core/EmiBufferPool.h"
 #include "EmiNodeUtil.h"
 #include "EmiConnection.h"
 #include "EmiSocket.h"
@@ -14,13 +15,29 @@
 
 using namespace v8;
 
+// Message data is allocated from an EmiBufferPool rather than from the
+// SlabAllocator, because persistent data can stay in the sender buffer
+// for a long time, and a slice of a slab keeps the whole slab alive.
+//
+// node is single threaded, so one pool is enough.
+static EmiBufferPool bufferPool;
+
+static void freePooledBuffer(char *data, void *hint) {
+    bufferPool.free(data);
+}
+
+// Returns a node::Buffer whose contents are allocated from bufferPool
+static node::Buffer *makePooledBuffer(size_t size) {
+    char *data = (char *)bufferPool.alloc(size);
+    return node::Buffer::New(data, size, freePooledBuffer, NULL);
+}
+
 Persistent<Object> EmiBinding::makePersistentData(const uint8_t *data, size_t length) {
     HandleScope scope;
     
-    // TODO It would probably be better to use the slab allocator here
-    
     // Copy the buffer
-    node::Buffer *buf(node::Buffer::New((char *)data, length));
+    node::Buffer *buf(makePooledBuffer(length));
+    memcpy(node::Buffer::Data(buf), data, length);
     
     // Make a new persistent handle (do not just reuse the persistent buf->handle_ handle)
     return Persistent<Object>::New(buf->handle_);
@@ -29,9 +46,7 @@ Persistent<Object> EmiBinding::makePersistentData(const uint8_t *data, size_t le
 Local<Object> EmiBinding::makeTemporaryData(size_t size, uint8_t **outData) {
     HandleScope scope;
     
-    // TODO It would probably be better to use the slab allocator here
-    
-    node::Buffer *buf(node::Buffer::New(size));
+    node::Buffer *buf(makePooledBuffer(size));
     
     *outData = (uint8_t *)node::Buffer::Data(buf);
     
@@ -59,6 +74,10 @@ static void timer_cb(uv_timer_t *handle, int status) {
     timerCb(EmiNodeUtil::now(), handle, handle->data);
 }
 
+EmiTimeInterval EmiBinding::now() {
+    return EmiNodeUtil::now();
+}
+
 EmiBinding::Timer *EmiBinding::makeTimer(void *timerCookie) {
     EmiBinding::Timer *timer = (uv_timer_t *)malloc(sizeof(uv_timer_t)+sizeof(TimerCb*));
     
@@ -276,7 +295,8 @@ void EmiBinding::extractLocalAddress(uv_udp_t *socket, sockaddr_storage& address
 
 void EmiBinding::sendData(uv_udp_t *socket,
                                const sockaddr_storage& address,
-                               const uint8_t *data,
-                               size_t size) {
-    EmiNodeUtil::sendData(socket, address, data, size);
+                               const struct iovec *iov,
+                               size_t iovcnt,
+                               bool packetPair) {
+    EmiNodeUtil::sendData(socket, address, iov, iovcnt);
 }
@@ -16,6 +16,8 @@
 #include <net/if.h>
 #endif
 
+#include <sys/uio.h>
+
 class EmiSockDelegate;
 class EmiObjectWrap;
 
@@ -67,6 +69,11 @@ public:
                          uint8_t *buf, size_t bufLen);
     static void randomBytes(uint8_t *buf, size_t bufSize);
     
+    // Must use the same clock as the now parameter of timer callbacks
+    static EmiTimeInterval now();
+    // node is single threaded, so all connections of a socket can share
+    // one EmiTimerWheel.
+    static const bool SHARED_TIMER_WHEEL = true;
     static Timer *makeTimer(void *timerCookie);
     static void freeTimer(Timer *timer);
     static void scheduleTimer(Timer *timer, TimerCb *timerCb, void *data, EmiTimeInterval interval,
@@ -95,8 +102,9 @@ public:
     static void extractLocalAddress(uv_udp_t *socket, sockaddr_storage& address);
     static void sendData(uv_udp_t *socket,
                          const sockaddr_storage& address,
-                         const uint8_t *data,
-                         size_t size);
+                         const struct iovec *iov,
+                         size_t iovcnt,
+                         bool packetPair);
 };
 
 #endif
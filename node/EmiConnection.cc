@@ -13,6 +13,7 @@ using namespace v8;
 
 Persistent<String>   EmiConnection::channelQualifierSymbol;
 Persistent<String>   EmiConnection::prioritySymbol;
+Persistent<String>   EmiConnection::deadlineSymbol;
 Persistent<Function> EmiConnection::constructor;
 
 EmiConnection::EmiConnection(EmiSocket& es, const ECP& params) :
@@ -27,6 +28,7 @@ void EmiConnection::Init(Handle<Object> target) {
 #define X(sym) sym##Symbol = Persistent<String>::New(String::NewSymbol(#sym));
     X(channelQualifier);
     X(priority);
+    X(deadline);
 #undef X
     
     // Prepare constructor template
@@ -43,6 +45,7 @@ void EmiConnection::Init(Handle<Object> target) {
     X(CloseOrForceClose,          "closeOrForceClose");
     X(Send,                       "send");
     X(HasIssuedConnectionWarning, "hasIssuedConnectionWarning");
+    X(GetExpiredMessages,         "getExpiredMessages");
     X(GetSocket,                  "getSocket");
     X(GetAddressType,             "getAddressType");
     X(GetLocalPort,               "getLocalPort");
@@ -152,11 +155,13 @@ Handle<Value> EmiConnection::Send(const Arguments& args) {
     
     EmiChannelQualifier channelQualifier = EMI_CHANNEL_QUALIFIER_DEFAULT;
     EmiPriority priority = EMI_PRIORITY_DEFAULT;
+    EmiTimeInterval deadline = EMI_NO_DEADLINE;
     
     if (2 == numArgs) {
         Local<Object> opts(args[1]->ToObject());
         Local<Value>   cqv(opts->Get(channelQualifierSymbol));
         Local<Value>    pv(opts->Get(prioritySymbol));
+        Local<Value>    dv(opts->Get(deadlineSymbol));
         
         if (!cqv.IsEmpty() && !cqv->IsUndefined()) {
             if (!cqv->IsNumber()) {
@@ -173,6 +178,14 @@ Handle<Value> EmiConnection::Send(const Arguments& args) {
             
             priority = (EmiPriority) pv->Uint32Value();
         }
+        
+        if (!dv.IsEmpty() && !dv->IsUndefined()) {
+            if (!dv->IsNumber() || dv->NumberValue() < 0) {
+                THROW_TYPE_ERROR("Wrong deadline argument");
+            }
+            
+            deadline = dv->NumberValue();
+        }
     }
     
     
@@ -185,6 +198,7 @@ Handle<Value> EmiConnection::Send(const Arguments& args) {
                         Persistent<Object>::New(args[0]->ToObject()),
                         channelQualifier,
                         priority,
+                        deadline,
                         err)) {
         return err.raise("Failed to send message");
     }
@@ -201,6 +215,15 @@ Handle<Value> EmiConnection::HasIssuedConnectionWarning(const Arguments& args) {
     return scope.Close(Boolean::New(ec->_conn.issuedConnectionWarning()));
 }
 
+Handle<Value> EmiConnection::GetExpiredMessages(const Arguments& args) {
+    HandleScope scope;
+    
+    ENSURE_ZERO_ARGS(args);
+    UNWRAP(EmiConnection, ec, args);
+    
+    return scope.Close(Number::New(ec->_conn.getExpiredMessages()));
+}
+
 Handle<Value> EmiConnection::GetSocket(const Arguments& args) {
     HandleScope scope;
     
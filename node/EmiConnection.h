@@ -22,6 +22,7 @@ private:
     
     static v8::Persistent<v8::String>   channelQualifierSymbol;
     static v8::Persistent<v8::String>   prioritySymbol;
+    static v8::Persistent<v8::String>   deadlineSymbol;
     static v8::Persistent<v8::Function> constructor;
     
     // Private copy constructor and assignment operator
@@ -53,6 +54,7 @@ private:
     static v8::Handle<v8::Value> Send(const v8::Arguments& args);
     
     static v8::Handle<v8::Value> HasIssuedConnectionWarning(const v8::Arguments& args);
+    static v8::Handle<v8::Value> GetExpiredMessages(const v8::Arguments& args);
     static v8::Handle<v8::Value> GetSocket(const v8::Arguments& args);
     static v8::Handle<v8::Value> GetAddressType(const v8::Arguments& args);
     static v8::Handle<v8::Value> GetLocalPort(const v8::Arguments& args);
@@ -178,21 +178,31 @@ error:
 
 void EmiNodeUtil::sendData(uv_udp_t *socket,
                            const sockaddr_storage& address,
-                           const uint8_t *data,
-                           size_t size) {
+                           const struct iovec *iov,
+                           size_t iovcnt) {
+    size_t size = 0;
+    for (size_t i=0; i<iovcnt; i++) {
+        size += iov[i].iov_len;
+    }
+    
     uv_udp_send_t *req = (uv_udp_send_t *)malloc(sizeof(uv_udp_send_t)+
                                                  sizeof(uv_buf_t)+
                                                  sizeof(size_t));
     uv_buf_t      *buf = (uv_buf_t *)&req[1];
     size_t        *sizePtr = (size_t *)&buf[1];
     
-    // TODO This copies the packet data. We might want to redesign
-    // this part of the code so that this is not required.
+    // The data has to be copied, because libuv sends it
+    // asynchronously. The buffers in iov are gathered straight into
+    // the send buffer.
     //
     // TODO It would probably be better and faster to use the slab
     // allocator here.
     char *bufData = (char *)malloc(size);
-    memcpy(bufData, data, size);
+    size_t pos = 0;
+    for (size_t i=0; i<iovcnt; i++) {
+        memcpy(bufData+pos, iov[i].iov_base, iov[i].iov_len);
+        pos += iov[i].iov_len;
+    }
     
     *buf = uv_buf_init((char *)bufData, size);
     *sizePtr = size;
@@ -6,6 +6,7 @@
 #include "../core/EmiTypes.h"
 
 #include <stdint.h>
+#include <sys/uio.h>
 #include <uv.h>
 #include <node.h>
 
@@ -106,10 +107,12 @@ public:
                                 EmiNodeUtilRecvCb *recvCb,
                                 void *data,
                                 EmiError& error);
+    // Sends a datagram that consists of the concatenation of the
+    // buffers in iov
     static void sendData(uv_udp_t *socket,
                          const sockaddr_storage& address,
-                         const uint8_t *data,
-                         size_t size);
+                         const struct iovec *iov,
+                         size_t iovcnt);
     
     static EmiTimeInterval now();
 
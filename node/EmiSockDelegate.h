@@ -58,6 +58,7 @@ public:
     inline const EmiSocket& getEmiSocket() const { return _es; }
     
     inline EmiObjectWrap *getSocketCookie() { return (EmiObjectWrap *)&_es; }
+    inline void *getTimerCookie() { return NULL; }
 };
 
 #endif
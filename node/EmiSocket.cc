@@ -18,6 +18,11 @@ using namespace v8;
   EXPAND_SYM(initialConnectionTimeout);                    \
   EXPAND_SYM(receiverBufferSize);                          \
   EXPAND_SYM(senderBufferSize);                            \
+  EXPAND_SYM(congestionControl);                           \
+  EXPAND_SYM(fecChannels);                                 \
+  EXPAND_SYM(fecGroupSize);                                \
+  EXPAND_SYM(conflatedChannels);                           \
+  EXPAND_SYM(channelWeights);                              \
   EXPAND_SYM(acceptConnections);                           \
   EXPAND_SYM(type);                                        \
   EXPAND_SYM(port);                                        \
@@ -145,10 +150,29 @@ Handle<Value> EmiSocket::New(const Arguments& args) {
     READ_CONFIG(sc, connectionTimeout,                 IsNumber,  EmiTimeInterval, NumberValue);
     READ_CONFIG(sc, initialConnectionTimeout,          IsNumber,  EmiTimeInterval, NumberValue);
     READ_CONFIG(sc, senderBufferSize,                  IsNumber,  size_t,          Uint32Value);
+    READ_CONFIG(sc, congestionControl,                 IsNumber,  EmiCongestionControlAlgorithm, Uint32Value);
+    READ_CONFIG(sc, fecChannels,                       IsNumber,  uint32_t,        Uint32Value);
+    READ_CONFIG(sc, fecGroupSize,                      IsNumber,  size_t,          Uint32Value);
+    READ_CONFIG(sc, conflatedChannels,                 IsNumber,  uint32_t,        Uint32Value);
     READ_CONFIG(sc, acceptConnections,                 IsBoolean, bool,            BooleanValue);
     READ_CONFIG(sc, port,                              IsNumber,  uint16_t,        Uint32Value);
     READ_CONFIG(sc, fabricatedPacketDropRate,          IsNumber,  EmiTimeInterval, NumberValue);
     
+    if (HAS_CONFIG_PARAM(channelWeights)) {
+        // channelWeights maps channel qualifiers to weights. It can be
+        // an array or an object with numeric keys.
+        CHECK_CONFIG_PARAM(channelWeights, IsObject);
+        Local<Object> weights(channelWeights->ToObject());
+        for (uint32_t i=0; i<256; i++) {
+            Local<Value> weight(weights->Get(i));
+            if (weight.IsEmpty() || weight->IsUndefined()) {
+                continue;
+            }
+            CHECK_CONFIG_PARAM(weight, IsNumber);
+            sc.channelWeights[i] = (uint8_t) weight->Uint32Value();
+        }
+    }
+    
     // If initialConnectionTimeout is not set, it should be
     // the value of connectionTimeout.
     if (!HAS_CONFIG_PARAM(initialConnectionTimeout)) {
@@ -29,6 +29,11 @@ private:
     static v8::Persistent<v8::String> initialConnectionTimeoutSymbol;
     static v8::Persistent<v8::String> receiverBufferSizeSymbol;
     static v8::Persistent<v8::String> senderBufferSizeSymbol;
+    static v8::Persistent<v8::String> congestionControlSymbol;
+    static v8::Persistent<v8::String> fecChannelsSymbol;
+    static v8::Persistent<v8::String> fecGroupSizeSymbol;
+    static v8::Persistent<v8::String> conflatedChannelsSymbol;
+    static v8::Persistent<v8::String> channelWeightsSymbol;
     static v8::Persistent<v8::String> acceptConnectionsSymbol;
     static v8::Persistent<v8::String> typeSymbol;
     static v8::Persistent<v8::String> portSymbol;
@@ -36,6 +36,7 @@ void InitAll(Handle<Object> target) {
     X(UNRELIABLE_SEQUENCED, EMI_CHANNEL_TYPE_UNRELIABLE_SEQUENCED);
     X(RELIABLE_SEQUENCED,   EMI_CHANNEL_TYPE_RELIABLE_SEQUENCED);
     X(RELIABLE_ORDERED,     EMI_CHANNEL_TYPE_RELIABLE_ORDERED);
+    X(RELIABLE_UNORDERED,   EMI_CHANNEL_TYPE_RELIABLE_UNORDERED);
     
     // EmiDisconnectReason
     X(NO_ERROR,                   EMI_REASON_NO_ERROR);
@@ -44,6 +45,10 @@ void InitAll(Handle<Object> target) {
     X(CONNECTION_TIMED_OUT,       EMI_REASON_CONNECTION_TIMED_OUT);
     X(OTHER_HOST_DID_NOT_RESPOND, EMI_REASON_OTHER_HOST_DID_NOT_RESPOND);
     
+    // EmiCongestionControlAlgorithm
+    X(CONGESTION_CONTROL_UDT,   EMI_CONGESTION_CONTROL_UDT);
+    X(CONGESTION_CONTROL_DELAY, EMI_CONGESTION_CONTROL_DELAY);
+    
 #undef X
 }
 
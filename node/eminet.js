@@ -147,7 +147,7 @@ Util.inherits(EmiConnection, Events.EventEmitter);
   'hasIssuedConnectionWarning', 'getSocket', 'getAddressType',
   'getLocalPort', 'getLocalAddress', 'getRemoteAddress',
   'getRemotePort', 'getInboundPort', 'isOpen', 'isOpening',
-  'getP2PState'
+  'getP2PState', 'getExpiredMessages'
 ].forEach(function(name) {
   EmiConnection.prototype[name] = function() {
     return this._handle[name].apply(this._handle, arguments);
@@ -222,22 +222,24 @@ exports.channelQualifier = function(type, number) {
 
   var typeIsNumber = (Object.prototype.toString.call(type) == '[object Number]');
   
-  if (!typeIsNumber || type < 0 || type > 3) {
+  if (!typeIsNumber || type < 0 || type > 4) {
     throw new Error("Invalid channel type "+type);
   }
   if (!typeIsNumber || number < 0 || number > 31) {
     throw new Error("Invalid channel number "+number);
   }
   
-  return number | (type << 6);
+  // Reliable unordered channels don't fit in the two type bits; see
+  // EMI_CHANNEL_QUALIFIER in EmiTypes.h
+  return number | (4 == type ? 0x20 : (type << 6));
 };
 
 exports.channelQualifierType = function(cq) {
-  return (cq & 0xc0) >> 6;
+  return (0x20 == (cq & 0xe0) ? 4 : (cq & 0xc0) >> 6);
 };
 
 exports.isValidChannelQualifier = function(cq) {
-  return 0 == (cq & 0x20);
+  return 0 == (cq & 0x20) || 0 == (cq & 0xc0);
 };
 
 for (var key in EmiNetAddon.enums) {
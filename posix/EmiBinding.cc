@@ -0,0 +1,729 @@
+//
+//  EmiBinding.cc
+//  eminet
+//
+
+#include "EmiBinding.h"
+
+#include "../core/EmiNetUtil.h"
+#include "../core/EmiAddressCmp.h"
+
+#include <openssl/rand.h>
+#include <openssl/hmac.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <cstring>
+#include <algorithm>
+
+// Datagrams are received with recvmmsg, up to
+// EMI_BINDING_RECV_BATCH_SIZE at a time, into slots of
+// EMI_BINDING_RECV_SLOT_SIZE bytes of one shared receive buffer.
+// EmiNet packets are never larger than the MTU, so a datagram that
+// doesn't fit in a slot is not an EmiNet packet and is dropped.
+static const size_t EMI_BINDING_RECV_BATCH_SIZE = 32;
+static const size_t EMI_BINDING_RECV_SLOT_SIZE = 4096;
+
+// EMI_BINDING_UDP_OFFLOAD enables Linux UDP segmentation offload (GSO)
+// and receive offload (GRO), when the kernel supports them. Define it
+// to 0 to disable them.
+//
+// With GSO, consecutive datagrams in a send batch that go to the same
+// address and have the same size are sent as one train of segments,
+// which the kernel (or the network card) splits up. This is what
+// happens when a connection sends a large backlog of full packets.
+// The last segment of a train may be smaller than the others.
+//
+// With GRO, the kernel may deliver several datagrams from the same
+// sender as one, and tells the size of the segments. The segments are
+// delivered to the callback one by one. Coalesced datagrams can be up
+// to 64KB, so sockets with GRO receive into fewer but larger slots.
+//
+// Packet pairs (see EmiLinkCapacity) are never put in GSO trains: The
+// first packet of a pair ends the train before it, and the second one
+// is sent on its own. Segments of one train arrive as one coalesced
+// datagram with one arrival time, so a pair in a train would give the
+// receiver no time difference to measure. Datagrams that are sent on
+// their own are not coalesced by GRO over loopback; network cards may
+// still coalesce them, in which case EmiLinkCapacity drops the sample.
+#ifndef EMI_BINDING_UDP_OFFLOAD
+#  if defined(UDP_SEGMENT) && defined(UDP_GRO)
+#    define EMI_BINDING_UDP_OFFLOAD 1
+#  else
+#    define EMI_BINDING_UDP_OFFLOAD 0
+#  endif
+#endif
+
+static const size_t EMI_BINDING_GRO_RECV_BATCH_SIZE = 8;
+static const size_t EMI_BINDING_GRO_RECV_SLOT_SIZE = 65536;
+
+// The limits of one GSO train. The kernel rejects trains of more than
+// 64 segments, and the train has to fit in one IP packet.
+static const size_t EMI_BINDING_GSO_MAX_SEGMENTS = 64;
+static const size_t EMI_BINDING_GSO_MAX_BYTES = 65000;
+
+// The maximal number of datagrams and bytes that are buffered per
+// socket before they are sent with sendmmsg. When the batch is full,
+// it is flushed immediately.
+static const size_t EMI_BINDING_SEND_BATCH_SIZE = 64;
+static const size_t EMI_BINDING_SEND_BATCH_BYTES = 65536;
+
+// Datagrams that are sent while the EmiEventLoop is dispatching events
+// are not sent immediately. They are copied into the send batch of the
+// socket, and the whole batch is sent with one sendmmsg call at the end
+// of the loop iteration. Because all connection tick timers that are
+// due fire in the same loop iteration, this sends the packets of all
+// server connections on a socket with one system call.
+struct EmiBindingSendBatch {
+    struct mmsghdr   msgs[EMI_BINDING_SEND_BATCH_SIZE];
+    struct iovec     iovs[EMI_BINDING_SEND_BATCH_SIZE];
+    sockaddr_storage addrs[EMI_BINDING_SEND_BATCH_SIZE];
+    // For GSO trains: The size of the segments, the number of segments,
+    // and whether the last segment was smaller than the others, which
+    // means that no more segments can be added.
+    size_t           segmentSizes[EMI_BINDING_SEND_BATCH_SIZE];
+    size_t           segmentCounts[EMI_BINDING_SEND_BATCH_SIZE];
+    bool             trainsClosed[EMI_BINDING_SEND_BATCH_SIZE];
+    char             controls[EMI_BINDING_SEND_BATCH_SIZE][CMSG_SPACE(sizeof(uint16_t))];
+    uint8_t          bytes[EMI_BINDING_SEND_BATCH_BYTES];
+    size_t           count;
+    size_t           bytesUsed;
+};
+
+struct EmiBindingRecvBatch {
+    struct mmsghdr   msgs[EMI_BINDING_RECV_BATCH_SIZE];
+    struct iovec     iovs[EMI_BINDING_RECV_BATCH_SIZE];
+    sockaddr_storage addrs[EMI_BINDING_RECV_BATCH_SIZE];
+    // Receives the arrival time and the GRO segment size
+    char             controls[EMI_BINDING_RECV_BATCH_SIZE][CMSG_SPACE(sizeof(struct timespec))+CMSG_SPACE(sizeof(int))];
+    // The order in which the received datagrams are delivered; see
+    // groupRecvBatch.
+    size_t           order[EMI_BINDING_RECV_BATCH_SIZE];
+};
+
+struct EmiBindingSocket {
+    int                      fd;
+    EmiEventLoop            *loop;
+    EmiEventLoop::Watcher   *watcher;
+    EmiBinding::EmiOnMessage *callback;
+    void                    *userData;
+    sockaddr_storage         localAddress;
+    // The buffer that datagrams are received into. It is reused for
+    // every batch unless someone keeps a reference to it after the
+    // receive callback has returned.
+    EmiBuffer               *recvBuf;
+    EmiBindingRecvBatch     *recvBatch;
+    size_t                   recvSlotSize;
+    size_t                   recvBatchSize;
+    // True if UDP_GRO or UDP_SEGMENT, respectively, is enabled
+    bool                     gro;
+    bool                     gso;
+    // True if SO_TIMESTAMPNS is enabled, in which case the kernel tells
+    // when each datagram arrived.
+    bool                     timestamps;
+    // The arrival time of the last datagram that was delivered to the
+    // callback, in the time base of EmiEventLoop::now
+    EmiTimeInterval          lastRecvTime;
+    // closeSocket might be called from within the receive callback.
+    // When that happens, the socket is deallocated when the callback
+    // returns instead.
+    bool                     inCallback;
+    bool                     closed;
+    // Allocated the first time a datagram is batched, to avoid
+    // wasting memory on sockets that never send anything.
+    EmiBindingSendBatch     *sendBatch;
+};
+
+// Returns false if the datagram could not be sent
+static bool sendDatagram(EmiBindingSocket *sock,
+                         const sockaddr_storage& address,
+                         const struct iovec *iov,
+                         size_t iovcnt) {
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_name = (void *)&address;
+    hdr.msg_namelen = EmiNetUtil::addrSize(address);
+    hdr.msg_iov = (struct iovec *)iov;
+    hdr.msg_iovlen = iovcnt;
+    
+    ssize_t ret;
+    do {
+        ret = sendmsg(sock->fd, &hdr, /*flags:*/0);
+    } while (-1 == ret && EINTR == errno);
+    
+    // If the send buffer of the socket is full (EAGAIN), the packet is
+    // dropped. This is no different from a packet that is lost on the
+    // network, and the protocol handles that.
+    return -1 != ret;
+}
+
+// Sends the segments of a GSO train as separate datagrams. Returns
+// true if any of them could be sent.
+static bool sendSegmentsSeparately(EmiBindingSocket *sock, EmiBindingSendBatch *batch, size_t idx) {
+    uint8_t *data = (uint8_t *)batch->iovs[idx].iov_base;
+    size_t size = batch->iovs[idx].iov_len;
+    size_t segmentSize = batch->segmentSizes[idx];
+    
+    bool sent = false;
+    for (size_t offset=0; offset<size; offset+=segmentSize) {
+        struct iovec iov;
+        iov.iov_base = data+offset;
+        iov.iov_len = std::min(segmentSize, size-offset);
+        if (sendDatagram(sock, batch->addrs[idx], &iov, 1)) {
+            sent = true;
+        }
+    }
+    return sent;
+}
+
+static void flushSendBatch(EmiBindingSocket *sock) {
+    EmiBindingSendBatch *batch = sock->sendBatch;
+    if (!batch || 0 == batch->count) {
+        return;
+    }
+    
+    size_t i = 0;
+    while (i < batch->count) {
+        int ret = sendmmsg(sock->fd, batch->msgs+i, batch->count-i, /*flags:*/0);
+        
+        if (-1 == ret) {
+            if (EINTR == errno) {
+                continue;
+            }
+            else if (EAGAIN == errno || EWOULDBLOCK == errno) {
+                // The send buffer of the socket is full. Drop the rest
+                // of the batch; see the comment in sendDatagram.
+                break;
+            }
+            else if (batch->segmentCounts[i] > 1 && (EIO == errno || EINVAL == errno || EMSGSIZE == errno)) {
+                // The kernel or the network interface doesn't accept
+                // GSO trains after all, or the segments are bigger than
+                // the MTU of the interface, which the socket doesn't
+                // fragment (see setDontFragment). If the segments can
+                // be sent separately, it was GSO that failed, so stop
+                // using GSO on this socket.
+                if (sendSegmentsSeparately(sock, batch, i)) {
+                    sock->gso = false;
+                }
+                i++;
+            }
+            else {
+                // Sending datagram i failed, for instance because its
+                // destination is unreachable. Skip it, but don't let
+                // that prevent the other datagrams from being sent.
+                i++;
+            }
+        }
+        else {
+            i += ret;
+        }
+    }
+    
+    batch->count = 0;
+    batch->bytesUsed = 0;
+}
+
+static void flush_cb(EmiTimeInterval now, EmiEventLoop::Watcher *watcher, void *data) {
+    flushSendBatch((EmiBindingSocket *)data);
+}
+
+void EmiBinding::hmacHash(const uint8_t *key, size_t keyLength,
+                          const uint8_t *data, size_t dataLength,
+                          uint8_t *buf, size_t bufLen) {
+    unsigned int bufLenInt = bufLen;
+    ASSERT(HMAC(EVP_sha256(), key, keyLength, data, dataLength, buf, &bufLenInt));
+}
+
+void EmiBinding::randomBytes(uint8_t *buf, size_t bufSize) {
+    ASSERT(RAND_bytes(buf, bufSize));
+}
+
+EmiBinding::Timer *EmiBinding::makeTimer(EmiEventLoop *loop) {
+    return loop->makeTimer();
+}
+
+void EmiBinding::freeTimer(Timer *timer) {
+    timer->getLoop().freeTimer(timer);
+}
+
+void EmiBinding::scheduleTimer(Timer *timer, TimerCb *timerCb, void *data, EmiTimeInterval interval,
+                               bool repeating, bool reschedule) {
+    if (!reschedule && timer->isActive()) {
+        // We were told not to re-schedule the timer.
+        // The timer is already active, so do nothing.
+        return;
+    }
+    
+    timer->getLoop().scheduleTimer(timer, timerCb, data, interval, repeating);
+}
+
+void EmiBinding::descheduleTimer(Timer *timer) {
+    timer->getLoop().descheduleTimer(timer);
+}
+
+bool EmiBinding::getNetworkInterfaces(NetworkInterfaces& ni, Error& err) {
+    int ret = getifaddrs(&ni.first);
+    if (-1 == ret) {
+        err = makeError("com.emilir.eminet.networkifaces", errno);
+        return false;
+    }
+    
+    ni.second = ni.first;
+    return true;
+}
+
+bool EmiBinding::nextNetworkInterface(NetworkInterfaces& ni, const char*& name, struct sockaddr_storage& addr) {
+    while (ni.second) {
+        ifaddrs *ifa = ni.second;
+        ni.second = ifa->ifa_next;
+        
+        if (!ifa->ifa_addr) {
+            continue;
+        }
+        
+        int family = ifa->ifa_addr->sa_family;
+        if (AF_INET == family) {
+            memcpy(&addr, ifa->ifa_addr, sizeof(sockaddr_in));
+        }
+        else if (AF_INET6 == family) {
+            memcpy(&addr, ifa->ifa_addr, sizeof(sockaddr_in6));
+        }
+        else {
+            // Some other address family that we don't support or care about. Continue the search.
+            continue;
+        }
+        
+        name = ifa->ifa_name;
+        
+        return true;
+    }
+    
+    return false;
+}
+
+void EmiBinding::freeNetworkInterfaces(const NetworkInterfaces& ni) {
+    freeifaddrs(ni.first);
+}
+
+static void deleteSocket(EmiBindingSocket *sock) {
+    sock->recvBuf->release();
+    delete sock->recvBatch;
+    delete sock;
+}
+
+// Sorts the datagrams of a batch so that datagrams from the same remote
+// address are delivered back to back. The sort is stable, so datagrams
+// from one host are still delivered in the order they arrived. This
+// makes EmiSock find the connection of every datagram but the first of
+// each group in its last connection cache instead of in its map.
+//
+// Batches are small, and most often come from only a few hosts, so an
+// insertion sort is good enough.
+static void groupRecvBatch(EmiBindingRecvBatch *batch, size_t count) {
+    for (size_t i=0; i<count; i++) {
+        batch->order[i] = i;
+    }
+    
+    size_t groupEnd = 0;
+    while (groupEnd < count) {
+        const sockaddr_storage& addr(batch->addrs[batch->order[groupEnd]]);
+        groupEnd++;
+        
+        for (size_t i=groupEnd; i<count; i++) {
+            size_t idx = batch->order[i];
+            if (0 == EmiAddressCmp::compare(addr, batch->addrs[idx])) {
+                memmove(batch->order+groupEnd+1, batch->order+groupEnd, (i-groupEnd)*sizeof(size_t));
+                batch->order[groupEnd] = idx;
+                groupEnd++;
+            }
+        }
+    }
+}
+
+// Returns the size of the segments of a received datagram. This is the
+// size of the datagram itself unless GRO has coalesced several
+// datagrams into it.
+static size_t groSegmentSize(const struct mmsghdr& msg) {
+#if EMI_BINDING_UDP_OFFLOAD
+    struct msghdr *hdr = (struct msghdr *)&msg.msg_hdr;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+        if (SOL_UDP == cmsg->cmsg_level && UDP_GRO == cmsg->cmsg_type) {
+            int segmentSize;
+            memcpy(&segmentSize, CMSG_DATA(cmsg), sizeof(segmentSize));
+            if (segmentSize > 0) {
+                return segmentSize;
+            }
+        }
+    }
+#endif
+    
+    return msg.msg_len;
+}
+
+// Returns the difference between the realtime clock, which
+// SO_TIMESTAMPNS uses, and the monotonic clock of EmiEventLoop::now.
+static EmiTimeInterval realtimeOffset() {
+    struct timespec rt, mt;
+    clock_gettime(CLOCK_REALTIME, &rt);
+    clock_gettime(CLOCK_MONOTONIC, &mt);
+    return (rt.tv_sec-mt.tv_sec) + ((EmiTimeInterval)(rt.tv_nsec-mt.tv_nsec))/1000000000.0;
+}
+
+// Returns the time when the kernel received a datagram, in the time
+// base of EmiEventLoop::now. All datagrams of a batch are read at the
+// same time, but they might have arrived far apart; the two packets of
+// a packet pair (see EmiLinkCapacity) usually end up in the same batch.
+//
+// The result is never later than now, and never earlier than the time
+// of the previous datagram on the socket, so that the time that is
+// given to the callback never goes backwards.
+static EmiTimeInterval recvTime(EmiBindingSocket *sock,
+                                const struct mmsghdr& msg,
+                                EmiTimeInterval clockOffset,
+                                EmiTimeInterval now) {
+    EmiTimeInterval time = now;
+    
+    struct msghdr *hdr = (struct msghdr *)&msg.msg_hdr;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+        if (SOL_SOCKET == cmsg->cmsg_level && SCM_TIMESTAMPNS == cmsg->cmsg_type) {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            time = std::min(now, ts.tv_sec + ((EmiTimeInterval)ts.tv_nsec)/1000000000.0 - clockOffset);
+            break;
+        }
+    }
+    
+    time = std::max(time, sock->lastRecvTime);
+    sock->lastRecvTime = time;
+    return time;
+}
+
+static void recv_cb(EmiTimeInterval now, EmiEventLoop::Watcher *watcher, void *data) {
+    EmiBindingSocket *sock = (EmiBindingSocket *)data;
+    EmiBindingRecvBatch *batch = sock->recvBatch;
+    
+    // Drain the socket completely, so that one epoll wakeup handles
+    // all datagrams that have arrived since the last one.
+    for (;;) {
+        if (sock->recvBuf->isShared()) {
+            // Someone kept a reference to the previous buffer; we can't
+            // overwrite it.
+            sock->recvBuf->release();
+            sock->recvBuf = EmiBuffer::make(sock->recvSlotSize*sock->recvBatchSize);
+        }
+        
+        uint8_t *buf = sock->recvBuf->getData();
+        for (size_t i=0; i<sock->recvBatchSize; i++) {
+            batch->iovs[i].iov_base = buf+i*sock->recvSlotSize;
+            batch->iovs[i].iov_len = sock->recvSlotSize;
+            
+            struct msghdr& hdr(batch->msgs[i].msg_hdr);
+            memset(&hdr, 0, sizeof(hdr));
+            hdr.msg_name = &batch->addrs[i];
+            hdr.msg_namelen = sizeof(sockaddr_storage);
+            hdr.msg_iov = &batch->iovs[i];
+            hdr.msg_iovlen = 1;
+            if (sock->gro || sock->timestamps) {
+                hdr.msg_control = batch->controls[i];
+                hdr.msg_controllen = sizeof(batch->controls[i]);
+            }
+        }
+        
+        int count = recvmmsg(sock->fd, batch->msgs, sock->recvBatchSize,
+                             /*flags:*/0, /*timeout:*/NULL);
+        
+        if (-1 == count) {
+            // EAGAIN means that the socket is drained. Other errors, for
+            // instance ECONNREFUSED caused by ICMP messages, are not
+            // interesting for a connectionless protocol.
+            if (EINTR == errno) {
+                continue;
+            }
+            return;
+        }
+        
+        groupRecvBatch(batch, count);
+        
+        EmiTimeInterval clockOffset = (sock->timestamps ? realtimeOffset() : 0);
+        
+        // The EmiBufferRef holds an extra reference during the callbacks.
+        // If a callback retains it, recvBuf will be shared afterwards.
+        {
+            EmiBufferRef data(EmiBufferRef::retained(sock->recvBuf));
+            
+            sock->inCallback = true;
+            for (int i=0; i<count && !sock->closed; i++) {
+                size_t idx = batch->order[i];
+                const struct mmsghdr& msg(batch->msgs[idx]);
+                
+                if (0 == msg.msg_len || (msg.msg_hdr.msg_flags & MSG_TRUNC)) {
+                    continue;
+                }
+                
+                EmiTimeInterval time = (sock->timestamps ? recvTime(sock, msg, clockOffset, now) : now);
+                
+                size_t segmentSize = groSegmentSize(msg);
+                for (size_t segmentOffset=0; segmentOffset<msg.msg_len && !sock->closed; segmentOffset+=segmentSize) {
+                    sock->callback(sock,
+                                   sock->userData,
+                                   time,
+                                   batch->addrs[idx],
+                                   data,
+                                   /*offset:*/idx*sock->recvSlotSize+segmentOffset,
+                                   std::min(segmentSize, msg.msg_len-segmentOffset));
+                }
+            }
+            sock->inCallback = false;
+        }
+        
+        if (sock->closed) {
+            deleteSocket(sock);
+            return;
+        }
+        
+        if ((size_t)count < sock->recvBatchSize) {
+            // The socket is drained; don't waste a system call on
+            // finding that out.
+            return;
+        }
+    }
+}
+
+void EmiBinding::closeSocket(EmiBindingSocket *socket) {
+    // Unwatching cancels the pending flush, so do it now
+    flushSendBatch(socket);
+    delete socket->sendBatch;
+    socket->sendBatch = NULL;
+    
+    socket->loop->unwatch(socket->watcher);
+    socket->watcher = NULL;
+    
+    close(socket->fd);
+    
+    if (socket->inCallback) {
+        socket->closed = true;
+    }
+    else {
+        deleteSocket(socket);
+    }
+}
+
+// Makes the kernel set the don't fragment bit on the datagrams of the
+// socket and never fragment them. EmiPathMtu relies on this: a probe
+// that is bigger than the path MTU must be dropped, not fragmented,
+// or the probe succeeds anyway and every full packet after it is
+// fragmented. The probe modes also make the kernel ignore its cached
+// path MTU, which would otherwise prevent probes above it from being
+// sent at all. Failing to do this is not fatal; the socket then works
+// like before, without the MTU guarantee.
+static void setDontFragment(int fd, int family) {
+    if (AF_INET == family) {
+        int val = IP_PMTUDISC_PROBE;
+        setsockopt(fd, IPPROTO_IP, IP_MTU_DISCOVER, &val, sizeof(val));
+    }
+    else if (AF_INET6 == family) {
+        int val = IPV6_PMTUDISC_PROBE;
+        setsockopt(fd, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &val, sizeof(val));
+        
+        int one = 1;
+        setsockopt(fd, IPPROTO_IPV6, IPV6_DONTFRAG, &one, sizeof(one));
+    }
+}
+
+EmiBindingSocket *EmiBinding::openSocket(EmiEventLoop *loop,
+                                         EmiOnMessage *callback,
+                                         void *userData,
+                                         const sockaddr_storage& address,
+                                         Error& err) {
+    int fd = socket(address.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (-1 == fd) {
+        err = makeError("com.emilir.eminet.socket", errno);
+        return NULL;
+    }
+    
+    setDontFragment(fd, address.ss_family);
+    
+    if (-1 == bind(fd, (const struct sockaddr *)&address, EmiNetUtil::addrSize(address))) {
+        err = makeError("com.emilir.eminet.socket", errno);
+        close(fd);
+        return NULL;
+    }
+    
+    EmiBindingSocket *sock = new EmiBindingSocket;
+    sock->fd = fd;
+    sock->loop = loop;
+    sock->callback = callback;
+    sock->userData = userData;
+    sock->gro = false;
+    sock->gso = false;
+    sock->lastRecvTime = 0;
+    
+    // Without timestamps, all datagrams of a batch get the time when
+    // the batch was read.
+    int timestampsOn = 1;
+    sock->timestamps = (0 == setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &timestampsOn, sizeof(timestampsOn)));
+
+#if EMI_BINDING_UDP_OFFLOAD
+    // These fail on kernels that don't support GRO or GSO, in which
+    // case the socket works like it would without offloading.
+    int one = 1;
+    sock->gro = (0 == setsockopt(fd, SOL_UDP, UDP_GRO, &one, sizeof(one)));
+    
+    int segmentSize;
+    socklen_t segmentSizeLen = sizeof(segmentSize);
+    sock->gso = (0 == getsockopt(fd, SOL_UDP, UDP_SEGMENT, &segmentSize, &segmentSizeLen));
+#endif
+    
+    sock->recvSlotSize = (sock->gro ? EMI_BINDING_GRO_RECV_SLOT_SIZE : EMI_BINDING_RECV_SLOT_SIZE);
+    sock->recvBatchSize = (sock->gro ? EMI_BINDING_GRO_RECV_BATCH_SIZE : EMI_BINDING_RECV_BATCH_SIZE);
+    sock->recvBuf = EmiBuffer::make(sock->recvSlotSize*sock->recvBatchSize);
+    sock->recvBatch = new EmiBindingRecvBatch;
+    sock->inCallback = false;
+    sock->closed = false;
+    sock->sendBatch = NULL;
+    
+    socklen_t len = sizeof(sockaddr_storage);
+    getsockname(fd, (struct sockaddr *)&sock->localAddress, &len);
+    
+    sock->watcher = loop->watch(fd, recv_cb, flush_cb, sock, err);
+    if (!sock->watcher) {
+        close(fd);
+        deleteSocket(sock);
+        return NULL;
+    }
+    
+    return sock;
+}
+
+void EmiBinding::extractLocalAddress(EmiBindingSocket *socket, sockaddr_storage& address) {
+    address = socket->localAddress;
+}
+
+// Copies the buffers in iov to buf. The datagrams that are batched are
+// gathered straight into the batch; this is the only time that their
+// data is copied.
+static void gather(uint8_t *buf, const struct iovec *iov, size_t iovcnt) {
+    size_t pos = 0;
+    for (size_t i=0; i<iovcnt; i++) {
+        memcpy(buf+pos, iov[i].iov_base, iov[i].iov_len);
+        pos += iov[i].iov_len;
+    }
+}
+
+// Adds the datagram as a segment of the GSO train of the last datagram
+// of the batch, if possible. Returns false if it couldn't be added.
+static bool appendToTrain(EmiBindingSocket *sock,
+                          EmiBindingSendBatch *batch,
+                          const sockaddr_storage& address,
+                          const struct iovec *iov,
+                          size_t iovcnt,
+                          size_t size) {
+#if EMI_BINDING_UDP_OFFLOAD
+    if (!sock->gso || 0 == batch->count) {
+        return false;
+    }
+    
+    size_t idx = batch->count-1;
+    size_t segmentSize = batch->segmentSizes[idx];
+    
+    if (batch->trainsClosed[idx] ||
+        0 == size ||
+        size > segmentSize ||
+        EMI_BINDING_GSO_MAX_SEGMENTS == batch->segmentCounts[idx] ||
+        batch->iovs[idx].iov_len+size > EMI_BINDING_GSO_MAX_BYTES ||
+        EMI_BINDING_SEND_BATCH_BYTES-batch->bytesUsed < size ||
+        0 != EmiAddressCmp::compare(address, batch->addrs[idx])) {
+        return false;
+    }
+    
+    // The datagrams of a batch are stored back to back, so the new
+    // segment goes right after the end of the train.
+    gather(batch->bytes+batch->bytesUsed, iov, iovcnt);
+    batch->iovs[idx].iov_len += size;
+    batch->bytesUsed += size;
+    batch->segmentCounts[idx] += 1;
+    if (size < segmentSize) {
+        batch->trainsClosed[idx] = true;
+    }
+    
+    if (2 == batch->segmentCounts[idx]) {
+        // This datagram just became a train
+        struct msghdr& hdr(batch->msgs[idx].msg_hdr);
+        hdr.msg_control = batch->controls[idx];
+        hdr.msg_controllen = sizeof(batch->controls[idx]);
+        
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        uint16_t gsoSize = segmentSize;
+        memcpy(CMSG_DATA(cmsg), &gsoSize, sizeof(gsoSize));
+    }
+    
+    return true;
+#else
+    return false;
+#endif
+}
+
+void EmiBinding::sendData(EmiBindingSocket *socket,
+                          const sockaddr_storage& address,
+                          const struct iovec *iov,
+                          size_t iovcnt,
+                          bool packetPair) {
+    size_t size = 0;
+    for (size_t i=0; i<iovcnt; i++) {
+        size += iov[i].iov_len;
+    }
+    
+    if (size > EMI_BINDING_SEND_BATCH_BYTES) {
+        // This datagram will never fit in a batch
+        sendDatagram(socket, address, iov, iovcnt);
+        return;
+    }
+    
+    EmiBindingSendBatch *batch = socket->sendBatch;
+    if (!batch) {
+        batch = socket->sendBatch = new EmiBindingSendBatch;
+        batch->count = 0;
+        batch->bytesUsed = 0;
+    }
+    
+    if (!packetPair && appendToTrain(socket, batch, address, iov, iovcnt, size)) {
+        socket->loop->requestFlush(socket->watcher);
+        return;
+    }
+    
+    if (EMI_BINDING_SEND_BATCH_SIZE == batch->count ||
+        EMI_BINDING_SEND_BATCH_BYTES-batch->bytesUsed < size) {
+        flushSendBatch(socket);
+    }
+    
+    size_t idx = batch->count;
+    uint8_t *buf = batch->bytes+batch->bytesUsed;
+    gather(buf, iov, iovcnt);
+    batch->addrs[idx] = address;
+    batch->segmentSizes[idx] = size;
+    batch->segmentCounts[idx] = 1;
+    batch->trainsClosed[idx] = packetPair;
+    
+    batch->iovs[idx].iov_base = buf;
+    batch->iovs[idx].iov_len = size;
+    
+    struct msghdr& hdr(batch->msgs[idx].msg_hdr);
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_name = &batch->addrs[idx];
+    hdr.msg_namelen = EmiNetUtil::addrSize(address);
+    hdr.msg_iov = &batch->iovs[idx];
+    hdr.msg_iovlen = 1;
+    
+    batch->count += 1;
+    batch->bytesUsed += size;
+    
+    // If the loop is not dispatching events, this flushes the batch
+    // immediately.
+    socket->loop->requestFlush(socket->watcher);
+}
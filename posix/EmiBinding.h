@@ -0,0 +1,129 @@
+//
+//  EmiBinding.h
+//  eminet
+//
+
+#ifndef eminet_EmiBinding_h
+#define eminet_EmiBinding_h
+
+#include "EmiError.h"
+#include "EmiBuffer.h"
+#include "EmiEventLoop.h"
+
+#include "../core/EmiTypes.h"
+
+#include <utility>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/uio.h>
+
+struct EmiBindingSocket;
+
+// The posix binding. It uses an EmiEventLoop (epoll and timerfd) for
+// timers and network I/O and plain reference counted EmiBuffers for
+// data, which means that there is no per packet overhead of a managed
+// runtime like V8 or ObjC.
+//
+// The SocketCookie and the TimerCookie are the EmiEventLoop* that the
+// sockets and timers should be attached to.
+class EmiBinding {
+private:
+    inline EmiBinding();
+    
+public:
+    
+    typedef EmiError             Error;
+    typedef EmiBindingSocket     SocketHandle;
+    typedef EmiBufferRef         TemporaryData;
+    typedef EmiBuffer*           PersistentData;
+    typedef EmiEventLoop::Timer  Timer;
+    typedef EmiEventLoop*        TimerCookie;
+    typedef EmiEventLoop::TimerCb TimerCb;
+    
+    typedef void (EmiOnMessage)(EmiBindingSocket *socket,
+                                void *userData,
+                                EmiTimeInterval now,
+                                const sockaddr_storage& address,
+                                const TemporaryData& data,
+                                size_t offset,
+                                size_t len);
+    
+    inline static EmiError makeError(const char *domain, int32_t code) {
+        return EmiError(domain, code);
+    }
+    
+    inline static EmiBuffer *makePersistentData(const uint8_t *data, size_t length) {
+        return EmiBuffer::copy(data, length);
+    }
+    inline static EmiBufferRef makeTemporaryData(size_t size, uint8_t **outData) {
+        EmiBuffer *buf = EmiBuffer::make(size);
+        *outData = buf->getData();
+        return EmiBufferRef(buf);
+    }
+    inline static void releasePersistentData(EmiBuffer *buf) {
+        // Messages without contents have NULL data
+        if (buf) {
+            buf->release();
+        }
+    }
+    inline static EmiBufferRef castToTemporary(EmiBuffer *buf) {
+        return EmiBufferRef::retained(buf);
+    }
+    
+    inline static const uint8_t *extractData(const EmiBufferRef& data) {
+        return data.isEmpty() ? NULL : data.get()->getData();
+    }
+    inline static size_t extractLength(const EmiBufferRef& data) {
+        return data.isEmpty() ? 0 : data.get()->getLength();
+    }
+    inline static const uint8_t *extractData(EmiBuffer *data) {
+        return data ? data->getData() : NULL;
+    }
+    inline static size_t extractLength(EmiBuffer *data) {
+        return data ? data->getLength() : 0;
+    }
+    
+    static const size_t HMAC_HASH_SIZE = 32;
+    static void hmacHash(const uint8_t *key, size_t keyLength,
+                         const uint8_t *data, size_t dataLength,
+                         uint8_t *buf, size_t bufLen);
+    static void randomBytes(uint8_t *buf, size_t bufSize);
+    
+    // Must use the same clock as the now parameter of timer callbacks
+    inline static EmiTimeInterval now() {
+        return EmiEventLoop::now();
+    }
+    // All connections of an EmiSocket use the EmiEventLoop of the
+    // socket, so they can share one EmiTimerWheel.
+    static const bool SHARED_TIMER_WHEEL = true;
+    static Timer *makeTimer(EmiEventLoop *loop);
+    static void freeTimer(Timer *timer);
+    static void scheduleTimer(Timer *timer, TimerCb *timerCb, void *data, EmiTimeInterval interval,
+                              bool repeating, bool reschedule);
+    static void descheduleTimer(Timer *timer);
+    
+    typedef std::pair<ifaddrs*, ifaddrs*> NetworkInterfaces;
+    static bool getNetworkInterfaces(NetworkInterfaces& ni, Error& err);
+    static bool nextNetworkInterface(NetworkInterfaces& ni, const char*& name, struct sockaddr_storage& addr);
+    static void freeNetworkInterfaces(const NetworkInterfaces& ni);
+    
+    static void closeSocket(EmiBindingSocket *socket);
+    static EmiBindingSocket *openSocket(EmiEventLoop *loop,
+                                        EmiOnMessage *callback,
+                                        void *userData,
+                                        const sockaddr_storage& address,
+                                        Error& err);
+    static void extractLocalAddress(EmiBindingSocket *socket, sockaddr_storage& address);
+    // Sends a datagram that consists of the concatenation of the
+    // buffers in iov. The data is copied; the buffers can be reused
+    // as soon as this method returns. The packets of a packet pair are
+    // never part of a GSO train.
+    static void sendData(EmiBindingSocket *socket,
+                         const sockaddr_storage& address,
+                         const struct iovec *iov,
+                         size_t iovcnt,
+                         bool packetPair);
+};
+
+#endif
@@ -0,0 +1,30 @@
+//
+//  EmiBuffer.cc
+//  eminet
+//
+
+#include "EmiBuffer.h"
+
+#include <pthread.h>
+
+static pthread_key_t  emiBufferPoolKey;
+static pthread_once_t emiBufferPoolKeyOnce = PTHREAD_ONCE_INIT;
+
+static void deleteBufferPool(void *pool) {
+    delete (EmiBufferPool *)pool;
+}
+
+static void makeBufferPoolKey() {
+    ASSERT(0 == pthread_key_create(&emiBufferPoolKey, deleteBufferPool));
+}
+
+EmiBufferPool& EmiBuffer::pool() {
+    pthread_once(&emiBufferPoolKeyOnce, makeBufferPoolKey);
+    
+    EmiBufferPool *pool = (EmiBufferPool *)pthread_getspecific(emiBufferPoolKey);
+    if (!pool) {
+        pool = new EmiBufferPool;
+        ASSERT(0 == pthread_setspecific(emiBufferPoolKey, pool));
+    }
+    return *pool;
+}
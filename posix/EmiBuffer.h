@@ -0,0 +1,152 @@
+//
+//  EmiBuffer.h
+//  eminet
+//
+
+#ifndef eminet_EmiBuffer_h
+#define eminet_EmiBuffer_h
+
+#include "../core/EmiNetUtil.h"
+#include "../core/EmiBufferPool.h"
+
+#include <new>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+
+// A plain reference counted byte buffer. This is what the posix
+// binding uses instead of node::Buffer objects or NSData.
+//
+// The buffer header and its contents are allocated in one chunk of
+// memory from an EmiBufferPool. Each thread has its own pool, so
+// creating a buffer usually doesn't malloc at all.
+class EmiBuffer {
+private:
+    // Private copy constructor and assignment operator
+    inline EmiBuffer(const EmiBuffer& other);
+    inline EmiBuffer& operator=(const EmiBuffer& other);
+    
+    size_t _refCount;
+    size_t _length;
+    size_t _capacity;
+    
+    explicit EmiBuffer(size_t capacity) :
+    _refCount(1),
+    _length(capacity),
+    _capacity(capacity) {}
+    
+    ~EmiBuffer() {}
+    
+public:
+    
+    // Returns the EmiBufferPool of the calling thread
+    static EmiBufferPool& pool();
+    
+    // Returns a buffer with a reference count of 1
+    static EmiBuffer *make(size_t capacity) {
+        void *mem = pool().alloc(sizeof(EmiBuffer)+capacity);
+        return new (mem) EmiBuffer(capacity);
+    }
+    
+    // Returns a buffer with a reference count of 1
+    static EmiBuffer *copy(const uint8_t *data, size_t length) {
+        EmiBuffer *buf = make(length);
+        if (length) {
+            memcpy(buf->getData(), data, length);
+        }
+        return buf;
+    }
+    
+    inline void retain() {
+        ++_refCount;
+    }
+    
+    inline void release() {
+        ASSERT(0 != _refCount);
+        
+        if (0 == --_refCount) {
+            this->~EmiBuffer();
+            pool().free(this);
+        }
+    }
+    
+    inline bool isShared() const {
+        return 1 != _refCount;
+    }
+    
+    inline uint8_t *getData() {
+        return reinterpret_cast<uint8_t *>(this+1);
+    }
+    
+    inline const uint8_t *getData() const {
+        return reinterpret_cast<const uint8_t *>(this+1);
+    }
+    
+    inline size_t getLength() const {
+        return _length;
+    }
+    
+    inline size_t getCapacity() const {
+        return _capacity;
+    }
+    
+    inline void setLength(size_t length) {
+        ASSERT(length <= _capacity);
+        _length = length;
+    }
+};
+
+// EmiBufferRef is a smart pointer to an EmiBuffer. It holds one
+// reference to the buffer for as long as it lives. It is used as
+// TemporaryData by the posix binding.
+class EmiBufferRef {
+    EmiBuffer *_buf;
+    
+public:
+    EmiBufferRef() : _buf(NULL) {}
+    
+    // Takes over the reference that the caller has to buf
+    explicit EmiBufferRef(EmiBuffer *buf) : _buf(buf) {}
+    
+    EmiBufferRef(const EmiBufferRef& other) : _buf(other._buf) {
+        if (_buf) {
+            _buf->retain();
+        }
+    }
+    
+    EmiBufferRef& operator=(const EmiBufferRef& other) {
+        if (other._buf) {
+            other._buf->retain();
+        }
+        if (_buf) {
+            _buf->release();
+        }
+        _buf = other._buf;
+        return *this;
+    }
+    
+    ~EmiBufferRef() {
+        if (_buf) {
+            _buf->release();
+        }
+    }
+    
+    // Returns a new reference to buf, leaving the caller's reference
+    // untouched.
+    static EmiBufferRef retained(EmiBuffer *buf) {
+        if (buf) {
+            buf->retain();
+        }
+        return EmiBufferRef(buf);
+    }
+    
+    inline EmiBuffer *get() const {
+        return _buf;
+    }
+    
+    inline bool isEmpty() const {
+        return !_buf;
+    }
+};
+
+#endif
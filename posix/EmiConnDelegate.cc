@@ -0,0 +1,93 @@
+//
+//  EmiConnDelegate.cc
+//  eminet
+//
+
+#include "EmiConnDelegate.h"
+
+#include "EmiSocket.h"
+#include "EmiConnection.h"
+
+EmiConnDelegate::EmiConnDelegate(EmiConnection& conn) : _conn(conn) {}
+
+static void release_cb(EmiTimeInterval now, EmiBinding::Timer *timer, void *data) {
+    EmiBinding::freeTimer(timer);
+    ((EmiConnection *)data)->release();
+}
+
+void EmiConnDelegate::invalidate() {
+    if (EMI_CONNECTION_TYPE_SERVER == _conn.getConn().getType()) {
+        _conn.getSocket().getSock().deregisterServerConnection(&_conn.getConn());
+    }
+    
+    // This releases the reference that the EmiConnection was created
+    // with in EmiSockDelegate::makeConnection. This method is invoked
+    // from within the EmiConn object, so the release is done on the
+    // next loop iteration; releasing it here might deallocate the
+    // connection while there are references to it left on the stack.
+    EmiBinding::Timer *timer = EmiBinding::makeTimer(getTimerCookie());
+    EmiBinding::scheduleTimer(timer, release_cb, &_conn,
+                              /*interval:*/0,
+                              /*repeating:*/false, /*reschedule:*/true);
+}
+
+void EmiConnDelegate::emiConnPacketLoss(EmiChannelQualifier channelQualifier,
+                                        EmiSequenceNumber packetsLost) {
+    EmiConnectionDelegate *delegate = _conn.getDelegate();
+    if (delegate) {
+        delegate->emiConnectionPacketLoss(_conn, channelQualifier, packetsLost);
+    }
+}
+
+void EmiConnDelegate::emiConnMessage(EmiChannelQualifier channelQualifier,
+                                     const EmiBufferRef& data,
+                                     size_t offset,
+                                     size_t size) {
+    EmiConnectionDelegate *delegate = _conn.getDelegate();
+    if (delegate) {
+        delegate->emiConnectionMessage(_conn, channelQualifier, data, offset, size);
+    }
+}
+
+void EmiConnDelegate::emiConnLost() {
+    EmiConnectionDelegate *delegate = _conn.getDelegate();
+    if (delegate) {
+        delegate->emiConnectionLost(_conn);
+    }
+}
+
+void EmiConnDelegate::emiConnRegained() {
+    EmiConnectionDelegate *delegate = _conn.getDelegate();
+    if (delegate) {
+        delegate->emiConnectionRegained(_conn);
+    }
+}
+
+void EmiConnDelegate::emiConnDisconnect(EmiDisconnectReason reason) {
+    EmiConnectionDelegate *delegate = _conn.getDelegate();
+    if (delegate) {
+        delegate->emiConnectionDisconnect(_conn, reason);
+    }
+}
+
+void EmiConnDelegate::emiNatPunchthroughFinished(bool success) {
+    EmiConnectionDelegate *delegate = _conn.getDelegate();
+    if (!delegate) {
+        return;
+    }
+    
+    if (success) {
+        delegate->emiP2PConnectionEstablished(_conn);
+    }
+    else {
+        delegate->emiP2PConnectionNotEstablished(_conn);
+    }
+}
+
+EmiEventLoop *EmiConnDelegate::getSocketCookie() {
+    return &_conn.getSocket().getLoop();
+}
+
+EmiEventLoop *EmiConnDelegate::getTimerCookie() {
+    return &_conn.getSocket().getLoop();
+}
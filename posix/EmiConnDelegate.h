@@ -0,0 +1,42 @@
+//
+//  EmiConnDelegate.h
+//  eminet
+//
+
+#ifndef eminet_EmiConnDelegate_h
+#define eminet_EmiConnDelegate_h
+
+#include "EmiBinding.h"
+
+#include "../core/EmiTypes.h"
+
+class EmiConnection;
+
+class EmiConnDelegate {
+    EmiConnection& _conn;
+    
+public:
+    EmiConnDelegate(EmiConnection& conn);
+    
+    void invalidate();
+    
+    void emiConnPacketLoss(EmiChannelQualifier channelQualifier,
+                           EmiSequenceNumber packetsLost);
+    void emiConnMessage(EmiChannelQualifier channelQualifier,
+                        const EmiBufferRef& data,
+                        size_t offset,
+                        size_t size);
+    
+    void emiConnLost();
+    void emiConnRegained();
+    void emiConnDisconnect(EmiDisconnectReason reason);
+    void emiNatPunchthroughFinished(bool success);
+    
+    inline EmiConnection& getConnection() { return _conn; }
+    inline const EmiConnection& getConnection() const { return _conn; }
+    
+    EmiEventLoop *getSocketCookie();
+    EmiEventLoop *getTimerCookie();
+};
+
+#endif
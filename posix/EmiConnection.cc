@@ -0,0 +1,70 @@
+//
+//  EmiConnection.cc
+//  eminet
+//
+
+#include "EmiConnection.h"
+
+#include "EmiSocket.h"
+
+EmiConnection::EmiConnection(EmiSocket& es, const ECP& params) :
+_es(es),
+_delegate(NULL),
+_refCount(1),
+_conn(EmiConnDelegate(*this), es.getSock().config, params) {}
+
+EmiConnection::~EmiConnection() {}
+
+void EmiConnection::retain() {
+    ++_refCount;
+}
+
+void EmiConnection::release() {
+    ASSERT(0 != _refCount);
+    
+    if (0 == --_refCount) {
+        delete this;
+    }
+}
+
+bool EmiConnection::close(EmiError& err) {
+    return _conn.close(EmiEventLoop::now(), err);
+}
+
+void EmiConnection::forceClose() {
+    _conn.forceClose();
+}
+
+void EmiConnection::closeOrForceClose() {
+    EmiError err;
+    if (!_conn.close(EmiEventLoop::now(), err)) {
+        _conn.forceClose();
+    }
+}
+
+bool EmiConnection::send(const uint8_t *data, size_t size,
+                         EmiChannelQualifier channelQualifier, EmiPriority priority,
+                         EmiError& err) {
+    return send(EmiBinding::makePersistentData(data, size),
+                channelQualifier, priority, err);
+}
+
+bool EmiConnection::send(EmiBuffer *data,
+                         EmiChannelQualifier channelQualifier, EmiPriority priority,
+                         EmiError& err) {
+    return send(data, channelQualifier, priority, EMI_NO_DEADLINE, err);
+}
+
+bool EmiConnection::send(const uint8_t *data, size_t size,
+                         EmiChannelQualifier channelQualifier, EmiPriority priority,
+                         EmiTimeInterval deadline, EmiError& err) {
+    return send(EmiBinding::makePersistentData(data, size),
+                channelQualifier, priority, deadline, err);
+}
+
+bool EmiConnection::send(EmiBuffer *data,
+                         EmiChannelQualifier channelQualifier, EmiPriority priority,
+                         EmiTimeInterval deadline, EmiError& err) {
+    // EmiConn::send assumes ownership over data
+    return _conn.send(EmiEventLoop::now(), data, channelQualifier, priority, deadline, err);
+}
@@ -0,0 +1,115 @@
+//
+//  EmiConnection.h
+//  eminet
+//
+
+#ifndef eminet_EmiConnection_h
+#define eminet_EmiConnection_h
+
+#include "EmiBinding.h"
+#include "EmiSockDelegate.h"
+#include "EmiConnDelegate.h"
+
+#include "../core/EmiConn.h"
+
+class EmiSocket;
+class EmiConnection;
+
+// All callbacks are invoked in the thread that runs the EmiEventLoop
+// of the connection's EmiSocket.
+class EmiConnectionDelegate {
+public:
+    virtual ~EmiConnectionDelegate() {}
+    
+    virtual void emiConnectionOpened(EmiConnection& conn, void *userData) = 0;
+    virtual void emiConnectionFailedToConnect(EmiSocket& socket, const EmiError& err, void *userData) = 0;
+    
+    // data is only guaranteed to be valid for the duration of the
+    // callback. To keep it, retain data.get() or copy it.
+    virtual void emiConnectionMessage(EmiConnection& conn,
+                                      EmiChannelQualifier channelQualifier,
+                                      const EmiBufferRef& data,
+                                      size_t offset,
+                                      size_t size) = 0;
+    virtual void emiConnectionDisconnect(EmiConnection& conn, EmiDisconnectReason reason) = 0;
+    
+    virtual void emiConnectionLost(EmiConnection& conn) {}
+    virtual void emiConnectionRegained(EmiConnection& conn) {}
+    virtual void emiConnectionPacketLoss(EmiConnection& conn,
+                                         EmiChannelQualifier channelQualifier,
+                                         EmiSequenceNumber packetsLost) {}
+    virtual void emiP2PConnectionEstablished(EmiConnection& conn) {}
+    virtual void emiP2PConnectionNotEstablished(EmiConnection& conn) {}
+};
+
+// EmiConnection objects are reference counted. An EmiConnection holds
+// a reference to itself from when it's created until it's closed, so
+// there is no need to retain a connection to keep it open. Retain it
+// to be able to use the object after it has been closed.
+class EmiConnection {
+    typedef EmiConn<EmiSockDelegate, EmiConnDelegate> EC;
+    typedef EmiConnParams<EmiBinding>                 ECP;
+    
+private:
+    // Private copy constructor and assignment operator
+    inline EmiConnection(const EmiConnection& other);
+    inline EmiConnection& operator=(const EmiConnection& other);
+    
+    EmiSocket&             _es;
+    EmiConnectionDelegate *_delegate;
+    size_t                 _refCount;
+    EC                     _conn;
+    
+    // Use release instead
+    virtual ~EmiConnection();
+    
+public:
+    EmiConnection(EmiSocket& es, const ECP& params);
+    
+    void retain();
+    void release();
+    
+    bool close(EmiError& err);
+    void forceClose();
+    // Tries to close the connection gracefully, and force closes it
+    // if that fails.
+    void closeOrForceClose();
+    
+    // Copies the data
+    bool send(const uint8_t *data, size_t size,
+              EmiChannelQualifier channelQualifier, EmiPriority priority,
+              EmiError& err);
+    // Takes over the caller's reference to data. This avoids a copy,
+    // but data must not be modified after it has been sent.
+    bool send(EmiBuffer *data,
+              EmiChannelQualifier channelQualifier, EmiPriority priority,
+              EmiError& err);
+    // deadline is the number of seconds from now that the message
+    // should be sent within. Unreliable messages that miss it are
+    // dropped; see EmiSendScheduler.
+    bool send(const uint8_t *data, size_t size,
+              EmiChannelQualifier channelQualifier, EmiPriority priority,
+              EmiTimeInterval deadline, EmiError& err);
+    bool send(EmiBuffer *data,
+              EmiChannelQualifier channelQualifier, EmiPriority priority,
+              EmiTimeInterval deadline, EmiError& err);
+    
+    inline EmiConnectionDelegate *getDelegate() const { return _delegate; }
+    inline void setDelegate(EmiConnectionDelegate *delegate) { _delegate = delegate; }
+    
+    inline EmiSocket& getSocket() const { return _es; }
+    
+    inline EC& getConn() { return _conn; }
+    inline const EC& getConn() const { return _conn; }
+    
+    inline bool hasIssuedConnectionWarning() const { return _conn.issuedConnectionWarning(); }
+    inline size_t getExpiredMessages() const { return _conn.getExpiredMessages(); }
+    inline const sockaddr_storage& getLocalAddress() const { return _conn.getLocalAddress(); }
+    inline const sockaddr_storage& getRemoteAddress() const { return _conn.getRemoteAddress(); }
+    inline uint16_t getInboundPort() const { return _conn.getInboundPort(); }
+    inline bool isOpen() const { return _conn.isOpen(); }
+    inline bool isOpening() const { return _conn.isOpening(); }
+    inline EmiP2PState getP2PState() const { return _conn.getP2PState(); }
+};
+
+#endif
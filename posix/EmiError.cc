@@ -0,0 +1,17 @@
+//
+//  EmiError.cc
+//  eminet
+//
+
+#include "EmiError.h"
+
+#include <cstdio>
+
+EmiError::EmiError() : domain(""), code(0) {}
+
+EmiError::EmiError(const std::string& domain_, int32_t code_) :
+domain(domain_), code(code_) {}
+
+void EmiError::format(const char *desc, char *buf, size_t bufSize) const {
+    snprintf(buf, bufSize, "%s: %s (%d)", desc, domain.c_str(), code);
+}
@@ -0,0 +1,360 @@
+//
+//  EmiEventLoop.cc
+//  eminet
+//
+
+#include "EmiEventLoop.h"
+
+#include "../core/EmiNetUtil.h"
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <cmath>
+
+static const int EMI_EVENT_LOOP_MAX_EVENTS = 64;
+
+static void timespecFromInterval(EmiTimeInterval interval, struct timespec *ts) {
+    double secs = floor(interval);
+    ts->tv_sec = (time_t)secs;
+    ts->tv_nsec = (long)((interval-secs)*1000000000.0);
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec += 1;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+EmiEventLoop::EmiEventLoop() :
+_epollFd(-1),
+_timerFd(-1),
+_timers(),
+_timerSeq(0),
+_armedDeadline(-1),
+_dispatching(false),
+_stopped(false),
+_deadTimers(),
+_deadWatchers(),
+_flushQueue() {}
+
+EmiEventLoop::~EmiEventLoop() {
+    TimerSetIter iter(_timers.begin());
+    TimerSetIter  end(_timers.end());
+    while (iter != end) {
+        (*iter)->_active = false;
+        ++iter;
+    }
+    _timers.clear();
+    
+    collectGarbage();
+    
+    if (-1 != _timerFd) {
+        close(_timerFd);
+    }
+    if (-1 != _epollFd) {
+        close(_epollFd);
+    }
+}
+
+bool EmiEventLoop::open(EmiError& err) {
+    if (-1 != _epollFd) {
+        return true;
+    }
+    
+    _epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (-1 == _epollFd) {
+        err = EmiError("com.emilir.eminet.eventloop", errno);
+        return false;
+    }
+    
+    _timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (-1 == _timerFd) {
+        err = EmiError("com.emilir.eminet.eventloop", errno);
+        goto error;
+    }
+    
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    // The timerfd is the only registered descriptor without a Watcher
+    ev.data.ptr = NULL;
+    if (-1 == epoll_ctl(_epollFd, EPOLL_CTL_ADD, _timerFd, &ev)) {
+        err = EmiError("com.emilir.eminet.eventloop", errno);
+        goto error;
+    }
+    
+    return true;
+    
+error:
+    if (-1 != _timerFd) {
+        close(_timerFd);
+        _timerFd = -1;
+    }
+    close(_epollFd);
+    _epollFd = -1;
+    return false;
+}
+
+EmiTimeInterval EmiEventLoop::now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ((EmiTimeInterval)ts.tv_nsec)/1000000000.0;
+}
+
+void EmiEventLoop::armTimerFd() {
+    EmiTimeInterval deadline = (_timers.empty() ? -1 : (*_timers.begin())->_deadline);
+    
+    if (deadline == _armedDeadline) {
+        return;
+    }
+    _armedDeadline = deadline;
+    
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (-1 != deadline) {
+        timespecFromInterval(deadline, &its.it_value);
+    }
+    
+    ASSERT(0 == timerfd_settime(_timerFd, TFD_TIMER_ABSTIME, &its, NULL));
+}
+
+void EmiEventLoop::fireTimers(EmiTimeInterval now) {
+    // Timers that are scheduled by the timer callbacks that we invoke
+    // here get a sequence number that is >= seqLimit. They are not fired
+    // until the next loop iteration, even if they are already due. This
+    // guarantees that a timer with an interval of 0 can't starve the loop.
+    const uint64_t seqLimit = _timerSeq;
+    
+    while (!_timers.empty()) {
+        Timer *timer = *_timers.begin();
+        
+        if (timer->_deadline > now) {
+            break;
+        }
+        
+        if (timer->_seq >= seqLimit) {
+            // Because the set is ordered by deadline first, there
+            // might be older timers that are due after this one.
+            // Scan for them instead of giving up.
+            TimerSetIter iter(_timers.begin());
+            TimerSetIter  end(_timers.end());
+            timer = NULL;
+            while (iter != end && (*iter)->_deadline <= now) {
+                if ((*iter)->_seq < seqLimit) {
+                    timer = *iter;
+                    break;
+                }
+                ++iter;
+            }
+            
+            if (!timer) {
+                break;
+            }
+        }
+        
+        _timers.erase(timer);
+        
+        if (timer->_repeating) {
+            // Re-insert the timer before invoking the callback; the
+            // callback is allowed to deschedule or free the timer.
+            timer->_deadline = now + timer->_interval;
+            timer->_seq = _timerSeq++;
+            _timers.insert(timer);
+        }
+        else {
+            timer->_active = false;
+        }
+        
+        timer->_timerCb(now, timer, timer->_data);
+    }
+}
+
+void EmiEventLoop::flushWatchers(EmiTimeInterval now) {
+    // Flush callbacks might request new flushes, so don't use iterators
+    for (size_t i=0; i<_flushQueue.size(); i++) {
+        Watcher *watcher = _flushQueue[i];
+        watcher->_flushRequested = false;
+        
+        if (!watcher->_dead) {
+            watcher->_flushCb(now, watcher, watcher->_data);
+        }
+    }
+    _flushQueue.clear();
+}
+
+void EmiEventLoop::collectGarbage() {
+    std::vector<Timer*>::iterator titer(_deadTimers.begin());
+    std::vector<Timer*>::iterator  tend(_deadTimers.end());
+    while (titer != tend) {
+        delete *titer;
+        ++titer;
+    }
+    _deadTimers.clear();
+    
+    std::vector<Watcher*>::iterator witer(_deadWatchers.begin());
+    std::vector<Watcher*>::iterator  wend(_deadWatchers.end());
+    while (witer != wend) {
+        delete *witer;
+        ++witer;
+    }
+    _deadWatchers.clear();
+}
+
+EmiEventLoop::Timer *EmiEventLoop::makeTimer() {
+    return new Timer(*this);
+}
+
+void EmiEventLoop::freeTimer(Timer *timer) {
+    descheduleTimer(timer);
+    
+    if (_dispatching) {
+        _deadTimers.push_back(timer);
+    }
+    else {
+        delete timer;
+    }
+}
+
+void EmiEventLoop::scheduleTimer(Timer *timer, TimerCb *timerCb, void *data,
+                                 EmiTimeInterval interval, bool repeating) {
+    ASSERT(&timer->_loop == this);
+    
+    if (timer->_active) {
+        _timers.erase(timer);
+    }
+    
+    timer->_timerCb = timerCb;
+    timer->_data = data;
+    timer->_interval = interval;
+    timer->_repeating = repeating;
+    timer->_deadline = now() + interval;
+    timer->_seq = _timerSeq++;
+    timer->_active = true;
+    
+    _timers.insert(timer);
+    
+    if (!_dispatching) {
+        armTimerFd();
+    }
+}
+
+void EmiEventLoop::descheduleTimer(Timer *timer) {
+    if (timer->_active) {
+        _timers.erase(timer);
+        timer->_active = false;
+    }
+}
+
+EmiEventLoop::Watcher *EmiEventLoop::watch(int fd, WatcherCb *watcherCb, WatcherCb *flushCb, void *data, EmiError& err) {
+    Watcher *watcher = new Watcher(fd, watcherCb, flushCb, data);
+    
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = watcher;
+    if (-1 == epoll_ctl(_epollFd, EPOLL_CTL_ADD, fd, &ev)) {
+        err = EmiError("com.emilir.eminet.eventloop", errno);
+        delete watcher;
+        return NULL;
+    }
+    
+    return watcher;
+}
+
+void EmiEventLoop::unwatch(Watcher *watcher) {
+    ASSERT(!watcher->_dead);
+    
+    // This can fail if the file descriptor was closed before it was
+    // unwatched; that is fine, the kernel has already forgotten it then.
+    epoll_ctl(_epollFd, EPOLL_CTL_DEL, watcher->_fd, NULL);
+    
+    watcher->_dead = true;
+    
+    if (_dispatching) {
+        _deadWatchers.push_back(watcher);
+    }
+    else {
+        delete watcher;
+    }
+}
+
+void EmiEventLoop::requestFlush(Watcher *watcher) {
+    ASSERT(watcher->_flushCb);
+    
+    if (!_dispatching) {
+        watcher->_flushCb(now(), watcher, watcher->_data);
+    }
+    else if (!watcher->_flushRequested) {
+        watcher->_flushRequested = true;
+        _flushQueue.push_back(watcher);
+    }
+}
+
+void EmiEventLoop::runOnce(EmiTimeInterval timeout) {
+    ASSERT(!_dispatching);
+    
+    armTimerFd();
+    
+    struct epoll_event events[EMI_EVENT_LOOP_MAX_EVENTS];
+    int timeoutMs = (timeout < 0 ? -1 : (int)ceil(timeout*1000));
+    int numEvents = epoll_wait(_epollFd, events, EMI_EVENT_LOOP_MAX_EVENTS, timeoutMs);
+    if (-1 == numEvents) {
+        // EINTR is the only error that can happen here unless the
+        // loop itself is broken.
+        ASSERT(EINTR == errno);
+        return;
+    }
+    
+    _dispatching = true;
+    
+    EmiTimeInterval now = EmiEventLoop::now();
+    
+    for (int i=0; i<numEvents; i++) {
+        Watcher *watcher = (Watcher *)events[i].data.ptr;
+        
+        if (!watcher) {
+            uint64_t expirations;
+            // This read only serves to reset the readiness of the
+            // timerfd. It may fail with EAGAIN if the timerfd was re-armed
+            // after it expired; that's fine.
+            ssize_t ret = read(_timerFd, &expirations, sizeof(expirations));
+            (void)ret;
+            
+            // The timerfd is not periodic, so it's disarmed now
+            _armedDeadline = -1;
+            
+            continue;
+        }
+        
+        if (!watcher->_dead) {
+            watcher->_watcherCb(now, watcher, watcher->_data);
+        }
+    }
+    
+    // Timers are checked even when the timerfd did not fire, because
+    // timers that were scheduled with a zero interval may already be
+    // due, and it's cheap to check.
+    fireTimers(EmiEventLoop::now());
+    
+    // This is done after the timers have fired, because most datagrams
+    // are sent from timer callbacks.
+    flushWatchers(EmiEventLoop::now());
+    
+    _dispatching = false;
+    
+    collectGarbage();
+    
+    // The timers might have been changed by the callbacks
+    armTimerFd();
+}
+
+void EmiEventLoop::run() {
+    _stopped = false;
+    
+    while (!_stopped) {
+        runOnce(-1);
+    }
+}
+
+void EmiEventLoop::stop() {
+    _stopped = true;
+}
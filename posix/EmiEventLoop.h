@@ -0,0 +1,200 @@
+//
+//  EmiEventLoop.h
+//  eminet
+//
+
+#ifndef eminet_EmiEventLoop_h
+#define eminet_EmiEventLoop_h
+
+#include "EmiError.h"
+
+#include "../core/EmiTypes.h"
+
+#include <set>
+#include <vector>
+#include <stdint.h>
+
+// EmiEventLoop is a minimal single threaded run loop built on epoll
+// and timerfd. It is what the posix binding uses instead of libuv or
+// GCD.
+//
+// All timers of a loop share one timerfd, which is always armed for
+// the earliest deadline. This keeps the number of file descriptors
+// independent of the number of connections; an EmiConn has several
+// timers, and a server with many connections would otherwise run out
+// of file descriptors long before it runs out of anything else.
+//
+// Timers and watchers that are freed while the loop is dispatching
+// events are not deallocated immediately, because there might be
+// pending events for them in the current batch. They are deallocated
+// at the end of the loop iteration instead.
+//
+// Watchers can ask to be flushed at the end of the current loop
+// iteration, after all I/O and timer callbacks have been invoked. The
+// posix binding uses this to send all datagrams that were produced
+// during one iteration with one sendmmsg call per socket.
+//
+// An EmiEventLoop is not thread safe. All EmiSocket and EmiConnection
+// objects that use a loop must be accessed from the thread that runs
+// the loop.
+class EmiEventLoop {
+private:
+    // Private copy constructor and assignment operator
+    inline EmiEventLoop(const EmiEventLoop& other);
+    inline EmiEventLoop& operator=(const EmiEventLoop& other);
+    
+public:
+    class Timer;
+    class Watcher;
+    
+    typedef void (TimerCb)(EmiTimeInterval now, Timer *timer, void *data);
+    typedef void (WatcherCb)(EmiTimeInterval now, Watcher *watcher, void *data);
+    
+    class Timer {
+        friend class EmiEventLoop;
+    private:
+        // Private copy constructor and assignment operator
+        inline Timer(const Timer& other);
+        inline Timer& operator=(const Timer& other);
+        
+        EmiEventLoop&   _loop;
+        TimerCb        *_timerCb;
+        void           *_data;
+        EmiTimeInterval _deadline;
+        EmiTimeInterval _interval;
+        uint64_t        _seq;
+        bool            _repeating;
+        bool            _active;
+        
+        explicit Timer(EmiEventLoop& loop) :
+        _loop(loop),
+        _timerCb(NULL),
+        _data(NULL),
+        _deadline(0),
+        _interval(0),
+        _seq(0),
+        _repeating(false),
+        _active(false) {}
+        
+    public:
+        inline bool isActive() const {
+            return _active;
+        }
+        
+        inline EmiEventLoop& getLoop() const {
+            return _loop;
+        }
+    };
+    
+    class Watcher {
+        friend class EmiEventLoop;
+    private:
+        // Private copy constructor and assignment operator
+        inline Watcher(const Watcher& other);
+        inline Watcher& operator=(const Watcher& other);
+        
+        int        _fd;
+        WatcherCb *_watcherCb;
+        WatcherCb *_flushCb;
+        void      *_data;
+        bool       _dead;
+        bool       _flushRequested;
+        
+        Watcher(int fd, WatcherCb *watcherCb, WatcherCb *flushCb, void *data) :
+        _fd(fd),
+        _watcherCb(watcherCb),
+        _flushCb(flushCb),
+        _data(data),
+        _dead(false),
+        _flushRequested(false) {}
+        
+    public:
+        inline int getFd() const {
+            return _fd;
+        }
+    };
+    
+private:
+    
+    class TimerCmp {
+    public:
+        inline bool operator()(const Timer *a, const Timer *b) const {
+            if (a->_deadline != b->_deadline) {
+                return a->_deadline < b->_deadline;
+            }
+            return a->_seq < b->_seq;
+        }
+    };
+    
+    typedef std::set<Timer*, TimerCmp>   TimerSet;
+    typedef TimerSet::iterator          TimerSetIter;
+    
+    int _epollFd;
+    int _timerFd;
+    
+    TimerSet              _timers;
+    uint64_t              _timerSeq;
+    // The deadline that _timerFd is currently armed for, or -1
+    // if it is disarmed.
+    EmiTimeInterval       _armedDeadline;
+    
+    bool                  _dispatching;
+    bool                  _stopped;
+    std::vector<Timer*>   _deadTimers;
+    std::vector<Watcher*> _deadWatchers;
+    std::vector<Watcher*> _flushQueue;
+    
+    void armTimerFd();
+    void fireTimers(EmiTimeInterval now);
+    void flushWatchers(EmiTimeInterval now);
+    void collectGarbage();
+    
+public:
+    
+    EmiEventLoop();
+    virtual ~EmiEventLoop();
+    
+    // Must be called once before the loop is used
+    bool open(EmiError& err);
+    
+    // Returns the current time of CLOCK_MONOTONIC, in seconds
+    static EmiTimeInterval now();
+    
+    Timer *makeTimer();
+    void freeTimer(Timer *timer);
+    // An interval of 0 means that the timer fires on the next loop
+    // iteration.
+    void scheduleTimer(Timer *timer, TimerCb *timerCb, void *data,
+                       EmiTimeInterval interval, bool repeating);
+    void descheduleTimer(Timer *timer);
+    
+    // Starts watching fd for readability. The loop does not take
+    // ownership over the file descriptor. flushCb may be NULL if the
+    // watcher never requests to be flushed.
+    Watcher *watch(int fd, WatcherCb *watcherCb, WatcherCb *flushCb, void *data, EmiError& err);
+    // Note that unwatching a watcher with a pending flush request
+    // cancels the flush; the caller has to flush it itself first.
+    void unwatch(Watcher *watcher);
+    
+    // Makes the loop invoke the flush callback of watcher at the end
+    // of the current loop iteration. If the loop is not dispatching
+    // events, the flush callback is invoked immediately.
+    void requestFlush(Watcher *watcher);
+    
+    // Waits for at most timeout seconds for events, and dispatches the
+    // events that arrive. A negative timeout means wait forever.
+    void runOnce(EmiTimeInterval timeout);
+    // Dispatches events until stop is called
+    void run();
+    void stop();
+    
+    // The epoll file descriptor of this loop. It becomes readable when
+    // the loop has events to dispatch, which makes it possible to embed
+    // an EmiEventLoop in another event loop; call runOnce(0) when the
+    // descriptor is readable.
+    inline int getFd() const {
+        return _epollFd;
+    }
+};
+
+#endif
@@ -0,0 +1,17 @@
+//
+//  EmiNet.h
+//  eminet
+//
+
+#ifndef eminet_EmiNet_h
+#define eminet_EmiNet_h
+
+// This is the header that users of the posix binding should include.
+
+#include "EmiEventLoop.h"
+#include "EmiBuffer.h"
+#include "EmiError.h"
+#include "EmiSocket.h"
+#include "EmiConnection.h"
+
+#endif
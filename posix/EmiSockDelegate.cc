@@ -0,0 +1,74 @@
+//
+//  EmiSockDelegate.cc
+//  eminet
+//
+
+#include "EmiSockDelegate.h"
+
+#include "EmiSocket.h"
+#include "EmiConnection.h"
+
+EmiSockDelegate::EmiSockDelegate(EmiSocket& es) : _es(es) {}
+
+EmiSockDelegate::EC *EmiSockDelegate::makeConnection(const EmiConnParams<EmiBinding>& params) {
+    // The connection is released in EmiConnDelegate::invalidate
+    EmiConnection *ec = new EmiConnection(_es, params);
+    return &ec->getConn();
+}
+
+void EmiSockDelegate::gotServerConnection(EC& conn) {
+    EmiSocketDelegate *delegate = _es.getDelegate();
+    
+    if (delegate) {
+        delegate->emiSocketGotConnection(_es, conn.getDelegate().getConnection());
+    }
+}
+
+void EmiSockDelegate::connectionOpened(ConnectionOpenedCallbackCookie& cookie,
+                                       bool error,
+                                       EmiDisconnectReason reason,
+                                       EC& ec) {
+    EmiConnection& conn(ec.getDelegate().getConnection());
+    EmiConnectionDelegate *delegate = cookie.delegate;
+    
+    // It is important that the delegate is set before the callback is
+    // invoked, so that no message can arrive to a connection that does
+    // not have its delegate set.
+    conn.setDelegate(delegate);
+    
+    if (!delegate) {
+        return;
+    }
+    
+    if (error) {
+        delegate->emiConnectionFailedToConnect(conn.getSocket(),
+                                               EmiBinding::makeError("com.emilir.eminet.disconnect", reason),
+                                               cookie.userData);
+    }
+    else {
+        delegate->emiConnectionOpened(conn, cookie.userData);
+    }
+}
+
+void EmiSockDelegate::connectionGotMessage(EC *conn,
+                                           EmiUdpSocket<EmiBinding> *socket,
+                                           EmiTimeInterval now,
+                                           const sockaddr_storage& inboundAddress,
+                                           const sockaddr_storage& remoteAddress,
+                                           const EmiBinding::TemporaryData& data,
+                                           size_t offset,
+                                           size_t len) {
+    // The posix binding is single threaded, so the connection can
+    // process the message right away.
+    conn->onMessage(now, socket,
+                    inboundAddress, remoteAddress,
+                    data, offset, len);
+}
+
+EmiEventLoop *EmiSockDelegate::getSocketCookie() {
+    return &_es.getLoop();
+}
+
+EmiEventLoop *EmiSockDelegate::getTimerCookie() {
+    return &_es.getLoop();
+}
@@ -0,0 +1,76 @@
+//
+//  EmiSockDelegate.h
+//  eminet
+//
+
+#ifndef eminet_EmiSockDelegate_h
+#define eminet_EmiSockDelegate_h
+
+#include "EmiError.h"
+#include "EmiBinding.h"
+
+#include "../core/EmiTypes.h"
+
+class EmiSocket;
+class EmiConnectionDelegate;
+class EmiSockDelegate;
+class EmiConnDelegate;
+template<class SockDelegate, class ConnDelegate>
+class EmiSock;
+template<class SockDelegate, class ConnDelegate>
+class EmiConn;
+template<class Binding>
+class EmiConnParams;
+template<class Binding>
+class EmiUdpSocket;
+
+// The cookie that is passed to EmiSock::connect. It tells
+// connectionOpened which delegate the new connection should have.
+struct EmiConnectionOpenedCookie {
+    EmiConnectionOpenedCookie() :
+    delegate(NULL), userData(NULL) {}
+    
+    EmiConnectionOpenedCookie(EmiConnectionDelegate *delegate_, void *userData_) :
+    delegate(delegate_), userData(userData_) {}
+    
+    EmiConnectionDelegate *delegate;
+    void *userData;
+};
+
+class EmiSockDelegate {
+    typedef EmiConn<EmiSockDelegate, EmiConnDelegate> EC;
+    
+    EmiSocket& _es;
+    
+public:
+    
+    typedef EmiBinding                Binding;
+    typedef EmiConnectionOpenedCookie ConnectionOpenedCallbackCookie;
+    
+    EmiSockDelegate(EmiSocket& es);
+    
+    EC *makeConnection(const EmiConnParams<EmiBinding>& params);
+    void gotServerConnection(EC& conn);
+    
+    static void connectionOpened(ConnectionOpenedCallbackCookie& cookie,
+                                 bool error,
+                                 EmiDisconnectReason reason,
+                                 EC& ec);
+    
+    void connectionGotMessage(EC *conn,
+                              EmiUdpSocket<EmiBinding> *socket,
+                              EmiTimeInterval now,
+                              const sockaddr_storage& inboundAddress,
+                              const sockaddr_storage& remoteAddress,
+                              const EmiBinding::TemporaryData& data,
+                              size_t offset,
+                              size_t len);
+    
+    inline EmiSocket& getEmiSocket() { return _es; }
+    inline const EmiSocket& getEmiSocket() const { return _es; }
+    
+    EmiEventLoop *getSocketCookie();
+    EmiEventLoop *getTimerCookie();
+};
+
+#endif
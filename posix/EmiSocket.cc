@@ -0,0 +1,41 @@
+//
+//  EmiSocket.cc
+//  eminet
+//
+
+#include "EmiSocket.h"
+
+#include "EmiConnection.h"
+
+EmiSocket::EmiSocket(EmiEventLoop& loop, const EmiSockConfig& sc, EmiSocketDelegate *delegate) :
+_loop(loop),
+_delegate(delegate),
+_sock(sc, EmiSockDelegate(*this)) {}
+
+EmiSocket::~EmiSocket() {}
+
+bool EmiSocket::open(EmiError& err) {
+    return _sock.open(err);
+}
+
+bool EmiSocket::connect(const sockaddr_storage& address,
+                        EmiConnectionDelegate *delegate,
+                        void *userData,
+                        EmiError& err) {
+    return _sock.connect(EmiEventLoop::now(), address,
+                         EmiConnectionOpenedCookie(delegate, userData),
+                         err);
+}
+
+bool EmiSocket::connect(const sockaddr_storage& address,
+                        const uint8_t *p2pCookie, size_t p2pCookieLength,
+                        const uint8_t *sharedSecret, size_t sharedSecretLength,
+                        EmiConnectionDelegate *delegate,
+                        void *userData,
+                        EmiError& err) {
+    return _sock.connect(EmiEventLoop::now(), address,
+                         p2pCookie, p2pCookieLength,
+                         sharedSecret, sharedSecretLength,
+                         EmiConnectionOpenedCookie(delegate, userData),
+                         err);
+}
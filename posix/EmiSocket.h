@@ -0,0 +1,77 @@
+//
+//  EmiSocket.h
+//  eminet
+//
+
+#ifndef eminet_EmiSocket_h
+#define eminet_EmiSocket_h
+
+#include "EmiBinding.h"
+#include "EmiSockDelegate.h"
+#include "EmiConnDelegate.h"
+
+#include "../core/EmiSock.h"
+#include "../core/EmiConn.h"
+
+class EmiSocket;
+class EmiConnection;
+class EmiConnectionDelegate;
+
+class EmiSocketDelegate {
+public:
+    virtual ~EmiSocketDelegate() {}
+    
+    // Invoked when a client connects to this socket. The receiver
+    // should set the delegate of the connection (EmiConnection::setDelegate)
+    // before it returns; otherwise messages on the connection are lost.
+    virtual void emiSocketGotConnection(EmiSocket& socket, EmiConnection& conn) = 0;
+};
+
+// The entry point of the C++ API of EmiNet. An EmiSocket must be
+// opened with open before it is used, and it must be used only from
+// the thread that runs its EmiEventLoop.
+class EmiSocket {
+    typedef EmiSock<EmiSockDelegate, EmiConnDelegate> EmiS;
+    
+    friend class EmiSockDelegate;
+    friend class EmiConnDelegate;
+    
+private:
+    // Private copy constructor and assignment operator
+    inline EmiSocket(const EmiSocket& other);
+    inline EmiSocket& operator=(const EmiSocket& other);
+    
+    EmiEventLoop&      _loop;
+    EmiSocketDelegate *_delegate;
+    EmiS               _sock;
+    
+public:
+    EmiSocket(EmiEventLoop& loop, const EmiSockConfig& sc, EmiSocketDelegate *delegate);
+    virtual ~EmiSocket();
+    
+    bool open(EmiError& err);
+    
+    // Exactly one of EmiConnectionDelegate::emiConnectionOpened and
+    // emiConnectionFailedToConnect will be invoked on delegate iff this
+    // method returns true.
+    bool connect(const sockaddr_storage& address,
+                 EmiConnectionDelegate *delegate,
+                 void *userData,
+                 EmiError& err);
+    bool connect(const sockaddr_storage& address,
+                 const uint8_t *p2pCookie, size_t p2pCookieLength,
+                 const uint8_t *sharedSecret, size_t sharedSecretLength,
+                 EmiConnectionDelegate *delegate,
+                 void *userData,
+                 EmiError& err);
+    
+    inline EmiSocketDelegate *getDelegate() const { return _delegate; }
+    inline void setDelegate(EmiSocketDelegate *delegate) { _delegate = delegate; }
+    
+    inline EmiEventLoop& getLoop() const { return _loop; }
+    
+    inline EmiS& getSock() { return _sock; }
+    inline const EmiS& getSock() const { return _sock; }
+};
+
+#endif
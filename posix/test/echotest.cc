@@ -0,0 +1,215 @@
+//
+//  echotest.cc
+//  eminet
+//
+
+// echotest opens a server and a client socket on the same EmiEventLoop
+// and sends messages of mixed sizes from the client over loopback. The
+// server echoes every message, and the client checks that all of them
+// come back once, in order and intact. It exits with status 0 if they
+// do and 1 if they don't within the time limit. Build it with:
+//
+//   g++ -O2 -Iposix -o echotest posix/test/echotest.cc posix/*.cc core/*.cc -lcrypto
+//
+// Options:
+//   -l rate   Make both sockets drop this fraction of their packets
+//   -p port   The port of the server (default 27015)
+
+#include "EmiNet.h"
+
+#include "../../core/EmiNetUtil.h"
+
+#include <arpa/inet.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+
+static const int NUM_MESSAGES = 200;
+// Every third message is bigger than a packet, so that it is split up
+static const size_t SMALL_MESSAGE_SIZE = 50;
+static const size_t BIG_MESSAGE_SIZE = 3000;
+static const EmiTimeInterval TIME_LIMIT = 10;
+// All messages are sent at once, so the default buffer is too small
+static const size_t SENDER_BUFFER_SIZE = 1024*1024;
+static const EmiChannelQualifier CHANNEL =
+    EMI_CHANNEL_QUALIFIER(EMI_CHANNEL_TYPE_RELIABLE_ORDERED, 0);
+
+static EmiEventLoop loop;
+static int messagesEchoed = 0;
+static int messagesReceived = 0;
+static int errors = 0;
+
+static size_t messageSize(int i) {
+    return (0 == i%3 ? BIG_MESSAGE_SIZE : SMALL_MESSAGE_SIZE);
+}
+
+class ServerConnDelegate : public EmiConnectionDelegate {
+public:
+    void emiConnectionOpened(EmiConnection& conn, void *userData) {}
+    void emiConnectionFailedToConnect(EmiSocket& socket, const EmiError& err, void *userData) {}
+    
+    void emiConnectionMessage(EmiConnection& conn,
+                              EmiChannelQualifier channelQualifier,
+                              const EmiBufferRef& data,
+                              size_t offset,
+                              size_t size) {
+        EmiError err;
+        if (!conn.send(data.get()->getData()+offset, size, channelQualifier, EMI_PRIORITY_HIGH, err)) {
+            printf("The server failed to echo message %d: %s\n", messagesEchoed, err.domain.c_str());
+            errors++;
+        }
+        messagesEchoed++;
+    }
+    
+    void emiConnectionDisconnect(EmiConnection& conn, EmiDisconnectReason reason) {}
+};
+
+class ServerDelegate : public EmiSocketDelegate {
+    ServerConnDelegate _connDelegate;
+public:
+    void emiSocketGotConnection(EmiSocket& socket, EmiConnection& conn) {
+        conn.setDelegate(&_connDelegate);
+    }
+};
+
+class ClientConnDelegate : public EmiConnectionDelegate {
+public:
+    void emiConnectionOpened(EmiConnection& conn, void *userData) {
+        uint8_t buf[BIG_MESSAGE_SIZE];
+        for (int i=0; i<NUM_MESSAGES; i++) {
+            memset(buf, i, sizeof(buf));
+            
+            EmiError err;
+            if (!conn.send(buf, messageSize(i), CHANNEL, EMI_PRIORITY_HIGH, err)) {
+                printf("Failed to send message %d: %s\n", i, err.domain.c_str());
+                errors++;
+            }
+        }
+    }
+    
+    void emiConnectionFailedToConnect(EmiSocket& socket, const EmiError& err, void *userData) {
+        printf("Failed to connect: %s\n", err.domain.c_str());
+        errors++;
+        loop.stop();
+    }
+    
+    void emiConnectionMessage(EmiConnection& conn,
+                              EmiChannelQualifier channelQualifier,
+                              const EmiBufferRef& data,
+                              size_t offset,
+                              size_t size) {
+        const uint8_t *buf = data.get()->getData()+offset;
+        int i = messagesReceived++;
+        
+        if (i >= NUM_MESSAGES || messageSize(i) != size) {
+            printf("Message %d has the wrong size (%lu bytes)\n", i, (unsigned long)size);
+            errors++;
+        }
+        else {
+            for (size_t j=0; j<size; j++) {
+                if ((uint8_t)i != buf[j]) {
+                    printf("Message %d has the wrong contents\n", i);
+                    errors++;
+                    break;
+                }
+            }
+        }
+        
+        if (NUM_MESSAGES == messagesReceived) {
+            EmiError err;
+            conn.close(err);
+        }
+    }
+    
+    void emiConnectionDisconnect(EmiConnection& conn, EmiDisconnectReason reason) {
+        loop.stop();
+    }
+};
+
+static void timeoutCb(EmiTimeInterval now, EmiEventLoop::Timer *timer, void *data) {
+    printf("Timed out\n");
+    loop.stop();
+}
+
+// Returns true if the test passed
+static bool runTest(double lossRate, uint16_t port) {
+    EmiError err;
+    
+    ServerDelegate serverDelegate;
+    EmiSockConfig serverConfig;
+    serverConfig.acceptConnections = true;
+    serverConfig.port = port;
+    serverConfig.senderBufferSize = SENDER_BUFFER_SIZE;
+    serverConfig.fabricatedPacketDropRate = lossRate;
+    EmiNetUtil::anyAddr(port, AF_INET, &serverConfig.address);
+    EmiSocket server(loop, serverConfig, &serverDelegate);
+    if (!server.open(err)) {
+        printf("Failed to open the server socket: %s\n", err.domain.c_str());
+        return false;
+    }
+    
+    // The delegates have to outlive the sockets, which close their
+    // connections when they are destroyed
+    ClientConnDelegate clientDelegate;
+    EmiSockConfig clientConfig;
+    clientConfig.senderBufferSize = SENDER_BUFFER_SIZE;
+    clientConfig.fabricatedPacketDropRate = lossRate;
+    EmiNetUtil::anyAddr(0, AF_INET, &clientConfig.address);
+    EmiSocket client(loop, clientConfig, NULL);
+    if (!client.open(err)) {
+        printf("Failed to open the client socket: %s\n", err.domain.c_str());
+        return false;
+    }
+    
+    sockaddr_storage address;
+    EmiNetUtil::anyAddr(port, AF_INET, &address);
+    inet_pton(AF_INET, "127.0.0.1", &((sockaddr_in *)&address)->sin_addr);
+    
+    if (!client.connect(address, &clientDelegate, NULL, err)) {
+        printf("Failed to connect: %s\n", err.domain.c_str());
+        return false;
+    }
+    
+    EmiEventLoop::Timer *timeout = loop.makeTimer();
+    loop.scheduleTimer(timeout, timeoutCb, NULL, TIME_LIMIT, /*repeating:*/false);
+    
+    EmiTimeInterval start = EmiEventLoop::now();
+    loop.run();
+    loop.freeTimer(timeout);
+    
+    printf("%d of %d messages echoed in %.3fs\n",
+           messagesReceived, NUM_MESSAGES, EmiEventLoop::now()-start);
+    
+    return (0 == errors && NUM_MESSAGES == messagesReceived);
+}
+
+int main(int argc, char **argv) {
+    double lossRate = 0;
+    uint16_t port = 27015;
+    
+    int c;
+    while (-1 != (c = getopt(argc, argv, "l:p:"))) {
+        switch (c) {
+            case 'l': lossRate = atof(optarg); break;
+            case 'p': port = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-l loss rate] [-p port]\n", argv[0]);
+                return 2;
+        }
+    }
+    
+    EmiError err;
+    if (!loop.open(err)) {
+        printf("Failed to open the event loop: %s\n", err.domain.c_str());
+        return 1;
+    }
+    
+    bool passed = runTest(lossRate, port);
+    // The connections are released on the loop iteration after their
+    // sockets are closed
+    loop.runOnce(0);
+    
+    printf("%s\n", passed ? "PASS" : "FAIL");
+    return passed ? 0 : 1;
+}
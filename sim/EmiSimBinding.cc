@@ -0,0 +1,94 @@
+//
+//  EmiSimBinding.cc
+//  eminet
+//
+
+#include "EmiSimBinding.h"
+
+#include "../core/EmiNetUtil.h"
+
+#include <openssl/hmac.h>
+#include <cstring>
+#include <algorithm>
+
+void EmiSimBinding::hmacHash(const uint8_t *key, size_t keyLength,
+                             const uint8_t *data, size_t dataLength,
+                             uint8_t *buf, size_t bufLen) {
+    unsigned int bufLenInt = bufLen;
+    ASSERT(HMAC(EVP_sha256(), key, keyLength, data, dataLength, buf, &bufLenInt));
+}
+
+void EmiSimBinding::randomBytes(uint8_t *buf, size_t bufSize) {
+    EmiSimNetwork& network(EmiSimNetwork::current());
+    
+    for (size_t i=0; i<bufSize; i+=sizeof(uint64_t)) {
+        uint64_t rand = network.random();
+        memcpy(buf+i, &rand, std::min(sizeof(uint64_t), bufSize-i));
+    }
+}
+
+EmiSimBinding::Timer *EmiSimBinding::makeTimer(EmiSimNetwork *network) {
+    return network->makeTimer();
+}
+
+void EmiSimBinding::freeTimer(Timer *timer) {
+    timer->getNetwork().freeTimer(timer);
+}
+
+void EmiSimBinding::scheduleTimer(Timer *timer, TimerCb *timerCb, void *data, EmiTimeInterval interval,
+                                  bool repeating, bool reschedule) {
+    if (!reschedule && timer->isActive()) {
+        // We were told not to re-schedule the timer.
+        // The timer is already active, so do nothing.
+        return;
+    }
+    
+    timer->getNetwork().scheduleTimer(timer, timerCb, data, interval, repeating);
+}
+
+void EmiSimBinding::descheduleTimer(Timer *timer) {
+    timer->getNetwork().descheduleTimer(timer);
+}
+
+bool EmiSimBinding::getNetworkInterfaces(NetworkInterfaces& ni, Error& err) {
+    ni.first = &EmiSimNetwork::current().getHosts();
+    ni.second = 0;
+    return true;
+}
+
+bool EmiSimBinding::nextNetworkInterface(NetworkInterfaces& ni, const char*& name, struct sockaddr_storage& addr) {
+    if (ni.second >= ni.first->size()) {
+        return false;
+    }
+    
+    addr = (*ni.first)[ni.second];
+    name = "sim";
+    ni.second++;
+    return true;
+}
+
+void EmiSimBinding::freeNetworkInterfaces(const NetworkInterfaces& ni) {}
+
+void EmiSimBinding::closeSocket(EmiSimNetwork::Socket *socket) {
+    socket->getNetwork().closeSocket(socket);
+}
+
+EmiSimNetwork::Socket *EmiSimBinding::openSocket(EmiSimNetwork *network,
+                                                 EmiOnMessage *callback,
+                                                 void *userData,
+                                                 const sockaddr_storage& address,
+                                                 Error& err) {
+    return network->openSocket(address, callback, userData, err);
+}
+
+void EmiSimBinding::extractLocalAddress(EmiSimNetwork::Socket *socket, sockaddr_storage& address) {
+    address = socket->getAddress();
+}
+
+void EmiSimBinding::sendData(EmiSimNetwork::Socket *socket,
+                             const sockaddr_storage& address,
+                             const struct iovec *iov,
+                             size_t iovcnt,
+                             bool packetPair) {
+    socket->getNetwork().send(socket, address, iov, iovcnt);
+}
@@ -0,0 +1,115 @@
+//
+//  EmiSimBinding.h
+//  eminet
+//
+
+#ifndef eminet_EmiSimBinding_h
+#define eminet_EmiSimBinding_h
+
+#include "EmiSimNetwork.h"
+
+#include "../posix/EmiError.h"
+#include "../posix/EmiBuffer.h"
+
+#include "../core/EmiTypes.h"
+
+#include <utility>
+#include <vector>
+#include <netinet/in.h>
+#include <sys/uio.h>
+
+// The binding of the network simulator. Timers and sockets live in an
+// EmiSimNetwork, which is both the SocketCookie and the TimerCookie,
+// and time is the virtual time of that network. Data is represented
+// with EmiBuffers, like in the posix binding.
+class EmiSimBinding {
+private:
+    inline EmiSimBinding();
+    
+public:
+    
+    typedef EmiError                  Error;
+    typedef EmiSimNetwork::Socket     SocketHandle;
+    typedef EmiBufferRef              TemporaryData;
+    typedef EmiBuffer*                PersistentData;
+    typedef EmiSimNetwork::Timer      Timer;
+    typedef EmiSimNetwork*            TimerCookie;
+    typedef EmiSimNetwork::TimerCb    TimerCb;
+    typedef EmiSimNetwork::ReceiveCb  EmiOnMessage;
+    
+    inline static EmiError makeError(const char *domain, int32_t code) {
+        return EmiError(domain, code);
+    }
+    
+    inline static EmiBuffer *makePersistentData(const uint8_t *data, size_t length) {
+        return EmiBuffer::copy(data, length);
+    }
+    inline static EmiBufferRef makeTemporaryData(size_t size, uint8_t **outData) {
+        EmiBuffer *buf = EmiBuffer::make(size);
+        *outData = buf->getData();
+        return EmiBufferRef(buf);
+    }
+    inline static void releasePersistentData(EmiBuffer *buf) {
+        // Messages without contents have NULL data
+        if (buf) {
+            buf->release();
+        }
+    }
+    inline static EmiBufferRef castToTemporary(EmiBuffer *buf) {
+        return EmiBufferRef::retained(buf);
+    }
+    
+    inline static const uint8_t *extractData(const EmiBufferRef& data) {
+        return data.isEmpty() ? NULL : data.get()->getData();
+    }
+    inline static size_t extractLength(const EmiBufferRef& data) {
+        return data.isEmpty() ? 0 : data.get()->getLength();
+    }
+    inline static const uint8_t *extractData(EmiBuffer *data) {
+        return data ? data->getData() : NULL;
+    }
+    inline static size_t extractLength(EmiBuffer *data) {
+        return data ? data->getLength() : 0;
+    }
+    
+    static const size_t HMAC_HASH_SIZE = 32;
+    static void hmacHash(const uint8_t *key, size_t keyLength,
+                         const uint8_t *data, size_t dataLength,
+                         uint8_t *buf, size_t bufLen);
+    // The bytes come from the random number generator of the current
+    // EmiSimNetwork, so that simulations are reproducible.
+    static void randomBytes(uint8_t *buf, size_t bufSize);
+    
+    inline static EmiTimeInterval now() {
+        return EmiSimNetwork::current().now();
+    }
+    static const bool SHARED_TIMER_WHEEL = true;
+    static Timer *makeTimer(EmiSimNetwork *network);
+    static void freeTimer(Timer *timer);
+    static void scheduleTimer(Timer *timer, TimerCb *timerCb, void *data, EmiTimeInterval interval,
+                              bool repeating, bool reschedule);
+    static void descheduleTimer(Timer *timer);
+    
+    // The network interfaces of the simulator are the hosts of the
+    // current EmiSimNetwork. Sockets that are bound to the any address
+    // get one socket per host, so bind to the address of a host.
+    typedef std::pair<const std::vector<sockaddr_storage>*, size_t> NetworkInterfaces;
+    static bool getNetworkInterfaces(NetworkInterfaces& ni, Error& err);
+    static bool nextNetworkInterface(NetworkInterfaces& ni, const char*& name, struct sockaddr_storage& addr);
+    static void freeNetworkInterfaces(const NetworkInterfaces& ni);
+    
+    static void closeSocket(EmiSimNetwork::Socket *socket);
+    static EmiSimNetwork::Socket *openSocket(EmiSimNetwork *network,
+                                             EmiOnMessage *callback,
+                                             void *userData,
+                                             const sockaddr_storage& address,
+                                             Error& err);
+    static void extractLocalAddress(EmiSimNetwork::Socket *socket, sockaddr_storage& address);
+    static void sendData(EmiSimNetwork::Socket *socket,
+                         const sockaddr_storage& address,
+                         const struct iovec *iov,
+                         size_t iovcnt,
+                         bool packetPair);
+};
+
+#endif
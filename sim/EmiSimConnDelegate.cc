@@ -0,0 +1,93 @@
+//
+//  EmiSimConnDelegate.cc
+//  eminet
+//
+
+#include "EmiSimConnDelegate.h"
+
+#include "EmiSimSocket.h"
+#include "EmiSimConnection.h"
+
+EmiSimConnDelegate::EmiSimConnDelegate(EmiSimConnection& conn) : _conn(conn) {}
+
+static void release_cb(EmiTimeInterval now, EmiSimBinding::Timer *timer, void *data) {
+    EmiSimBinding::freeTimer(timer);
+    ((EmiSimConnection *)data)->release();
+}
+
+void EmiSimConnDelegate::invalidate() {
+    if (EMI_CONNECTION_TYPE_SERVER == _conn.getConn().getType()) {
+        _conn.getSocket().getSock().deregisterServerConnection(&_conn.getConn());
+    }
+    
+    // This releases the reference that the EmiSimConnection was created
+    // with in EmiSimSockDelegate::makeConnection. This method is invoked
+    // from within the EmiConn object, so the release is done in a
+    // separate event; releasing it here might deallocate the connection
+    // while there are references to it left on the stack.
+    EmiSimBinding::Timer *timer = EmiSimBinding::makeTimer(getTimerCookie());
+    EmiSimBinding::scheduleTimer(timer, release_cb, &_conn,
+                                 /*interval:*/0,
+                                 /*repeating:*/false, /*reschedule:*/true);
+}
+
+void EmiSimConnDelegate::emiConnPacketLoss(EmiChannelQualifier channelQualifier,
+                                           EmiSequenceNumber packetsLost) {
+    EmiSimConnectionDelegate *delegate = _conn.getDelegate();
+    if (delegate) {
+        delegate->emiConnectionPacketLoss(_conn, channelQualifier, packetsLost);
+    }
+}
+
+void EmiSimConnDelegate::emiConnMessage(EmiChannelQualifier channelQualifier,
+                                        const EmiBufferRef& data,
+                                        size_t offset,
+                                        size_t size) {
+    EmiSimConnectionDelegate *delegate = _conn.getDelegate();
+    if (delegate) {
+        delegate->emiConnectionMessage(_conn, channelQualifier, data, offset, size);
+    }
+}
+
+void EmiSimConnDelegate::emiConnLost() {
+    EmiSimConnectionDelegate *delegate = _conn.getDelegate();
+    if (delegate) {
+        delegate->emiConnectionLost(_conn);
+    }
+}
+
+void EmiSimConnDelegate::emiConnRegained() {
+    EmiSimConnectionDelegate *delegate = _conn.getDelegate();
+    if (delegate) {
+        delegate->emiConnectionRegained(_conn);
+    }
+}
+
+void EmiSimConnDelegate::emiConnDisconnect(EmiDisconnectReason reason) {
+    EmiSimConnectionDelegate *delegate = _conn.getDelegate();
+    if (delegate) {
+        delegate->emiConnectionDisconnect(_conn, reason);
+    }
+}
+
+void EmiSimConnDelegate::emiNatPunchthroughFinished(bool success) {
+    EmiSimConnectionDelegate *delegate = _conn.getDelegate();
+    if (!delegate) {
+        return;
+    }
+    
+    if (success) {
+        delegate->emiP2PConnectionEstablished(_conn);
+    }
+    else {
+        delegate->emiP2PConnectionNotEstablished(_conn);
+    }
+}
+
+EmiSimNetwork *EmiSimConnDelegate::getSocketCookie() {
+    return &_conn.getSocket().getNetwork();
+}
+
+EmiSimNetwork *EmiSimConnDelegate::getTimerCookie() {
+    return &_conn.getSocket().getNetwork();
+}
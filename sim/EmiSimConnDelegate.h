@@ -0,0 +1,42 @@
+//
+//  EmiSimConnDelegate.h
+//  eminet
+//
+
+#ifndef eminet_EmiSimConnDelegate_h
+#define eminet_EmiSimConnDelegate_h
+
+#include "EmiSimBinding.h"
+
+#include "../core/EmiTypes.h"
+
+class EmiSimConnection;
+
+class EmiSimConnDelegate {
+    EmiSimConnection& _conn;
+    
+public:
+    EmiSimConnDelegate(EmiSimConnection& conn);
+    
+    void invalidate();
+    
+    void emiConnPacketLoss(EmiChannelQualifier channelQualifier,
+                           EmiSequenceNumber packetsLost);
+    void emiConnMessage(EmiChannelQualifier channelQualifier,
+                        const EmiBufferRef& data,
+                        size_t offset,
+                        size_t size);
+    
+    void emiConnLost();
+    void emiConnRegained();
+    void emiConnDisconnect(EmiDisconnectReason reason);
+    void emiNatPunchthroughFinished(bool success);
+    
+    inline EmiSimConnection& getConnection() { return _conn; }
+    inline const EmiSimConnection& getConnection() const { return _conn; }
+    
+    EmiSimNetwork *getSocketCookie();
+    EmiSimNetwork *getTimerCookie();
+};
+
+#endif
@@ -0,0 +1,70 @@
+//
+//  EmiSimConnection.cc
+//  eminet
+//
+
+#include "EmiSimConnection.h"
+
+#include "EmiSimSocket.h"
+
+EmiSimConnection::EmiSimConnection(EmiSimSocket& es, const ECP& params) :
+_es(es),
+_delegate(NULL),
+_refCount(1),
+_conn(EmiSimConnDelegate(*this), es.getSock().config, params) {}
+
+EmiSimConnection::~EmiSimConnection() {}
+
+void EmiSimConnection::retain() {
+    ++_refCount;
+}
+
+void EmiSimConnection::release() {
+    ASSERT(0 != _refCount);
+    
+    if (0 == --_refCount) {
+        delete this;
+    }
+}
+
+bool EmiSimConnection::close(EmiError& err) {
+    return _conn.close(EmiSimBinding::now(), err);
+}
+
+void EmiSimConnection::forceClose() {
+    _conn.forceClose();
+}
+
+void EmiSimConnection::closeOrForceClose() {
+    EmiError err;
+    if (!_conn.close(EmiSimBinding::now(), err)) {
+        _conn.forceClose();
+    }
+}
+
+bool EmiSimConnection::send(const uint8_t *data, size_t size,
+                            EmiChannelQualifier channelQualifier, EmiPriority priority,
+                            EmiError& err) {
+    return send(EmiSimBinding::makePersistentData(data, size),
+                channelQualifier, priority, err);
+}
+
+bool EmiSimConnection::send(EmiBuffer *data,
+                            EmiChannelQualifier channelQualifier, EmiPriority priority,
+                            EmiError& err) {
+    return send(data, channelQualifier, priority, EMI_NO_DEADLINE, err);
+}
+
+bool EmiSimConnection::send(const uint8_t *data, size_t size,
+                            EmiChannelQualifier channelQualifier, EmiPriority priority,
+                            EmiTimeInterval deadline, EmiError& err) {
+    return send(EmiSimBinding::makePersistentData(data, size),
+                channelQualifier, priority, deadline, err);
+}
+
+bool EmiSimConnection::send(EmiBuffer *data,
+                            EmiChannelQualifier channelQualifier, EmiPriority priority,
+                            EmiTimeInterval deadline, EmiError& err) {
+    // EmiConn::send assumes ownership over data
+    return _conn.send(EmiSimBinding::now(), data, channelQualifier, priority, deadline, err);
+}
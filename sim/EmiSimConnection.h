@@ -0,0 +1,115 @@
+//
+//  EmiSimConnection.h
+//  eminet
+//
+
+#ifndef eminet_EmiSimConnection_h
+#define eminet_EmiSimConnection_h
+
+#include "EmiSimBinding.h"
+#include "EmiSimSockDelegate.h"
+#include "EmiSimConnDelegate.h"
+
+#include "../core/EmiConn.h"
+
+class EmiSimSocket;
+class EmiSimConnection;
+
+// All callbacks are invoked while the EmiSimNetwork of the
+// connection's EmiSimSocket dispatches events.
+class EmiSimConnectionDelegate {
+public:
+    virtual ~EmiSimConnectionDelegate() {}
+    
+    virtual void emiConnectionOpened(EmiSimConnection& conn, void *userData) = 0;
+    virtual void emiConnectionFailedToConnect(EmiSimSocket& socket, const EmiError& err, void *userData) = 0;
+    
+    // data is only guaranteed to be valid for the duration of the
+    // callback. To keep it, retain data.get() or copy it.
+    virtual void emiConnectionMessage(EmiSimConnection& conn,
+                                      EmiChannelQualifier channelQualifier,
+                                      const EmiBufferRef& data,
+                                      size_t offset,
+                                      size_t size) = 0;
+    virtual void emiConnectionDisconnect(EmiSimConnection& conn, EmiDisconnectReason reason) = 0;
+    
+    virtual void emiConnectionLost(EmiSimConnection& conn) {}
+    virtual void emiConnectionRegained(EmiSimConnection& conn) {}
+    virtual void emiConnectionPacketLoss(EmiSimConnection& conn,
+                                         EmiChannelQualifier channelQualifier,
+                                         EmiSequenceNumber packetsLost) {}
+    virtual void emiP2PConnectionEstablished(EmiSimConnection& conn) {}
+    virtual void emiP2PConnectionNotEstablished(EmiSimConnection& conn) {}
+};
+
+// EmiSimConnection objects are reference counted. An EmiSimConnection holds
+// a reference to itself from when it's created until it's closed, so
+// there is no need to retain a connection to keep it open. Retain it
+// to be able to use the object after it has been closed.
+class EmiSimConnection {
+    typedef EmiConn<EmiSimSockDelegate, EmiSimConnDelegate> EC;
+    typedef EmiConnParams<EmiSimBinding>                    ECP;
+    
+private:
+    // Private copy constructor and assignment operator
+    inline EmiSimConnection(const EmiSimConnection& other);
+    inline EmiSimConnection& operator=(const EmiSimConnection& other);
+    
+    EmiSimSocket&             _es;
+    EmiSimConnectionDelegate *_delegate;
+    size_t                    _refCount;
+    EC                        _conn;
+    
+    // Use release instead
+    virtual ~EmiSimConnection();
+    
+public:
+    EmiSimConnection(EmiSimSocket& es, const ECP& params);
+    
+    void retain();
+    void release();
+    
+    bool close(EmiError& err);
+    void forceClose();
+    // Tries to close the connection gracefully, and force closes it
+    // if that fails.
+    void closeOrForceClose();
+    
+    // Copies the data
+    bool send(const uint8_t *data, size_t size,
+              EmiChannelQualifier channelQualifier, EmiPriority priority,
+              EmiError& err);
+    // Takes over the caller's reference to data. This avoids a copy,
+    // but data must not be modified after it has been sent.
+    bool send(EmiBuffer *data,
+              EmiChannelQualifier channelQualifier, EmiPriority priority,
+              EmiError& err);
+    // deadline is the number of seconds from now that the message
+    // should be sent within. Unreliable messages that miss it are
+    // dropped; see EmiSendScheduler.
+    bool send(const uint8_t *data, size_t size,
+              EmiChannelQualifier channelQualifier, EmiPriority priority,
+              EmiTimeInterval deadline, EmiError& err);
+    bool send(EmiBuffer *data,
+              EmiChannelQualifier channelQualifier, EmiPriority priority,
+              EmiTimeInterval deadline, EmiError& err);
+    
+    inline EmiSimConnectionDelegate *getDelegate() const { return _delegate; }
+    inline void setDelegate(EmiSimConnectionDelegate *delegate) { _delegate = delegate; }
+    
+    inline EmiSimSocket& getSocket() const { return _es; }
+    
+    inline EC& getConn() { return _conn; }
+    inline const EC& getConn() const { return _conn; }
+    
+    inline bool hasIssuedConnectionWarning() const { return _conn.issuedConnectionWarning(); }
+    inline size_t getExpiredMessages() const { return _conn.getExpiredMessages(); }
+    inline const sockaddr_storage& getLocalAddress() const { return _conn.getLocalAddress(); }
+    inline const sockaddr_storage& getRemoteAddress() const { return _conn.getRemoteAddress(); }
+    inline uint16_t getInboundPort() const { return _conn.getInboundPort(); }
+    inline bool isOpen() const { return _conn.isOpen(); }
+    inline bool isOpening() const { return _conn.isOpening(); }
+    inline EmiP2PState getP2PState() const { return _conn.getP2PState(); }
+};
+
+#endif
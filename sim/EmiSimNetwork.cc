@@ -0,0 +1,366 @@
+//
+//  EmiSimNetwork.cc
+//  eminet
+//
+
+#include "EmiSimNetwork.h"
+
+#include "../core/EmiNetUtil.h"
+
+#include <errno.h>
+#include <cstring>
+#include <algorithm>
+
+// The clock starts at this time rather than at 0, because the core
+// uses negative and zero times as markers in some places.
+static const EmiTimeInterval EMI_SIM_START_TIME = 1000;
+static const uint16_t EMI_SIM_FIRST_EPHEMERAL_PORT = 49152;
+
+EmiSimNetwork *EmiSimNetwork::_current = NULL;
+
+EmiSimNetwork::EmiSimNetwork(uint64_t seed) :
+_now(EMI_SIM_START_TIME),
+_seq(0),
+_randomState(seed),
+_stopped(false),
+_timers(),
+_packets(),
+_sockets(),
+_links(),
+_hosts(),
+_defaultLinkParams(),
+_nextEphemeralPort(EMI_SIM_FIRST_EPHEMERAL_PORT) {
+    ASSERT(!_current);
+    _current = this;
+}
+
+EmiSimNetwork::~EmiSimNetwork() {
+    TimerSetIter iter(_timers.begin());
+    TimerSetIter  end(_timers.end());
+    while (iter != end) {
+        (*iter)->_active = false;
+        ++iter;
+    }
+    _timers.clear();
+    
+    PacketSetIter piter(_packets.begin());
+    PacketSetIter  pend(_packets.end());
+    while (piter != pend) {
+        (*piter)->data->release();
+        delete *piter;
+        ++piter;
+    }
+    _packets.clear();
+    
+    _current = NULL;
+}
+
+EmiSimNetwork& EmiSimNetwork::current() {
+    ASSERT(_current);
+    return *_current;
+}
+
+uint64_t EmiSimNetwork::random() {
+    // splitmix64. It is not cryptographically secure, but the point
+    // here is to be reproducible.
+    uint64_t z = (_randomState += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+double EmiSimNetwork::randomUniform() {
+    // The 53 most significant bits fill the mantissa of a double
+    return (random() >> 11) * (1.0/9007199254740992.0);
+}
+
+sockaddr_storage EmiSimNetwork::hostAddress(const sockaddr_storage& address) {
+    sockaddr_storage result(address);
+    EmiNetUtil::addrSetPort(result, 0);
+    return result;
+}
+
+void EmiSimNetwork::addHost(const sockaddr_storage& address) {
+    _hosts.push_back(hostAddress(address));
+}
+
+EmiSimNetwork::Link& EmiSimNetwork::getLink(const sockaddr_storage& from, const sockaddr_storage& to) {
+    HostPair key(hostAddress(from), hostAddress(to));
+    
+    LinkMapIter iter(_links.find(key));
+    if (_links.end() == iter) {
+        Link& link(_links[key]);
+        link.params = _defaultLinkParams;
+        return link;
+    }
+    
+    return (*iter).second;
+}
+
+void EmiSimNetwork::setLink(const sockaddr_storage& from, const sockaddr_storage& to, const EmiSimLinkParams& params) {
+    getLink(from, to).params = params;
+}
+
+void EmiSimNetwork::setDefaultLink(const EmiSimLinkParams& params) {
+    _defaultLinkParams = params;
+}
+
+const EmiSimLinkStats& EmiSimNetwork::getLinkStats(const sockaddr_storage& from, const sockaddr_storage& to) {
+    return getLink(from, to).stats;
+}
+
+EmiSimNetwork::Timer *EmiSimNetwork::makeTimer() {
+    return new Timer(*this);
+}
+
+void EmiSimNetwork::freeTimer(Timer *timer) {
+    descheduleTimer(timer);
+    
+    // Timers are unlinked before their callback is invoked, and the
+    // network doesn't touch them after the callback has returned, so
+    // they can be deleted right away, even from within the callback.
+    delete timer;
+}
+
+void EmiSimNetwork::scheduleTimer(Timer *timer, TimerCb *timerCb, void *data,
+                                  EmiTimeInterval interval, bool repeating) {
+    ASSERT(&timer->_network == this);
+    
+    if (timer->_active) {
+        _timers.erase(timer);
+    }
+    
+    timer->_timerCb = timerCb;
+    timer->_data = data;
+    timer->_interval = interval;
+    timer->_repeating = repeating;
+    timer->_deadline = _now + interval;
+    timer->_seq = _seq++;
+    timer->_active = true;
+    
+    _timers.insert(timer);
+}
+
+void EmiSimNetwork::descheduleTimer(Timer *timer) {
+    if (timer->_active) {
+        _timers.erase(timer);
+        timer->_active = false;
+    }
+}
+
+EmiSimNetwork::Socket *EmiSimNetwork::openSocket(const sockaddr_storage& address,
+                                                 ReceiveCb *receiveCb,
+                                                 void *userData,
+                                                 EmiError& err) {
+    sockaddr_storage host(hostAddress(address));
+    
+    bool hostExists = false;
+    std::vector<sockaddr_storage>::iterator iter(_hosts.begin());
+    std::vector<sockaddr_storage>::iterator  end(_hosts.end());
+    while (iter != end) {
+        if (0 == EmiAddressCmp::compare(host, *iter)) {
+            hostExists = true;
+            break;
+        }
+        ++iter;
+    }
+    
+    if (!hostExists) {
+        err = EmiError("com.emilir.eminet.socket", EADDRNOTAVAIL);
+        return NULL;
+    }
+    
+    sockaddr_storage socketAddress(address);
+    
+    if (0 == EmiNetUtil::addrPortH(address)) {
+        // Look for an unused ephemeral port
+        bool found = false;
+        for (int i=0; i<65536-EMI_SIM_FIRST_EPHEMERAL_PORT; i++) {
+            uint16_t port = _nextEphemeralPort;
+            _nextEphemeralPort = (65535 == port ? EMI_SIM_FIRST_EPHEMERAL_PORT : port+1);
+            
+            EmiNetUtil::addrSetPort(socketAddress, port);
+            if (_sockets.end() == _sockets.find(socketAddress)) {
+                found = true;
+                break;
+            }
+        }
+        
+        if (!found) {
+            err = EmiError("com.emilir.eminet.socket", EADDRINUSE);
+            return NULL;
+        }
+    }
+    else if (_sockets.end() != _sockets.find(socketAddress)) {
+        err = EmiError("com.emilir.eminet.socket", EADDRINUSE);
+        return NULL;
+    }
+    
+    Socket *socket = new Socket(*this, socketAddress, receiveCb, userData);
+    _sockets[socketAddress] = socket;
+    return socket;
+}
+
+void EmiSimNetwork::closeSocket(Socket *socket) {
+    ASSERT(&socket->_network == this);
+    
+    _sockets.erase(socket->_address);
+    delete socket;
+}
+
+void EmiSimNetwork::send(Socket *socket, const sockaddr_storage& address, const struct iovec *iov, size_t iovcnt) {
+    size_t size = 0;
+    for (size_t i=0; i<iovcnt; i++) {
+        size += iov[i].iov_len;
+    }
+    
+    Link& link(getLink(socket->_address, address));
+    const EmiSimLinkParams& params(link.params);
+    
+    link.stats.packetsSent++;
+    link.stats.bytesSent += size;
+    
+    if (0 != params.maxPacketSize && size > params.maxPacketSize) {
+        link.stats.packetsTooBig++;
+        return;
+    }
+    
+    EmiTimeInterval transmitted = _now;
+    if (0 != params.bandwidth) {
+        EmiTimeInterval start = std::max(_now, link.busyUntil);
+        
+        if (0 != params.queueSize &&
+            (start-_now)*params.bandwidth + size > params.queueSize) {
+            link.stats.packetsDropped++;
+            return;
+        }
+        
+        transmitted = start + size/params.bandwidth;
+        link.busyUntil = transmitted;
+    }
+    
+    if (0 != params.lossRate && randomUniform() < params.lossRate) {
+        link.stats.packetsLost++;
+        return;
+    }
+    
+    EmiTimeInterval arrival = transmitted + params.delay;
+    if (0 != params.jitter) {
+        arrival += params.jitter*randomUniform();
+    }
+    
+    if (0 != params.reorderRate && randomUniform() < params.reorderRate) {
+        arrival += params.reorderDelay;
+        link.stats.packetsReordered++;
+    }
+    else {
+        arrival = std::max(arrival, link.lastArrival);
+        link.lastArrival = arrival;
+    }
+    
+    Packet *packet = new Packet;
+    packet->deadline = arrival;
+    packet->seq = _seq++;
+    packet->from = socket->_address;
+    packet->to = address;
+    packet->link = &link;
+    packet->data = EmiBuffer::make(size);
+    
+    uint8_t *buf = packet->data->getData();
+    size_t pos = 0;
+    for (size_t i=0; i<iovcnt; i++) {
+        memcpy(buf+pos, iov[i].iov_base, iov[i].iov_len);
+        pos += iov[i].iov_len;
+    }
+    
+    _packets.insert(packet);
+}
+
+void EmiSimNetwork::fireTimer(Timer *timer) {
+    if (timer->_repeating) {
+        // Re-insert the timer before invoking the callback; the
+        // callback is allowed to deschedule or free the timer.
+        timer->_deadline = _now + timer->_interval;
+        timer->_seq = _seq++;
+        _timers.insert(timer);
+    }
+    else {
+        timer->_active = false;
+    }
+    
+    timer->_timerCb(_now, timer, timer->_data);
+}
+
+void EmiSimNetwork::deliverPacket(Packet *packet) {
+    // This takes over the reference of the packet
+    EmiBufferRef data(packet->data);
+    size_t size = data.get()->getLength();
+    
+    packet->link->stats.packetsDelivered++;
+    packet->link->stats.bytesDelivered += size;
+    
+    SocketMapIter iter(_sockets.find(packet->to));
+    if (_sockets.end() != iter) {
+        Socket *socket = (*iter).second;
+        socket->_receiveCb(socket, socket->_userData, _now, packet->from, data, 0, size);
+    }
+    
+    delete packet;
+}
+
+bool EmiSimNetwork::runOnce() {
+    Timer  *timer  = (_timers.empty()  ? NULL : *_timers.begin());
+    Packet *packet = (_packets.empty() ? NULL : *_packets.begin());
+    
+    if (timer && packet) {
+        // Dispatch whichever is first
+        if (timer->_deadline < packet->deadline ||
+            (timer->_deadline == packet->deadline && timer->_seq < packet->seq)) {
+            packet = NULL;
+        }
+        else {
+            timer = NULL;
+        }
+    }
+    
+    if (timer) {
+        _timers.erase(_timers.begin());
+        _now = std::max(_now, timer->_deadline);
+        fireTimer(timer);
+        return true;
+    }
+    else if (packet) {
+        _packets.erase(_packets.begin());
+        _now = std::max(_now, packet->deadline);
+        deliverPacket(packet);
+        return true;
+    }
+    
+    return false;
+}
+
+void EmiSimNetwork::runUntil(EmiTimeInterval time) {
+    _stopped = false;
+    
+    while (!_stopped) {
+        bool timerDue  = (!_timers.empty()  && (*_timers.begin())->_deadline <= time);
+        bool packetDue = (!_packets.empty() && (*_packets.begin())->deadline <= time);
+        
+        if (!timerDue && !packetDue) {
+            _now = std::max(_now, time);
+            break;
+        }
+        
+        runOnce();
+    }
+}
+
+void EmiSimNetwork::run() {
+    _stopped = false;
+    
+    while (!_stopped && runOnce());
+}
+
+void EmiSimNetwork::stop() {
+    _stopped = true;
+}
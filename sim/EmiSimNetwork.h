@@ -0,0 +1,336 @@
+//
+//  EmiSimNetwork.h
+//  eminet
+//
+
+#ifndef eminet_EmiSimNetwork_h
+#define eminet_EmiSimNetwork_h
+
+#include "../posix/EmiError.h"
+#include "../posix/EmiBuffer.h"
+
+#include "../core/EmiTypes.h"
+#include "../core/EmiAddressCmp.h"
+
+#include <map>
+#include <set>
+#include <vector>
+#include <utility>
+#include <stdint.h>
+#include <netinet/in.h>
+#include <sys/uio.h>
+
+// The properties of one direction of a simulated link.
+//
+// A packet that is sent on a link first waits for the packets ahead of
+// it to be transmitted at bandwidth bytes per second. If more than
+// queueSize bytes are waiting, it is dropped (tail drop). After it has
+// been transmitted, it is lost with probability lossRate; otherwise it
+// arrives after delay plus a uniformly distributed extra delay of up
+// to jitter seconds. Jitter never reorders packets by itself, but with
+// probability reorderRate a packet is held back for reorderDelay more
+// seconds, which lets the packets behind it overtake it. A packet that
+// is larger than maxPacketSize is dropped without notice, like on a
+// path with an MTU black hole.
+struct EmiSimLinkParams {
+    EmiSimLinkParams() :
+    bandwidth(0),
+    queueSize(0),
+    delay(0),
+    jitter(0),
+    lossRate(0),
+    reorderRate(0),
+    reorderDelay(0),
+    maxPacketSize(0) {}
+    
+    // In bytes per second, or 0 for a link without bandwidth limit
+    double          bandwidth;
+    // In bytes, or 0 for an unbounded queue
+    size_t          queueSize;
+    EmiTimeInterval delay;
+    EmiTimeInterval jitter;
+    double          lossRate;
+    double          reorderRate;
+    EmiTimeInterval reorderDelay;
+    // The largest UDP payload in bytes, or 0 for no limit
+    size_t          maxPacketSize;
+};
+
+struct EmiSimLinkStats {
+    EmiSimLinkStats() :
+    packetsSent(0),
+    bytesSent(0),
+    packetsDropped(0),
+    packetsLost(0),
+    packetsTooBig(0),
+    packetsReordered(0),
+    packetsDelivered(0),
+    bytesDelivered(0) {}
+    
+    uint64_t packetsSent;
+    uint64_t bytesSent;
+    // Packets that didn't fit in the queue
+    uint64_t packetsDropped;
+    // Packets that were lost because of lossRate
+    uint64_t packetsLost;
+    // Packets that were larger than maxPacketSize
+    uint64_t packetsTooBig;
+    uint64_t packetsReordered;
+    // Packets that arrived at a host. They are not necessarily
+    // received by anyone; there might be no socket at their
+    // destination address.
+    uint64_t packetsDelivered;
+    uint64_t bytesDelivered;
+};
+
+// EmiSimNetwork is a network of simulated hosts with a virtual clock.
+// Together with EmiSimBinding, it makes it possible to run real
+// EmiSock and EmiConn objects over links with a given bandwidth,
+// delay, jitter, loss rate and amount of reordering, much faster than
+// real time and with exactly reproducible results: All randomness,
+// including Binding::randomBytes, comes from a generator that is
+// seeded in the constructor.
+//
+// The clock only advances when the network dispatches events (timers
+// and packet arrivals), and it jumps straight to the next event. Time
+// spent in callbacks is not accounted for; the simulated hosts have
+// infinitely fast CPUs.
+//
+// Because Binding::now() is static, there can only be one EmiSimNetwork
+// at a time.
+class EmiSimNetwork {
+private:
+    // Private copy constructor and assignment operator
+    inline EmiSimNetwork(const EmiSimNetwork& other);
+    inline EmiSimNetwork& operator=(const EmiSimNetwork& other);
+    
+public:
+    class Timer;
+    class Socket;
+    
+    typedef void (TimerCb)(EmiTimeInterval now, Timer *timer, void *data);
+    typedef void (ReceiveCb)(Socket *socket,
+                             void *userData,
+                             EmiTimeInterval now,
+                             const sockaddr_storage& address,
+                             const EmiBufferRef& data,
+                             size_t offset,
+                             size_t len);
+    
+    class Timer {
+        friend class EmiSimNetwork;
+    private:
+        // Private copy constructor and assignment operator
+        inline Timer(const Timer& other);
+        inline Timer& operator=(const Timer& other);
+        
+        EmiSimNetwork&  _network;
+        TimerCb        *_timerCb;
+        void           *_data;
+        EmiTimeInterval _deadline;
+        EmiTimeInterval _interval;
+        uint64_t        _seq;
+        bool            _repeating;
+        bool            _active;
+        
+        explicit Timer(EmiSimNetwork& network) :
+        _network(network),
+        _timerCb(NULL),
+        _data(NULL),
+        _deadline(0),
+        _interval(0),
+        _seq(0),
+        _repeating(false),
+        _active(false) {}
+        
+    public:
+        inline bool isActive() const {
+            return _active;
+        }
+        
+        inline EmiSimNetwork& getNetwork() const {
+            return _network;
+        }
+    };
+    
+    class Socket {
+        friend class EmiSimNetwork;
+    private:
+        // Private copy constructor and assignment operator
+        inline Socket(const Socket& other);
+        inline Socket& operator=(const Socket& other);
+        
+        EmiSimNetwork&   _network;
+        sockaddr_storage _address;
+        ReceiveCb       *_receiveCb;
+        void            *_userData;
+        
+        Socket(EmiSimNetwork& network, const sockaddr_storage& address, ReceiveCb *receiveCb, void *userData) :
+        _network(network),
+        _address(address),
+        _receiveCb(receiveCb),
+        _userData(userData) {}
+        
+    public:
+        inline const sockaddr_storage& getAddress() const {
+            return _address;
+        }
+        
+        inline EmiSimNetwork& getNetwork() const {
+            return _network;
+        }
+    };
+    
+private:
+    
+    // The state of one direction of a link
+    struct Link {
+        Link() :
+        params(),
+        stats(),
+        busyUntil(0),
+        lastArrival(0) {}
+        
+        EmiSimLinkParams params;
+        EmiSimLinkStats  stats;
+        // The time when the last packet in the queue has been
+        // transmitted
+        EmiTimeInterval  busyUntil;
+        // The arrival time of the newest packet that was not held
+        // back for reordering
+        EmiTimeInterval  lastArrival;
+    };
+    
+    struct Packet {
+        EmiTimeInterval  deadline;
+        uint64_t         seq;
+        sockaddr_storage from;
+        sockaddr_storage to;
+        Link            *link;
+        EmiBuffer       *data;
+    };
+    
+    class TimerCmp {
+    public:
+        inline bool operator()(const Timer *a, const Timer *b) const {
+            if (a->_deadline != b->_deadline) {
+                return a->_deadline < b->_deadline;
+            }
+            return a->_seq < b->_seq;
+        }
+    };
+    
+    class PacketCmp {
+    public:
+        inline bool operator()(const Packet *a, const Packet *b) const {
+            if (a->deadline != b->deadline) {
+                return a->deadline < b->deadline;
+            }
+            return a->seq < b->seq;
+        }
+    };
+    
+    typedef std::set<Timer*, TimerCmp>                         TimerSet;
+    typedef TimerSet::iterator                                 TimerSetIter;
+    typedef std::set<Packet*, PacketCmp>                       PacketSet;
+    typedef PacketSet::iterator                                PacketSetIter;
+    typedef std::map<sockaddr_storage, Socket*, EmiAddressCmp> SocketMap;
+    typedef SocketMap::iterator                                SocketMapIter;
+    typedef std::pair<sockaddr_storage, sockaddr_storage>      HostPair;
+    
+    class HostPairCmp {
+    public:
+        inline bool operator()(const HostPair& a, const HostPair& b) const {
+            int cmp = EmiAddressCmp::compare(a.first, b.first);
+            if (0 != cmp) {
+                return cmp < 0;
+            }
+            return EmiAddressCmp::compare(a.second, b.second) < 0;
+        }
+    };
+    
+    typedef std::map<HostPair, Link, HostPairCmp> LinkMap;
+    typedef LinkMap::iterator                     LinkMapIter;
+    
+    static EmiSimNetwork *_current;
+    
+    EmiTimeInterval _now;
+    uint64_t        _seq;
+    uint64_t        _randomState;
+    bool            _stopped;
+    
+    TimerSet  _timers;
+    PacketSet _packets;
+    SocketMap _sockets;
+    LinkMap   _links;
+    
+    std::vector<sockaddr_storage> _hosts;
+    EmiSimLinkParams              _defaultLinkParams;
+    uint16_t                      _nextEphemeralPort;
+    
+    static sockaddr_storage hostAddress(const sockaddr_storage& address);
+    Link& getLink(const sockaddr_storage& from, const sockaddr_storage& to);
+    
+    void fireTimer(Timer *timer);
+    void deliverPacket(Packet *packet);
+    
+public:
+    
+    EmiSimNetwork(uint64_t seed);
+    virtual ~EmiSimNetwork();
+    
+    // Returns the network that currently exists. It is an error to
+    // call this when there is none.
+    static EmiSimNetwork& current();
+    
+    inline EmiTimeInterval now() const {
+        return _now;
+    }
+    
+    // Returns a uniformly distributed 64 bit random number
+    uint64_t random();
+    // Returns a uniformly distributed random number in [0, 1)
+    double randomUniform();
+    
+    // Adds a host to the network. Only the IP of address is used.
+    // Sockets can only be opened on the addresses of hosts.
+    void addHost(const sockaddr_storage& address);
+    inline const std::vector<sockaddr_storage>& getHosts() const {
+        return _hosts;
+    }
+    
+    // Sets the parameters of the link from the host from to the host
+    // to. Only the IPs of the addresses are used. Links that are not
+    // set use the default parameters.
+    void setLink(const sockaddr_storage& from, const sockaddr_storage& to, const EmiSimLinkParams& params);
+    void setDefaultLink(const EmiSimLinkParams& params);
+    const EmiSimLinkStats& getLinkStats(const sockaddr_storage& from, const sockaddr_storage& to);
+    
+    Timer *makeTimer();
+    void freeTimer(Timer *timer);
+    // An interval of 0 means that the timer fires after the events
+    // that are due now.
+    void scheduleTimer(Timer *timer, TimerCb *timerCb, void *data,
+                       EmiTimeInterval interval, bool repeating);
+    void descheduleTimer(Timer *timer);
+    
+    // A port of 0 picks an unused port. Fails if there is no host with
+    // the IP of address or if the port is taken.
+    Socket *openSocket(const sockaddr_storage& address, ReceiveCb *receiveCb, void *userData, EmiError& err);
+    // Packets that are in flight to the socket are dropped when they
+    // arrive.
+    void closeSocket(Socket *socket);
+    // The data is copied
+    void send(Socket *socket, const sockaddr_storage& address, const struct iovec *iov, size_t iovcnt);
+    
+    // Dispatches the next event. Returns false if there are no events.
+    bool runOnce();
+    // Dispatches events until the clock reaches time, and sets the
+    // clock to time. Returns early if stop is called.
+    void runUntil(EmiTimeInterval time);
+    // Dispatches events until there are none left or stop is called
+    void run();
+    void stop();
+};
+
+#endif
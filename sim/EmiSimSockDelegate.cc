@@ -0,0 +1,74 @@
+//
+//  EmiSimSockDelegate.cc
+//  eminet
+//
+
+#include "EmiSimSockDelegate.h"
+
+#include "EmiSimSocket.h"
+#include "EmiSimConnection.h"
+
+EmiSimSockDelegate::EmiSimSockDelegate(EmiSimSocket& es) : _es(es) {}
+
+EmiSimSockDelegate::EC *EmiSimSockDelegate::makeConnection(const EmiConnParams<EmiSimBinding>& params) {
+    // The connection is released in EmiSimConnDelegate::invalidate
+    EmiSimConnection *ec = new EmiSimConnection(_es, params);
+    return &ec->getConn();
+}
+
+void EmiSimSockDelegate::gotServerConnection(EC& conn) {
+    EmiSimSocketDelegate *delegate = _es.getDelegate();
+    
+    if (delegate) {
+        delegate->emiSocketGotConnection(_es, conn.getDelegate().getConnection());
+    }
+}
+
+void EmiSimSockDelegate::connectionOpened(ConnectionOpenedCallbackCookie& cookie,
+                                          bool error,
+                                          EmiDisconnectReason reason,
+                                          EC& ec) {
+    EmiSimConnection& conn(ec.getDelegate().getConnection());
+    EmiSimConnectionDelegate *delegate = cookie.delegate;
+    
+    // It is important that the delegate is set before the callback is
+    // invoked, so that no message can arrive to a connection that does
+    // not have its delegate set.
+    conn.setDelegate(delegate);
+    
+    if (!delegate) {
+        return;
+    }
+    
+    if (error) {
+        delegate->emiConnectionFailedToConnect(conn.getSocket(),
+                                               EmiSimBinding::makeError("com.emilir.eminet.disconnect", reason),
+                                               cookie.userData);
+    }
+    else {
+        delegate->emiConnectionOpened(conn, cookie.userData);
+    }
+}
+
+void EmiSimSockDelegate::connectionGotMessage(EC *conn,
+                                              EmiUdpSocket<EmiSimBinding> *socket,
+                                              EmiTimeInterval now,
+                                              const sockaddr_storage& inboundAddress,
+                                              const sockaddr_storage& remoteAddress,
+                                              const EmiSimBinding::TemporaryData& data,
+                                              size_t offset,
+                                              size_t len) {
+    // The simulator is single threaded, so the connection can
+    // process the message right away.
+    conn->onMessage(now, socket,
+                    inboundAddress, remoteAddress,
+                    data, offset, len);
+}
+
+EmiSimNetwork *EmiSimSockDelegate::getSocketCookie() {
+    return &_es.getNetwork();
+}
+
+EmiSimNetwork *EmiSimSockDelegate::getTimerCookie() {
+    return &_es.getNetwork();
+}
@@ -0,0 +1,76 @@
+//
+//  EmiSimSockDelegate.h
+//  eminet
+//
+
+#ifndef eminet_EmiSimSockDelegate_h
+#define eminet_EmiSimSockDelegate_h
+
+#include "../posix/EmiError.h"
+#include "EmiSimBinding.h"
+
+#include "../core/EmiTypes.h"
+
+class EmiSimSocket;
+class EmiSimConnectionDelegate;
+class EmiSimSockDelegate;
+class EmiSimConnDelegate;
+template<class SockDelegate, class ConnDelegate>
+class EmiSock;
+template<class SockDelegate, class ConnDelegate>
+class EmiConn;
+template<class Binding>
+class EmiConnParams;
+template<class Binding>
+class EmiUdpSocket;
+
+// The cookie that is passed to EmiSock::connect. It tells
+// connectionOpened which delegate the new connection should have.
+struct EmiSimConnectionOpenedCookie {
+    EmiSimConnectionOpenedCookie() :
+    delegate(NULL), userData(NULL) {}
+    
+    EmiSimConnectionOpenedCookie(EmiSimConnectionDelegate *delegate_, void *userData_) :
+    delegate(delegate_), userData(userData_) {}
+    
+    EmiSimConnectionDelegate *delegate;
+    void *userData;
+};
+
+class EmiSimSockDelegate {
+    typedef EmiConn<EmiSimSockDelegate, EmiSimConnDelegate> EC;
+    
+    EmiSimSocket& _es;
+    
+public:
+    
+    typedef EmiSimBinding                Binding;
+    typedef EmiSimConnectionOpenedCookie ConnectionOpenedCallbackCookie;
+    
+    EmiSimSockDelegate(EmiSimSocket& es);
+    
+    EC *makeConnection(const EmiConnParams<EmiSimBinding>& params);
+    void gotServerConnection(EC& conn);
+    
+    static void connectionOpened(ConnectionOpenedCallbackCookie& cookie,
+                                 bool error,
+                                 EmiDisconnectReason reason,
+                                 EC& ec);
+    
+    void connectionGotMessage(EC *conn,
+                              EmiUdpSocket<EmiSimBinding> *socket,
+                              EmiTimeInterval now,
+                              const sockaddr_storage& inboundAddress,
+                              const sockaddr_storage& remoteAddress,
+                              const EmiSimBinding::TemporaryData& data,
+                              size_t offset,
+                              size_t len);
+    
+    inline EmiSimSocket& getEmiSocket() { return _es; }
+    inline const EmiSimSocket& getEmiSocket() const { return _es; }
+    
+    EmiSimNetwork *getSocketCookie();
+    EmiSimNetwork *getTimerCookie();
+};
+
+#endif
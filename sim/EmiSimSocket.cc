@@ -0,0 +1,41 @@
+//
+//  EmiSimSocket.cc
+//  eminet
+//
+
+#include "EmiSimSocket.h"
+
+#include "EmiSimConnection.h"
+
+EmiSimSocket::EmiSimSocket(EmiSimNetwork& network, const EmiSockConfig& sc, EmiSimSocketDelegate *delegate) :
+_network(network),
+_delegate(delegate),
+_sock(sc, EmiSimSockDelegate(*this)) {}
+
+EmiSimSocket::~EmiSimSocket() {}
+
+bool EmiSimSocket::open(EmiError& err) {
+    return _sock.open(err);
+}
+
+bool EmiSimSocket::connect(const sockaddr_storage& address,
+                           EmiSimConnectionDelegate *delegate,
+                           void *userData,
+                           EmiError& err) {
+    return _sock.connect(EmiSimBinding::now(), address,
+                         EmiSimConnectionOpenedCookie(delegate, userData),
+                         err);
+}
+
+bool EmiSimSocket::connect(const sockaddr_storage& address,
+                           const uint8_t *p2pCookie, size_t p2pCookieLength,
+                           const uint8_t *sharedSecret, size_t sharedSecretLength,
+                           EmiSimConnectionDelegate *delegate,
+                           void *userData,
+                           EmiError& err) {
+    return _sock.connect(EmiSimBinding::now(), address,
+                         p2pCookie, p2pCookieLength,
+                         sharedSecret, sharedSecretLength,
+                         EmiSimConnectionOpenedCookie(delegate, userData),
+                         err);
+}
@@ -0,0 +1,77 @@
+//
+//  EmiSimSocket.h
+//  eminet
+//
+
+#ifndef eminet_EmiSimSocket_h
+#define eminet_EmiSimSocket_h
+
+#include "EmiSimBinding.h"
+#include "EmiSimSockDelegate.h"
+#include "EmiSimConnDelegate.h"
+
+#include "../core/EmiSock.h"
+#include "../core/EmiConn.h"
+
+class EmiSimSocket;
+class EmiSimConnection;
+class EmiSimConnectionDelegate;
+
+class EmiSimSocketDelegate {
+public:
+    virtual ~EmiSimSocketDelegate() {}
+    
+    // Invoked when a client connects to this socket. The receiver
+    // should set the delegate of the connection (EmiSimConnection::setDelegate)
+    // before it returns; otherwise messages on the connection are lost.
+    virtual void emiSocketGotConnection(EmiSimSocket& socket, EmiSimConnection& conn) = 0;
+};
+
+// The counterpart of the posix EmiSocket for sockets in an
+// EmiSimNetwork. An EmiSimSocket must be opened with open before it is
+// used.
+class EmiSimSocket {
+    typedef EmiSock<EmiSimSockDelegate, EmiSimConnDelegate> EmiS;
+    
+    friend class EmiSimSockDelegate;
+    friend class EmiSimConnDelegate;
+    
+private:
+    // Private copy constructor and assignment operator
+    inline EmiSimSocket(const EmiSimSocket& other);
+    inline EmiSimSocket& operator=(const EmiSimSocket& other);
+    
+    EmiSimNetwork&        _network;
+    EmiSimSocketDelegate *_delegate;
+    EmiS                  _sock;
+    
+public:
+    EmiSimSocket(EmiSimNetwork& network, const EmiSockConfig& sc, EmiSimSocketDelegate *delegate);
+    virtual ~EmiSimSocket();
+    
+    bool open(EmiError& err);
+    
+    // Exactly one of EmiSimConnectionDelegate::emiConnectionOpened and
+    // emiConnectionFailedToConnect will be invoked on delegate iff this
+    // method returns true.
+    bool connect(const sockaddr_storage& address,
+                 EmiSimConnectionDelegate *delegate,
+                 void *userData,
+                 EmiError& err);
+    bool connect(const sockaddr_storage& address,
+                 const uint8_t *p2pCookie, size_t p2pCookieLength,
+                 const uint8_t *sharedSecret, size_t sharedSecretLength,
+                 EmiSimConnectionDelegate *delegate,
+                 void *userData,
+                 EmiError& err);
+    
+    inline EmiSimSocketDelegate *getDelegate() const { return _delegate; }
+    inline void setDelegate(EmiSimSocketDelegate *delegate) { _delegate = delegate; }
+    
+    inline EmiSimNetwork& getNetwork() const { return _network; }
+    
+    inline EmiS& getSock() { return _sock; }
+    inline const EmiS& getSock() const { return _sock; }
+};
+
+#endif
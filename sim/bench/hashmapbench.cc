@@ -0,0 +1,136 @@
+//
+//  hashmapbench.cc
+//  eminet
+//
+
+// hashmapbench measures the cost of looking up a connection by its
+// remote address, the lookup that EmiSock does for every datagram that
+// isn't from the same host as the one before it. It compares EmiHashMap
+// with EmiAddressKey keys to a std::map that is ordered by
+// EmiAddressCmp, with 1000, 10000 and 100000 connections. It uses two
+// address sets: random IPv4 addresses, and many ports on a few
+// addresses, which is what clients behind a NAT look like. Build it
+// with:
+//
+//   g++ -O2 -o hashmapbench sim/bench/hashmapbench.cc
+//
+// It exits with status 1 if a lookup gives the wrong answer.
+
+#include "../../core/EmiAddressKey.h"
+#include "../../core/EmiAddressCmp.h"
+
+#include <arpa/inet.h>
+#include <time.h>
+#include <map>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+static const size_t NUM_LOOKUPS = 5000000;
+
+struct AddressLess {
+    inline bool operator()(const sockaddr_storage& a, const sockaddr_storage& b) const {
+        return EmiAddressCmp::compare(a, b) < 0;
+    }
+};
+
+typedef std::map<sockaddr_storage, int*, AddressLess> AddressMap;
+typedef EmiHashMap<EmiAddressKey, int*>               AddressHashMap;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ((double)ts.tv_nsec)/1000000000.0;
+}
+
+static uint64_t random64() {
+    return (((uint64_t)rand()) << 40) ^ (((uint64_t)rand()) << 20) ^ rand();
+}
+
+static sockaddr_storage makeAddress(uint32_t ip, uint16_t port) {
+    sockaddr_storage address;
+    memset(&address, 0, sizeof(address));
+    sockaddr_in& addr((sockaddr_in&)address);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(ip);
+    addr.sin_port = htons(port);
+    return address;
+}
+
+static void randomAddresses(std::vector<sockaddr_storage>& addresses, size_t count) {
+    for (size_t i=0; i<count; i++) {
+        addresses.push_back(makeAddress(random64(), random64()));
+    }
+}
+
+// Consecutive ports on 16 addresses
+static void natAddresses(std::vector<sockaddr_storage>& addresses, size_t count) {
+    for (size_t i=0; i<count; i++) {
+        addresses.push_back(makeAddress(0x0a000000+i%16, 1024+i/16));
+    }
+}
+
+// Returns false if a lookup failed
+static bool runBenchmark(const char *name, const std::vector<sockaddr_storage>& addresses) {
+    size_t count = addresses.size();
+    int value;
+    
+    AddressMap map;
+    AddressHashMap hashMap(EmiHashSeed(random64(), random64()));
+    for (size_t i=0; i<count; i++) {
+        map.insert(std::make_pair(addresses[i], &value));
+        hashMap.insert(EmiAddressKey(addresses[i]), &value);
+    }
+    
+    std::vector<size_t> order(NUM_LOOKUPS);
+    for (size_t i=0; i<NUM_LOOKUPS; i++) {
+        order[i] = rand() % count;
+    }
+    
+    size_t mapFound = 0;
+    double mapStart = now();
+    for (size_t i=0; i<NUM_LOOKUPS; i++) {
+        if (map.end() != map.find(addresses[order[i]])) {
+            mapFound++;
+        }
+    }
+    double mapTime = now()-mapStart;
+    
+    size_t hashMapFound = 0;
+    double hashMapStart = now();
+    for (size_t i=0; i<NUM_LOOKUPS; i++) {
+        if (hashMap.find(EmiAddressKey(addresses[order[i]]))) {
+            hashMapFound++;
+        }
+    }
+    double hashMapTime = now()-hashMapStart;
+    
+    printf("%-6s %7lu conns: std::map %6.1f ns/lookup, EmiHashMap %6.1f ns/lookup\n",
+           name, (unsigned long)count,
+           mapTime/NUM_LOOKUPS*1e9, hashMapTime/NUM_LOOKUPS*1e9);
+    
+    return (NUM_LOOKUPS == mapFound && NUM_LOOKUPS == hashMapFound);
+}
+
+int main(int argc, char **argv) {
+    srand(time(NULL));
+    
+    static const size_t COUNTS[] = { 1000, 10000, 100000 };
+    
+    bool ok = true;
+    for (size_t i=0; i<sizeof(COUNTS)/sizeof(*COUNTS); i++) {
+        std::vector<sockaddr_storage> addresses;
+        randomAddresses(addresses, COUNTS[i]);
+        ok = runBenchmark("random", addresses) && ok;
+        
+        addresses.clear();
+        natAddresses(addresses, COUNTS[i]);
+        ok = runBenchmark("nat", addresses) && ok;
+    }
+    
+    if (!ok) {
+        printf("A lookup failed\n");
+    }
+    return ok ? 0 : 1;
+}
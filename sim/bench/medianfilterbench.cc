@@ -0,0 +1,192 @@
+//
+//  medianfilterbench.cc
+//  eminet
+//
+
+// medianfilterbench compares EmiMedianFilter, which keeps its values
+// sorted as they are pushed, with the implementation that it replaced,
+// which copied and sorted the values on every call to calculate. It
+// first checks that both give bit identical results on sequences with
+// uniform values, many ties, outliers and zeros, and then measures the
+// time of a push followed by a calculate, and of a calculate alone,
+// which is what the send queue does when it asks for the link capacity
+// and the data arrival rate. Build it with:
+//
+//   g++ -O2 -o medianfilterbench sim/bench/medianfilterbench.cc
+//
+// It exits with status 1 if the results differ.
+
+#include "../../core/EmiMedianFilter.h"
+
+#include <time.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+static const int NUM_CHECKS = 200000;
+static const int NUM_TIMINGS = 2000000;
+static const int NUM_VALUES = 4096;
+
+// The implementation that EmiMedianFilter replaced, which sorts a copy
+// of its values on every call to calculate. Like EmiMedianFilter, it
+// only counts the values that have been pushed until the buffer is
+// full.
+template<typename Element, int BUFFER_SIZE = 64, int TOLERANCE = 8>
+class SortingMedianFilter {
+    
+    Element _elms[BUFFER_SIZE];
+    size_t  _frontIdx;
+    int     _numElms;
+    Element _defaultValue;
+    
+public:
+    explicit SortingMedianFilter(Element defaultValue) :
+    _frontIdx(0),
+    _numElms(0),
+    _defaultValue(defaultValue) {}
+    
+    inline void pushValue(Element value) {
+        _elms[_frontIdx] = value;
+        _frontIdx = (_frontIdx+1) % BUFFER_SIZE;
+        _numElms = std::min(_numElms+1, BUFFER_SIZE);
+    }
+    
+    Element calculate() const {
+        if (0 == _numElms) {
+            return _defaultValue;
+        }
+        
+        Element sortedElms[BUFFER_SIZE];
+        std::copy(_elms, _elms+_numElms, sortedElms);
+        std::sort(sortedElms, sortedElms+_numElms);
+        
+        Element median = sortedElms[_numElms/2];
+        
+        Element sum = 0;
+        int count = 0;
+        
+        for (int i=0; i<_numElms; i++) {
+            Element elm = sortedElms[i];
+            
+            if (TOLERANCE < ((elm > median) ? elm/median : median/elm)) {
+                continue;
+            }
+            
+            sum += elm;
+            count++;
+        }
+        
+        return sum/count;
+    }
+};
+
+enum Distribution {
+    UNIFORM,
+    TIES,
+    OUTLIERS,
+    ZEROS,
+    NUM_DISTRIBUTIONS
+};
+
+static const char *DISTRIBUTION_NAMES[] = { "uniform", "ties", "outliers", "zeros" };
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ((double)ts.tv_nsec)/1000000000.0;
+}
+
+static float randomValue(Distribution distribution) {
+    switch (distribution) {
+        case TIES:     return (rand()%10)*100+1;
+        case OUTLIERS: return (0 == rand()%50 ? 1000000 : 900+rand()%200);
+        case ZEROS:    return (0 == rand()%3 ? 0 : rand()%1000);
+        case UNIFORM:
+        default:       return 1+rand()%100000;
+    }
+}
+
+// NaN, which a filter full of zeros gives, is equal to itself here
+static bool isSameResult(float a, float b) {
+    return (0 == memcmp(&a, &b, sizeof(float)) || (a != a && b != b));
+}
+
+// Returns the number of results that differ
+static int checkDistribution(Distribution distribution) {
+    float defaultValue = (ZEROS == distribution ? 0 : 1000);
+    SortingMedianFilter<float> sortingFilter(defaultValue);
+    EmiMedianFilter<float> filter(defaultValue);
+    
+    int mismatches = 0;
+    for (int i=0; i<NUM_CHECKS; i++) {
+        float value = randomValue(distribution);
+        sortingFilter.pushValue(value);
+        filter.pushValue(value);
+        
+        if (!isSameResult(sortingFilter.calculate(), filter.calculate())) {
+            mismatches++;
+        }
+    }
+    
+    printf("%-8s %d values, %d mismatches\n",
+           DISTRIBUTION_NAMES[distribution], NUM_CHECKS, mismatches);
+    return mismatches;
+}
+
+template<class Filter>
+static double timePushAndCalculate(const float *values, double *sink) {
+    Filter filter(1000);
+    double start = now();
+    for (int i=0; i<NUM_TIMINGS; i++) {
+        filter.pushValue(values[i%NUM_VALUES]);
+        *sink += filter.calculate();
+    }
+    return (now()-start)/NUM_TIMINGS;
+}
+
+template<class Filter>
+static double timeCalculate(const float *values, double *sink) {
+    Filter filter(1000);
+    for (int i=0; i<NUM_VALUES; i++) {
+        filter.pushValue(values[i]);
+    }
+    
+    double start = now();
+    for (int i=0; i<NUM_TIMINGS; i++) {
+        *sink += filter.calculate();
+    }
+    return (now()-start)/NUM_TIMINGS;
+}
+
+int main(int argc, char **argv) {
+    srand(1);
+    
+    int mismatches = 0;
+    for (int i=0; i<NUM_DISTRIBUTIONS; i++) {
+        mismatches += checkDistribution((Distribution)i);
+    }
+    
+    float values[NUM_VALUES];
+    for (int i=0; i<NUM_VALUES; i++) {
+        values[i] = randomValue(UNIFORM);
+    }
+    
+    // The results are summed and printed so that the compiler can't
+    // optimize the calls away
+    double sink = 0;
+    double sortingPush = timePushAndCalculate<SortingMedianFilter<float> >(values, &sink);
+    double push = timePushAndCalculate<EmiMedianFilter<float> >(values, &sink);
+    double sortingCalculate = timeCalculate<SortingMedianFilter<float> >(values, &sink);
+    double calculate = timeCalculate<EmiMedianFilter<float> >(values, &sink);
+    
+    printf("push+calculate: sorting %6.1f ns, EmiMedianFilter %6.1f ns\n",
+           sortingPush*1e9, push*1e9);
+    printf("calculate:      sorting %6.1f ns, EmiMedianFilter %6.1f ns\n",
+           sortingCalculate*1e9, calculate*1e9);
+    printf("(checksum %g)\n", sink);
+    
+    if (0 != mismatches) {
+        printf("The results differ\n");
+    }
+    return (0 == mismatches ? 0 : 1);
+}
@@ -0,0 +1,563 @@
+//
+//  emisim.cc
+//  eminet
+//
+
+// emisim runs one client and one server connection over a simulated
+// link, with the client sending messages on one channel (reliable
+// ordered by default), and reports the goodput, the message latency
+// and the retransmission overhead. Optionally, the client also keeps
+// a second, reliable ordered channel busy with bulk data, which shows
+// how well the first channel holds up against it. Everything runs on the virtual clock of an
+// EmiSimNetwork, so a run is reproducible for a given seed and much
+// faster than real time. Build it with:
+//
+//   g++ -O2 -Isim -o emisim sim/*.cc core/*.cc posix/EmiBuffer.cc posix/EmiError.cc -lcrypto
+//
+// Run emisim -h for the options.
+
+#include "EmiSimNetwork.h"
+#include "EmiSimSocket.h"
+#include "EmiSimConnection.h"
+
+#include "../core/EmiNetUtil.h"
+
+#include <arpa/inet.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// The interval at which the client offers messages to the connection
+static const EmiTimeInterval SEND_INTERVAL = 0.001;
+static const EmiChannelQualifier BULK_CHANNEL =
+    EMI_CHANNEL_QUALIFIER(EMI_CHANNEL_TYPE_RELIABLE_ORDERED, 1);
+
+struct Options {
+    EmiCongestionControlAlgorithm congestionControl;
+    EmiChannelType  channelType;
+    // -1 for no forward error correction
+    int             fecGroupSize;
+    uint8_t         channelWeight;
+    // EMI_NO_DEADLINE for messages without deadline
+    EmiTimeInterval deadline;
+    bool            conflate;
+    // 0 for no bulk channel
+    size_t          bulkMessageSize;
+    double          bandwidth;
+    size_t          queueSize;
+    EmiTimeInterval rtt;
+    EmiTimeInterval jitter;
+    double          lossRate;
+    double          reorderRate;
+    // 0 for no limit
+    size_t          mtu;
+    EmiTimeInterval mtuTime;
+    double          rate;
+    size_t          messageSize;
+    EmiTimeInterval duration;
+    uint64_t        seed;
+};
+
+// Every message starts with the time it was sent
+struct MessageHeader {
+    EmiTimeInterval sendTime;
+};
+
+struct Results {
+    Results() :
+    opened(false),
+    disconnected(false),
+    openTime(0),
+    bytesOffered(0),
+    messagesOffered(0),
+    bytesReceived(0),
+    messagesReceived(0),
+    bulkBytesReceived(0),
+    latencies() {}
+    
+    bool            opened;
+    bool            disconnected;
+    EmiTimeInterval openTime;
+    uint64_t        bytesOffered;
+    uint64_t        messagesOffered;
+    uint64_t        bytesReceived;
+    uint64_t        messagesReceived;
+    uint64_t        bulkBytesReceived;
+    std::vector<EmiTimeInterval> latencies;
+};
+
+static Results results;
+
+class ServerConnectionDelegate : public EmiSimConnectionDelegate {
+public:
+    virtual void emiConnectionOpened(EmiSimConnection& conn, void *userData) {}
+    virtual void emiConnectionFailedToConnect(EmiSimSocket& socket, const EmiError& err, void *userData) {}
+    
+    virtual void emiConnectionMessage(EmiSimConnection& conn,
+                                      EmiChannelQualifier channelQualifier,
+                                      const EmiBufferRef& data,
+                                      size_t offset,
+                                      size_t size) {
+        if (BULK_CHANNEL == channelQualifier) {
+            results.bulkBytesReceived += size;
+            return;
+        }
+        
+        MessageHeader header;
+        ASSERT(size >= sizeof(header));
+        memcpy(&header, data.get()->getData()+offset, sizeof(header));
+        
+        results.bytesReceived += size;
+        results.messagesReceived++;
+        results.latencies.push_back(EmiSimBinding::now()-header.sendTime);
+    }
+    
+    virtual void emiConnectionDisconnect(EmiSimConnection& conn, EmiDisconnectReason reason) {}
+};
+
+class ServerSocketDelegate : public EmiSimSocketDelegate {
+    ServerConnectionDelegate& _connDelegate;
+    EmiSimConnection         *_conn;
+    
+public:
+    ServerSocketDelegate(ServerConnectionDelegate& connDelegate) :
+    _connDelegate(connDelegate),
+    _conn(NULL) {}
+    
+    virtual ~ServerSocketDelegate() {
+        if (_conn) {
+            _conn->release();
+        }
+    }
+    
+    virtual void emiSocketGotConnection(EmiSimSocket& socket, EmiSimConnection& conn) {
+        conn.setDelegate(&_connDelegate);
+        
+        if (!_conn) {
+            _conn = &conn;
+            _conn->retain();
+        }
+    }
+    
+    void forceClose() {
+        if (_conn) {
+            _conn->forceClose();
+        }
+    }
+};
+
+class ClientConnectionDelegate : public EmiSimConnectionDelegate {
+    const Options&        _options;
+    EmiSimConnection     *_conn;
+    EmiSimNetwork::Timer *_sendTimer;
+    bool                  _closing;
+    // The number of bytes that the application has produced but not
+    // yet managed to send, because the sender buffer was full
+    double                _backlog;
+    
+    static void send_cb(EmiTimeInterval now, EmiSimNetwork::Timer *timer, void *data) {
+        ((ClientConnectionDelegate *)data)->send(now);
+    }
+    
+    void send(EmiTimeInterval now) {
+        if (!_conn) {
+            return;
+        }
+        
+        bool saturate = (0 == _options.rate);
+        if (!saturate) {
+            _backlog += _options.rate*SEND_INTERVAL;
+        }
+        
+        while (saturate || _backlog >= _options.messageSize) {
+            EmiBuffer *buf = EmiBuffer::make(_options.messageSize);
+            memset(buf->getData(), 0, _options.messageSize);
+            MessageHeader header;
+            header.sendTime = now;
+            memcpy(buf->getData(), &header, sizeof(header));
+            
+            EmiError err;
+            if (!_conn->send(buf,
+                             EMI_CHANNEL_QUALIFIER(_options.channelType, 0),
+                             EMI_PRIORITY_HIGH,
+                             _options.deadline,
+                             err)) {
+                // The sender buffer is full
+                break;
+            }
+            
+            results.bytesOffered += _options.messageSize;
+            results.messagesOffered++;
+            _backlog -= _options.messageSize;
+        }
+        
+        if (saturate) {
+            _backlog = 0;
+        }
+        
+        if (0 != _options.bulkMessageSize) {
+            sendBulk();
+        }
+    }
+    
+    // Sends bulk messages until the sender buffer is full
+    void sendBulk() {
+        while (true) {
+            EmiBuffer *buf = EmiBuffer::make(_options.bulkMessageSize);
+            memset(buf->getData(), 0, _options.bulkMessageSize);
+            
+            EmiError err;
+            if (!_conn->send(buf, BULK_CHANNEL, EMI_PRIORITY_HIGH, err)) {
+                break;
+            }
+        }
+    }
+    
+public:
+    ClientConnectionDelegate(const Options& options) :
+    _options(options),
+    _conn(NULL),
+    _sendTimer(NULL),
+    _closing(false),
+    _backlog(0) {}
+    
+    virtual ~ClientConnectionDelegate() {
+        if (_sendTimer) {
+            EmiSimBinding::freeTimer(_sendTimer);
+        }
+    }
+    
+    virtual void emiConnectionOpened(EmiSimConnection& conn, void *userData) {
+        results.opened = true;
+        results.openTime = EmiSimBinding::now();
+        
+        _conn = &conn;
+        _sendTimer = EmiSimBinding::makeTimer(&conn.getSocket().getNetwork());
+        EmiSimBinding::scheduleTimer(_sendTimer, send_cb, this, SEND_INTERVAL,
+                                     /*repeating:*/true, /*reschedule:*/true);
+    }
+    
+    virtual void emiConnectionFailedToConnect(EmiSimSocket& socket, const EmiError& err, void *userData) {
+        socket.getNetwork().stop();
+    }
+    
+    virtual void emiConnectionMessage(EmiSimConnection& conn,
+                                      EmiChannelQualifier channelQualifier,
+                                      const EmiBufferRef& data,
+                                      size_t offset,
+                                      size_t size) {}
+    
+    virtual void emiConnectionDisconnect(EmiSimConnection& conn, EmiDisconnectReason reason) {
+        if (!_closing) {
+            results.disconnected = true;
+        }
+        _conn = NULL;
+        if (_sendTimer) {
+            EmiSimBinding::descheduleTimer(_sendTimer);
+        }
+    }
+    
+    // The number of messages that were dropped because they missed
+    // their deadline
+    size_t expiredMessages() const {
+        return (_conn ? _conn->getExpiredMessages() : 0);
+    }
+    
+    void forceClose() {
+        _closing = true;
+        if (_conn) {
+            _conn->forceClose();
+        }
+    }
+};
+
+static void makeAddress(const char *ip, uint16_t port, sockaddr_storage *out) {
+    struct in_addr addr;
+    ASSERT(1 == inet_pton(AF_INET, ip, &addr));
+    EmiNetUtil::makeAddress(AF_INET, (const uint8_t *)&addr, sizeof(addr), htons(port), out);
+}
+
+static double wallClock() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec/1000000.0;
+}
+
+static EmiTimeInterval percentile(const std::vector<EmiTimeInterval>& sorted, double p) {
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t idx = std::min(sorted.size()-1, (size_t)(p*sorted.size()));
+    return sorted[idx];
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -c udt|delay  congestion control algorithm (udt)\n"
+            "  -t ro|ru|rs|us|u\n"
+            "                channel type: reliable ordered, reliable unordered,\n"
+            "                reliable sequenced, unreliable sequenced or\n"
+            "                unreliable (ro)\n"
+            "  -F parts      send a parity message per this many parts of split\n"
+            "                messages, 0 to adapt it to the loss rate, -1 for\n"
+            "                none (-1)\n"
+            "  -w weight     the weight of the channel (1)\n"
+            "  -D ms         send the messages with this deadline (none)\n"
+            "  -C 0|1        conflate the channel; only applies to unreliable\n"
+            "                sequenced channels (0)\n"
+            "  -B bytes      message size of a bulk channel that keeps the\n"
+            "                sender buffer full, 0 for none (0)\n"
+            "  -b KB/s       bottleneck bandwidth, 0 for unlimited (1000)\n"
+            "  -q KB         bottleneck queue size, 0 for unbounded (64)\n"
+            "  -r ms         round trip time (50)\n"
+            "  -j ms         jitter, per direction (0)\n"
+            "  -l percent    loss rate, per direction (0)\n"
+            "  -o percent    reordering rate, per direction (0)\n"
+            "  -m bytes      path MTU, the largest UDP payload as in\n"
+            "                EmiSockConfig::mtu; larger packets are dropped\n"
+            "                without notice, 0 for no limit (0)\n"
+            "  -M seconds    apply the path MTU only after this time, which\n"
+            "                simulates a route change (0)\n"
+            "  -R KB/s       offered load, 0 to keep the sender buffer full (0);\n"
+            "                required for unreliable and reliable sequenced\n"
+            "                channels\n"
+            "  -s bytes      message size (1000)\n"
+            "  -d seconds    simulated duration (30)\n"
+            "  -S seed       random seed (1)\n",
+            name);
+}
+
+static bool parseOptions(int argc, char **argv, Options& options) {
+    options.congestionControl = EMI_CONGESTION_CONTROL_UDT;
+    options.channelType = EMI_CHANNEL_TYPE_RELIABLE_ORDERED;
+    options.fecGroupSize = -1;
+    options.channelWeight = EMI_DEFAULT_CHANNEL_WEIGHT;
+    options.deadline = EMI_NO_DEADLINE;
+    options.conflate = false;
+    options.bulkMessageSize = 0;
+    options.bandwidth = 1000*1000;
+    options.queueSize = 64*1000;
+    options.rtt = 0.05;
+    options.jitter = 0;
+    options.lossRate = 0;
+    options.reorderRate = 0;
+    options.mtu = 0;
+    options.mtuTime = 0;
+    options.rate = 0;
+    options.messageSize = 1000;
+    options.duration = 30;
+    options.seed = 1;
+    
+    for (int i=1; i<argc; i++) {
+        const char *arg = argv[i];
+        if ('-' != arg[0] || 0 == arg[1] || 0 != arg[2] || i+1 >= argc) {
+            return false;
+        }
+        
+        const char *value = argv[++i];
+        switch (arg[1]) {
+            case 'c':
+                if (0 == strcmp("udt", value)) {
+                    options.congestionControl = EMI_CONGESTION_CONTROL_UDT;
+                }
+                else if (0 == strcmp("delay", value)) {
+                    options.congestionControl = EMI_CONGESTION_CONTROL_DELAY;
+                }
+                else {
+                    return false;
+                }
+                break;
+            case 't':
+                if (0 == strcmp("ro", value)) {
+                    options.channelType = EMI_CHANNEL_TYPE_RELIABLE_ORDERED;
+                }
+                else if (0 == strcmp("ru", value)) {
+                    options.channelType = EMI_CHANNEL_TYPE_RELIABLE_UNORDERED;
+                }
+                else if (0 == strcmp("rs", value)) {
+                    options.channelType = EMI_CHANNEL_TYPE_RELIABLE_SEQUENCED;
+                }
+                else if (0 == strcmp("us", value)) {
+                    options.channelType = EMI_CHANNEL_TYPE_UNRELIABLE_SEQUENCED;
+                }
+                else if (0 == strcmp("u", value)) {
+                    options.channelType = EMI_CHANNEL_TYPE_UNRELIABLE;
+                }
+                else {
+                    return false;
+                }
+                break;
+            case 'F': options.fecGroupSize = atoi(value); break;
+            case 'w': options.channelWeight = (uint8_t)atoi(value); break;
+            case 'D': options.deadline = atof(value)/1000; break;
+            case 'C': options.conflate = (0 != atoi(value)); break;
+            case 'B': options.bulkMessageSize = (size_t)atoi(value); break;
+            case 'b': options.bandwidth = atof(value)*1000; break;
+            case 'q': options.queueSize = (size_t)(atof(value)*1000); break;
+            case 'r': options.rtt = atof(value)/1000; break;
+            case 'j': options.jitter = atof(value)/1000; break;
+            case 'l': options.lossRate = atof(value)/100; break;
+            case 'o': options.reorderRate = atof(value)/100; break;
+            case 'm': options.mtu = (size_t)atoi(value); break;
+            case 'M': options.mtuTime = atof(value); break;
+            case 'R': options.rate = atof(value)*1000; break;
+            case 's': options.messageSize = (size_t)atoi(value); break;
+            case 'd': options.duration = atof(value); break;
+            case 'S': options.seed = strtoull(value, NULL, 10); break;
+            default: return false;
+        }
+    }
+    
+    // The sender buffer never fills up on unreliable channels, or on
+    // reliable sequenced channels, where a new message replaces the
+    // one that hasn't been acknowledged yet
+    bool neverFull = (EMI_CHANNEL_TYPE_UNRELIABLE == options.channelType ||
+                      EMI_CHANNEL_TYPE_UNRELIABLE_SEQUENCED == options.channelType ||
+                      EMI_CHANNEL_TYPE_RELIABLE_SEQUENCED == options.channelType);
+    
+    return (options.messageSize >= sizeof(MessageHeader) &&
+            (!neverFull || 0 != options.rate));
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        usage(argv[0]);
+        return 1;
+    }
+    
+    EmiSimNetwork network(options.seed);
+    
+    sockaddr_storage serverAddress;
+    sockaddr_storage clientAddress;
+    makeAddress("10.0.0.1", 5000, &serverAddress);
+    makeAddress("10.0.0.2", 0, &clientAddress);
+    network.addHost(serverAddress);
+    network.addHost(clientAddress);
+    
+    EmiSimLinkParams link;
+    link.bandwidth = options.bandwidth;
+    link.queueSize = options.queueSize;
+    link.delay = options.rtt/2;
+    link.jitter = options.jitter;
+    link.lossRate = options.lossRate;
+    link.reorderRate = options.reorderRate;
+    link.reorderDelay = std::max(options.rtt/4, 0.002);
+    if (0 == options.mtuTime && 0 != options.mtu) {
+        link.maxPacketSize = options.mtu;
+    }
+    network.setDefaultLink(link);
+    
+    EmiSockConfig serverConfig;
+    serverConfig.address = serverAddress;
+    serverConfig.port = EmiNetUtil::addrPortH(serverAddress);
+    serverConfig.acceptConnections = true;
+    serverConfig.congestionControl = options.congestionControl;
+    // Let the server buffer as much as the client can have in flight
+    serverConfig.receiverBufferSize = std::max((size_t)EMI_DEFAULT_RECEIVER_BUFFER_SIZE,
+                                               options.messageSize*4);
+    
+    EmiSockConfig clientConfig;
+    clientConfig.address = clientAddress;
+    clientConfig.congestionControl = options.congestionControl;
+    clientConfig.senderBufferSize = std::max((size_t)(64*1024), options.messageSize*4);
+    if (-1 != options.fecGroupSize) {
+        clientConfig.fecChannels = 1;
+        clientConfig.fecGroupSize = options.fecGroupSize;
+    }
+    clientConfig.channelWeights[EMI_CHANNEL_QUALIFIER(options.channelType, 0)] = options.channelWeight;
+    if (options.conflate) {
+        clientConfig.conflatedChannels = 1;
+    }
+    
+    ServerConnectionDelegate serverConnDelegate;
+    ServerSocketDelegate serverSockDelegate(serverConnDelegate);
+    ClientConnectionDelegate clientConnDelegate(options);
+    
+    EmiError err;
+    EmiSimSocket server(network, serverConfig, &serverSockDelegate);
+    EmiSimSocket client(network, clientConfig, NULL);
+    if (!server.open(err) || !client.open(err) ||
+        !client.connect(serverAddress, &clientConnDelegate, NULL, err)) {
+        fprintf(stderr, "Failed to set up the connection: %s %d\n", err.domain.c_str(), err.code);
+        return 1;
+    }
+    
+    double wallStart = wallClock();
+    EmiTimeInterval simStart = network.now();
+    if (0 != options.mtuTime && 0 != options.mtu) {
+        network.runUntil(simStart+options.mtuTime);
+        link.maxPacketSize = options.mtu;
+        network.setLink(clientAddress, serverAddress, link);
+        network.setLink(serverAddress, clientAddress, link);
+    }
+    network.runUntil(simStart+options.duration);
+    double wallTime = wallClock()-wallStart;
+    
+    if (!results.opened) {
+        fprintf(stderr, "The connection could not be opened\n");
+        return 1;
+    }
+    
+    const EmiSimLinkStats& up(network.getLinkStats(clientAddress, serverAddress));
+    const EmiSimLinkStats& down(network.getLinkStats(serverAddress, clientAddress));
+    
+    EmiTimeInterval activeTime = network.now()-results.openTime;
+    double goodput = results.bytesReceived/activeTime;
+    
+    std::sort(results.latencies.begin(), results.latencies.end());
+    
+    printf("simulated %.1fs in %.2fs (%.0fx real time)\n",
+           options.duration, wallTime, options.duration/std::max(wallTime, 0.000001));
+    printf("goodput:     %.1f KB/s", goodput/1000);
+    if (0 != options.bandwidth) {
+        printf(" (%.1f%% of the bandwidth)", 100*goodput/options.bandwidth);
+    }
+    printf("\n");
+    if (0 != options.bulkMessageSize) {
+        printf("bulk:        %.1f KB/s\n", results.bulkBytesReceived/activeTime/1000);
+    }
+    printf("messages:    %llu of %llu received, %.1f KB offered\n",
+           (unsigned long long)results.messagesReceived,
+           (unsigned long long)results.messagesOffered,
+           results.bytesOffered/1000.0);
+    if (EMI_NO_DEADLINE != options.deadline) {
+        printf("expired:     %llu messages missed their deadline\n",
+               (unsigned long long)clientConnDelegate.expiredMessages());
+    }
+    printf("latency:     p50 %.1fms  p90 %.1fms  p99 %.1fms  max %.1fms\n",
+           percentile(results.latencies, 0.5)*1000,
+           percentile(results.latencies, 0.9)*1000,
+           percentile(results.latencies, 0.99)*1000,
+           (results.latencies.empty() ? 0 : results.latencies.back()*1000));
+    // The overhead counts everything that the client sent beyond the
+    // payload that arrived: headers, acks, heartbeats and retransmissions.
+    printf("overhead:    %.1f%% (%llu bytes sent for %llu bytes of payload)\n",
+           (0 == results.bytesReceived ? 0 : 100.0*((double)up.bytesSent/results.bytesReceived-1)),
+           (unsigned long long)up.bytesSent, (unsigned long long)results.bytesReceived);
+    printf("data link:   %llu packets, %llu dropped by the queue, %llu lost, %llu reordered\n",
+           (unsigned long long)up.packetsSent, (unsigned long long)up.packetsDropped,
+           (unsigned long long)up.packetsLost, (unsigned long long)up.packetsReordered);
+    printf("ack link:    %llu packets, %llu dropped by the queue, %llu lost\n",
+           (unsigned long long)down.packetsSent, (unsigned long long)down.packetsDropped,
+           (unsigned long long)down.packetsLost);
+    if (0 != options.mtu) {
+        printf("too big:     %llu data packets and %llu ack packets were larger than the path MTU\n",
+               (unsigned long long)up.packetsTooBig, (unsigned long long)down.packetsTooBig);
+    }
+    if (results.disconnected) {
+        printf("the connection was lost\n");
+    }
+    
+    // The connections are released in separate events after they have
+    // been closed
+    clientConnDelegate.forceClose();
+    serverSockDelegate.forceClose();
+    network.runUntil(network.now());
+    
+    return 0;
+}
@@ -0,0 +1,48 @@
+//
+//  EmiTestUtil.h
+//  eminet
+//
+
+#ifndef eminet_EmiTestUtil_h
+#define eminet_EmiTestUtil_h
+
+#include "EmiSimBinding.h"
+
+#include "../../core/EmiMessage.h"
+
+#include <cstdio>
+
+// Helpers that the tests in sim/test share. Each test is a single
+// translation unit, so the failure count lives in this header.
+
+typedef EmiMessage<EmiSimBinding> EmiTestMessage;
+
+static int failures = 0;
+
+// Prints whether a check passed, and counts it if it failed
+inline void check(bool passed, const char *description) {
+    printf("%s: %s\n", passed ? "PASS" : "FAIL", description);
+    if (!passed) {
+        failures++;
+    }
+}
+
+// The exit status of a test: 0 if all checks passed and 1 otherwise
+inline int testExitStatus() {
+    return (0 == failures ? 0 : 1);
+}
+
+// Returns a new message with a payload of length bytes. The caller
+// owns one reference to it.
+inline EmiTestMessage *makeTestMessage(size_t length,
+                                       int32_t channelQualifier,
+                                       EmiPriority priority,
+                                       EmiTimeInterval deadline = EMI_NO_DEADLINE) {
+    EmiTestMessage *msg = new EmiTestMessage(EmiBuffer::make(length));
+    msg->channelQualifier = channelQualifier;
+    msg->priority = priority;
+    msg->deadline = deadline;
+    return msg;
+}
+
+#endif
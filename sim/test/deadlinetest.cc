@@ -0,0 +1,98 @@
+//
+//  deadlinetest.cc
+//  eminet
+//
+
+// deadlinetest drives EmiSendScheduler directly with messages that have
+// deadlines behind a backlog of bulk messages, and checks that they are
+// sent first, in deadline order, that unreliable messages that missed
+// their deadline are dropped and counted, and that reliable ones are
+// sent late instead. Build it with:
+//
+//   g++ -O2 -Isim -o deadlinetest sim/test/deadlinetest.cc posix/EmiBuffer.cc posix/EmiError.cc
+//
+// It exits with status 0 if all checks pass and 1 otherwise.
+
+#include "EmiTestUtil.h"
+
+#include "../../core/EmiSendScheduler.h"
+
+typedef EmiTestMessage                  EM;
+typedef EmiSendScheduler<EmiSimBinding> Scheduler;
+
+static const int32_t BULK_CHANNEL = EMI_CHANNEL_QUALIFIER(EMI_CHANNEL_TYPE_RELIABLE_ORDERED, 1);
+static const int32_t UNRELIABLE_CHANNEL = EMI_CHANNEL_QUALIFIER(EMI_CHANNEL_TYPE_UNRELIABLE, 2);
+static const int32_t RELIABLE_CHANNEL = EMI_CHANNEL_QUALIFIER(EMI_CHANNEL_TYPE_RELIABLE_ORDERED, 3);
+static const int32_t IMMEDIATE_CHANNEL = EMI_CHANNEL_QUALIFIER(EMI_CHANNEL_TYPE_UNRELIABLE, 4);
+
+static const size_t BULK_SIZE = 1200;
+static const int NUM_BULK = 100;
+static const size_t SMALL_SIZE = 40;
+
+static void push(Scheduler& scheduler, size_t length, int32_t channelQualifier,
+                 EmiPriority priority, EmiTimeInterval deadline) {
+    EM *msg = makeTestMessage(length, channelQualifier, priority, deadline);
+    scheduler.push(msg, 1);
+    msg->release();
+}
+
+// Returns true if the next message is on channelQualifier and has the
+// deadline, and removes it
+static bool popExpected(Scheduler& scheduler, EmiTimeInterval now,
+                        int32_t channelQualifier, EmiTimeInterval deadline) {
+    if (!scheduler.front(now)) {
+        return false;
+    }
+    
+    EM *msg = scheduler.pop();
+    bool result = (channelQualifier == msg->channelQualifier &&
+                   deadline == msg->deadline);
+    msg->release();
+    return result;
+}
+
+int main(int argc, char **argv) {
+    Scheduler scheduler;
+    for (int i=0; i<NUM_BULK; i++) {
+        push(scheduler, BULK_SIZE, BULK_CHANNEL, EMI_PRIORITY_HIGH, EMI_NO_DEADLINE);
+    }
+    
+    // The deadline messages are pushed out of deadline order, with a low
+    // priority, behind the bulk messages
+    static const EmiTimeInterval DEADLINES[] = { 10.05, 10.02, 10.03, 10.001 };
+    for (size_t i=0; i<sizeof(DEADLINES)/sizeof(*DEADLINES); i++) {
+        push(scheduler, SMALL_SIZE, UNRELIABLE_CHANNEL, EMI_PRIORITY_LOW, DEADLINES[i]);
+    }
+    push(scheduler, SMALL_SIZE, RELIABLE_CHANNEL, EMI_PRIORITY_LOW, 10.0005);
+    push(scheduler, SMALL_SIZE, IMMEDIATE_CHANNEL, EMI_PRIORITY_IMMEDIATE, 10.0);
+    
+    // At this time, the unreliable message with deadline 10.001 and the
+    // reliable message with deadline 10.0005 have missed their deadlines
+    EmiTimeInterval now = 10.01;
+    
+    check(popExpected(scheduler, now, IMMEDIATE_CHANNEL, 10.0),
+          "an immediate message is sent before the deadline messages");
+    check(popExpected(scheduler, now, RELIABLE_CHANNEL, 10.0005),
+          "a reliable message that missed its deadline is sent late");
+    check(popExpected(scheduler, now, UNRELIABLE_CHANNEL, 10.02) &&
+          popExpected(scheduler, now, UNRELIABLE_CHANNEL, 10.03) &&
+          popExpected(scheduler, now, UNRELIABLE_CHANNEL, 10.05),
+          "the deadline messages are sent before the bulk messages, in deadline order");
+    check(1 == scheduler.expiredMessages(),
+          "an unreliable message that missed its deadline is dropped and counted");
+    
+    EM *bulk = makeTestMessage(BULK_SIZE, BULK_CHANNEL, EMI_PRIORITY_HIGH);
+    size_t bulkSize = bulk->approximateSize();
+    bulk->release();
+    check(NUM_BULK*bulkSize == scheduler.sizeInBytes(),
+          "only the bulk messages are left");
+    
+    for (int i=0; i<3; i++) {
+        push(scheduler, SMALL_SIZE, UNRELIABLE_CHANNEL, EMI_PRIORITY_LOW, 11);
+    }
+    check(popExpected(scheduler, 20, BULK_CHANNEL, EMI_NO_DEADLINE) &&
+          4 == scheduler.expiredMessages(),
+          "when all deadline messages have expired, the bulk messages are sent");
+    
+    return testExitStatus();
+}
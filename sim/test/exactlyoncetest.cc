@@ -0,0 +1,346 @@
+//
+//  exactlyoncetest.cc
+//  eminet
+//
+
+// exactlyoncetest sends numbered messages over a simulated link with
+// loss, reordering and jitter on reliable unordered and reliable
+// ordered channels, lets the connection drain, and checks that every
+// message arrived exactly once and intact, and in order on the ordered
+// channel. Each channel type is tried with messages that fit in a
+// packet and with messages that are split. Build it with:
+//
+//   g++ -O2 -Isim -o exactlyoncetest sim/test/exactlyoncetest.cc sim/Emi*.cc core/*.cc posix/EmiBuffer.cc posix/EmiError.cc -lcrypto
+//
+// It exits with status 0 if all checks pass and 1 otherwise.
+
+#include "EmiSimNetwork.h"
+#include "EmiSimSocket.h"
+#include "EmiSimConnection.h"
+#include "EmiTestUtil.h"
+
+#include "../../core/EmiNetUtil.h"
+
+#include <arpa/inet.h>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+
+// The interval at which the client offers messages to the connection
+static const EmiTimeInterval SEND_INTERVAL = 0.001;
+// The time that the connection gets to deliver the messages after the
+// last one has been offered
+static const EmiTimeInterval DRAIN_TIME = 20;
+static const EmiTimeInterval TIME_LIMIT = 120;
+
+struct Scenario {
+    const char     *name;
+    EmiChannelType  channelType;
+    size_t          messageSize;
+    uint32_t        numMessages;
+};
+
+static const Scenario SCENARIOS[] = {
+    { "reliable unordered, small", EMI_CHANNEL_TYPE_RELIABLE_UNORDERED, 100,  5000 },
+    { "reliable unordered, split", EMI_CHANNEL_TYPE_RELIABLE_UNORDERED, 3000, 1000 },
+    { "reliable ordered, small",   EMI_CHANNEL_TYPE_RELIABLE_ORDERED,   100,  5000 },
+    { "reliable ordered, split",   EMI_CHANNEL_TYPE_RELIABLE_ORDERED,   3000, 1000 }
+};
+
+// Every message starts with its number, and the rest of it is filled
+// with bytes that are derived from the number
+static void fillMessage(uint8_t *buf, size_t size, uint32_t id) {
+    memcpy(buf, &id, sizeof(id));
+    for (size_t i=sizeof(id); i<size; i++) {
+        buf[i] = (uint8_t)(id+i);
+    }
+}
+
+static bool checkMessage(const uint8_t *buf, size_t size, uint32_t id) {
+    for (size_t i=sizeof(id); i<size; i++) {
+        if ((uint8_t)(id+i) != buf[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+struct Results {
+    explicit Results(uint32_t numMessages) :
+    opened(false),
+    disconnected(false),
+    messagesOffered(0),
+    lastOfferTime(0),
+    corrupted(0),
+    outOfOrder(0),
+    nextInOrder(0),
+    receiveCounts(numMessages, 0) {}
+    
+    bool            opened;
+    bool            disconnected;
+    uint32_t        messagesOffered;
+    EmiTimeInterval lastOfferTime;
+    uint32_t        corrupted;
+    uint32_t        outOfOrder;
+    uint32_t        nextInOrder;
+    std::vector<uint32_t> receiveCounts;
+};
+
+class ServerConnectionDelegate : public EmiSimConnectionDelegate {
+    const Scenario& _scenario;
+    Results&        _results;
+    
+public:
+    ServerConnectionDelegate(const Scenario& scenario, Results& results) :
+    _scenario(scenario),
+    _results(results) {}
+    
+    virtual void emiConnectionOpened(EmiSimConnection& conn, void *userData) {}
+    virtual void emiConnectionFailedToConnect(EmiSimSocket& socket, const EmiError& err, void *userData) {}
+    
+    virtual void emiConnectionMessage(EmiSimConnection& conn,
+                                      EmiChannelQualifier channelQualifier,
+                                      const EmiBufferRef& data,
+                                      size_t offset,
+                                      size_t size) {
+        const uint8_t *buf = data.get()->getData()+offset;
+        
+        uint32_t id;
+        if (size != _scenario.messageSize) {
+            _results.corrupted++;
+            return;
+        }
+        memcpy(&id, buf, sizeof(id));
+        if (id >= _scenario.numMessages || !checkMessage(buf, size, id)) {
+            _results.corrupted++;
+            return;
+        }
+        
+        _results.receiveCounts[id]++;
+        if (id != _results.nextInOrder) {
+            _results.outOfOrder++;
+        }
+        _results.nextInOrder = id+1;
+    }
+    
+    virtual void emiConnectionDisconnect(EmiSimConnection& conn, EmiDisconnectReason reason) {}
+};
+
+class ServerSocketDelegate : public EmiSimSocketDelegate {
+    ServerConnectionDelegate& _connDelegate;
+    EmiSimConnection         *_conn;
+    
+public:
+    ServerSocketDelegate(ServerConnectionDelegate& connDelegate) :
+    _connDelegate(connDelegate),
+    _conn(NULL) {}
+    
+    virtual ~ServerSocketDelegate() {
+        if (_conn) {
+            _conn->release();
+        }
+    }
+    
+    virtual void emiSocketGotConnection(EmiSimSocket& socket, EmiSimConnection& conn) {
+        conn.setDelegate(&_connDelegate);
+        
+        if (!_conn) {
+            _conn = &conn;
+            _conn->retain();
+        }
+    }
+    
+    void forceClose() {
+        if (_conn) {
+            _conn->forceClose();
+        }
+    }
+};
+
+class ClientConnectionDelegate : public EmiSimConnectionDelegate {
+    const Scenario&       _scenario;
+    Results&              _results;
+    EmiSimConnection     *_conn;
+    EmiSimNetwork::Timer *_sendTimer;
+    bool                  _closing;
+    
+    static void send_cb(EmiTimeInterval now, EmiSimNetwork::Timer *timer, void *data) {
+        ((ClientConnectionDelegate *)data)->send(now);
+    }
+    
+    // Offers messages until the sender buffer is full or all of them
+    // have been offered
+    void send(EmiTimeInterval now) {
+        std::vector<uint8_t> buf(_scenario.messageSize);
+        
+        while (_conn && _results.messagesOffered < _scenario.numMessages) {
+            fillMessage(&buf[0], buf.size(), _results.messagesOffered);
+            
+            EmiError err;
+            if (!_conn->send(&buf[0], buf.size(),
+                             EMI_CHANNEL_QUALIFIER(_scenario.channelType, 0),
+                             EMI_PRIORITY_HIGH, err)) {
+                // The sender buffer is full
+                return;
+            }
+            
+            _results.messagesOffered++;
+            _results.lastOfferTime = now;
+        }
+        
+        EmiSimBinding::descheduleTimer(_sendTimer);
+    }
+    
+public:
+    ClientConnectionDelegate(const Scenario& scenario, Results& results) :
+    _scenario(scenario),
+    _results(results),
+    _conn(NULL),
+    _sendTimer(NULL),
+    _closing(false) {}
+    
+    virtual ~ClientConnectionDelegate() {
+        if (_sendTimer) {
+            EmiSimBinding::freeTimer(_sendTimer);
+        }
+    }
+    
+    virtual void emiConnectionOpened(EmiSimConnection& conn, void *userData) {
+        _results.opened = true;
+        
+        _conn = &conn;
+        _sendTimer = EmiSimBinding::makeTimer(&conn.getSocket().getNetwork());
+        EmiSimBinding::scheduleTimer(_sendTimer, send_cb, this, SEND_INTERVAL,
+                                     /*repeating:*/true, /*reschedule:*/true);
+    }
+    
+    virtual void emiConnectionFailedToConnect(EmiSimSocket& socket, const EmiError& err, void *userData) {
+        socket.getNetwork().stop();
+    }
+    
+    virtual void emiConnectionMessage(EmiSimConnection& conn,
+                                      EmiChannelQualifier channelQualifier,
+                                      const EmiBufferRef& data,
+                                      size_t offset,
+                                      size_t size) {}
+    
+    virtual void emiConnectionDisconnect(EmiSimConnection& conn, EmiDisconnectReason reason) {
+        if (!_closing) {
+            _results.disconnected = true;
+        }
+        _conn = NULL;
+        if (_sendTimer) {
+            EmiSimBinding::descheduleTimer(_sendTimer);
+        }
+    }
+    
+    void forceClose() {
+        _closing = true;
+        if (_conn) {
+            _conn->forceClose();
+        }
+    }
+};
+
+static void makeAddress(const char *ip, uint16_t port, sockaddr_storage *out) {
+    struct in_addr addr;
+    ASSERT(1 == inet_pton(AF_INET, ip, &addr));
+    EmiNetUtil::makeAddress(AF_INET, (const uint8_t *)&addr, sizeof(addr), htons(port), out);
+}
+
+static void runScenario(const Scenario& scenario) {
+    EmiSimNetwork network(/*seed:*/1);
+    
+    sockaddr_storage serverAddress;
+    sockaddr_storage clientAddress;
+    makeAddress("10.0.0.1", 5000, &serverAddress);
+    makeAddress("10.0.0.2", 0, &clientAddress);
+    network.addHost(serverAddress);
+    network.addHost(clientAddress);
+    
+    EmiSimLinkParams link;
+    link.bandwidth = 1000*1000;
+    link.queueSize = 64*1000;
+    link.delay = 0.025;
+    link.jitter = 0.005;
+    link.lossRate = 0.03;
+    link.reorderRate = 0.05;
+    link.reorderDelay = 0.0125;
+    network.setDefaultLink(link);
+    
+    EmiSockConfig serverConfig;
+    serverConfig.address = serverAddress;
+    serverConfig.port = EmiNetUtil::addrPortH(serverAddress);
+    serverConfig.acceptConnections = true;
+    
+    EmiSockConfig clientConfig;
+    clientConfig.address = clientAddress;
+    
+    Results results(scenario.numMessages);
+    ServerConnectionDelegate serverConnDelegate(scenario, results);
+    ServerSocketDelegate serverSockDelegate(serverConnDelegate);
+    ClientConnectionDelegate clientConnDelegate(scenario, results);
+    
+    EmiError err;
+    EmiSimSocket server(network, serverConfig, &serverSockDelegate);
+    EmiSimSocket client(network, clientConfig, NULL);
+    if (!server.open(err) || !client.open(err) ||
+        !client.connect(serverAddress, &clientConnDelegate, NULL, err)) {
+        printf("Failed to set up the connection: %s %d\n", err.domain.c_str(), err.code);
+        check(false, "the connection is set up");
+        return;
+    }
+    
+    // Run until all messages have been offered, and then let the
+    // connection drain
+    EmiTimeInterval start = network.now();
+    while (network.now() < start+TIME_LIMIT &&
+           (results.messagesOffered < scenario.numMessages ||
+            network.now() < results.lastOfferTime+DRAIN_TIME)) {
+        network.runUntil(network.now()+1);
+    }
+    
+    uint32_t missing = 0;
+    uint32_t duplicated = 0;
+    for (uint32_t i=0; i<scenario.numMessages; i++) {
+        if (0 == results.receiveCounts[i]) {
+            missing++;
+        }
+        else if (results.receiveCounts[i] > 1) {
+            duplicated++;
+        }
+    }
+    
+    printf("      %s: %u of %u offered, %u missing, %u duplicated, %u corrupted, %u out of order\n",
+           scenario.name, results.messagesOffered, scenario.numMessages,
+           missing, duplicated, results.corrupted, results.outOfOrder);
+    
+    char description[128];
+    snprintf(description, sizeof(description),
+             "%s: the connection stays open", scenario.name);
+    check(results.opened && !results.disconnected, description);
+    snprintf(description, sizeof(description),
+             "%s: every message arrives exactly once and intact", scenario.name);
+    check(scenario.numMessages == results.messagesOffered &&
+          0 == missing && 0 == duplicated && 0 == results.corrupted,
+          description);
+    if (EMI_CHANNEL_TYPE_RELIABLE_ORDERED == scenario.channelType) {
+        snprintf(description, sizeof(description),
+                 "%s: the messages arrive in order", scenario.name);
+        check(0 == results.outOfOrder, description);
+    }
+    
+    // The connections are released in separate events after they have
+    // been closed
+    clientConnDelegate.forceClose();
+    serverSockDelegate.forceClose();
+    network.runUntil(network.now());
+}
+
+int main(int argc, char **argv) {
+    for (size_t i=0; i<sizeof(SCENARIOS)/sizeof(*SCENARIOS); i++) {
+        runScenario(SCENARIOS[i]);
+    }
+    
+    return testExitStatus();
+}
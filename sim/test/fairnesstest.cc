@@ -0,0 +1,133 @@
+//
+//  fairnesstest.cc
+//  eminet
+//
+
+// fairnesstest drives EmiSendScheduler directly with saturated
+// channels, and checks that the deficit round robin shares the bytes
+// it sends according to the channel and priority weights, that a
+// message on a quiet channel doesn't wait for the whole backlog of a
+// busy one, and that immediate messages go first. Build it with:
+//
+//   g++ -O2 -Isim -o fairnesstest sim/test/fairnesstest.cc posix/EmiBuffer.cc posix/EmiError.cc
+//
+// It exits with status 0 if all checks pass and 1 otherwise.
+
+#include "EmiTestUtil.h"
+
+#include "../../core/EmiSendScheduler.h"
+
+typedef EmiTestMessage                  EM;
+typedef EmiSendScheduler<EmiSimBinding> Scheduler;
+
+// The scheduler ignores the time unless messages have deadlines
+static const EmiTimeInterval NOW = 0;
+
+static void push(Scheduler& scheduler, size_t length, int32_t channelQualifier,
+                 EmiPriority priority, size_t channelWeight) {
+    EM *msg = makeTestMessage(length, channelQualifier, priority);
+    scheduler.push(msg, channelWeight);
+    msg->release();
+}
+
+static EM *pop(Scheduler& scheduler) {
+    if (!scheduler.front(NOW)) {
+        return NULL;
+    }
+    return scheduler.pop();
+}
+
+// Two saturated channels of the same priority with weights 1 and 3
+// should get a quarter and three quarters of the bytes
+static void testChannelWeights() {
+    Scheduler scheduler;
+    for (int i=0; i<3000; i++) {
+        push(scheduler, 1000, 1, EMI_PRIORITY_MEDIUM, 1);
+        push(scheduler, 400, 2, EMI_PRIORITY_MEDIUM, 3);
+    }
+    
+    size_t bytes[3] = { 0, 0, 0 };
+    size_t sent = 0;
+    while (sent < 1000000) {
+        EM *msg = pop(scheduler);
+        bytes[msg->channelQualifier] += msg->approximateSize();
+        sent += msg->approximateSize();
+        msg->release();
+    }
+    
+    double share = bytes[2]/(double)sent;
+    printf("      weights 1:3 give a byte share of %.3f:%.3f\n", bytes[1]/(double)sent, share);
+    check(share > 0.74 && share < 0.76, "channel weights 1:3 share the bytes 1:3");
+}
+
+// Saturated channels of high, medium and low priority should be served
+// in proportion to the priority weights
+static void testPriorityWeights() {
+    Scheduler scheduler;
+    for (int i=0; i<3000; i++) {
+        push(scheduler, 500, 1, EMI_PRIORITY_HIGH, 1);
+        push(scheduler, 500, 2, EMI_PRIORITY_MEDIUM, 1);
+        push(scheduler, 500, 3, EMI_PRIORITY_LOW, 1);
+    }
+    
+    size_t counts[4] = { 0, 0, 0, 0 };
+    for (int i=0; i<3500; i++) {
+        EM *msg = pop(scheduler);
+        counts[msg->channelQualifier]++;
+        msg->release();
+    }
+    
+    printf("      high:medium:low messages %lu:%lu:%lu\n",
+           (unsigned long)counts[1], (unsigned long)counts[2], (unsigned long)counts[3]);
+    check(counts[1]*EMI_PRIORITY_MEDIUM_WEIGHT == counts[2]*EMI_PRIORITY_HIGH_WEIGHT &&
+          counts[2]*EMI_PRIORITY_LOW_WEIGHT == counts[3]*EMI_PRIORITY_MEDIUM_WEIGHT,
+          "priorities share the messages by their weights");
+    
+    push(scheduler, 100, 4, EMI_PRIORITY_IMMEDIATE, 1);
+    EM *msg = pop(scheduler);
+    check(4 == msg->channelQualifier, "an immediate message is sent before the backlog");
+    msg->release();
+}
+
+// A short message on a quiet channel that arrives behind a backlog of
+// bulk messages of the same priority should only wait for the rest of
+// the bulk channel's turn, not for the whole backlog like with FIFO
+static void testQuietChannelLatency() {
+    static const size_t BULK_SIZE = 1200;
+    static const int NUM_BULK = 200;
+    
+    Scheduler scheduler;
+    for (int i=0; i<NUM_BULK; i++) {
+        push(scheduler, BULK_SIZE, 1, EMI_PRIORITY_HIGH, 1);
+    }
+    for (int i=0; i<5; i++) {
+        pop(scheduler)->release();
+    }
+    push(scheduler, 50, 2, EMI_PRIORITY_HIGH, 1);
+    
+    size_t bytesBefore = 0;
+    EM *msg;
+    while ((msg = pop(scheduler))) {
+        int32_t channelQualifier = msg->channelQualifier;
+        size_t size = msg->approximateSize();
+        msg->release();
+        
+        if (2 == channelQualifier) {
+            break;
+        }
+        bytesBefore += size;
+    }
+    
+    printf("      the quiet channel waits for %lu bytes (FIFO: %lu)\n",
+           (unsigned long)bytesBefore, (unsigned long)((NUM_BULK-5)*BULK_SIZE));
+    check(msg && bytesBefore <= EMI_SCHEDULER_QUANTUM*EMI_PRIORITY_HIGH_WEIGHT,
+          "a quiet channel waits for at most one turn of a busy one");
+}
+
+int main(int argc, char **argv) {
+    testChannelWeights();
+    testPriorityWeights();
+    testQuietChannelLatency();
+    
+    return testExitStatus();
+}